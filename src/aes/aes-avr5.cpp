@@ -148,19 +148,15 @@ static void gen_aes128_setup_key(Code &code)
         Reg s12 = Reg(sched, 12, 4);
         if (w == 4) {
             // Apply the key schedule core every 16 bytes / 4 words.
-            code.sbox_lookup(temp, Reg(s12, 0, 1));
-            code.logxor(Reg(s0, 3, 1), temp);
+            code.sbox_lookup_xor(Reg(s0, 3, 1), Reg(s12, 0, 1), temp);
 
-            code.sbox_lookup(temp, Reg(s12, 1, 1));
-            code.logxor(Reg(s0, 0, 1), temp);
+            code.sbox_lookup_xor(Reg(s0, 0, 1), Reg(s12, 1, 1), temp);
             code.move(temp, rcon[iteration++]);
             code.logxor(Reg(s0, 0, 1), temp);
 
-            code.sbox_lookup(temp, Reg(s12, 2, 1));
-            code.logxor(Reg(s0, 1, 1), temp);
+            code.sbox_lookup_xor(Reg(s0, 1, 1), Reg(s12, 2, 1), temp);
 
-            code.sbox_lookup(temp, Reg(s12, 3, 1));
-            code.logxor(Reg(s0, 2, 1), temp);
+            code.sbox_lookup_xor(Reg(s0, 2, 1), Reg(s12, 3, 1), temp);
             w = 0;
         } else {
             // XOR the word with the one 16 bytes previous.
@@ -211,19 +207,15 @@ static void gen_aes192_setup_key(Code &code)
         Reg s20 = Reg(sched, 20, 4);
         if (w == 6) {
             // Apply the key schedule core every 24 bytes / 6 words.
-            code.sbox_lookup(temp, Reg(s20, 0, 1));
-            code.logxor(Reg(s0, 3, 1), temp);
+            code.sbox_lookup_xor(Reg(s0, 3, 1), Reg(s20, 0, 1), temp);
 
-            code.sbox_lookup(temp, Reg(s20, 1, 1));
-            code.logxor(Reg(s0, 0, 1), temp);
+            code.sbox_lookup_xor(Reg(s0, 0, 1), Reg(s20, 1, 1), temp);
             code.move(temp, rcon[iteration++]);
             code.logxor(Reg(s0, 0, 1), temp);
 
-            code.sbox_lookup(temp, Reg(s20, 2, 1));
-            code.logxor(Reg(s0, 1, 1), temp);
+            code.sbox_lookup_xor(Reg(s0, 1, 1), Reg(s20, 2, 1), temp);
 
-            code.sbox_lookup(temp, Reg(s20, 3, 1));
-            code.logxor(Reg(s0, 2, 1), temp);
+            code.sbox_lookup_xor(Reg(s0, 2, 1), Reg(s20, 3, 1), temp);
             w = 0;
         } else {
             // XOR the word with the one 24 bytes previous.
@@ -274,33 +266,25 @@ static void gen_aes256_setup_key(Code &code)
     for (n = 32, w = 8; n < 240; n += 4, ++w) {
         if (w == 8) {
             // Apply the key schedule core every 32 bytes / 8 words.
-            code.sbox_lookup(temp, Reg(s28, 0, 1));
-            code.logxor(Reg(s0, 3, 1), temp);
+            code.sbox_lookup_xor(Reg(s0, 3, 1), Reg(s28, 0, 1), temp);
 
-            code.sbox_lookup(temp, Reg(s28, 1, 1));
-            code.logxor(Reg(s0, 0, 1), temp);
+            code.sbox_lookup_xor(Reg(s0, 0, 1), Reg(s28, 1, 1), temp);
             code.move(temp, rcon[iteration++]);
             code.logxor(Reg(s0, 0, 1), temp);
 
-            code.sbox_lookup(temp, Reg(s28, 2, 1));
-            code.logxor(Reg(s0, 1, 1), temp);
+            code.sbox_lookup_xor(Reg(s0, 1, 1), Reg(s28, 2, 1), temp);
 
-            code.sbox_lookup(temp, Reg(s28, 3, 1));
-            code.logxor(Reg(s0, 2, 1), temp);
+            code.sbox_lookup_xor(Reg(s0, 2, 1), Reg(s28, 3, 1), temp);
             w = 0;
         } else if (w == 4) {
             // At the 16 byte mark we need to apply the S-box.
-            code.sbox_lookup(temp, Reg(s28, 0, 1));
-            code.logxor(Reg(s0, 0, 1), temp);
+            code.sbox_lookup_xor(Reg(s0, 0, 1), Reg(s28, 0, 1), temp);
 
-            code.sbox_lookup(temp, Reg(s28, 1, 1));
-            code.logxor(Reg(s0, 1, 1), temp);
+            code.sbox_lookup_xor(Reg(s0, 1, 1), Reg(s28, 1, 1), temp);
 
-            code.sbox_lookup(temp, Reg(s28, 2, 1));
-            code.logxor(Reg(s0, 2, 1), temp);
+            code.sbox_lookup_xor(Reg(s0, 2, 1), Reg(s28, 2, 1), temp);
 
-            code.sbox_lookup(temp, Reg(s28, 3, 1));
-            code.logxor(Reg(s0, 3, 1), temp);
+            code.sbox_lookup_xor(Reg(s0, 3, 1), Reg(s28, 3, 1), temp);
         } else {
             // XOR the word with the one 32 bytes previous.
             code.logxor(s0, s28);
@@ -829,3 +813,53 @@ GENCRYPTO_REGISTER_AVR("aes_ecb_decrypt", 0, "avr5",
                        gen_aes_ecb_decrypt,
                        test_aes_ecb_decrypt);
 GENCRYPTO_REGISTER_AVR("aes_sboxes", 0, "avr5", gen_aes_sboxes, 0);
+
+// AVRxt has the same instruction set as avr5 as far as AES is concerned.
+// The timing model and S-box access are handled by the code generator.
+
+static void gen_avrxt_aes128_setup_key(Code &code)
+{
+    gen_aes128_setup_key(code);
+}
+
+static void gen_avrxt_aes192_setup_key(Code &code)
+{
+    gen_aes192_setup_key(code);
+}
+
+static void gen_avrxt_aes256_setup_key(Code &code)
+{
+    gen_aes256_setup_key(code);
+}
+
+static void gen_avrxt_aes_ecb_encrypt(Code &code)
+{
+    gen_aes_ecb_encrypt(code);
+}
+
+static void gen_avrxt_aes_ecb_decrypt(Code &code)
+{
+    gen_aes_ecb_decrypt(code);
+}
+
+static void gen_avrxt_aes_sboxes(Code &code)
+{
+    gen_aes_sboxes(code);
+}
+
+GENCRYPTO_REGISTER_AVR("aes_128_init", 0, "avrxt",
+                       gen_avrxt_aes128_setup_key,
+                       test_aes128_setup_key);
+GENCRYPTO_REGISTER_AVR("aes_192_init", 0, "avrxt",
+                       gen_avrxt_aes192_setup_key,
+                       test_aes192_setup_key);
+GENCRYPTO_REGISTER_AVR("aes_256_init", 0, "avrxt",
+                       gen_avrxt_aes256_setup_key,
+                       test_aes256_setup_key);
+GENCRYPTO_REGISTER_AVR("aes_ecb_encrypt", 0, "avrxt",
+                       gen_avrxt_aes_ecb_encrypt,
+                       test_aes_ecb_encrypt);
+GENCRYPTO_REGISTER_AVR("aes_ecb_decrypt", 0, "avrxt",
+                       gen_avrxt_aes_ecb_decrypt,
+                       test_aes_ecb_decrypt);
+GENCRYPTO_REGISTER_AVR("aes_sboxes", 0, "avrxt", gen_avrxt_aes_sboxes, 0);
@@ -0,0 +1,373 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "avr/code.h"
+#include "avr/masked.h"
+#include "common/registry.h"
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+
+using namespace AVR;
+
+// This is the same permutation as "ascon-avr5.cpp", but written against
+// the MaskedCode layer so that it can be generated for any number of
+// shares.  The hand-written versions in "ascon-avr5-x2.cpp" and
+// "ascon-avr5-x3.cpp" are faster, but this one shows what the generic
+// DOM gadgets cost and how much randomness they need.
+
+// Offset of a byte of share 0 in the masked state in big-endian order.
+#define ASCON_MASKED_BYTE(word, byte, shares) \
+    ((word) * (shares) * 8 + 7 - (byte))
+
+// Offset of share 0 of a word in the masked state.
+#define ASCON_MASKED_WORD(word, shares) ((word) * (shares) * 8)
+
+static void ascon_masked_substitute
+    (MaskedCode &masked, int offset, const Reg &round, unsigned stash)
+{
+    unsigned shares = masked.shares();
+
+    // Load the byte slice for all words and shares.
+    SharedReg x0 = masked.allocateReg(1);
+    SharedReg x1 = masked.allocateReg(1);
+    SharedReg x2 = masked.allocateReg(1);
+    SharedReg x3 = masked.allocateReg(1);
+    SharedReg x4 = masked.allocateReg(1);
+    masked.ldz(x0, ASCON_MASKED_BYTE(0, offset, shares));
+    masked.ldz(x1, ASCON_MASKED_BYTE(1, offset, shares));
+    masked.ldz(x2, ASCON_MASKED_BYTE(2, offset, shares));
+    masked.ldz(x3, ASCON_MASKED_BYTE(3, offset, shares));
+    masked.ldz(x4, ASCON_MASKED_BYTE(4, offset, shares));
+
+    // XOR the round constant with the low byte of "x2".
+    if (offset == 0)
+        masked.logxor(x2, round);
+
+    // Start of the substitution layer.
+    masked.logxor(x0, x4);          // x0 ^= x4;
+    masked.logxor(x4, x3);          // x4 ^= x3;
+    masked.logxor(x2, x1);          // x2 ^= x1;
+
+    // Chi5 needs the original x0 and x1 at the end, but there aren't
+    // enough registers for 4 shares to keep copies, so stash them.
+    masked.stlocal(x0, stash);
+    masked.stlocal(x1, stash + shares);
+
+    // Middle part of the substitution layer, Chi5.
+    masked.logxor_and_not(x0, x2, x1);  // x0 ^= (~x1) & x2;
+    masked.logxor_and_not(x1, x3, x2);  // x1 ^= (~x2) & x3;
+    masked.logxor_and_not(x2, x4, x3);  // x2 ^= (~x3) & x4;
+    masked.logxor(x1, x0);              // x1 ^= x0;
+    masked.stz(x1, ASCON_MASKED_BYTE(1, offset, shares));
+
+    // x1 is finished, so reuse its registers for the original x0.
+    SharedReg t1 = x1;
+    masked.ldlocal(t1, stash);
+    masked.logxor_and_not(x3, t1, x4);  // x3 ^= (~x4) & t1;
+    masked.logxor(x3, x2);              // x3 ^= x2;
+    masked.lognot(x2);                  // x2 = ~x2;
+    masked.stz(x2, ASCON_MASKED_BYTE(2, offset, shares));
+    masked.stz(x3, ASCON_MASKED_BYTE(3, offset, shares));
+
+    // x2 is finished, so reuse its registers for the original x1.
+    SharedReg t2 = x2;
+    masked.ldlocal(t2, stash + shares);
+    masked.logxor_and_not(x4, t2, t1);  // x4 ^= (~t1) & t2;
+    masked.logxor(x0, x4);              // x0 ^= x4;
+    masked.stz(x0, ASCON_MASKED_BYTE(0, offset, shares));
+    masked.stz(x4, ASCON_MASKED_BYTE(4, offset, shares));
+
+    masked.releaseReg(x0);
+    masked.releaseReg(x1);
+    masked.releaseReg(x2);
+    masked.releaseReg(x3);
+    masked.releaseReg(x4);
+}
+
+static void ascon_masked_diffuse
+    (Code &code, unsigned offset, int shift1, int shift2)
+{
+    // Compute "x ^= (x >>> shift1) ^ (x >>> shift2)" on one share.
+    // The linear layer does not need the masking layer's help.
+    Reg x = code.allocateReg(8);
+    Reg t = code.allocateReg(8);
+    code.ldz_long(x.reversed(), offset);
+    code.move(t, x);
+    code.ror_lazy(t, shift2 - shift1);
+    code.materialise(t);
+    code.logxor(t, x);
+    code.ror_lazy(t, shift1);
+    code.materialise(t);
+    code.logxor(x, t);
+    code.stz_long(x.reversed(), offset);
+    code.releaseReg(x);
+    code.releaseReg(t);
+}
+
+static void gen_avr_ascon_masked_permutation_body
+    (Code &code, unsigned shares, MaskedRandomPlan &plan)
+{
+    // Set up the function prologue with local variable storage for
+    // a copy of the preserved randomness and the stashed Chi5 inputs.
+    //
+    // Z points to the permutation state on input and output.
+    // X points to the preserved randomness on input.
+    unsigned preserve_size = (shares - 1) * 8;
+    unsigned stash = preserve_size;
+    Reg round = code.prologue_masked_permutation
+        ("ascon_masked_permute", preserve_size + shares * 2);
+
+    // We are short on registers for 4 shares, so allow r0 to be used.
+    code.setFlag(Code::TempR0);
+
+    // Compute "round = ((0x0F - round) << 4) | round" to convert the
+    // first round number into a round constant.
+    Reg temp = code.allocateHighReg(1);
+    code.move(temp, 0x0F);
+    code.sub(temp, round);
+    code.onereg(Insn::SWAP, temp.reg(0));
+    code.logor(round, temp);
+    code.releaseReg(temp);
+
+    // Transfer the preserved randomness from the caller to the locals
+    // and then release X for use as temporaries during the function.
+    Reg t = code.allocateReg(8);
+    for (unsigned word = 0; word < (shares - 1); ++word) {
+        code.ldx(t, POST_INC);
+        code.stlocal(t, word * 8);
+    }
+    code.releaseReg(t);
+    code.setFlag(Code::TempX);
+
+    // The DOM gadgets draw their randomness from the preserved words.
+    MaskedCode masked(code, shares, 8);
+    masked.setRandomBuffer(0, preserve_size);
+    masked.setRandomPlan(&plan);
+
+    // Top of the round loop.
+    unsigned char top_label = 0;
+    code.label(top_label);
+
+    // Perform the substitution layer byte by byte.
+    for (int index = 0; index < 8; ++index)
+        ascon_masked_substitute(masked, index, round, stash);
+
+    // Perform the linear diffusion layer on each share of each word.
+    for (unsigned share = 0; share < shares; ++share) {
+        unsigned offset = share * 8;
+        ascon_masked_diffuse
+            (code, ASCON_MASKED_WORD(0, shares) + offset, 19, 28);
+        ascon_masked_diffuse
+            (code, ASCON_MASKED_WORD(1, shares) + offset, 61, 39);
+        ascon_masked_diffuse
+            (code, ASCON_MASKED_WORD(2, shares) + offset,  1,  6);
+        ascon_masked_diffuse
+            (code, ASCON_MASKED_WORD(3, shares) + offset, 10, 17);
+        ascon_masked_diffuse
+            (code, ASCON_MASKED_WORD(4, shares) + offset,  7, 41);
+    }
+
+    // Rotate the preserved words right by 13 bits so that the next
+    // round draws different randomness from the same buffer.
+    t = code.allocateReg(8);
+    for (unsigned word = 0; word < (shares - 1); ++word) {
+        code.ldlocal(t, word * 8);
+        code.ror_lazy(t, 13);
+        code.materialise(t);
+        code.stlocal(t, word * 8);
+    }
+    code.releaseReg(t);
+
+    // Bottom of the round loop.  Adjust the round constant and
+    // check to see if we have reached the final round.
+    code.sub(round, 0x0F);
+    code.compare_and_loop(round, 0x3C, top_label);
+
+    // Transfer the preserved randomness back to the caller.
+    code.clearFlag(Code::TempX);
+    code.load_output_ptr();
+    t = code.allocateReg(8);
+    for (unsigned word = 0; word < (shares - 1); ++word) {
+        code.ldlocal(t, word * 8);
+        code.stx(t, POST_INC);
+    }
+    code.releaseReg(t);
+}
+
+static void gen_avr_ascon_masked_permutation(Code &code, unsigned shares)
+{
+    // Generate the code once to find out which gadgets can share random
+    // bytes, and then again with the bytes that the plan assigned.
+    //
+    // With two shares, the gadgets of different byte slices do not
+    // meet in the substitution layer and so can reuse the same bytes.
+    // The diffusion layer does combine the slices, but its rotations
+    // are never a multiple of 8, so a reused byte is only ever XOR'ed
+    // with different bits of itself.  The preserved words are also
+    // rotated between rounds, so each round sees new values.  With more
+    // shares, we keep every gadget's randomness fresh because reuse
+    // within the same slice is not safe against higher-order probes.
+    MaskedRandomPlan plan;
+    Code scratch;
+    gen_avr_ascon_masked_permutation_body(scratch, shares, plan);
+    if (shares == 2)
+        plan.optimise(MaskedRandomPlan::FirstOrder);
+    else
+        plan.optimise(MaskedRandomPlan::HigherOrder);
+    gen_avr_ascon_masked_permutation_body(code, shares, plan);
+}
+
+/* Load a big-endian 64-bit word from a byte buffer */
+#define be_load_word64(ptr) \
+    ((((uint64_t)((ptr)[0])) << 56) | \
+     (((uint64_t)((ptr)[1])) << 48) | \
+     (((uint64_t)((ptr)[2])) << 40) | \
+     (((uint64_t)((ptr)[3])) << 32) | \
+     (((uint64_t)((ptr)[4])) << 24) | \
+     (((uint64_t)((ptr)[5])) << 16) | \
+     (((uint64_t)((ptr)[6])) << 8) | \
+      ((uint64_t)((ptr)[7])))
+
+/* Store a big-endian 64-bit word into a byte buffer */
+#define be_store_word64(ptr, x) \
+    do { \
+        uint64_t _x = (x); \
+        (ptr)[0] = (uint8_t)(_x >> 56); \
+        (ptr)[1] = (uint8_t)(_x >> 48); \
+        (ptr)[2] = (uint8_t)(_x >> 40); \
+        (ptr)[3] = (uint8_t)(_x >> 32); \
+        (ptr)[4] = (uint8_t)(_x >> 24); \
+        (ptr)[5] = (uint8_t)(_x >> 16); \
+        (ptr)[6] = (uint8_t)(_x >> 8); \
+        (ptr)[7] = (uint8_t)_x; \
+    } while (0)
+
+// Get a random 64-bit word.
+static uint64_t get_random(void)
+{
+    static bool initialized = false;
+    if (!initialized) {
+        srand(time(NULL));
+        initialized = true;
+    }
+    // rand() produces a 31-bit number; we need a 64-bit number.
+    return ((uint64_t)rand()) |
+           (((uint64_t)rand()) << 31) |
+           (((uint64_t)rand()) << 62);
+}
+
+// Mask the input state.
+static void mask
+    (unsigned char out[160], const unsigned char in[40], unsigned shares)
+{
+    uint64_t word;
+    uint64_t random;
+    unsigned index, share;
+    for (index = 0; index < 5; ++index) {
+        word = be_load_word64(in + index * 8);
+        for (share = 1; share < shares; ++share) {
+            random = get_random();
+            word ^= random;
+            be_store_word64(out + (index * shares + share) * 8, random);
+        }
+        be_store_word64(out + index * shares * 8, word);
+    }
+}
+
+// Unmask the output state.
+static void unmask
+    (unsigned char out[40], const unsigned char in[160], unsigned shares)
+{
+    uint64_t word;
+    unsigned index, share;
+    for (index = 0; index < 5; ++index) {
+        word = 0;
+        for (share = 0; share < shares; ++share)
+            word ^= be_load_word64(in + (index * shares + share) * 8);
+        be_store_word64(out + index * 8, word);
+    }
+}
+
+static bool test_avr_ascon_masked_permutation
+    (Code &code, const gencrypto::TestVector &vec, unsigned shares)
+{
+    int firstRound = vec.valueAsInt("First_Round", 0);
+    unsigned char input[40];
+    unsigned char output[40];
+    unsigned char preserve[24];
+    unsigned char state[160];
+    if (firstRound < 0 || firstRound > 12)
+        return false;
+    if (!vec.populate(input, sizeof(input), "Input"))
+        return false;
+    mask(state, input, shares);
+    for (unsigned word = 0; word < (shares - 1); ++word)
+        be_store_word64(preserve + word * 8, get_random());
+    code.exec_masked_permutation
+        (state, shares * 40, firstRound, preserve, (shares - 1) * 8);
+    unmask(output, state, shares);
+    return vec.check(output, sizeof(output), "Output");
+}
+
+static void gen_avr_ascon_masked_permutation_2(Code &code)
+{
+    gen_avr_ascon_masked_permutation(code, 2);
+}
+
+static void gen_avr_ascon_masked_permutation_3(Code &code)
+{
+    gen_avr_ascon_masked_permutation(code, 3);
+}
+
+static void gen_avr_ascon_masked_permutation_4(Code &code)
+{
+    gen_avr_ascon_masked_permutation(code, 4);
+}
+
+static bool test_avr_ascon_masked_permutation_2
+    (Code &code, const gencrypto::TestVector &vec)
+{
+    return test_avr_ascon_masked_permutation(code, vec, 2);
+}
+
+static bool test_avr_ascon_masked_permutation_3
+    (Code &code, const gencrypto::TestVector &vec)
+{
+    return test_avr_ascon_masked_permutation(code, vec, 3);
+}
+
+static bool test_avr_ascon_masked_permutation_4
+    (Code &code, const gencrypto::TestVector &vec)
+{
+    return test_avr_ascon_masked_permutation(code, vec, 4);
+}
+
+GENCRYPTO_REGISTER_AVR("ascon_masked_permute", "2shares", "avr5",
+                       gen_avr_ascon_masked_permutation_2,
+                       test_avr_ascon_masked_permutation_2);
+GENCRYPTO_REGISTER_AVR("ascon_masked_permute", "3shares", "avr5",
+                       gen_avr_ascon_masked_permutation_3,
+                       test_avr_ascon_masked_permutation_3);
+GENCRYPTO_REGISTER_AVR("ascon_masked_permute", "4shares", "avr5",
+                       gen_avr_ascon_masked_permutation_4,
+                       test_avr_ascon_masked_permutation_4);
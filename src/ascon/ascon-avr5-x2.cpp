@@ -215,10 +215,15 @@ static void ascon_diffuse
     Reg t = code.allocateReg(8);
     if (word != 2 || share != 0) // x2_a is already in registers.
         load_word(code, x, locations.loc[word], share);
+    // Rotations are applied lazily to "t" so that byte rotations become
+    // renamings, and "x" is never rotated so that it stays where it is:
+    // "t = (x ^ (x >>> (shift2 - shift1))) >>> shift1".
     code.move(t, x);
-    code.ror(t, shift1);
+    code.ror_lazy(t, shift2 - shift1);
+    code.materialise(t);
     code.logxor(t, x);
-    code.ror(x, shift2);
+    code.ror_lazy(t, shift1);
+    code.materialise(t);
     code.logxor(x, t);
     if (word != 2 || share != 0)
         store_word(code, x, locations.loc[word], share);
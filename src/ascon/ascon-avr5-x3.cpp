@@ -282,10 +282,15 @@ static void ascon_diffuse
     // Compute "x ^= (x >>> shift1) ^ (x >>> shift2)".
     Reg t = code.allocateReg(8);
     load_word(code, x, locations.loc[word], share);
+    // Rotations are applied lazily to "t" so that byte rotations become
+    // renamings, and "x" is never rotated so that it stays where it is:
+    // "t = (x ^ (x >>> (shift2 - shift1))) >>> shift1".
     code.move(t, x);
-    code.ror(t, shift1);
+    code.ror_lazy(t, shift2 - shift1);
+    code.materialise(t);
     code.logxor(t, x);
-    code.ror(x, shift2);
+    code.ror_lazy(t, shift1);
+    code.materialise(t);
     code.logxor(x, t);
     store_word(code, x, locations.loc[word], share);
     code.releaseReg(t);
@@ -100,10 +100,15 @@ static void ascon_diffuse
     Reg t = code.allocateReg(8);
     if (word != 0)
         code.ldz(x.reversed(), ASCON_WORD(word));
+    // Rotations are applied lazily to "t" so that byte rotations become
+    // renamings, and "x" is never rotated so that it stays where it is:
+    // "t = (x ^ (x >>> (shift2 - shift1))) >>> shift1".
     code.move(t, x);
-    code.ror(t, shift1);
+    code.ror_lazy(t, shift2 - shift1);
+    code.materialise(t);
     code.logxor(t, x);
-    code.ror(x, shift2);
+    code.ror_lazy(t, shift1);
+    code.materialise(t);
     code.logxor(x, t);
     if (word != 2 && word != 4)
         code.stz(x.reversed(), ASCON_WORD(word));
@@ -185,6 +190,27 @@ static void gen_avr_ascon_cleanup(Code &code)
     code.move(r0, 0);
 }
 
+static void gen_avr_ascon_permute_twice(Code &code)
+{
+    // Set up the function prologue with 0 bytes of local variable storage.
+    // Z points to the permutation state on input and output.
+    Reg round = code.prologue_permutation_with_count("ascon_permute_twice", 0);
+    code.setFlag(Code::NoLocals); // Don't need Y, so no point creating locals.
+
+    // Run the permutation twice by calling ascon_permute() directly, which
+    // exercises calls between functions that are linked in one template.
+    // The state pointer and round number are in call-clobbered registers,
+    // so save them on the stack across the first call.
+    Reg state = code.explicitReg(24, 2);
+    code.move(state, Reg::z_ptr());
+    code.push(state);
+    code.push(round);
+    code.call_function("ascon_permute");
+    code.pop(round);
+    code.pop(state);
+    code.call_function("ascon_permute");
+}
+
 static bool test_avr_ascon_permutation
     (Code &code, const gencrypto::TestVector &vec)
 {
@@ -203,3 +229,6 @@ GENCRYPTO_REGISTER_AVR("ascon_permute", 0, "avr5",
                        test_avr_ascon_permutation);
 GENCRYPTO_REGISTER_AVR("ascon_backend_free", 0, "avr5",
                        gen_avr_ascon_cleanup, 0);
+GENCRYPTO_REGISTER_AVR("ascon_permute_twice", 0, "avr5",
+                       gen_avr_ascon_permute_twice,
+                       test_avr_ascon_permutation);
@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "avr/code.h"
+#include "common/registry.h"
+#include <cstring>
+
+using namespace AVR;
+
+// Offset of a byte in the ASCON state in big-endian byte order.
+#define ASCON_BYTE(word, byte) ((word) * 8 + 7 - (byte))
+
+// Offset of a word in the ASCON state.  Points to the high byte.
+#define ASCON_WORD(word) ((word) * 8)
+
+// The reduced core does not have enough registers to keep "x2" and "x4"
+// in registers between rounds like the avr5 version does, so the state
+// is kept in memory and processed one byte or one word at a time.
+
+static void ascon_substitute_rc(Code &code, int offset, const Reg &round)
+{
+    // Load the five bytes of the state for this bit slice.
+    Reg x0 = code.allocateReg(1);
+    Reg x1 = code.allocateReg(1);
+    Reg x2 = code.allocateReg(1);
+    Reg x3 = code.allocateReg(1);
+    Reg x4 = code.allocateReg(1);
+    code.ldz(x0, ASCON_BYTE(0, offset));
+    code.ldz(x1, ASCON_BYTE(1, offset));
+    code.ldz(x2, ASCON_BYTE(2, offset));
+    code.ldz(x3, ASCON_BYTE(3, offset));
+    code.ldz(x4, ASCON_BYTE(4, offset));
+
+    // XOR the round constant with the low byte of "x2".
+    if (offset == 0)
+        code.logxor(x2, round);
+
+    // We need some temporary registers as well.
+    Reg t0 = code.allocateReg(1);
+    Reg t1 = code.allocateReg(1);
+    Reg t2 = code.allocateReg(1);
+
+    // process S-box
+    code.move(t0, x1);
+    code.move(t1, x0);
+    code.move(t2, x3);
+    code.logxor(t0, x2);
+    code.logxor(t1, x4);
+    code.logxor(t2, x4);
+    code.lognot(x4);
+    code.logor(x4, x3);
+    code.logxor(x4, t0);
+    code.logxor(x3, x1);
+    code.logor(x3, t0);
+    code.logxor(x3, t1);
+    code.logxor(x2, t1);
+    code.logor(x2, x1);
+    code.logxor(x2, t2);
+    code.lognot(t1);
+    code.logand(x1, t1);
+    code.logxor(x1, t2);
+    code.logor(x0, t2);
+    code.logxor(x0, t0);
+
+    // After substitution, x2 contains x0, x4 contains x2, x1 contains x4,
+    // x3 contains x1, and x0 contains x3.  Write everything back.
+    code.stz(x2, ASCON_BYTE(0, offset));
+    code.stz(x3, ASCON_BYTE(1, offset));
+    code.stz(x4, ASCON_BYTE(2, offset));
+    code.stz(x0, ASCON_BYTE(3, offset));
+    code.stz(x1, ASCON_BYTE(4, offset));
+
+    // Release all of the registers.
+    code.releaseReg(x0);
+    code.releaseReg(x1);
+    code.releaseReg(x2);
+    code.releaseReg(x3);
+    code.releaseReg(x4);
+    code.releaseReg(t0);
+    code.releaseReg(t1);
+    code.releaseReg(t2);
+}
+
+static void ascon_rotate_byte_rc
+    (Code &code, const Reg &acc, const Reg &x, int index, int shift, bool first)
+{
+    // Extract byte "index" of "x >>> shift" and XOR it into "acc".
+    // We shift a pair of adjacent bytes by whichever direction is shorter.
+    int q = shift / 8;
+    int r = shift % 8;
+    Reg pair = code.allocateReg(2);
+    Reg result;
+    if (r == 0) {
+        result = Reg(x, (index + q) % 8, 1);
+    } else {
+        code.move(Reg(pair, 0, 1), Reg(x, (index + q) % 8, 1));
+        code.move(Reg(pair, 1, 1), Reg(x, (index + q + 1) % 8, 1));
+        if (r <= 4) {
+            code.lsr(pair, r);
+            result = Reg(pair, 0, 1);
+        } else {
+            code.lsl(pair, 8 - r);
+            result = Reg(pair, 1, 1);
+        }
+    }
+    if (first)
+        code.move(acc, result);
+    else
+        code.logxor(acc, result);
+    code.releaseReg(pair);
+}
+
+static void ascon_diffuse_rc(Code &code, int word, int shift1, int shift2)
+{
+    // Compute "x ^= (x >>> shift1) ^ (x >>> shift2)" one byte at a time.
+    // The bytes are stored from the low end of the word to the high end,
+    // which walks Z backwards from where the load left it.
+    Reg x = code.allocateReg(8);
+    Reg acc = code.allocateReg(1);
+    code.ldz(x.reversed(), ASCON_WORD(word));
+    for (int index = 0; index < 8; ++index) {
+        ascon_rotate_byte_rc(code, acc, x, index, shift1, true);
+        ascon_rotate_byte_rc(code, acc, x, index, shift2, false);
+        code.logxor(acc, Reg(x, index, 1));
+        code.stz(acc, ASCON_BYTE(word, index));
+    }
+    code.releaseReg(acc);
+    code.releaseReg(x);
+}
+
+static void gen_avrrc_ascon_permutation(Code &code)
+{
+    // Set up the function prologue with 0 bytes of local variable storage.
+    // Z points to the permutation state on input and output.
+    Reg round = code.prologue_permutation_with_count("ascon_permute", 0);
+    code.setFlag(Code::NoLocals); // Don't need Y, so no point creating locals.
+    code.setFlag(Code::TempY);
+
+    // Compute "round = ((0x0F - round) << 4) | round" to convert the
+    // first round number into a round constant.
+    Reg temp = code.allocateHighReg(1);
+    code.move(temp, 0x0F);
+    code.sub(temp, round);
+    code.onereg(Insn::SWAP, temp.reg(0));
+    code.logor(round, temp);
+    code.releaseReg(temp);
+
+    // Top of the round loop.
+    unsigned char top_label = 0;
+    code.label(top_label);
+
+    // Perform the substitution layer byte by byte.
+    for (int index = 0; index < 8; ++index)
+        ascon_substitute_rc(code, index, round);
+
+    // Perform the linear diffusion layer on each of the state words.
+    ascon_diffuse_rc(code, 0, 19, 28);
+    ascon_diffuse_rc(code, 1, 61, 39);
+    ascon_diffuse_rc(code, 2,  1,  6);
+    ascon_diffuse_rc(code, 3, 10, 17);
+    ascon_diffuse_rc(code, 4,  7, 41);
+
+    // Bottom of the round loop.  Adjust the round constant and
+    // check to see if we have reached the final round.
+    code.syncPointers();
+    code.sub(round, 0x0F);
+    code.compare_and_loop(round, 0x3C, top_label);
+}
+
+static void gen_avrrc_ascon_cleanup(Code &code)
+{
+    // Set up the function prologue with 0 bytes of local variable storage.
+    // Z points to the permutation state on input and output.
+    code.prologue_permutation("ascon_backend_free", 0);
+    code.setFlag(Code::NoLocals); // Don't need Y, so no point creating locals.
+
+    // Clear all scratch registers on the reduced core: r16, r22-r27,
+    // and r30-r31.  As with avr5, r24-r25 and r30-r31 hold the incoming
+    // state pointer and the call-saved registers r18-r21 and Y were
+    // already restored by ascon_permute() when it popped its frame.
+    code.setFlag(Code::TempR0);
+    Reg r0 = code.explicitReg(TEMP_REG, 1);
+    Reg r22to23 = code.explicitReg(22, 24 - 22);
+    Reg r26to27 = code.explicitReg(26, 28 - 26);
+    code.move(r22to23, 0);
+    code.move(r26to27, 0);
+    code.move(r0, 0);
+}
+
+static bool test_avrrc_ascon_permutation
+    (Code &code, const gencrypto::TestVector &vec)
+{
+    int firstRound = vec.valueAsInt("First_Round", 0);
+    unsigned char state[40];
+    if (firstRound < 0 || firstRound > 12)
+        return false;
+    if (!vec.populate(state, sizeof(state), "Input"))
+        return false;
+    code.exec_permutation(state, 40, firstRound);
+    return vec.check(state, sizeof(state), "Output");
+}
+
+GENCRYPTO_REGISTER_AVR("ascon_permute", 0, "avrrc",
+                       gen_avrrc_ascon_permutation,
+                       test_avrrc_ascon_permutation);
+GENCRYPTO_REGISTER_AVR("ascon_backend_free", 0, "avrrc",
+                       gen_avrrc_ascon_cleanup, 0);
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "aig.h"
+
+namespace AVR
+{
+
+Aig::Aig()
+{
+    // Node 0 is the constant false node.
+    m_fanin0.push_back(0);
+    m_fanin1.push_back(0);
+}
+
+Aig::~Aig()
+{
+}
+
+/**
+ * \brief Creates a new primary input.
+ *
+ * \return The literal for the input.
+ */
+AigLit Aig::input()
+{
+    uint32_t node = m_fanin0.size();
+    m_fanin0.push_back(NotAnd);
+    m_fanin1.push_back(NotAnd);
+    m_inputs.push_back(node);
+    return node * 2;
+}
+
+/**
+ * \brief Creates the AND of two literals.
+ *
+ * \param a The first literal.
+ * \param b The second literal.
+ *
+ * \return The literal for the result, which may be an existing node
+ * if the AND simplifies or has been created before.
+ */
+AigLit Aig::andLit(AigLit a, AigLit b)
+{
+    if (a > b) {
+        AigLit t = a;
+        a = b;
+        b = t;
+    }
+    if (a == False || a == invert(b))
+        return False;
+    if (a == True || a == b)
+        return b;
+    uint64_t key = (((uint64_t)a) << 32) | b;
+    std::unordered_map<uint64_t, uint32_t>::const_iterator it;
+    it = m_strash.find(key);
+    if (it != m_strash.end())
+        return it->second * 2;
+    uint32_t node = m_fanin0.size();
+    m_fanin0.push_back(a);
+    m_fanin1.push_back(b);
+    m_strash[key] = node;
+    return node * 2;
+}
+
+/**
+ * \brief Creates the XOR of two literals.
+ *
+ * \param a The first literal.
+ * \param b The second literal.
+ *
+ * \return The literal for the result.
+ */
+AigLit Aig::xorLit(AigLit a, AigLit b)
+{
+    if (isConstant(a))
+        return a ? invert(b) : b;
+    if (isConstant(b))
+        return b ? invert(a) : a;
+    if (a == b)
+        return False;
+    if (a == invert(b))
+        return True;
+
+    // Normalize the polarity so that XNOR shares nodes with XOR.
+    AigLit flip = (a & 1) ^ (b & 1);
+    a &= ~1U;
+    b &= ~1U;
+    return invert(andLit(invert(andLit(a, invert(b))),
+                         invert(andLit(invert(a), b)))) ^ flip;
+}
+
+/**
+ * \brief Creates a multiplexer.
+ *
+ * \param sel The selector literal.
+ * \param a The literal to select when \a sel is true.
+ * \param b The literal to select when \a sel is false.
+ *
+ * \return The literal for the result.
+ */
+AigLit Aig::mux(AigLit sel, AigLit a, AigLit b)
+{
+    if (isConstant(sel))
+        return sel ? a : b;
+    if (a == b)
+        return a;
+    return orLit(andLit(sel, a), andLit(invert(sel), b));
+}
+
+/**
+ * \brief Simulates the graph on 64 input patterns in parallel.
+ *
+ * \param inputs Values for the primary inputs, one bit per pattern.
+ * \param values Returns the values of every node in the graph.
+ */
+void Aig::simulate(const std::vector<uint64_t> &inputs,
+                   std::vector<uint64_t> &values) const
+{
+    size_t count = m_fanin0.size();
+    values.resize(count);
+    values[0] = 0;
+    size_t next = 0;
+    for (size_t node = 1; node < count; ++node) {
+        if (m_fanin0[node] == NotAnd) {
+            values[node] = (next < inputs.size()) ? inputs[next] : 0;
+            ++next;
+        } else {
+            values[node] = value(values, m_fanin0[node]) &
+                           value(values, m_fanin1[node]);
+        }
+    }
+}
+
+} // namespace AVR
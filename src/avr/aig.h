@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef GENAVR_AIG_H
+#define GENAVR_AIG_H
+
+#include <vector>
+#include <unordered_map>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace AVR
+{
+
+/**
+ * \brief Literal in an and-inverter graph.
+ *
+ * The low bit indicates that the literal is inverted, and the remaining
+ * bits are the index of the node.  Node 0 is the constant false node.
+ */
+typedef uint32_t AigLit;
+
+/**
+ * \brief And-inverter graph for bit-precise symbolic execution.
+ *
+ * Nodes are structurally hashed as they are created, so identical
+ * computations on identical inputs always produce the same literal.
+ * Node indexes are in topological order: the children of a node
+ * always have smaller indexes than the node itself.
+ */
+class Aig
+{
+public:
+    Aig();
+    ~Aig();
+
+    /**
+     * \brief Literal for the constant false value.
+     */
+    static const AigLit False = 0;
+
+    /**
+     * \brief Literal for the constant true value.
+     */
+    static const AigLit True = 1;
+
+    AigLit input();
+    AigLit andLit(AigLit a, AigLit b);
+    AigLit orLit(AigLit a, AigLit b)
+        { return invert(andLit(invert(a), invert(b))); }
+    AigLit xorLit(AigLit a, AigLit b);
+    AigLit mux(AigLit sel, AigLit a, AigLit b);
+    AigLit constant(bool value) const { return value ? True : False; }
+
+    /**
+     * \brief Inverts a literal.
+     *
+     * \param lit The literal to invert.
+     *
+     * \return The inverted version of \a lit.
+     */
+    static AigLit invert(AigLit lit) { return lit ^ 1; }
+
+    /**
+     * \brief Determine if a literal is a constant.
+     *
+     * \param lit The literal to check.
+     *
+     * \return Returns true if \a lit is either True or False.
+     */
+    static bool isConstant(AigLit lit) { return lit < 2; }
+
+    /**
+     * \brief Gets the number of nodes in the graph, including the
+     * constant node and the inputs.
+     */
+    unsigned nodeCount() const { return m_fanin0.size(); }
+
+    /**
+     * \brief Gets the number of primary inputs in the graph.
+     */
+    unsigned inputCount() const { return m_inputs.size(); }
+
+    /**
+     * \brief Gets the node index for a primary input.
+     *
+     * \param index Index of the input, in the order they were created.
+     */
+    uint32_t inputNode(unsigned index) const { return m_inputs[index]; }
+
+    /**
+     * \brief Determine if a node is a primary input.
+     *
+     * \param node Index of the node.
+     */
+    bool isInput(uint32_t node) const { return m_fanin0[node] == NotAnd; }
+
+    /**
+     * \brief Gets the first child literal of an AND node.
+     *
+     * \param node Index of the node.
+     */
+    AigLit fanin0(uint32_t node) const { return m_fanin0[node]; }
+
+    /**
+     * \brief Gets the second child literal of an AND node.
+     *
+     * \param node Index of the node.
+     */
+    AigLit fanin1(uint32_t node) const { return m_fanin1[node]; }
+
+    void simulate(const std::vector<uint64_t> &inputs,
+                  std::vector<uint64_t> &values) const;
+
+    /**
+     * \brief Gets the simulated value of a literal.
+     *
+     * \param values Values of all nodes from simulate().
+     * \param lit The literal.
+     *
+     * \return The 64 simulated values of \a lit.
+     */
+    static uint64_t value(const std::vector<uint64_t> &values, AigLit lit)
+    {
+        uint64_t v = values[lit >> 1];
+        return (lit & 1) ? ~v : v;
+    }
+
+private:
+    enum { NotAnd = 0xFFFFFFFFU };
+
+    std::vector<AigLit> m_fanin0;
+    std::vector<AigLit> m_fanin1;
+    std::vector<uint32_t> m_inputs;
+    std::unordered_map<uint64_t, uint32_t> m_strash;
+};
+
+} // namespace AVR
+
+#endif
@@ -46,6 +46,18 @@ namespace AVR
  *
  * Similar register allocation is used for return values up to 8 bytes;
  * e.g. 1 byte return values will be returned in r24, 2 byte in r24:r25.
+ *
+ * Reduced AVRrc cores such as the ATtiny10 do not have r0-r15:
+ *
+ * r16      Can be clobbered - temporary scratch register.
+ * r17      Always set to zero.
+ * r18-r21  Call-saved registers.
+ * r22-r25  Can be clobbered.
+ * r26-r31  Same as above.
+ *
+ * Function call arguments are passed in r20-r25 only.  In this code
+ * generator we continue to refer to the temporary and zero registers
+ * as r0 and r1 and then map them to r16 and r17 during output.
  */
 
 Insn Insn::bare(Type type)
@@ -111,6 +123,42 @@ Insn Insn::memory(Type type, unsigned char reg, unsigned char offset)
     return Insn(type, reg, offset);
 }
 
+bool Insn::hasReg1() const
+{
+    switch (m_type) {
+    case BRCC: case BRCS: case BREQ: case BRNE: case CALL: case CALL_FUNC:
+    case JMP: case LABEL: case LPM_CLEAN: case LPM_OFFSET: case NOP: case PRINTCH:
+    case PRINTLN: case RET:
+        return false;
+    default: break;
+    }
+    return true;
+}
+
+bool Insn::hasReg2() const
+{
+    switch (m_type) {
+    case ADC: case ADD: case AND: case CP: case CPC: case CPSE: case EOR:
+    case LPM_SETLOW: case MOV: case MOVW: case OR: case SBC: case SUB:
+        return true;
+    case LPM_SBOX:
+        return m_reg2 != POST_INC;
+    default: break;
+    }
+    return false;
+}
+
+// Gets the pointer register that is used by a memory instruction.
+static unsigned char ptr_reg(Insn::Type type)
+{
+    if (type == Insn::LD_X || type == Insn::ST_X)
+        return 26;
+    else if (type == Insn::LD_Y || type == Insn::ST_Y)
+        return 28;
+    else
+        return 30;
+}
+
 /**
  * \brief Constructs a subset of another register.
  *
@@ -126,7 +174,10 @@ Insn Insn::memory(Type type, unsigned char reg, unsigned char offset)
  * to extract a rotated version of the register.
  */
 Reg::Reg(const Reg &other, unsigned char offset, unsigned char count)
+    : m_rotate(0)
 {
+    if (other.m_rotate != 0)
+        throw std::invalid_argument("register has a pending rotation");
     if (offset >= other.size())
         return;
     if (count == 0xFF)
@@ -143,6 +194,8 @@ Reg::Reg(const Reg &other, unsigned char offset, unsigned char count)
 Reg Reg::reversed() const
 {
     Reg temp;
+    if (m_rotate != 0)
+        throw std::invalid_argument("register has a pending rotation");
     for (int index = size(); index > 0; --index)
         temp.m_regs.push_back(m_regs[index - 1]);
     return temp;
@@ -151,6 +204,8 @@ Reg Reg::reversed() const
 Reg Reg::shuffle(const unsigned char *pattern) const
 {
     Reg temp;
+    if (m_rotate != 0)
+        throw std::invalid_argument("register has a pending rotation");
     for (int index = 0; index < size(); ++index)
         temp.m_regs.push_back(m_regs[pattern[index]]);
     return temp;
@@ -194,6 +249,8 @@ Reg Reg::shuffle(unsigned char offset0, unsigned char offset1,
 Reg Reg::append(const Reg &other)
 {
     Reg temp;
+    if (m_rotate != 0 || other.m_rotate != 0)
+        throw std::invalid_argument("register has a pending rotation");
     for (int index = 0; index < size(); ++index)
         temp.m_regs.push_back(m_regs[index]);
     for (int index = 0; index < other.size(); ++index)
@@ -238,6 +295,8 @@ unsigned char Sbox::lookup(int value) const
 }
 
 Code::Code()
+    : m_trace(0)
+    , m_probes(0)
 {
     memset(m_immValues, 0, sizeof(m_immValues));
     clear();
@@ -250,6 +309,8 @@ Code::~Code()
 void Code::clear()
 {
     m_flags = MoveWord;
+    m_sboxPlacement = SboxInFlash;
+    m_sboxBudget = 0;
     m_insns.clear();
     m_labels.clear();
     m_allocated = 0;
@@ -259,6 +320,17 @@ void Code::clear()
     m_prologueType = Permutation;
     m_localsSize = 0;
     m_name = std::string();
+    memset(m_ptrAdjust, 0, sizeof(m_ptrAdjust));
+    m_cycles = 0;
+    m_randomDrawn = 0;
+    m_randomFresh = 0;
+    memset(&m_outline, 0, sizeof(m_outline));
+    m_sboxNames.clear();
+    m_calls.clear();
+    m_callCode.clear();
+    m_callNear.clear();
+    m_paramReg = -1;
+    m_paramValue = -1;
     resetRegs();
 }
 
@@ -433,6 +505,89 @@ void Code::add(const Reg &reg1, unsigned long long value, bool carryIn)
     }
 }
 
+/**
+ * \brief Adds a rotated register to another register.
+ *
+ * \param reg1 The destination register to add to.
+ * \param reg2 The source register to rotate and add, which is destroyed.
+ * \param bits The number of bits to rotate \a reg2 left by.
+ *
+ * The result in reg1 will be set to (reg1 + (reg2 <<< bits)).
+ *
+ * Rotations by whole bytes are performed by renaming the bytes of \a reg2
+ * during the addition.  When the rest of the rotation is a single bit,
+ * the bit that is shifted out of the top of \a reg2 is left in the carry
+ * flag and the addition starts with "ADC" instead of "ADD".  Bit 0 of
+ * the shifted value is zero, so this adds the rotated-out bit for free
+ * and we don't need "ADC r1" or "BST/BLD" to put it back.
+ *
+ * It is assumed that \a reg1 and \a reg2 have the same size.
+ */
+void Code::add_rol(const Reg &reg1, const Reg &reg2, unsigned bits)
+{
+    int size = reg2.size();
+    if (size == 0)
+        return;
+    if (reg1.size() != size)
+        throw std::invalid_argument("registers must be the same size");
+    bits %= size * 8;
+    unsigned bytes = bits / 8;
+    bits %= 8;
+    if (bits == 1 && bytes == 0) {
+        // Shift left by 1 bit and fold the carry out into the addition.
+        for (int index = 0; index < size; ++index) {
+            if (index == 0)
+                onereg(Insn::LSL, reg2.reg(index));
+            else
+                onereg(Insn::ROL, reg2.reg(index));
+        }
+        adc(reg1, reg2);
+        return;
+    } else if (bits >= 5) {
+        // Rotate right instead and adjust the byte renaming to match.
+        ror(reg2, 8 - bits);
+        bytes = (bytes + 1) % size;
+    } else {
+        rol(reg2, bits);
+    }
+    add(reg1, Reg(reg2, (size - bytes) % size, size));
+}
+
+/**
+ * \brief XOR's the sum of two registers into a third register.
+ *
+ * \param reg1 The destination register to XOR into.
+ * \param reg2 The first register to add, which is not modified.
+ * \param reg3 The second register to add, which is not modified.
+ *
+ * The result in reg1 will be set to (reg1 ^ (reg2 + reg3)).
+ *
+ * The sum is formed one byte at a time in the temporary register and
+ * XOR'ed into \a reg1 straight away.  "MOV" and "EOR" do not modify
+ * the carry flag, so the carry from each "ADD" or "ADC" is still there
+ * for the next byte.  This avoids the need for a temporary register
+ * that is as large as the sum.  It is safe for \a reg1 to be the same
+ * as \a reg2 or \a reg3.
+ *
+ * It is assumed that \a reg2 and \a reg3 have the same size.
+ * If \a reg1 is shorter, then the high bytes of the sum are ignored.
+ */
+void Code::add_xor(const Reg &reg1, const Reg &reg2, const Reg &reg3)
+{
+    int minsize = reg1.size();
+    if (reg2.size() < minsize)
+        minsize = reg2.size();
+    unsigned char temp_reg = tempreg();
+    for (int index = 0; index < minsize; ++index) {
+        tworeg(Insn::MOV, temp_reg, reg2.reg(index));
+        if (index == 0)
+            tworeg(Insn::ADD, temp_reg, reg3.reg(index));
+        else
+            tworeg(Insn::ADC, temp_reg, reg3.reg(index));
+        tworeg(Insn::EOR, reg1.reg(index), temp_reg);
+    }
+}
+
 /**
  * \brief Performs an arithmetic shift right by 1 bit on a register.
  *
@@ -763,6 +918,9 @@ void Code::compare_and_set
  * \brief Establish a "leapfrog" at this location that extends the
  * range of a previous "jmp" instruction.
  *
+ * Conditional branches are relaxed automatically, so this is only needed
+ * to keep "rjmp" within range on devices that do not have "jmp".
+ *
  * \param jmpLabel The label that the previous "jmp" instruction referenced.
  * \param withSkip True to skip over the leapfrog, false if skip not needed.
  */
@@ -786,6 +944,9 @@ void Code::leapfrogDown(unsigned char &jmpLabel, bool withSkip)
  * \brief Establish a "leapfrog" at this location that extends the
  * range of a later branch instruction.
  *
+ * Conditional branches are relaxed automatically, so this is only needed
+ * to keep "rjmp" within range on devices that do not have "jmp".
+ *
  * \param jmpLabel The label that the later "jmp" instruction will reference.
  * \param withSkip True to skip over the leapfrog, false if skip not needed.
  */
@@ -1583,6 +1744,51 @@ void Code::rol(const Reg &reg, unsigned bits)
     }
 }
 
+/**
+ * \brief XOR's a register rotated left by 1 bit into another register.
+ *
+ * \param reg1 The destination register to XOR into.
+ * \param reg2 The source register to rotate, which is not modified.
+ *
+ * The result in reg1 will be set to (reg1 ^ (reg2 <<< 1)).
+ *
+ * Each byte of the rotated value is formed in the temporary register
+ * with "ROL" and then XOR'ed into \a reg1.  The carry flag is primed
+ * with the top bit of \a reg2 first so that the rotated-out bit comes
+ * in at the bottom with no "ADC r1" fix-up, and it then carries between
+ * the bytes because "MOV" and "EOR" do not modify it.  This does not
+ * need a temporary copy of \a reg2 or r1 to be zero.  It is safe for
+ * \a reg1 to be the same as \a reg2.
+ *
+ * If \a reg1 is shorter than \a reg2, then the high bytes of the rotated
+ * value will be ignored.
+ */
+void Code::rol1_xor(const Reg &reg1, const Reg &reg2)
+{
+    int size = reg2.size();
+    int minsize = reg1.size();
+    if (size < minsize)
+        minsize = size;
+    if (minsize == 0)
+        return;
+    unsigned char temp_reg = tempreg();
+    if (size == 1 && !hasFlag(TempR1)) {
+        // Single byte rotations are cheaper with "ADC r1".
+        tworeg(Insn::MOV, temp_reg, reg2.reg(0));
+        onereg(Insn::LSL, temp_reg);
+        tworeg(Insn::ADC, temp_reg, ZERO_REG);
+        tworeg(Insn::EOR, reg1.reg(0), temp_reg);
+        return;
+    }
+    tworeg(Insn::MOV, temp_reg, reg2.reg(size - 1));
+    onereg(Insn::LSL, temp_reg);
+    for (int index = 0; index < minsize; ++index) {
+        tworeg(Insn::MOV, temp_reg, reg2.reg(index));
+        onereg(Insn::ROL, temp_reg);
+        tworeg(Insn::EOR, reg1.reg(index), temp_reg);
+    }
+}
+
 /**
  * \brief Rotates the contents of a register left by a number of bytes.
  *
@@ -1659,6 +1865,59 @@ void Code::rol_bytes(const Reg &reg, unsigned count)
     }
 }
 
+/**
+ * \brief Rotates the contents of a register left by a number of bits,
+ * deferring as much of the work as possible.
+ *
+ * \param reg The register to rotate, which is updated in place.
+ * \param bits The number of bits to rotate by.
+ *
+ * Rotations by whole bytes are performed by renaming the bytes of \a reg,
+ * which costs nothing.  The remaining 0 to 7 bits are recorded in \a reg
+ * as a pending rotation and are combined with any later lazy rotations.
+ * The register cannot be used by other operations until materialise()
+ * has been called to perform the pending bit rotation.
+ *
+ * Because the bytes are renamed, the caller must use the updated \a reg
+ * afterwards and not some other copy of it.
+ *
+ * \sa ror_lazy(), materialise()
+ */
+void Code::rol_lazy(Reg &reg, unsigned bits)
+{
+    if (reg.size() == 0)
+        return;
+    bits = (bits + reg.m_rotate) % (reg.size() * 8);
+    reg.m_rotate = 0;
+    reg = Reg(reg, (reg.size() - bits / 8) % reg.size(), reg.size());
+    reg.m_rotate = bits % 8;
+}
+
+/**
+ * \brief Performs the bit rotation that is pending on a register
+ * after rol_lazy() or ror_lazy().
+ *
+ * \param reg The register to materialise, which is updated in place.
+ *
+ * Pending rotations of 5 to 7 bits are performed as a rotation right
+ * by 1 to 3 bits after renaming the bytes, which is cheaper than
+ * rotating left by the full amount.
+ */
+void Code::materialise(Reg &reg)
+{
+    unsigned bits = reg.m_rotate;
+    reg.m_rotate = 0;
+    if (bits == 0) {
+        // Nothing to do.
+        return;
+    } else if (bits <= 4 || reg.size() == 1) {
+        rol(reg, bits);
+    } else {
+        reg = Reg(reg, reg.size() - 1, reg.size());
+        ror(reg, 8 - bits);
+    }
+}
+
 /**
  * \brief Rotates the contents of a register right by a number of bits.
  *
@@ -1796,6 +2055,23 @@ void Code::ror_bytes(const Reg &reg, unsigned count)
     }
 }
 
+/**
+ * \brief Rotates the contents of a register right by a number of bits,
+ * deferring as much of the work as possible.
+ *
+ * \param reg The register to rotate, which is updated in place.
+ * \param bits The number of bits to rotate by.
+ *
+ * \sa rol_lazy(), materialise()
+ */
+void Code::ror_lazy(Reg &reg, unsigned bits)
+{
+    if (reg.size() == 0)
+        return;
+    unsigned width = reg.size() * 8;
+    rol_lazy(reg, width - (bits % width));
+}
+
 /**
  * \brief Subtracts two registers with carry in.
  *
@@ -2046,6 +2322,8 @@ void Code::swapmove
  */
 void Code::sbox_setup(unsigned char num, const Sbox &sbox, const Reg &temp)
 {
+    if (hasFlag(ReducedCore))
+        throw std::invalid_argument("S-boxes are not supported on the reduced core");
     if (temp.size() == 0 || temp.reg(0) < 16) {
         Reg t = allocateHighReg(1);
         m_insns.push_back(Insn::reg2(Insn::LPM_SETUP, t.reg(0), num));
@@ -2074,6 +2352,8 @@ void Code::sbox_setup(unsigned char num, const Sbox &sbox, const Reg &temp)
 void Code::sbox_setup2
     (unsigned char num, const Sbox &sbox, const Reg &low, const Reg &temp)
 {
+    if (hasFlag(ReducedCore))
+        throw std::invalid_argument("S-boxes are not supported on the reduced core");
     m_insns.push_back(Insn::reg2(Insn::LPM_SETUP2, temp.reg(0), num));
     m_insns.push_back(Insn::reg2(Insn::LPM_SETLOW, 30, low.reg(0)));
     m_sboxes[num] = sbox;
@@ -2094,6 +2374,8 @@ void Code::sbox_setup2
  */
 void Code::sbox_switch(unsigned char num, const Sbox &sbox, const Reg &temp)
 {
+    if (hasFlag(ReducedCore))
+        throw std::invalid_argument("S-boxes are not supported on the reduced core");
     if (temp.size() == 0 || temp.reg(0) < 16) {
         Reg t = allocateHighReg(1);
         m_insns.push_back(Insn::reg2(Insn::LPM_SWITCH, t.reg(0), num));
@@ -2157,6 +2439,35 @@ void Code::sbox_lookup(const Reg &reg1, const Reg &reg2)
         tworeg(Insn::LPM_SBOX, reg1.reg(index), reg2.reg(index));
 }
 
+/**
+ * \brief XORs the S-box mapping of 8-bit values into a destination.
+ *
+ * \param reg1 Destination to XOR the mapped output values into.
+ * \param reg2 Input values to the S-box.
+ * \param temp Temporary register to hold the output of the S-box.
+ *
+ * Devices without "LPM Rd,Z" can only load from the S-box into r0.
+ * When the device is known to be like that, the output is loaded into
+ * r0 and XORed from there rather than moved into \a temp first.
+ *
+ * \sa sbox_lookup()
+ */
+void Code::sbox_lookup_xor(const Reg &reg1, const Reg &reg2, const Reg &temp)
+{
+    unsigned char treg = temp.reg(0);
+    if (hasFlag(DeviceSpecific) && !hasFlag(HasLPMX) &&
+            !sbox_in_data_space() && !hasFlag(ReducedCore)) {
+        treg = tempreg();
+    }
+    int minsize = reg1.size();
+    if (minsize > reg2.size())
+        minsize = reg2.size();
+    for (int index = 0; index < minsize; ++index) {
+        tworeg(Insn::LPM_SBOX, treg, reg2.reg(index));
+        tworeg(Insn::EOR, reg1.reg(index), treg);
+    }
+}
+
 /**
  * \brief Loads a register from the current S-box and increments Z.
  *
@@ -2168,6 +2479,50 @@ void Code::sbox_load_inc(const Reg &reg)
         immreg(Insn::LPM_SBOX, reg.reg(index), POST_INC);
 }
 
+/**
+ * \brief Gets the assembly code symbol for an S-box table.
+ *
+ * \param num Number of the S-box table.
+ *
+ * \return The symbol that was assigned by the Linker, or "table_<num>"
+ * if the table has not been linked.
+ */
+std::string Code::sbox_name(unsigned char num) const
+{
+    std::map<unsigned char, std::string>::const_iterator it;
+    it = m_sboxNames.find(num);
+    if (it != m_sboxNames.end())
+        return it->second;
+    return "table_" + std::to_string((int)num);
+}
+
+/**
+ * \brief Determine if this code indexes into S-box tables.
+ *
+ * \return Returns true if the code moves an index into the low byte of
+ * Z or adjusts the high byte of Z, which requires the tables to be
+ * aligned on a 256-byte boundary.  Returns false if the code only reads
+ * the tables sequentially.
+ */
+bool Code::sbox_indexed() const
+{
+    for (size_t index = 0; index < m_insns.size(); ++index) {
+        const Insn &insn = m_insns[index];
+        switch (insn.type()) {
+        case Insn::LPM_SBOX:
+            if (insn.reg2() != POST_INC)
+                return true;
+            break;
+        case Insn::LPM_SETUP2:
+        case Insn::LPM_SETLOW:
+        case Insn::LPM_ADJUST:
+            return true;
+        default: break;
+        }
+    }
+    return false;
+}
+
 /**
  * \brief Sets up the function prologue for a key setup function.
  *
@@ -2291,6 +2646,9 @@ Reg Code::prologue_encrypt_block_with_tweak
     prologue_encrypt_block(name, size_locals);
 
     // r18 will contain the "tweak" parameter on entry, so allocate it.
+    // The reduced core passes the fourth argument on the stack instead.
+    if (hasFlag(ReducedCore))
+        throw std::invalid_argument("too many arguments for the reduced core");
     m_allocated |= (1 << 18);
     m_usedRegs |= (1 << 18);
     Reg reg;
@@ -2365,6 +2723,7 @@ Reg Code::prologue_permutation_with_count
     // r22 will contain the "count" parameter on entry, so allocate it.
     m_allocated |= (1 << 22);
     m_usedRegs |= (1 << 22);
+    m_paramReg = 22;
     Reg reg;
     reg.m_regs.push_back(22);
     return reg;
@@ -2403,6 +2762,7 @@ Reg Code::prologue_masked_permutation
     // r22 will contain the "count" parameter on entry, so allocate it.
     m_allocated |= (1 << 22);
     m_usedRegs |= (1 << 22);
+    m_paramReg = 22;
     Reg reg;
     reg.m_regs.push_back(22);
     return reg;
@@ -2434,6 +2794,7 @@ void Code::prologue_tinyjambu(const char *name, Reg &rounds)
     // r20 will contain the "rounds" parameter.
     m_allocated |= (1 << 20);
     m_usedRegs |= (1 << 20);
+    m_paramReg = 20;
     Reg reg1;
     reg1.m_regs.push_back(20);
     rounds = reg1;
@@ -2481,6 +2842,8 @@ Reg Code::arg(unsigned size)
         break;
     }
     first_reg -= rounded_size;
+    if (hasFlag(ReducedCore) && first_reg < 20)
+        throw std::invalid_argument("too many arguments for the reduced core");
     return allocateExplicitReg(first_reg, size);
 }
 
@@ -2588,6 +2951,7 @@ void Code::bare(Insn::Type type)
         // Flush temporary immediates when we see a "ret" instruction.
         m_immRegs = 0;
         m_immCount = 0;
+        syncPointers();
     }
     m_insns.push_back(Insn::bare(type));
 }
@@ -2596,6 +2960,14 @@ void Code::branch(Insn::Type type, unsigned char &ref)
 {
     m_immRegs = 0; // Flush temporary immediates when we see a branch point.
     m_immCount = 0;
+    if (hasFlag(ReducedCore)) {
+        // Pointers must have their nominal values at all branch points.
+        // Conditional branches need the flags, so we cannot use "subi".
+        bool keepFlags = (type != Insn::LABEL && type != Insn::JMP &&
+                          type != Insn::CALL);
+        ptr_sync(26, keepFlags);
+        ptr_sync(30, keepFlags);
+    }
     if (ref == 0) {
         if (type == Insn::LABEL)
             m_labels.push_back((int)(m_insns.size()));
@@ -2615,14 +2987,74 @@ void Code::branch(Insn::Type type, unsigned char &ref)
     m_insns.push_back(Insn::branch(type, ref));
 }
 
+/**
+ * \brief Calls another function that is generated from the same template.
+ *
+ * \param name Name of the function to call, as passed to its prologue.
+ *
+ * The arguments must already be in r24, r22, r20, etc according to the
+ * avr-gcc calling convention.  On return, the call-clobbered registers
+ * will have been destroyed and the zero register will be zero.  On the
+ * reduced core, use syncPointers() before copying X or Z into argument
+ * registers.
+ *
+ * The call is resolved by the Linker when the template is processed.
+ * It becomes "rcall" if the functions in the template are close enough
+ * together, or "call" otherwise.
+ */
+void Code::call_function(const std::string &name)
+{
+    // The callee destroys any temporary immediates in high registers.
+    m_immRegs = 0;
+    m_immCount = 0;
+    syncPointers();
+
+    // Reuse the same function table entry for multiple calls.
+    unsigned index;
+    for (index = 0; index < m_calls.size(); ++index) {
+        if (m_calls[index] == name)
+            break;
+    }
+    if (index >= m_calls.size()) {
+        if (index >= 256)
+            throw std::invalid_argument("too many called functions");
+        m_calls.push_back(name);
+        m_callCode.push_back(0);
+        m_callNear.push_back(false);
+    }
+    m_insns.push_back(Insn::branch(Insn::CALL_FUNC, (unsigned char)index));
+}
+
+/**
+ * \brief Links a called function to its code.
+ *
+ * \param index Index of the called function, between 0 and
+ * function_count() - 1.
+ * \param code The code for the called function.
+ * \param near Set to true if the called function is within "rcall" range.
+ */
+void Code::link_function(unsigned index, const Code *code, bool near)
+{
+    m_callCode.at(index) = code;
+    m_callNear.at(index) = near;
+}
+
 void Code::onereg(Insn::Type type, unsigned char reg)
 {
+    ptr_sync(reg & 0xFE, false);
     m_insns.push_back(Insn::reg1(type, reg));
     used(reg);
 }
 
 void Code::tworeg(Insn::Type type, unsigned char reg1, unsigned char reg2)
 {
+    if (type == Insn::CPSE) {
+        // The following instruction may be skipped, so it is too late
+        // to adjust the pointers after the "cpse".
+        syncPointers();
+    }
+    ptr_sync(reg1 & 0xFE, false);
+    ptr_sync(reg2 & 0xFE, false);
     m_insns.push_back(Insn::reg2(type, reg1, reg2));
     used(reg1);
     used(reg2);
@@ -2630,18 +3062,33 @@ void Code::tworeg(Insn::Type type, unsigned char reg1, unsigned char reg2)
 
 void Code::bitop(Insn::Type type, unsigned char reg, unsigned char bit)
 {
+    ptr_sync(reg & 0xFE, false);
     m_insns.push_back(Insn::reg2(type, reg, bit));
     used(reg);
 }
 
 void Code::immreg(Insn::Type type, unsigned char reg, unsigned char value)
 {
+    ptr_sync(reg & 0xFE, false);
     m_insns.push_back(Insn::imm(type, reg, value));
     used(reg);
 }
 
 void Code::memory(Insn::Type type, unsigned char reg, unsigned char offset)
 {
+    if (hasFlag(ReducedCore)) {
+        if (offset != 0 && offset != PRE_DEC && offset != POST_INC) {
+            throw std::invalid_argument
+                ("displacement addressing is not supported on the reduced core");
+        }
+        // The caller expects the pointer to be at its nominal value,
+        // and any post-increment or pre-decrement moves it for real.
+        unsigned char ptr = ptr_reg(type);
+        ptr_sync(ptr, false);
+        ptr_walk(type, reg, offset);
+        m_ptrAdjust[(ptr - 26) / 2] = 0;
+        return;
+    }
     m_insns.push_back(Insn::memory(type, reg, offset));
     used(reg);
 }
@@ -2677,6 +3124,39 @@ void Code::resetRegs()
 {
     m_regOrder.clear();
 
+    if (hasFlag(ReducedCore)) {
+        // The reduced core only has r16-r31 and r16/r17 stand in for
+        // "r0" and "r1".  Allocate the call-clobbered registers first
+        // and then the call-saved registers r18-r21.
+        m_regOrder.push_back(22);
+        m_regOrder.push_back(23);
+        m_regOrder.push_back(24);
+        m_regOrder.push_back(25);
+        if (hasFlag(TempX)) {
+            m_regOrder.push_back(26);
+            m_regOrder.push_back(27);
+        }
+        if (hasFlag(TempY)) {
+            m_regOrder.push_back(28);
+            m_regOrder.push_back(29);
+        }
+        if (hasFlag(TempZ)) {
+            m_regOrder.push_back(30);
+            m_regOrder.push_back(31);
+        }
+        m_regOrder.push_back(18);
+        m_regOrder.push_back(19);
+        m_regOrder.push_back(20);
+        m_regOrder.push_back(21);
+        if (hasFlag(TempR1)) {
+            m_regOrder.push_back(1);
+        }
+        if (hasFlag(TempR0)) {
+            m_regOrder.push_back(0);
+        }
+        return;
+    }
+
     // Allocate some high registers that we don't need to save first.
     m_regOrder.push_back(18);
     m_regOrder.push_back(19);
@@ -2938,6 +3418,9 @@ void Code::add_ptr(unsigned char reg, int offset)
 {
     if (offset == 0) {
         return;
+    } else if (hasFlag(ReducedCore) && reg != 28) {
+        // Defer the adjustment of X or Z until the pointer is next used.
+        m_ptrAdjust[(reg - 26) / 2] -= offset;
     } else if (offset > 0 && offset <= 63 && hasFlag(MoveWord)) {
         immreg(Insn::ADIW, reg, (unsigned char)offset);
     } else if (offset < 0 && offset >= -63 && hasFlag(MoveWord)) {
@@ -3001,6 +3484,16 @@ void Code::ld_st_long(const Reg &reg, Insn::Type type, unsigned offset)
 {
     if (reg.size() == 0) {
         // Nothing to do to load/store an empty register.
+    } else if (hasFlag(ReducedCore)) {
+        // No displacements on the reduced core, so walk the pointer.
+        if (ptr_start(type, offset, reg.size()) == POST_INC) {
+            for (int index = 0; index < reg.size(); ++index)
+                ptr_walk(type, reg.reg(index), POST_INC);
+        } else {
+            for (int index = reg.size() - 1; index >= 0; --index)
+                ptr_walk(type, reg.reg(index), PRE_DEC);
+        }
+        ptr_finish(type);
     } else if (type == Insn::LD_X && (offset != 0 || reg.size() > 1)) {
         // X pointer does not support non-zero offsets so we need
         // to add the offset to X, perform the store, and then
@@ -3044,6 +3537,20 @@ void Code::ld_xor(const Reg &reg, Insn::Type type, unsigned offset)
     unsigned char temp_reg = tempreg();
     if (reg.size() == 0) {
         // Nothing to do to XOR an empty register.
+    } else if (hasFlag(ReducedCore)) {
+        // No displacements on the reduced core, so walk the pointer.
+        if (ptr_start(type, offset, reg.size()) == POST_INC) {
+            for (int index = 0; index < reg.size(); ++index) {
+                ptr_walk(type, temp_reg, POST_INC);
+                tworeg(Insn::EOR, reg.reg(index), temp_reg);
+            }
+        } else {
+            for (int index = reg.size() - 1; index >= 0; --index) {
+                ptr_walk(type, temp_reg, PRE_DEC);
+                tworeg(Insn::EOR, reg.reg(index), temp_reg);
+            }
+        }
+        ptr_finish(type);
     } else if ((((int)offset) + reg.size()) <= 64) {
         // Load direct from the pointer and XOR with the register.
         for (int index = 0; index < reg.size(); ++index) {
@@ -3084,6 +3591,24 @@ void Code::ld_xor_in(const Reg &reg, Insn::Type type, unsigned offset)
     unsigned char temp_reg = tempreg();
     if (reg.size() == 0) {
         // Nothing to do to XOR an empty register.
+    } else if (hasFlag(ReducedCore)) {
+        // No displacements on the reduced core, so walk the pointer.
+        Insn::Type st_type = (type == Insn::LD_X ? Insn::ST_X :
+                              type == Insn::LD_Y ? Insn::ST_Y : Insn::ST_Z);
+        if (ptr_start(type, offset, reg.size()) == POST_INC) {
+            for (int index = 0; index < reg.size(); ++index) {
+                ptr_walk(type, temp_reg, 0);
+                tworeg(Insn::EOR, temp_reg, reg.reg(index));
+                ptr_walk(st_type, temp_reg, POST_INC);
+            }
+        } else {
+            for (int index = reg.size() - 1; index >= 0; --index) {
+                ptr_walk(type, temp_reg, PRE_DEC);
+                tworeg(Insn::EOR, temp_reg, reg.reg(index));
+                ptr_walk(st_type, temp_reg, 0);
+            }
+        }
+        ptr_finish(type);
     } else if ((((int)offset) + reg.size()) <= 64) {
         // Load direct from the pointer and XOR with the register.
         for (int index = 0; index < reg.size(); ++index) {
@@ -3138,7 +3663,15 @@ void Code::st_zero(Insn::Type type, unsigned offset, unsigned count)
     } else {
         zeroreg.m_regs.push_back(ZERO_REG);
     }
-    if (type == Insn::ST_X || (offset + count) > 64) {
+    if (count == 0) {
+        // Nothing to do to zero an empty region.
+    } else if (hasFlag(ReducedCore)) {
+        // No displacements on the reduced core, so walk the pointer.
+        unsigned char mode = ptr_start(type, offset, count);
+        for (index = 0; index < count; ++index)
+            ptr_walk(type, zeroreg.reg(0), mode);
+        ptr_finish(type);
+    } else if (type == Insn::ST_X || (offset + count) > 64) {
         // Too far away from the base register, so increase the pointer,
         // zero the region, and then decrease the pointer to the start.
         if (type == Insn::ST_X)
@@ -3164,4 +3697,142 @@ void Code::st_zero(Insn::Type type, unsigned offset, unsigned count)
     releaseReg(zeroreg);
 }
 
+/**
+ * \brief Brings the X and Z pointers back to their nominal values.
+ *
+ * On the reduced core, memory accesses walk the pointer registers with
+ * post-increment and pre-decrement addressing and the adjustments are
+ * deferred until a branch point or direct use of the pointer.  This can
+ * be called by generators to force the adjustment earlier; e.g. before
+ * setting up the flags for a conditional branch.
+ */
+void Code::syncPointers()
+{
+    ptr_sync(26, false);
+    ptr_sync(30, false);
+}
+
+/**
+ * \brief Moves a pointer register to a specific offset from its nominal value.
+ *
+ * \param reg The pointer register: 26, 28, or 30.
+ * \param offset The offset from the nominal value to move to.
+ *
+ * This is only used on the reduced core.
+ */
+void Code::ptr_seek(unsigned char reg, int offset)
+{
+    int index = (reg - 26) / 2;
+    int delta = offset - m_ptrAdjust[index];
+    m_ptrAdjust[index] = offset;
+    if (delta == 0)
+        return;
+    delta = -delta;
+    unsigned char low = (unsigned char)delta;
+    unsigned char high = (unsigned char)(delta >> 8);
+    if (low != 0) {
+        m_insns.push_back(Insn::imm(Insn::SUBI, reg, low));
+        m_insns.push_back(Insn::imm(Insn::SBCI, reg + 1, high));
+    } else {
+        m_insns.push_back(Insn::imm(Insn::SUBI, reg + 1, high));
+    }
+    used(reg);
+    used(reg + 1);
+}
+
+/**
+ * \brief Brings a pointer register back to its nominal value.
+ *
+ * \param reg The pointer register to synchronize.  Nothing happens if
+ * this is not X or Z, or if the code is not for the reduced core.
+ * \param keepFlags Set to true if the status flags must be preserved.
+ *
+ * When \a keepFlags is true, dummy loads into the temporary register are
+ * used to step the pointer back into place without affecting the flags.
+ */
+void Code::ptr_sync(unsigned char reg, bool keepFlags)
+{
+    if (!hasFlag(ReducedCore) || (reg != 26 && reg != 30))
+        return;
+    int index = (reg - 26) / 2;
+    int adjust = m_ptrAdjust[index];
+    if (adjust == 0) {
+        return;
+    } else if (!keepFlags) {
+        ptr_seek(reg, 0);
+        return;
+    } else if (adjust > 8 || adjust < -8) {
+        throw std::invalid_argument
+            ("pointer is too far from its nominal value at a branch");
+    }
+    Insn::Type type = (reg == 26 ? Insn::LD_X : Insn::LD_Z);
+    while (m_ptrAdjust[index] > 0)
+        ptr_walk(type, TEMP_REG, PRE_DEC);
+    while (m_ptrAdjust[index] < 0)
+        ptr_walk(type, TEMP_REG, POST_INC);
+}
+
+/**
+ * \brief Outputs a memory access that walks a pointer on the reduced core.
+ *
+ * \param type The type of memory instruction.
+ * \param reg The register to load or store.
+ * \param mode Zero, PRE_DEC, or POST_INC.
+ */
+void Code::ptr_walk(Insn::Type type, unsigned char reg, unsigned char mode)
+{
+    unsigned char ptr = ptr_reg(type);
+    int index = (ptr - 26) / 2;
+    m_insns.push_back(Insn::memory(type, reg, mode));
+    used(reg);
+    if (mode == POST_INC)
+        ++(m_ptrAdjust[index]);
+    else if (mode == PRE_DEC)
+        --(m_ptrAdjust[index]);
+    if ((reg == 26 || reg == 27 || reg == 30 || reg == 31) &&
+            (type == Insn::LD_X || type == Insn::LD_Y || type == Insn::LD_Z)) {
+        // Loading a new value into X or Z cancels any pending adjustment.
+        m_ptrAdjust[(reg - 26) / 2] = 0;
+    }
+}
+
+/**
+ * \brief Positions a pointer to access a region of memory on the reduced core.
+ *
+ * \param type The type of memory instruction.
+ * \param offset Offset of the start of the region from the nominal pointer.
+ * \param size Size of the region in bytes.
+ *
+ * \return POST_INC if the region should be walked upwards from its start,
+ * or PRE_DEC if the region should be walked downwards from its end.
+ *
+ * Walking downwards is chosen if the pointer is already sitting at the
+ * end of the region, which is common when reversed words are accessed.
+ */
+unsigned char Code::ptr_start(Insn::Type type, unsigned offset, unsigned size)
+{
+    unsigned char ptr = ptr_reg(type);
+    if (m_ptrAdjust[(ptr - 26) / 2] == (int)(offset + size)) {
+        return PRE_DEC;
+    } else {
+        ptr_seek(ptr, (int)offset);
+        return POST_INC;
+    }
+}
+
+/**
+ * \brief Finishes a memory access on the reduced core.
+ *
+ * \param type The type of memory instruction.
+ *
+ * Y is the frame pointer so we always restore it immediately.
+ * X and Z are restored lazily by ptr_sync().
+ */
+void Code::ptr_finish(Insn::Type type)
+{
+    unsigned char ptr = ptr_reg(type);
+    if (ptr == 28)
+        ptr_seek(ptr, 0);
+}
+
 } // namespace AVR
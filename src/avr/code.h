@@ -27,11 +27,26 @@
 #include <map>
 #include <string>
 #include <ostream>
+#include <stdexcept>
+#include "aig.h"
 
 namespace AVR
 {
 
 class Code;
+class Trace;
+struct AVRState;
+
+/**
+ * \brief Exception that is thrown when specialised code is executed
+ * with a different parameter value than it was specialised for.
+ */
+class SpecialisationMismatch : public std::invalid_argument
+{
+public:
+    explicit SpecialisationMismatch(const std::string &what)
+        : std::invalid_argument(what) {}
+};
 
 /**
  * \brief Holds information about a single AVR instruction.
@@ -54,6 +69,7 @@ public:
         BREQ,       /**< Conditional branch if equal */
         BRNE,       /**< Conditional branch if not equal */
         CALL,       /**< Call a subroutine */
+        CALL_FUNC,  /**< Call another function in the same template */
         COM,        /**< One's complement of a register (logical NOT) */
         CP,         /**< Compare two registers */
         CPC,        /**< Compare two registers with carry */
@@ -123,6 +139,21 @@ public:
     unsigned char label() const { return m_reg1; }
     unsigned char offset() const { return m_reg2; }
 
+    /**
+     * \brief Determine if reg1() is a register number for this instruction.
+     *
+     * \return Returns true for a register; false for a label or nothing.
+     */
+    bool hasReg1() const;
+
+    /**
+     * \brief Determine if reg2() is a register number for this instruction.
+     *
+     * \return Returns true for a register; false for an immediate value,
+     * bit number, memory offset, or nothing.
+     */
+    bool hasReg2() const;
+
     // Note: The functions below may throw an exception if the arguments
     // are inconsistent with the instruction type; e.g. using a low register
     // with an instruction that only accepts high registers.
@@ -209,8 +240,11 @@ public:
      * \param ostream The output stream to write to.
      * \param code The code block that contains this instruction.
      * \param offset The offset into the code block of this instruction.
+     * \param form The form to use for a branch instruction, from
+     * Code::relax_branches().
      */
-    void write(std::ostream &ostream, const Code &code, int offset) const;
+    void write(std::ostream &ostream, const Code &code, int offset,
+               unsigned char form = 0) const;
 
 private:
     Type m_type;
@@ -227,14 +261,15 @@ private:
 class Reg
 {
 public:
-    Reg() {}
-    Reg(const Reg &other) : m_regs(other.m_regs) {}
+    Reg() : m_rotate(0) {}
+    Reg(const Reg &other) : m_regs(other.m_regs), m_rotate(other.m_rotate) {}
     Reg(const Reg &other, unsigned char offset, unsigned char count = 0xFF);
     ~Reg() {}
 
     Reg &operator=(const Reg &other)
     {
         m_regs = other.m_regs;
+        m_rotate = other.m_rotate;
         return *this;
     }
 
@@ -252,7 +287,22 @@ public:
      *
      * \return The register number at \a index.
      */
-    unsigned char reg(int index) const { return m_regs.at(index); }
+    unsigned char reg(int index) const
+    {
+        if (m_rotate != 0)
+            throw std::invalid_argument("register has a pending rotation");
+        return m_regs.at(index);
+    }
+
+    /**
+     * \brief Gets the number of bits that this register is still to be
+     * rotated left by before its value can be used.
+     *
+     * \return The pending rotation, between 0 and 7.
+     *
+     * \sa Code::rol_lazy(), Code::materialise()
+     */
+    unsigned rotation() const { return m_rotate; }
 
     /**
      * \brief Gets a byte-reversed version of this register.
@@ -373,6 +423,7 @@ public:
 
 private:
     std::vector<unsigned char> m_regs;
+    unsigned char m_rotate;
 
     friend class Code;
 };
@@ -397,10 +448,29 @@ public:
     int size() const { return m_data.size(); }
     unsigned char lookup(int value) const;
 
+    bool operator==(const Sbox &other) const
+        { return m_data == other.m_data; }
+
 private:
     std::vector<unsigned char> m_data;
 };
 
+/**
+ * \brief Results of outlining repeated code into subroutines.
+ *
+ * \sa Code::outline()
+ */
+struct OutlineReport
+{
+    unsigned subroutines;   /**< Number of subroutines that were created */
+    unsigned calls;         /**< Number of calls that replaced the code */
+    unsigned wordsBefore;   /**< Size of the code before outlining */
+    unsigned wordsAfter;    /**< Size of the code after outlining */
+    unsigned cyclesAdded;   /**< Cycles added per pass through all calls */
+    unsigned renamedWords;  /**< Words that could also be saved if repeated
+                                 sequences used the same registers */
+};
+
 class Code
 {
 public:
@@ -416,17 +486,55 @@ public:
      *
      * If the code won't be using local variables, then TempY can
      * be specified to add "Y" to the list of temporaries as well.
+     *
+     * ReducedCore targets AVRrc devices like the ATtiny10 which only have
+     * r16-r31 and no "LDD", "STD", "ADIW", "SBIW", or "MOVW" instructions.
+     * The temporary and zero registers become r16 and r17 in the output.
+     *
+     * XTCore targets AVRxt devices like the tinyAVR 0/1/2, megaAVR 0, and
+     * AVR-Dx series, which have different instruction timings to avr5.
+     * These devices map flash into the data space, so FlashMapped can be
+     * used to read S-boxes with "LD" instead of "LPM" and to avoid RAMPZ.
+     *
+     * By default, the output uses "#if" fallback chains to select the
+     * right instructions for the device at assembly time.  DeviceSpecific
+     * indicates that the device is known when the code is generated, and
+     * HasRAMPZ, HasLPMX, and HasJmpCall describe its features.  Exactly
+     * one instruction sequence is then emitted for each operation.
      */
     enum Flag
     {
-        MoveWord = 0x0001,      /**< Core supports the "MOVW" instruction */
-        TempX    = 0x0002,      /**< X pointer can be used as a temporary */
-        TempY    = 0x0004,      /**< Y pointer can be used as a temporary */
-        TempZ    = 0x0008,      /**< Z pointer can be used as a temporary */
-        Print    = 0x0010,      /**< Use diagnostic printing */
-        NoLocals = 0x0020,      /**< No locals and Y will not be touched */
-        TempR0   = 0x0040,      /**< "r0" can be used as a temporary */
-        TempR1   = 0x0080,      /**< "r1" can be used as a temporary */
+        MoveWord    = 0x0001,   /**< Core supports the "MOVW" instruction */
+        TempX       = 0x0002,   /**< X pointer can be used as a temporary */
+        TempY       = 0x0004,   /**< Y pointer can be used as a temporary */
+        TempZ       = 0x0008,   /**< Z pointer can be used as a temporary */
+        Print       = 0x0010,   /**< Use diagnostic printing */
+        NoLocals    = 0x0020,   /**< No locals and Y will not be touched */
+        TempR0      = 0x0040,   /**< "r0" can be used as a temporary */
+        TempR1      = 0x0080,   /**< "r1" can be used as a temporary */
+        ReducedCore = 0x0100,   /**< Generate code for the AVRrc core */
+        XTCore      = 0x0200,   /**< Generate code for the AVRxt core */
+        FlashMapped = 0x0400,   /**< Flash is mapped into the data space */
+        DeviceSpecific = 0x0800,/**< Device features are known up front */
+        HasRAMPZ    = 0x1000,   /**< Device has the RAMPZ register */
+        HasLPMX     = 0x2000,   /**< Device has "LPM Rd,Z" and "LPM Rd,Z+" */
+        HasJmpCall  = 0x4000,   /**< Device has "JMP" and "CALL" */
+    };
+
+    /**
+     * \brief Placement of the S-box tables in the device's memory.
+     *
+     * Tables in flash are read with "LPM" and may need RAMPZ to be saved
+     * and restored.  Tables in RAM are copied from flash at startup and
+     * then read with "LD", which is faster and does not touch RAMPZ.
+     * SboxAuto places the tables in RAM if they fit within a budget;
+     * the Linker resolves it to SboxInFlash or SboxInRAM.
+     */
+    enum SboxPlacement
+    {
+        SboxInFlash,            /**< S-box tables are in flash */
+        SboxInRAM,              /**< S-box tables are copied into RAM */
+        SboxAuto                /**< Choose RAM if the tables fit the budget */
     };
 
     /**
@@ -460,6 +568,27 @@ public:
      */
     int getLabel(unsigned char ref) const;
 
+    /**
+     * \brief Forms that a branch instruction can be written in.
+     */
+    enum BranchForm
+    {
+        BranchShort,    /**< "brxx", "rjmp", or "rcall" */
+        BranchLong,     /**< Reversed "brxx" over an "rjmp" */
+        BranchFar       /**< Reversed "brxx" over a "jmp", or "jmp"/"call" */
+    };
+
+    std::vector<unsigned char> relax_branches() const;
+    unsigned code_words() const;
+
+    /**
+     * \brief Gets the name of the function from its prologue.
+     *
+     * \return The function name, or the empty string if there is no
+     * prologue yet.
+     */
+    const std::string &name() const { return m_name; }
+
     /**
      * \brief Returns a mask with the list of registers that were used.
      *
@@ -490,6 +619,49 @@ public:
      */
     bool hasFlag(Flag flag) const { return (m_flags & flag) == flag; }
 
+    /**
+     * \brief Sets the placement of the S-box tables.
+     *
+     * \param placement The placement to use.
+     * \param budget Maximum number of bytes of RAM to use for the tables
+     * when \a placement is SboxAuto.
+     */
+    void setSboxPlacement(SboxPlacement placement, unsigned budget = 0)
+        { m_sboxPlacement = placement; m_sboxBudget = budget; }
+
+    /**
+     * \brief Gets the placement of the S-box tables.
+     */
+    SboxPlacement sboxPlacement() const { return m_sboxPlacement; }
+
+    /**
+     * \brief Gets the RAM budget for the S-box tables in bytes.
+     */
+    unsigned sboxBudget() const { return m_sboxBudget; }
+
+    /**
+     * \brief Determine if the S-box tables are read from the data space
+     * with "LD" rather than from flash with "LPM".
+     *
+     * \return Returns true if the tables are in RAM, or flash is mapped
+     * into the data space.
+     */
+    bool sbox_in_data_space() const
+        { return m_sboxPlacement == SboxInRAM || hasFlag(FlashMapped); }
+
+    /**
+     * \brief Determine if S-box operations may need to save and restore
+     * the RAMPZ register.
+     *
+     * \return Returns false if the S-boxes are in the data space or the
+     * device is known not to have RAMPZ; true otherwise.
+     */
+    bool sbox_uses_rampz() const
+    {
+        return !sbox_in_data_space() &&
+               (!hasFlag(DeviceSpecific) || hasFlag(HasRAMPZ));
+    }
+
     Reg allocateReg(unsigned size);
     Reg allocateHighReg(unsigned size);
     Reg allocateOptionalReg(unsigned size);
@@ -500,6 +672,8 @@ public:
     void adc(const Reg &reg1, unsigned long long value) { add(reg1, value, true); }
     void add(const Reg &reg1, const Reg &reg2);
     void add(const Reg &reg1, unsigned long long value, bool carryIn = false);
+    void add_rol(const Reg &reg1, const Reg &reg2, unsigned bits);
+    void add_xor(const Reg &reg1, const Reg &reg2, const Reg &reg3);
     void add_ptr_x(int offset) { add_ptr(26, offset); }
     void add_ptr_y(int offset) { add_ptr(28, offset); }
     void add_ptr_z(int offset) { add_ptr(30, offset); }
@@ -512,6 +686,7 @@ public:
     void breq(unsigned char &label) { branch(Insn::BREQ, label); }
     void brne(unsigned char &label) { branch(Insn::BRNE, label); }
     void call(unsigned char &label) { branch(Insn::CALL, label); }
+    void call_function(const std::string &name);
     void clr(const Reg &reg);
     void compare(const Reg& reg1, const Reg& reg2);
     void compare(const Reg& reg1, unsigned long long value);
@@ -565,9 +740,13 @@ public:
     void push(const Reg &reg);
     void ret() { bare(Insn::RET); }
     void rol(const Reg &reg, unsigned bits);
+    void rol1_xor(const Reg &reg1, const Reg &reg2);
     void rol_bytes(const Reg &reg, unsigned count);
+    void rol_lazy(Reg &reg, unsigned bits);
+    void materialise(Reg &reg);
     void ror(const Reg &reg, unsigned bits);
     void ror_bytes(const Reg &reg, unsigned count);
+    void ror_lazy(Reg &reg, unsigned bits);
     void sbc(const Reg &reg1, const Reg &reg2);
     void sbc(const Reg &reg1, unsigned long long value) { add(reg1, value, true); }
     void sub(const Reg &reg1, const Reg &reg2);
@@ -599,11 +778,20 @@ public:
     void sbox_adjust_by_offset(unsigned char offset);
     void sbox_cleanup(void);
     void sbox_lookup(const Reg &reg1, const Reg &reg2);
+    void sbox_lookup_xor(const Reg &reg1, const Reg &reg2, const Reg &temp);
     void sbox_load_inc(const Reg &reg);
     void sbox_write(std::ostream &ostream, unsigned char num, const Sbox &sbox);
+    void sbox_write(std::ostream &ostream, const std::string &name,
+                    const Sbox &sbox, bool aligned) const;
+    std::string sbox_section() const;
     Sbox sbox_get(unsigned char num) const { return m_sboxes.at(num); }
     unsigned sbox_count() { return m_sboxes.size(); }
     void sbox_add(unsigned char num, const Sbox &sbox) { m_sboxes[num] = sbox; }
+    const std::map<unsigned char, Sbox> &sboxes() const { return m_sboxes; }
+    std::string sbox_name(unsigned char num) const;
+    void sbox_set_name(unsigned char num, const std::string &name)
+        { m_sboxNames[num] = name; }
+    bool sbox_indexed() const;
 
     // Function prologue management.
     void prologue_setup_key(const char *name, unsigned size_locals);
@@ -627,6 +815,9 @@ public:
     Reg arg(unsigned size);
     Reg return_value(unsigned size);
 
+    // Bring X and Z back to their nominal values on the reduced core.
+    void syncPointers();
+
     // Mark pointer registers as used when not allocated by the prologue.
     void usedX() { allocateExplicitReg(26, 2); }
     void usedY() { allocateExplicitReg(28, 2); }
@@ -664,6 +855,91 @@ public:
         (void *state, unsigned state_len, const void *key,
          unsigned key_len, unsigned rounds);
 
+    void exec_call(AVRState &s, unsigned char index) const;
+
+    // Cross-function calls to be resolved by the Linker.
+    unsigned function_count() const { return m_calls.size(); }
+    const std::string &function_name(unsigned index) const
+        { return m_calls.at(index); }
+    void link_function(unsigned index, const Code *code, bool near);
+    bool function_is_near(unsigned index) const
+        { return m_callNear.at(index); }
+
+    // Specialise the code for a fixed "count" or "rounds" parameter.
+    void specialise(unsigned value);
+    int specialised_value() const { return m_paramValue; }
+
+    // Outline repeated instruction sequences into local subroutines.
+    OutlineReport outline(unsigned min_saving = 1);
+
+    /**
+     * \brief Gets the report from the last call to outline().
+     *
+     * All fields are zero if the code has not been outlined.
+     */
+    const OutlineReport &outlineReport() const { return m_outline; }
+
+    // Execute generated code symbolically for equivalence checking.
+    void symbolic_permutation
+        (Aig &aig, std::vector<AigLit> &state, unsigned count = 0) const;
+
+    /**
+     * \brief Gets the number of cycles taken by the last execution.
+     *
+     * \return The number of cycles according to the timing model for
+     * the core that the code was generated for.  This does not include
+     * the function prologue and epilogue that is added by write().
+     */
+    unsigned long cycles() const { return m_cycles; }
+    unsigned long straight_line_cycles(int first = 0) const;
+
+    /**
+     * \brief Records that the code draws random bytes for masking.
+     *
+     * \param drawn Number of random bytes that were drawn.
+     * \param fresh Number of those bytes that had not been drawn before.
+     *
+     * \sa MaskedCode
+     */
+    void addRandomBytes(unsigned drawn, unsigned fresh)
+    {
+        m_randomDrawn += drawn;
+        m_randomFresh += fresh;
+    }
+
+    /**
+     * \brief Gets the number of random bytes drawn by the code.
+     *
+     * Loop bodies are counted once, so for a permutation this is
+     * the number of bytes that are drawn per round.
+     */
+    unsigned randomBytesDrawn() const { return m_randomDrawn; }
+
+    /**
+     * \brief Gets the number of distinct random bytes drawn by the code.
+     *
+     * If this is less than randomBytesDrawn(), then random bytes are
+     * being reused between masking gadgets.
+     */
+    unsigned randomBytesFresh() const { return m_randomFresh; }
+
+    /**
+     * \brief Sets the trace recorder to use when executing this code.
+     *
+     * \param trace The trace recorder, or null to disable tracing.
+     * The caller retains ownership of the recorder.
+     */
+    void setTrace(Trace *trace) { m_trace = trace; }
+
+    /**
+     * \brief Sets the buffer to record probes in when executing this code.
+     *
+     * \param probes The buffer, or null to disable probing.  The values
+     * of the registers that each instruction writes are appended to it.
+     * The caller retains ownership of the buffer.
+     */
+    void setProbes(std::vector<unsigned char> *probes) { m_probes = probes; }
+
     // Speciality instructions for cryptography.
     void double_gf(const Reg &reg, unsigned feedback);
 
@@ -717,15 +993,31 @@ private:
     unsigned m_usedRegs;
     unsigned m_immRegs;
     unsigned m_flags;
+    SboxPlacement m_sboxPlacement;
+    unsigned m_sboxBudget;
     unsigned char m_immValues[16];
     unsigned m_immCount;
     PrologueType m_prologueType;
     unsigned m_localsSize;
     std::string m_name;
     std::map<unsigned char, Sbox> m_sboxes;
+    std::map<unsigned char, std::string> m_sboxNames;
+    int m_ptrAdjust[3];
+    unsigned long m_cycles;
+    unsigned m_randomDrawn;
+    unsigned m_randomFresh;
+    OutlineReport m_outline;
+    Trace *m_trace;
+    std::vector<unsigned char> *m_probes;
+    std::vector<std::string> m_calls;
+    std::vector<const Code *> m_callCode;
+    std::vector<bool> m_callNear;
+    int m_paramReg;
+    int m_paramValue;
 
     void resetRegs();
     void used(unsigned char reg);
+    void check_specialised(unsigned value) const;
     unsigned char allocateSpare(bool high);
     unsigned char allocateSparePair(bool high);
     Reg allocateRegInternal(unsigned size, bool high, bool optional);
@@ -740,6 +1032,11 @@ private:
     void ld_xor(const Reg &reg, Insn::Type type, unsigned offset);
     void ld_xor_in(const Reg &reg, Insn::Type type, unsigned offset);
     void st_zero(Insn::Type type, unsigned offset, unsigned count);
+    void ptr_seek(unsigned char reg, int offset);
+    void ptr_sync(unsigned char reg, bool keepFlags);
+    void ptr_walk(Insn::Type type, unsigned char reg, unsigned char mode);
+    unsigned char ptr_start(Insn::Type type, unsigned offset, unsigned size);
+    void ptr_finish(Insn::Type type);
 };
 
 } // namespace AVR
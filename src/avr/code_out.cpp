@@ -44,7 +44,7 @@ static void Insn_write_bare(std::ostream &ostream, const char *name)
     ostream << "\t";
     ostream << name;
     ostream << " ";
-    ostream << std::endl;
+    ostream << '\n';
 }
 
 static void Insn_write_onereg
@@ -54,7 +54,7 @@ static void Insn_write_onereg
     ostream << name;
     ostream << " ";
     Insn_write_reg(ostream, insn.reg1());
-    ostream << std::endl;
+    ostream << '\n';
 }
 
 static void Insn_write_tworeg
@@ -66,7 +66,7 @@ static void Insn_write_tworeg
     Insn_write_reg(ostream, insn.reg1());
     ostream << ",";
     Insn_write_reg(ostream, insn.reg2());
-    ostream << std::endl;
+    ostream << '\n';
 }
 
 static void Insn_write_immreg
@@ -78,7 +78,7 @@ static void Insn_write_immreg
     Insn_write_reg(ostream, insn.reg1());
     ostream << ",";
     ostream << (int)insn.value();
-    ostream << std::endl;
+    ostream << '\n';
 }
 
 static void Insn_write_bitop
@@ -90,7 +90,7 @@ static void Insn_write_bitop
     Insn_write_reg(ostream, insn.reg1());
     ostream << ",";
     ostream << (int)insn.value();
-    ostream << std::endl;
+    ostream << '\n';
 }
 
 static void Insn_write_load
@@ -122,7 +122,7 @@ static void Insn_write_load
         ostream << "+";
         ostream << (int)offset;
     }
-    ostream << std::endl;
+    ostream << '\n';
 }
 
 static void Insn_write_store
@@ -148,77 +148,151 @@ static void Insn_write_store
     }
     ostream << ",";
     Insn_write_reg(ostream, insn.reg1());
-    ostream << std::endl;
+    ostream << '\n';
+}
+
+// Writes a reference to a local label from the instruction at "offset".
+static void Insn_write_target(std::ostream &ostream, int target, int offset)
+{
+    ostream << target;
+    if (target > offset)
+        ostream << "f\n";
+    else
+        ostream << "b\n";
+}
+
+// Writes a "jmp" or "call" that can reach anywhere in the program.  If the
+// device is not known, then fall back to "rjmp" or "rcall" for devices
+// that don't have "jmp" and "call" because they have 8K of flash or less.
+static void Insn_write_far
+    (std::ostream &ostream, const char *name, const Code &code,
+     int target, int offset)
+{
+    if (code.hasFlag(Code::DeviceSpecific)) {
+        ostream << '\t' << name << ' ';
+        Insn_write_target(ostream, target, offset);
+        return;
+    }
+    ostream << "#if defined(__AVR_HAVE_JMP_CALL__)\n";
+    ostream << '\t' << name << ' ';
+    Insn_write_target(ostream, target, offset);
+    ostream << "#else\n";
+    ostream << "\tr" << name << ' ';
+    Insn_write_target(ostream, target, offset);
+    ostream << "#endif\n";
 }
 
 static void Insn_write_br
     (std::ostream &ostream, const char *name, const char *namerev,
-     const Code &code, int offset, const Insn &insn)
+     const Code &code, int offset, const Insn &insn, unsigned char form)
 {
-    // Determine if we need to do a long or short jump as it
-    // will modify the instruction sequence that we need to use.
+    // The form was chosen by Code::relax_branches() based on how far
+    // away the target is.  Long conditional branches are written as the
+    // reverse branch skipping over an unconditional jump to the target.
     int target = code.getLabel(insn.label());
-    bool forward = true;
-    bool long_jump = false;
-    bool large_jump = false;
-    if (target > offset) {
-        if ((target - (offset + 1)) > 50)
-            long_jump = true;
-        if ((target - (offset + 1)) > 2040)
-            large_jump = true;
-    } else {
-        if (((offset + 1) - target) > 50)
-            long_jump = true;
-        if (((offset + 1) - target) > 2040)
-            large_jump = true;
-        forward = false;
-    }
-    if (large_jump) {
-        throw std::invalid_argument("relative branch is too large");
+    if (form == Code::BranchShort) {
+        ostream << '\t' << name << ' ';
+        Insn_write_target(ostream, target, offset);
+        return;
     }
-    if (long_jump && insn.type() != Insn::JMP && insn.type() != Insn::CALL) {
-        // We need to jump a long way, so output the reverse branch as a
-        // skip and then perform an "rjmp" instruction to jump to where
-        // we really want to go.
-        ostream << "\t";
-        ostream << namerev;
-        ostream << " ";
-        ostream << 5000 + offset;
-        ostream << "f";
-        ostream << std::endl;
-
+    ostream << '\t' << namerev << ' ' << 5000 + offset << "f\n";
+    if (form == Code::BranchLong) {
         ostream << "\trjmp ";
-        ostream << target;
-        if (forward)
-            ostream << "f";
-        else
-            ostream << "b";
-        ostream << std::endl;
+        Insn_write_target(ostream, target, offset);
+    } else {
+        Insn_write_far(ostream, "jmp", code, target, offset);
+    }
+    ostream << 5000 + offset << ":\n";
+}
 
-        ostream << 5000 + offset;
-        ostream << ":";
-        ostream << std::endl;
+static void Insn_write_jmp
+    (std::ostream &ostream, const char *name, const Code &code,
+     int offset, const Insn &insn, unsigned char form)
+{
+    int target = code.getLabel(insn.label());
+    if (form == Code::BranchFar) {
+        Insn_write_far(ostream, name + 1, code, target, offset);
     } else {
-        ostream << "\t";
-        ostream << name;
-        ostream << " ";
-        ostream << target;
-        if (forward)
-            ostream << "f";
+        ostream << '\t' << name << ' ';
+        Insn_write_target(ostream, target, offset);
+    }
+}
+
+static void Insn_write_call_func
+    (std::ostream &ostream, const Code &code, const Insn &insn)
+{
+    // The reduced core does not have "call", and neither do devices with
+    // 8K of flash or less.  Otherwise use "rcall" if the linker says that
+    // the called function is within range.
+    const std::string &name = code.function_name(insn.label());
+    if (code.hasFlag(Code::ReducedCore) ||
+            code.function_is_near(insn.label())) {
+        ostream << "\trcall " << name << '\n';
+        return;
+    }
+    if (code.hasFlag(Code::DeviceSpecific)) {
+        if (code.hasFlag(Code::HasJmpCall))
+            ostream << "\tcall " << name << '\n';
         else
-            ostream << "b";
-        ostream << std::endl;
+            ostream << "\trcall " << name << '\n';
+        return;
     }
+    ostream << "#if defined(__AVR_HAVE_JMP_CALL__)\n";
+    ostream << "\tcall " << name << '\n';
+    ostream << "#else\n";
+    ostream << "\trcall " << name << '\n';
+    ostream << "#endif\n";
 }
 
 static void Insn_write_label(std::ostream &ostream, int offset)
 {
     ostream << offset;
     ostream << ":";
-    ostream << std::endl;
+    ostream << '\n';
+}
+
+// Forms of the "lpm" instruction on different devices.
+enum LpmForm
+{
+    LpmELPMX,       // "elpm Rd,Z" on devices with RAMPZ.
+    LpmELPM,        // "elpm" into r0 on devices with RAMPZ but no ELPMX.
+    LpmLPMX,        // "lpm Rd,Z" on devices with LPMX.
+    LpmTiny,        // "ld Rd,Z" on the reduced core, where flash is mapped.
+    LpmPlain        // "lpm" into r0 on devices without LPMX.
+};
+
+static void Insn_write_lpm_form
+    (std::ostream &ostream, const Insn &insn, const char *ptr_reg,
+     bool inc, LpmForm form)
+{
+    const char *mnemonic;
+    switch (form) {
+    case LpmELPMX:  mnemonic = "elpm"; break;
+    case LpmLPMX:   mnemonic = "lpm"; break;
+    case LpmTiny:   mnemonic = "ld"; break;
+    case LpmELPM:   mnemonic = 0; ostream << "\telpm\n"; break;
+    default:        mnemonic = 0; ostream << "\tlpm\n"; break;
+    }
+    if (mnemonic) {
+        ostream << "\t" << mnemonic << " ";
+        Insn_write_reg(ostream, insn.reg1());
+        ostream << ",";
+        ostream << ptr_reg << '\n';
+        return;
+    }
+    if (inc)
+        ostream << "\tinc r30\n";
+    if (insn.reg1() != 0) {
+        ostream << "\tmov ";
+        Insn_write_reg(ostream, insn.reg1());
+        ostream << ",r0";
+        ostream << '\n';
+    }
 }
 
-static void Insn_write_lpm(std::ostream &ostream, const Insn &insn, bool sbox)
+static void Insn_write_lpm
+    (std::ostream &ostream, const Code &code, const Insn &insn,
+     bool sbox, bool mapped)
 {
     // Different chips within the AVR family have different "lpm" instructions.
     const char *ptr_reg = "Z";
@@ -230,48 +304,49 @@ static void Insn_write_lpm(std::ostream &ostream, const Insn &insn, bool sbox)
         if (insn.reg2() != 30) {
             ostream << "\tmov r30,";
             Insn_write_reg(ostream, insn.reg2());
-            ostream << std::endl;
+            ostream << '\n';
         }
     } else if (insn.reg2() == POST_INC) {
         ptr_reg = "Z+";
         inc = true;
     }
-    ostream << "#if defined(RAMPZ)" << std::endl;
-    ostream << "\telpm ";
-    Insn_write_reg(ostream, insn.reg1());
-    ostream << ",";
-    ostream << ptr_reg << std::endl;
-    ostream << "#elif defined(__AVR_HAVE_LPMX__)" << std::endl;
-    ostream << "\tlpm ";
-    Insn_write_reg(ostream, insn.reg1());
-    ostream << ",";
-    ostream << ptr_reg << std::endl;
-    ostream << "#elif defined(__AVR_TINY__)" << std::endl;
-    ostream << "\tld ";
-    Insn_write_reg(ostream, insn.reg1());
-    ostream << ",";
-    ostream << ptr_reg << std::endl;
-    ostream << "#else" << std::endl;
-    ostream << "\tlpm" << std::endl;
-    if (inc)
-        ostream << "\tinc r30" << std::endl;
-    if (insn.reg1() != 0) {
-        ostream << "\tmov ";
-        Insn_write_reg(ostream, insn.reg1());
-        ostream << ",r0";
-        ostream << std::endl;
+    if (mapped) {
+        // The table is in RAM or mapped flash, so we can use "ld".
+        Insn_write_lpm_form(ostream, insn, ptr_reg, inc, LpmTiny);
+        return;
     }
-    ostream << "#endif" << std::endl;
+    if (code.hasFlag(Code::DeviceSpecific)) {
+        // We know which device we have, so emit exactly one sequence.
+        LpmForm form;
+        if (code.hasFlag(Code::ReducedCore))
+            form = LpmTiny;
+        else if (code.hasFlag(Code::HasRAMPZ))
+            form = code.hasFlag(Code::HasLPMX) ? LpmELPMX : LpmELPM;
+        else
+            form = code.hasFlag(Code::HasLPMX) ? LpmLPMX : LpmPlain;
+        Insn_write_lpm_form(ostream, insn, ptr_reg, inc, form);
+        return;
+    }
+    ostream << "#if defined(RAMPZ)\n";
+    Insn_write_lpm_form(ostream, insn, ptr_reg, inc, LpmELPMX);
+    ostream << "#elif defined(__AVR_HAVE_LPMX__)\n";
+    Insn_write_lpm_form(ostream, insn, ptr_reg, inc, LpmLPMX);
+    ostream << "#elif defined(__AVR_TINY__)\n";
+    Insn_write_lpm_form(ostream, insn, ptr_reg, inc, LpmTiny);
+    ostream << "#else\n";
+    Insn_write_lpm_form(ostream, insn, ptr_reg, inc, LpmPlain);
+    ostream << "#endif\n";
 }
 
 static void Insn_write_lpm_setup
-    (std::ostream &ostream, const Insn &insn, bool suppressLowByte = false)
+    (std::ostream &ostream, const Code &code, const Insn &insn,
+     bool suppressLowByte = false)
 {
     // Set up the Z and RAMPZ registers with the pointer to the sbox.
     // The value() parameter of the instruction is the sbox number,
-    // which indicates which global program memory label to reference.
+    // which indicates which program memory label to reference.
     // The reg1() parameter is a temporary high register for loading RAMPZ.
-    int table = insn.value();
+    std::string table = code.sbox_name(insn.value());
     // There is actually no point loading the low byte of the address.
     // We always align S-boxes on a 256-byte boundary and then move the
     // actual index into r30 when we need to look something up.  So the
@@ -279,54 +354,67 @@ static void Insn_write_lpm_setup
     // the linker will not relocate the program address properly if we don't
     // load both the high and low bytes.  So we have no choice but to load.
     if (!suppressLowByte) {
-        ostream << "\tldi r30,lo8(table_";
+        ostream << "\tldi r30,lo8(";
         ostream << table;
-        ostream << ")" << std::endl;
+        ostream << ")\n";
     }
-    ostream << "\tldi r31,hi8(table_";
+    ostream << "\tldi r31,hi8(";
     ostream << table;
-    ostream << ")" << std::endl;
-    ostream << "#if defined(RAMPZ)" << std::endl;
+    ostream << ")\n";
+    if (!code.sbox_uses_rampz()) {
+        // The table is in the data space or the device has no RAMPZ.
+        return;
+    }
+    bool known = code.hasFlag(Code::DeviceSpecific);
+    if (!known)
+        ostream << "#if defined(RAMPZ)\n";
     ostream << "\tldi ";
     Insn_write_reg(ostream, insn.reg1());
-    ostream << ",hh8(table_";
+    ostream << ",hh8(";
     ostream << table;
-    ostream << ")" << std::endl;
-    ostream << "\tin r0,_SFR_IO_ADDR(RAMPZ)" << std::endl;
-    ostream << "\tpush r0" << std::endl;
+    ostream << ")\n";
+    ostream << "\tin r0,_SFR_IO_ADDR(RAMPZ)\n";
+    ostream << "\tpush r0\n";
     ostream << "\tout _SFR_IO_ADDR(RAMPZ),";
     Insn_write_reg(ostream, insn.reg1());
-    ostream << std::endl;
-    ostream << "#endif" << std::endl;
+    ostream << '\n';
+    if (!known)
+        ostream << "#endif\n";
 }
 
-static void Insn_write_lpm_switch(std::ostream &ostream, const Insn &insn)
+static void Insn_write_lpm_switch
+    (std::ostream &ostream, const Code &code, const Insn &insn)
 {
     // Set up Z and RAMPZ, but no need to save the previous RAMPZ value.
-    int table = insn.value();
-    ostream << "\tldi r30,lo8(table_";
+    std::string table = code.sbox_name(insn.value());
+    ostream << "\tldi r30,lo8(";
     ostream << table;
-    ostream << ")" << std::endl;
-    ostream << "\tldi r31,hi8(table_";
+    ostream << ")\n";
+    ostream << "\tldi r31,hi8(";
     ostream << table;
-    ostream << ")" << std::endl;
-    ostream << "#if defined(RAMPZ)" << std::endl;
+    ostream << ")\n";
+    if (!code.sbox_uses_rampz())
+        return;
+    bool known = code.hasFlag(Code::DeviceSpecific);
+    if (!known)
+        ostream << "#if defined(RAMPZ)\n";
     ostream << "\tldi ";
     Insn_write_reg(ostream, insn.reg1());
-    ostream << ",hh8(table_";
+    ostream << ",hh8(";
     ostream << table;
-    ostream << ")" << std::endl;
+    ostream << ")\n";
     ostream << "\tout _SFR_IO_ADDR(RAMPZ),";
     Insn_write_reg(ostream, insn.reg1());
-    ostream << std::endl;
-    ostream << "#endif" << std::endl;
+    ostream << '\n';
+    if (!known)
+        ostream << "#endif\n";
 }
 
 static void Insn_write_lpm_adjust(std::ostream &ostream, const Insn &insn)
 {
     ostream << "\tadd r31,";
     Insn_write_reg(ostream, insn.reg1());
-    ostream << std::endl;
+    ostream << '\n';
 }
 
 static void Insn_write_lpm_offset(std::ostream &ostream, const Insn &insn)
@@ -334,23 +422,41 @@ static void Insn_write_lpm_offset(std::ostream &ostream, const Insn &insn)
     int offset = -(insn.value());
     ostream << "\tsubi r30,";
     ostream << (int)(offset & 0xFF);
-    ostream << std::endl;
+    ostream << '\n';
     ostream << "\tsbci r31,";
     ostream << (int)((offset >> 8) & 0xFF);
-    ostream << std::endl;
+    ostream << '\n';
 }
 
-static void Insn_write_lpm_clean(std::ostream &ostream)
+static void Insn_write_lpm_clean(std::ostream &ostream, const Code &code)
 {
     // Pop the previous state of the RAMPZ register.
-    ostream << "#if defined(RAMPZ)" << std::endl;
-    ostream << "\tpop r0" << std::endl;
-    ostream << "\tout _SFR_IO_ADDR(RAMPZ),r0" << std::endl;
-    ostream << "#endif" << std::endl;
+    if (!code.sbox_uses_rampz())
+        return;
+    bool known = code.hasFlag(Code::DeviceSpecific);
+    if (!known)
+        ostream << "#if defined(RAMPZ)\n";
+    ostream << "\tpop r0\n";
+    ostream << "\tout _SFR_IO_ADDR(RAMPZ),r0\n";
+    if (!known)
+        ostream << "#endif\n";
 }
 
-void Insn::write(std::ostream &ostream, const Code &code, int offset) const
+void Insn::write(std::ostream &ostream, const Code &code, int offset,
+                 unsigned char form) const
 {
+    if (code.hasFlag(Code::ReducedCore) &&
+            ((hasReg1() && m_reg1 < 2) || (hasReg2() && m_reg2 < 2))) {
+        // The reduced core uses r16 and r17 for "r0" and "r1".
+        Insn insn(*this);
+        if (hasReg1() && m_reg1 < 2)
+            insn.m_reg1 += 16;
+        if (hasReg2() && m_reg2 < 2)
+            insn.m_reg2 += 16;
+        insn.write(ostream, code, offset, form);
+        return;
+    }
+    bool mapped = code.sbox_in_data_space();
     switch (m_type) {
     case ADC:       Insn_write_tworeg(ostream, "adc", *this); break;
     case ADD:       Insn_write_tworeg(ostream, "add", *this); break;
@@ -361,15 +467,20 @@ void Insn::write(std::ostream &ostream, const Code &code, int offset) const
     case BLD:       Insn_write_bitop(ostream, "bld", *this); break;
     case BST:       Insn_write_bitop(ostream, "bst", *this); break;
     case BRCC:
-        Insn_write_br(ostream, "brcc", "brcs", code, offset, *this); break;
+        Insn_write_br(ostream, "brcc", "brcs", code, offset, *this, form);
+        break;
     case BRCS:
-        Insn_write_br(ostream, "brcs", "brcc", code, offset, *this); break;
+        Insn_write_br(ostream, "brcs", "brcc", code, offset, *this, form);
+        break;
     case BREQ:
-        Insn_write_br(ostream, "breq", "brne", code, offset, *this); break;
+        Insn_write_br(ostream, "breq", "brne", code, offset, *this, form);
+        break;
     case BRNE:
-        Insn_write_br(ostream, "brne", "breq", code, offset, *this); break;
+        Insn_write_br(ostream, "brne", "breq", code, offset, *this, form);
+        break;
     case CALL:
-        Insn_write_br(ostream, "rcall", "rcall", code, offset, *this); break;
+        Insn_write_jmp(ostream, "rcall", code, offset, *this, form); break;
+    case CALL_FUNC: Insn_write_call_func(ostream, code, *this); break;
     case COM:       Insn_write_onereg(ostream, "com", *this); break;
     case CP:        Insn_write_tworeg(ostream, "cp", *this); break;
     case CPC:       Insn_write_tworeg(ostream, "cpc", *this); break;
@@ -379,20 +490,20 @@ void Insn::write(std::ostream &ostream, const Code &code, int offset) const
     case EOR:       Insn_write_tworeg(ostream, "eor", *this); break;
     case INC:       Insn_write_onereg(ostream, "inc", *this); break;
     case JMP:
-        Insn_write_br(ostream, "rjmp", "rjmp", code, offset, *this); break;
+        Insn_write_jmp(ostream, "rjmp", code, offset, *this, form); break;
     case LABEL:     Insn_write_label(ostream, offset); break;
     case LD_X:      Insn_write_load(ostream, "X", *this); break;
     case LD_Y:      Insn_write_load(ostream, "Y", *this); break;
     case LD_Z:      Insn_write_load(ostream, "Z", *this); break;
     case LDI:       Insn_write_immreg(ostream, "ldi", *this); break;
-    case LPM_SBOX:  Insn_write_lpm(ostream, *this, true); break;
-    case LPM_SETUP: Insn_write_lpm_setup(ostream, *this); break;
-    case LPM_SETUP2:Insn_write_lpm_setup(ostream, *this, true); break;
+    case LPM_SBOX:  Insn_write_lpm(ostream, code, *this, true, mapped); break;
+    case LPM_SETUP: Insn_write_lpm_setup(ostream, code, *this); break;
+    case LPM_SETUP2:Insn_write_lpm_setup(ostream, code, *this, true); break;
     case LPM_SETLOW:Insn_write_tworeg(ostream, "mov", *this); break;
-    case LPM_SWITCH:Insn_write_lpm_switch(ostream, *this); break;
+    case LPM_SWITCH:Insn_write_lpm_switch(ostream, code, *this); break;
     case LPM_ADJUST:Insn_write_lpm_adjust(ostream, *this); break;
     case LPM_OFFSET:Insn_write_lpm_offset(ostream, *this); break;
-    case LPM_CLEAN: Insn_write_lpm_clean(ostream); break;
+    case LPM_CLEAN: Insn_write_lpm_clean(ostream, code); break;
     case LSL:       Insn_write_onereg(ostream, "lsl", *this); break;
     case LSR:       Insn_write_onereg(ostream, "lsr", *this); break;
     case MOV:       Insn_write_tworeg(ostream, "mov", *this); break;
@@ -425,20 +536,28 @@ void Code::write(std::ostream &ostream) const
 {
     // Registers that need to be saved if used: r2-r17.  We also need
     // to save r28:r29 but that is already handled in the common code.
+    // The reduced core has r18-r21 as its call-saved registers instead.
     unsigned saved = 0x0003FFFC;
+    const char *tmp_reg = "r0";
+    const char *zero_reg = "r1";
+    if (hasFlag(ReducedCore)) {
+        saved = 0x003C0000;
+        tmp_reg = "r16";
+        zero_reg = "r17";
+    }
 
     // Output the function header.
-    //ostream << std::endl;
-    //ostream << "\t.text" << std::endl;
-    //ostream << ".global " << m_name << std::endl;
-    //ostream << "\t.type " << m_name << ", @function" << std::endl;
-    //ostream << m_name << ":" << std::endl;
+    //ostream << '\n';
+    //ostream << "\t.text\n";
+    //ostream << ".global " << m_name << '\n';
+    //ostream << "\t.type " << m_name << ", @function\n";
+    //ostream << m_name << ":\n";
 
     // Push registers that we need to save on the stack.
     unsigned saved_regs = 2;
     if (!hasFlag(NoLocals) || hasFlag(TempY)) {
-        ostream << "\tpush r28" << std::endl; // Push Y
-        ostream << "\tpush r29" << std::endl;
+        ostream << "\tpush r28\n"; // Push Y
+        ostream << "\tpush r29\n";
     }
     for (int reg = 0; reg < 32; ++reg) {
         if ((saved & (1 << reg)) != 0 && (m_usedRegs & (1 << reg)) != 0) {
@@ -451,92 +570,92 @@ void Code::write(std::ostream &ostream) const
     unsigned extras = 0;
     switch (m_prologueType) {
     case EncryptBlock:
-        ostream << "\tpush r23" << std::endl;
-        ostream << "\tpush r22" << std::endl;
+        ostream << "\tpush r23\n";
+        ostream << "\tpush r22\n";
         extras = 2;
         if (hasFlag(MoveWord)) {
-            ostream << "\tmovw r30,r24" << std::endl;
-            ostream << "\tmovw r26,r20" << std::endl;
+            ostream << "\tmovw r30,r24\n";
+            ostream << "\tmovw r26,r20\n";
         } else {
-            ostream << "\tmov r30,r24" << std::endl;
-            ostream << "\tmov r31,r25" << std::endl;
-            ostream << "\tmov r26,r20" << std::endl;
-            ostream << "\tmov r27,r21" << std::endl;
+            ostream << "\tmov r30,r24\n";
+            ostream << "\tmov r31,r25\n";
+            ostream << "\tmov r26,r20\n";
+            ostream << "\tmov r27,r21\n";
         }
         break;
 
     case EncryptBlockKey2:
-        ostream << "\tpush r25" << std::endl;
-        ostream << "\tpush r24" << std::endl;
+        ostream << "\tpush r25\n";
+        ostream << "\tpush r24\n";
         extras = 2;
         if (hasFlag(MoveWord)) {
-            ostream << "\tmovw r30,r22" << std::endl;
-            ostream << "\tmovw r26,r20" << std::endl;
+            ostream << "\tmovw r30,r22\n";
+            ostream << "\tmovw r26,r20\n";
         } else {
-            ostream << "\tmov r30,r22" << std::endl;
-            ostream << "\tmov r31,r23" << std::endl;
-            ostream << "\tmov r26,r20" << std::endl;
-            ostream << "\tmov r27,r21" << std::endl;
+            ostream << "\tmov r30,r22\n";
+            ostream << "\tmov r31,r23\n";
+            ostream << "\tmov r26,r20\n";
+            ostream << "\tmov r27,r21\n";
         }
         break;
 
     case KeySetup:
         if (hasFlag(MoveWord)) {
-            ostream << "\tmovw r30,r24" << std::endl;
-            ostream << "\tmovw r26,r22" << std::endl;
+            ostream << "\tmovw r30,r24\n";
+            ostream << "\tmovw r26,r22\n";
         } else {
-            ostream << "\tmov r30,r24" << std::endl;
-            ostream << "\tmov r31,r25" << std::endl;
-            ostream << "\tmov r26,r22" << std::endl;
-            ostream << "\tmov r27,r23" << std::endl;
+            ostream << "\tmov r30,r24\n";
+            ostream << "\tmov r31,r25\n";
+            ostream << "\tmov r26,r22\n";
+            ostream << "\tmov r27,r23\n";
         }
         break;
 
     case KeySetupReversed:
         if (hasFlag(MoveWord)) {
-            ostream << "\tmovw r30,r22" << std::endl;
-            ostream << "\tmovw r26,r24" << std::endl;
+            ostream << "\tmovw r30,r22\n";
+            ostream << "\tmovw r26,r24\n";
         } else {
-            ostream << "\tmov r30,r22" << std::endl;
-            ostream << "\tmov r31,r23" << std::endl;
-            ostream << "\tmov r26,r24" << std::endl;
-            ostream << "\tmov r27,r25" << std::endl;
+            ostream << "\tmov r30,r22\n";
+            ostream << "\tmov r31,r23\n";
+            ostream << "\tmov r26,r24\n";
+            ostream << "\tmov r27,r25\n";
         }
         break;
 
     case Permutation:
         if (hasFlag(MoveWord)) {
-            ostream << "\tmovw r30,r24" << std::endl;
+            ostream << "\tmovw r30,r24\n";
         } else {
-            ostream << "\tmov r30,r24" << std::endl;
-            ostream << "\tmov r31,r25" << std::endl;
+            ostream << "\tmov r30,r24\n";
+            ostream << "\tmov r31,r25\n";
         }
         break;
 
     case PermutationMasked:
-        ostream << "\tpush r21" << std::endl;
-        ostream << "\tpush r20" << std::endl;
+        ostream << "\tpush r21\n";
+        ostream << "\tpush r20\n";
         extras = 2;
         if (hasFlag(MoveWord)) {
-            ostream << "\tmovw r30,r24" << std::endl;
-            ostream << "\tmovw r26,r20" << std::endl;
+            ostream << "\tmovw r30,r24\n";
+            ostream << "\tmovw r26,r20\n";
         } else {
-            ostream << "\tmov r30,r24" << std::endl;
-            ostream << "\tmov r31,r25" << std::endl;
-            ostream << "\tmov r26,r20" << std::endl;
-            ostream << "\tmov r27,r21" << std::endl;
+            ostream << "\tmov r30,r24\n";
+            ostream << "\tmov r31,r25\n";
+            ostream << "\tmov r26,r20\n";
+            ostream << "\tmov r27,r21\n";
         }
         break;
 
     case TinyJAMBU:
         if (hasFlag(MoveWord)) {
-            ostream << "\tmovw r26,r24" << std::endl;
-            ostream << "\tmovw r30,r22" << std::endl;
+            ostream << "\tmovw r26,r24\n";
+            ostream << "\tmovw r30,r22\n";
         } else {
-            ostream << "\tmov r26,r24" << std::endl;
-            ostream << "\tmov r27,r25" << std::endl;
-            ostream << "\tmov r30,r22" << std::endl;
-            ostream << "\tmov r31,r23" << std::endl;
+            ostream << "\tmov r26,r24\n";
+            ostream << "\tmov r27,r25\n";
+            ostream << "\tmov r30,r22\n";
+            ostream << "\tmov r31,r23\n";
         }
         break;
     }
@@ -547,34 +666,35 @@ void Code::write(std::ostream &ostream) const
         // Push some zeroes on the stack to create the locals as this
         // will involve less instructions than arithmetic on Y and SP.
         for (unsigned temp = 0; temp < locals; ++temp)
-            ostream << "\tpush r1" << std::endl;
+            ostream << "\tpush " << zero_reg << '\n';
         if (locals != 0 || !hasFlag(TempY)) {
-            ostream << "\tin r28,0x3d" << std::endl;    // Y = SP
-            ostream << "\tin r29,0x3e" << std::endl;
+            ostream << "\tin r28,0x3d\n";    // Y = SP
+            ostream << "\tin r29,0x3e\n";
         }
     } else {
-        ostream << "\tin r28,0x3d" << std::endl;    // Y = SP
-        ostream << "\tin r29,0x3e" << std::endl;
+        ostream << "\tin r28,0x3d\n";    // Y = SP
+        ostream << "\tin r29,0x3e\n";
         if ((locals % 256) == 0) {
-            ostream << "\tsubi r29," << ((locals / 256) & 0xFF) << std::endl;
+            ostream << "\tsubi r29," << ((locals / 256) & 0xFF) << '\n';
         } else if (locals > 63 || !hasFlag(MoveWord)) {
-            ostream << "\tsubi r28," << (locals & 0xFF) << std::endl;
-            ostream << "\tsbci r29," << ((locals / 256) & 0xFF) << std::endl;
+            ostream << "\tsubi r28," << (locals & 0xFF) << '\n';
+            ostream << "\tsbci r29," << ((locals / 256) & 0xFF) << '\n';
         } else {
-            ostream << "\tsbiw r28," << locals << std::endl;
+            ostream << "\tsbiw r28," << locals << '\n';
         }
-        ostream << "\tin r0,0x3f" << std::endl;     // r0 = SREG
-        ostream << "\tcli" << std::endl;            // Disable ints
-        ostream << "\tout 0x3e,r29" << std::endl;   // SPH = YH
-        ostream << "\tout 0x3f,r0" << std::endl;    // SREG = r0 (Enable ints)
-        ostream << "\tout 0x3d,r28" << std::endl;   // SPL = YL
+        ostream << "\tin " << tmp_reg << ",0x3f\n"; // SREG
+        ostream << "\tcli\n";            // Disable ints
+        ostream << "\tout 0x3e,r29\n";   // SPH = YH
+        ostream << "\tout 0x3f," << tmp_reg << '\n'; // Enable ints
+        ostream << "\tout 0x3d,r28\n";   // SPL = YL
     }
     ostream << ".L__stack_usage = "
-            << (locals + extras + saved_regs) << std::endl;
+            << (locals + extras + saved_regs) << '\n';
 
     // Output all instructions in the function.
+    std::vector<unsigned char> forms = relax_branches();
     for (unsigned index = 0; index < m_insns.size(); ++index)
-        m_insns[index].write(ostream, *this, index);
+        m_insns[index].write(ostream, *this, index, forms[index]);
 
     // Pop the stack frame.
     locals += extras; // Also pop the local for the "output" pointer.
@@ -584,7 +704,7 @@ void Code::write(std::ostream &ostream) const
         // Pop the values directly from the stack because it will
         // involve less instructions than arithmetic on Y and SP.
         while (locals > 0) {
-            ostream << "\tpop r0" << std::endl;
+            ostream << "\tpop " << tmp_reg << '\n';
             --locals;
         }
     } else if (locals > 0) {
@@ -592,26 +712,26 @@ void Code::write(std::ostream &ostream) const
             // Y was destroyed by the code so we need to restore it from SP.
             // We assume that the code has popped any extra stack positions
             // that it used before we get to here.
-            ostream << "\tin r28,0x3d" << std::endl;
-            ostream << "\tin r29,0x3e" << std::endl;
+            ostream << "\tin r28,0x3d\n";
+            ostream << "\tin r29,0x3e\n";
         }
         if (locals <= 63 && hasFlag(MoveWord)) {
-            ostream << "\tadiw r28," << locals << std::endl;
+            ostream << "\tadiw r28," << locals << '\n';
         } else {
             // It is more efficient to subtract the negative.
             locals = -locals;
             if ((locals % 256) == 0) {
-                ostream << "\tsubi r29," << ((locals / 256) & 0xFF) << std::endl;
+                ostream << "\tsubi r29," << ((locals / 256) & 0xFF) << '\n';
             } else {
-                ostream << "\tsubi r28," << (locals & 0xFF) << std::endl;
-                ostream << "\tsbci r29," << ((locals / 256) & 0xFF) << std::endl;
+                ostream << "\tsubi r28," << (locals & 0xFF) << '\n';
+                ostream << "\tsbci r29," << ((locals / 256) & 0xFF) << '\n';
             }
         }
-        ostream << "\tin r0,0x3f" << std::endl;     // r0 = SREG
-        ostream << "\tcli" << std::endl;            // Disable ints
-        ostream << "\tout 0x3e,r29" << std::endl;   // SPH = YH
-        ostream << "\tout 0x3f,r0" << std::endl;    // SREG = r0 (Enable ints)
-        ostream << "\tout 0x3d,r28" << std::endl;   // SPL = YL
+        ostream << "\tin " << tmp_reg << ",0x3f\n"; // SREG
+        ostream << "\tcli\n";            // Disable ints
+        ostream << "\tout 0x3e,r29\n";   // SPH = YH
+        ostream << "\tout 0x3f," << tmp_reg << '\n'; // Enable ints
+        ostream << "\tout 0x3d,r28\n";   // SPL = YL
     }
 
     // Restore the call-saved registers and return.
@@ -621,38 +741,72 @@ void Code::write(std::ostream &ostream) const
         }
     }
     if (!hasFlag(NoLocals) || hasFlag(TempY)) {
-        ostream << "\tpop r29" << std::endl;        // Pop Y
-        ostream << "\tpop r28" << std::endl;
+        ostream << "\tpop r29\n";        // Pop Y
+        ostream << "\tpop r28\n";
     }
     if (hasFlag(TempR1)) {
         // We need to set "r1" back to zero before we return.
-        ostream << "\teor r1,r1" << std::endl;
+        ostream << "\teor " << zero_reg << "," << zero_reg << '\n';
     }
-    ostream << "\tret" << std::endl;
+    ostream << "\tret\n";
 
     // Output the function footer.
     //ostream << "\t.size " << m_name;
-    //ostream << ", .-" << m_name << std::endl;
+    //ostream << ", .-" << m_name << '\n';
 }
 
 void Code::sbox_write
     (std::ostream &ostream, unsigned char num, const Sbox &sbox)
 {
-    ostream << std::endl;
-    ostream << "\t.section\t.progmem.data,\"a\",@progbits" << std::endl;
-    ostream << "\t.p2align\t8" << std::endl; // Align on a 256-byte boundary.
-    ostream << "\t.type\ttable_" << (int)num << ", @object" << std::endl;
-    ostream << "\t.size\ttable_" << (int)num << ", " << sbox.size() << std::endl;
-    ostream << "table_" << (int)num << ":" << std::endl;
+    sbox_write(ostream, sbox_name(num), sbox, true);
+}
+
+void Code::sbox_write
+    (std::ostream &ostream, const std::string &name,
+     const Sbox &sbox, bool aligned) const
+{
+    ostream << '\n';
+    if (m_sboxPlacement == SboxInRAM) {
+        // The table lives in ".data", so ask the C runtime's startup
+        // code to copy the initial contents from flash into RAM for us.
+        ostream << "\t.global\t__do_copy_data\n";
+        ostream << "\t.section\t" << sbox_section()
+                << ",\"aw\",@progbits\n";
+    } else {
+        ostream << "\t.section\t" << sbox_section()
+                << ",\"a\",@progbits\n";
+    }
+    if (aligned)
+        ostream << "\t.p2align\t8\n"; // Align on a 256-byte boundary.
+    ostream << "\t.type\t" << name << ", @object\n";
+    ostream << "\t.size\t" << name << ", " << sbox.size() << '\n';
+    ostream << name << ":\n";
     for (int index = 0; index < sbox.size(); ++index)
-        ostream << "\t.byte\t" << (int)(sbox.lookup(index)) << std::endl;
+        ostream << "\t.byte\t" << (int)(sbox.lookup(index)) << '\n';
+}
+
+/**
+ * \brief Gets the name of the section that S-box tables are placed into.
+ *
+ * \return ".data" if the tables are in RAM, ".rodata" if flash is mapped
+ * into the data space so that the linker can choose the mapping, or
+ * ".progmem.data" otherwise.
+ */
+std::string Code::sbox_section() const
+{
+    if (m_sboxPlacement == SboxInRAM)
+        return ".data";
+    else if (hasFlag(FlashMapped))
+        return ".rodata";
+    else
+        return ".progmem.data";
 }
 
 void Code::write_alias(std::ostream &ostream, const std::string &name) const
 {
-    ostream << std::endl;
-    ostream << ".global " << name << std::endl;
-    ostream << "\t.set " << name << "," << m_name << std::endl;
+    ostream << '\n';
+    ostream << ".global " << name << '\n';
+    ostream << "\t.set " << name << "," << m_name << '\n';
 }
 
 } // namespace AVR
@@ -0,0 +1,398 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// This file compares the generated assembly code for two versions of
+// the generator, so that changes to the code generator can be reviewed
+// by their impact on size and performance.  Cycle counts are static:
+// the cost of one pass through each basic block with branches not taken,
+// using the avr5 timings.  Only the first branch of each "#if" group
+// is counted, which is consistent between the old and new versions.
+
+#include "diff.h"
+#include <fstream>
+#include <algorithm>
+#include <cctype>
+#include <dirent.h>
+
+namespace AVR
+{
+
+unsigned AsmFunction::insns() const
+{
+    unsigned count = 0;
+    for (size_t index = 0; index < blocks.size(); ++index)
+        count += blocks[index].insns.size();
+    return count;
+}
+
+unsigned AsmFunction::bytes() const
+{
+    unsigned count = 0;
+    for (size_t index = 0; index < blocks.size(); ++index)
+        count += blocks[index].bytes;
+    return count;
+}
+
+unsigned AsmFunction::cycles() const
+{
+    unsigned count = 0;
+    for (size_t index = 0; index < blocks.size(); ++index)
+        count += blocks[index].cycles;
+    return count;
+}
+
+// Gets the size of an instruction in bytes from its mnemonic.
+static unsigned asm_bytes(const std::string &mnemonic)
+{
+    if (mnemonic == "call" || mnemonic == "jmp" ||
+            mnemonic == "lds" || mnemonic == "sts")
+        return 4;
+    return 2;
+}
+
+// Gets the number of cycles for an instruction from its mnemonic,
+// assuming that conditional branches and skips are not taken.
+static unsigned asm_cycles(const std::string &mnemonic)
+{
+    if (mnemonic == "ld" || mnemonic == "ldd" || mnemonic == "st" ||
+            mnemonic == "std" || mnemonic == "push" || mnemonic == "pop" ||
+            mnemonic == "adiw" || mnemonic == "sbiw" || mnemonic == "rjmp" ||
+            mnemonic == "lds" || mnemonic == "sts" || mnemonic == "mul")
+        return 2;
+    if (mnemonic == "lpm" || mnemonic == "elpm" || mnemonic == "rcall" ||
+            mnemonic == "jmp")
+        return 3;
+    if (mnemonic == "ret" || mnemonic == "call")
+        return 4;
+    return 1;
+}
+
+// Determine if an instruction ends a basic block.
+static bool asm_ends_block(const std::string &mnemonic)
+{
+    return (mnemonic.size() == 4 && mnemonic[0] == 'b' && mnemonic[1] == 'r') ||
+           mnemonic == "rjmp" || mnemonic == "jmp" || mnemonic == "ijmp" ||
+           mnemonic == "ret" || mnemonic == "reti";
+}
+
+// Normalizes the operands of an instruction.  Local label references
+// like "123f" and "45b" depend upon instruction offsets, which shift
+// whenever anything earlier in the function changes.
+static std::string asm_normalize(const std::string &line)
+{
+    std::string result;
+    size_t posn = 0;
+    while (posn < line.size()) {
+        char ch = line[posn];
+        if (isdigit((unsigned char)ch) &&
+                (posn == 0 || line[posn - 1] == ' ' ||
+                 line[posn - 1] == '\t' || line[posn - 1] == ',')) {
+            size_t end = posn;
+            while (end < line.size() && isdigit((unsigned char)(line[end])))
+                ++end;
+            if (end < line.size() && (line[end] == 'f' || line[end] == 'b') &&
+                    (end + 1) == line.size()) {
+                result += "L";
+                posn = end + 1;
+                continue;
+            }
+            result.append(line, posn, end - posn);
+            posn = end;
+            continue;
+        }
+        result += (ch == '\t') ? ' ' : ch;
+        ++posn;
+    }
+    return result;
+}
+
+/**
+ * \brief Parses the functions in a generated assembly code file.
+ *
+ * \param file Returns the functions in the file.
+ * \param istream The stream to read the assembly code from.
+ */
+void asmParse(AsmFile &file, std::istream &istream)
+{
+    std::string line;
+    std::string pending;
+    AsmFunction *func = 0;
+    AsmBlock block;
+    std::vector<bool> conditionals; // True if the branch is being counted.
+    while (std::getline(istream, line)) {
+        line.erase(line.find_last_not_of(" \t\r\n") + 1);
+        if (line.empty())
+            continue;
+
+        // Deal with preprocessor conditionals.
+        if (line[0] == '#') {
+            bool active = conditionals.empty() || conditionals.back();
+            if (line.rfind("#if", 0) == 0) {
+                conditionals.push_back(active);
+            } else if (line.rfind("#elif", 0) == 0 ||
+                       line.rfind("#else", 0) == 0) {
+                if (!conditionals.empty())
+                    conditionals.back() = false;
+            } else if (line.rfind("#endif", 0) == 0) {
+                if (!conditionals.empty())
+                    conditionals.pop_back();
+            }
+            continue;
+        }
+        if (!conditionals.empty() && !conditionals.back())
+            continue;
+
+        // Look for the start and end of functions.
+        if (line.rfind("\t.type ", 0) == 0 &&
+                line.find("@function") != std::string::npos) {
+            size_t comma = line.find(',');
+            pending = line.substr(7, comma - 7);
+            continue;
+        }
+        if (!func) {
+            if (!pending.empty() && line == (pending + ":")) {
+                func = &(file[pending]);
+                func->name = pending;
+                func->blocks.clear();
+                block = AsmBlock();
+            }
+            continue;
+        }
+        if (line.rfind("\t.size ", 0) == 0) {
+            if (!block.insns.empty() || !block.label.empty())
+                func->blocks.push_back(block);
+            func = 0;
+            pending.clear();
+            continue;
+        }
+
+        // Labels start a new basic block.
+        if (line[0] != '\t' && line[line.size() - 1] == ':') {
+            if (!block.insns.empty() || !block.label.empty())
+                func->blocks.push_back(block);
+            block = AsmBlock();
+            block.label = line.substr(0, line.size() - 1);
+            continue;
+        }
+
+        // Skip directives and anything else that isn't an instruction.
+        if (line[0] != '\t' || line.size() < 2 || line[1] == '.')
+            continue;
+        std::string insn = line.substr(1);
+        std::string mnemonic = insn.substr(0, insn.find_first_of(" \t"));
+        block.insns.push_back(asm_normalize(insn));
+        block.bytes += asm_bytes(mnemonic);
+        block.cycles += asm_cycles(mnemonic);
+        if (asm_ends_block(mnemonic)) {
+            func->blocks.push_back(block);
+            block = AsmBlock();
+        }
+    }
+}
+
+// Writes a signed delta between two values.
+static void asm_delta
+    (std::ostream &ostream, const char *name, unsigned oldValue,
+     unsigned newValue)
+{
+    long delta = ((long)newValue) - ((long)oldValue);
+    ostream << "    " << name << " " << oldValue << " -> " << newValue;
+    if (delta > 0)
+        ostream << " (+" << delta << ")";
+    else if (delta < 0)
+        ostream << " (" << delta << ")";
+    ostream << std::endl;
+}
+
+// Writes a summary of a basic block.
+static void asm_block
+    (std::ostream &ostream, char sign, size_t index, const AsmBlock &block)
+{
+    ostream << "      " << sign << " block " << index;
+    if (!block.label.empty())
+        ostream << " [" << block.label << "]";
+    ostream << ": " << block.insns.size() << " insns, "
+            << block.bytes << " bytes, " << block.cycles << " cycles"
+            << std::endl;
+}
+
+// Compares the basic blocks in two versions of a function.
+static void asm_diff_function
+    (std::ostream &ostream, const AsmFunction &oldFunc,
+     const AsmFunction &newFunc)
+{
+    // Find the longest common subsequence of identical blocks.
+    const std::vector<AsmBlock> &a = oldFunc.blocks;
+    const std::vector<AsmBlock> &b = newFunc.blocks;
+    size_t n = a.size();
+    size_t m = b.size();
+    std::vector<unsigned> lcs((n + 1) * (m + 1), 0);
+    for (size_t i = n; i-- > 0; ) {
+        for (size_t j = m; j-- > 0; ) {
+            if (a[i].insns == b[j].insns) {
+                lcs[i * (m + 1) + j] = lcs[(i + 1) * (m + 1) + j + 1] + 1;
+            } else {
+                lcs[i * (m + 1) + j] = std::max
+                    (lcs[(i + 1) * (m + 1) + j], lcs[i * (m + 1) + j + 1]);
+            }
+        }
+    }
+
+    // Report the blocks that are not part of the common subsequence.
+    ostream << "    changed blocks:" << std::endl;
+    size_t i = 0, j = 0;
+    while (i < n || j < m) {
+        if (i < n && j < m && a[i].insns == b[j].insns) {
+            ++i;
+            ++j;
+        } else if (j >= m || (i < n &&
+                   lcs[(i + 1) * (m + 1) + j] >= lcs[i * (m + 1) + j + 1])) {
+            asm_block(ostream, '-', i, a[i]);
+            ++i;
+        } else {
+            asm_block(ostream, '+', j, b[j]);
+            ++j;
+        }
+    }
+}
+
+/**
+ * \brief Compares the functions in two versions of an assembly code file.
+ *
+ * \param ostream The stream to write the report to.
+ * \param name Name of the file, for the report.
+ * \param oldFile Functions in the old version of the file.
+ * \param newFile Functions in the new version of the file.
+ *
+ * \return Returns true if the files are identical, or false if not.
+ */
+bool asmDiffFiles(std::ostream &ostream, const std::string &name,
+                  const AsmFile &oldFile, const AsmFile &newFile)
+{
+    bool same = true;
+    AsmFile::const_iterator it;
+    for (it = oldFile.begin(); it != oldFile.end(); ++it) {
+        AsmFile::const_iterator it2 = newFile.find(it->first);
+        if (it2 == newFile.end()) {
+            ostream << name << ": " << it->first << ": removed" << std::endl;
+            same = false;
+            continue;
+        }
+        const AsmFunction &oldFunc = it->second;
+        const AsmFunction &newFunc = it2->second;
+        bool changed = (oldFunc.blocks.size() != newFunc.blocks.size());
+        for (size_t index = 0; !changed && index < oldFunc.blocks.size(); ++index) {
+            if (oldFunc.blocks[index].insns != newFunc.blocks[index].insns)
+                changed = true;
+        }
+        if (!changed)
+            continue;
+        same = false;
+        ostream << name << ": " << it->first << ":" << std::endl;
+        asm_delta(ostream, "insns ", oldFunc.insns(), newFunc.insns());
+        asm_delta(ostream, "bytes ", oldFunc.bytes(), newFunc.bytes());
+        asm_delta(ostream, "cycles", oldFunc.cycles(), newFunc.cycles());
+        asm_diff_function(ostream, oldFunc, newFunc);
+    }
+    for (it = newFile.begin(); it != newFile.end(); ++it) {
+        if (oldFile.find(it->first) == oldFile.end()) {
+            ostream << name << ": " << it->first << ": added" << std::endl;
+            same = false;
+        }
+    }
+    return same;
+}
+
+// Lists the assembly code files in a directory.
+static bool asm_list(const std::string &dir, std::vector<std::string> &names)
+{
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+        return false;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != 0) {
+        std::string name = entry->d_name;
+        if (name.size() > 2 && (name.compare(name.size() - 2, 2, ".S") == 0 ||
+                                name.compare(name.size() - 2, 2, ".s") == 0))
+            names.push_back(name);
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    return true;
+}
+
+// Loads and parses an assembly code file.
+static void asm_load(AsmFile &file, const std::string &filename)
+{
+    std::ifstream istream(filename);
+    if (istream.is_open())
+        asmParse(file, istream);
+}
+
+/**
+ * \brief Compares the assembly code files in two directories.
+ *
+ * \param ostream The stream to write the report to.
+ * \param oldDir Directory containing the old versions of the files.
+ * \param newDir Directory containing the new versions of the files.
+ *
+ * \return Returns false if one of the directories could not be read.
+ */
+bool asmDiffDirectories(std::ostream &ostream, const std::string &oldDir,
+                        const std::string &newDir)
+{
+    std::vector<std::string> oldNames, newNames;
+    if (!asm_list(oldDir, oldNames)) {
+        ostream << oldDir << ": could not read the directory" << std::endl;
+        return false;
+    }
+    if (!asm_list(newDir, newNames)) {
+        ostream << newDir << ": could not read the directory" << std::endl;
+        return false;
+    }
+    bool same = true;
+    for (size_t index = 0; index < oldNames.size(); ++index) {
+        const std::string &name = oldNames[index];
+        if (!std::binary_search(newNames.begin(), newNames.end(), name)) {
+            ostream << name << ": only in " << oldDir << std::endl;
+            same = false;
+            continue;
+        }
+        AsmFile oldFile, newFile;
+        asm_load(oldFile, oldDir + "/" + name);
+        asm_load(newFile, newDir + "/" + name);
+        if (!asmDiffFiles(ostream, name, oldFile, newFile))
+            same = false;
+    }
+    for (size_t index = 0; index < newNames.size(); ++index) {
+        const std::string &name = newNames[index];
+        if (!std::binary_search(oldNames.begin(), oldNames.end(), name)) {
+            ostream << name << ": only in " << newDir << std::endl;
+            same = false;
+        }
+    }
+    if (same)
+        ostream << "No differences in the generated code" << std::endl;
+    return true;
+}
+
+} // namespace AVR
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef GENAVR_DIFF_H
+#define GENAVR_DIFF_H
+
+#include <vector>
+#include <map>
+#include <string>
+#include <istream>
+#include <ostream>
+
+namespace AVR
+{
+
+/**
+ * \brief Basic block within a generated assembly code function.
+ */
+struct AsmBlock
+{
+    std::string label;                  /**< Label at the start, if any */
+    std::vector<std::string> insns;     /**< Normalized instructions */
+    unsigned bytes;                     /**< Size of the block in bytes */
+    unsigned cycles;                    /**< Cycles for one pass through */
+
+    AsmBlock() : bytes(0), cycles(0) {}
+};
+
+/**
+ * \brief Function within a generated assembly code file.
+ */
+struct AsmFunction
+{
+    std::string name;                   /**< Name of the function */
+    std::vector<AsmBlock> blocks;       /**< Basic blocks in the function */
+
+    unsigned insns() const;
+    unsigned bytes() const;
+    unsigned cycles() const;
+};
+
+/**
+ * \brief Functions within a generated assembly code file, by name.
+ */
+typedef std::map<std::string, AsmFunction> AsmFile;
+
+void asmParse(AsmFile &file, std::istream &istream);
+bool asmDiffFiles(std::ostream &ostream, const std::string &name,
+                  const AsmFile &oldFile, const AsmFile &newFile);
+bool asmDiffDirectories(std::ostream &ostream, const std::string &oldDir,
+                        const std::string &newDir);
+
+} // namespace AVR
+
+#endif
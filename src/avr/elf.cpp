@@ -0,0 +1,350 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "elf.h"
+#include <stdexcept>
+
+namespace AVR
+{
+
+// Definitions from the ELF specification that we need.
+#define EM_AVR          83
+#define ET_REL          1
+#define SHT_PROGBITS    1
+#define SHT_SYMTAB      2
+#define SHT_STRTAB      3
+#define SHT_RELA        4
+#define SHF_WRITE       0x01
+#define SHF_ALLOC       0x02
+#define SHF_EXECINSTR   0x04
+#define SHF_INFO_LINK   0x40
+#define STB_LOCAL       0
+#define STB_GLOBAL      1
+#define STT_NOTYPE      0
+#define STT_OBJECT      1
+#define STT_FUNC        2
+#define ELF_HEADER_SIZE 52
+#define ELF_SHDR_SIZE   40
+#define ELF_SYM_SIZE    16
+#define ELF_RELA_SIZE   12
+
+// Fixed section numbers.  The data sections for the tables follow.
+#define SECTION_TEXT    1
+#define SECTION_RELA    2
+#define SECTION_DATA    3
+
+/**
+ * \brief Constructs a new ELF object writer.
+ *
+ * \param flags The value for the "e_flags" field in the ELF header,
+ * which is the AVR architecture number; e.g. 5 for avr5.
+ */
+ElfWriter::ElfWriter(unsigned flags)
+    : m_flags(flags)
+{
+}
+
+ElfWriter::~ElfWriter()
+{
+}
+
+// Finds a global symbol by name.  Returns -1 if not found.
+int ElfWriter::findGlobal(const std::string &name) const
+{
+    for (size_t index = 0; index < m_globals.size(); ++index) {
+        if (m_globals[index].name == name)
+            return index;
+    }
+    return -1;
+}
+
+/**
+ * \brief Adds a function to the ".text" section.
+ *
+ * \param name The name of the global symbol for the function.
+ * \param encoder The encoder that holds the function's machine code.
+ */
+void ElfWriter::addFunction(const std::string &name, const Encoder &encoder)
+{
+    int existing = findGlobal(name);
+    if (existing >= 0 && m_globals[existing].section != 0)
+        throw std::invalid_argument("function '" + name + "' is duplicated");
+    Symbol symbol;
+    symbol.name = name;
+    symbol.section = SECTION_TEXT;
+    symbol.value = m_text.size();
+    symbol.size = encoder.bytes().size();
+    symbol.info = (STB_GLOBAL << 4) | STT_FUNC;
+    if (existing >= 0)
+        m_globals[existing] = symbol; // Previously referenced as undefined.
+    else
+        m_globals.push_back(symbol);
+    const std::vector<Relocation> &relocs = encoder.relocations();
+    for (size_t index = 0; index < relocs.size(); ++index) {
+        Relocation reloc(relocs[index]);
+        reloc.offset += m_text.size();
+        m_relocs.push_back(reloc);
+    }
+    m_text.insert(m_text.end(), encoder.bytes().begin(),
+                  encoder.bytes().end());
+}
+
+/**
+ * \brief Adds an S-box table to a data section.
+ *
+ * \param name The name of the local symbol for the table.
+ * \param section The name of the section; e.g. ".progmem.data".
+ * \param sbox The contents of the table.
+ * \param aligned Set to true to align the table on a 256-byte boundary.
+ */
+void ElfWriter::addTable
+    (const std::string &name, const std::string &section,
+     const Sbox &sbox, bool aligned)
+{
+    size_t index;
+    for (index = 0; index < m_sections.size(); ++index) {
+        if (m_sections[index].name == section)
+            break;
+    }
+    if (index >= m_sections.size()) {
+        Section sect;
+        sect.name = section;
+        sect.type = SHT_PROGBITS;
+        sect.flags = SHF_ALLOC;
+        if (section == ".data")
+            sect.flags |= SHF_WRITE;
+        sect.align = 1;
+        m_sections.push_back(sect);
+    }
+    Section &sect = m_sections[index];
+    if (aligned) {
+        sect.align = 256;
+        while ((sect.data.size() % 256) != 0)
+            sect.data.push_back(0);
+    }
+    Symbol symbol;
+    symbol.name = name;
+    symbol.section = SECTION_DATA + index;
+    symbol.value = sect.data.size();
+    symbol.size = sbox.size();
+    symbol.info = (STB_LOCAL << 4) | STT_OBJECT;
+    m_locals.push_back(symbol);
+    for (int posn = 0; posn < sbox.size(); ++posn)
+        sect.data.push_back(sbox.lookup(posn));
+}
+
+/**
+ * \brief Adds a reference to an undefined global symbol.
+ *
+ * \param name The name of the symbol.
+ *
+ * This is used to pull in startup code from the C runtime library,
+ * such as "__do_copy_data".
+ */
+void ElfWriter::addUndefined(const std::string &name)
+{
+    if (findGlobal(name) >= 0)
+        return;
+    Symbol symbol;
+    symbol.name = name;
+    symbol.section = 0;
+    symbol.value = 0;
+    symbol.size = 0;
+    symbol.info = (STB_GLOBAL << 4) | STT_NOTYPE;
+    m_globals.push_back(symbol);
+}
+
+static void put16(std::vector<unsigned char> &out, unsigned value)
+{
+    out.push_back((unsigned char)value);
+    out.push_back((unsigned char)(value >> 8));
+}
+
+static void put32(std::vector<unsigned char> &out, unsigned value)
+{
+    put16(out, value & 0xFFFF);
+    put16(out, value >> 16);
+}
+
+// Adds a string to a string table and returns its offset.
+static unsigned addString(std::vector<unsigned char> &table,
+                          const std::string &str)
+{
+    unsigned offset = table.size();
+    table.insert(table.end(), str.begin(), str.end());
+    table.push_back(0);
+    return offset;
+}
+
+// Appends a section header to the section header table.
+static void putSectionHeader
+    (std::vector<unsigned char> &out, unsigned name, unsigned type,
+     unsigned flags, unsigned offset, unsigned size, unsigned link,
+     unsigned info, unsigned align, unsigned entsize)
+{
+    put32(out, name);
+    put32(out, type);
+    put32(out, flags);
+    put32(out, 0);          // sh_addr
+    put32(out, offset);
+    put32(out, size);
+    put32(out, link);
+    put32(out, info);
+    put32(out, align);
+    put32(out, entsize);
+}
+
+/**
+ * \brief Writes the ELF object file.
+ *
+ * \param ostream The stream to write to, which should be in binary mode.
+ *
+ * Any symbols that are referenced by relocations but not defined are
+ * added to the symbol table as undefined globals.
+ */
+void ElfWriter::write(std::ostream &ostream)
+{
+    // Make sure that every relocation has a symbol to refer to.
+    for (size_t index = 0; index < m_relocs.size(); ++index) {
+        const std::string &name = m_relocs[index].symbol;
+        bool found = false;
+        for (size_t posn = 0; posn < m_locals.size() && !found; ++posn)
+            found = (m_locals[posn].name == name);
+        if (!found)
+            addUndefined(name);
+    }
+
+    // Build the symbol and string tables.  Local symbols must come first.
+    std::vector<unsigned char> strtab;
+    std::vector<unsigned char> symtab;
+    strtab.push_back(0);
+    symtab.resize(ELF_SYM_SIZE, 0);
+    std::vector<Symbol> symbols(m_locals);
+    symbols.insert(symbols.end(), m_globals.begin(), m_globals.end());
+    for (size_t index = 0; index < symbols.size(); ++index) {
+        const Symbol &symbol = symbols[index];
+        put32(symtab, addString(strtab, symbol.name));
+        put32(symtab, symbol.value);
+        put32(symtab, symbol.size);
+        symtab.push_back(symbol.info);
+        symtab.push_back(0);    // st_other
+        put16(symtab, symbol.section);
+    }
+
+    // Build the relocation table for ".text".
+    std::vector<unsigned char> rela;
+    for (size_t index = 0; index < m_relocs.size(); ++index) {
+        const Relocation &reloc = m_relocs[index];
+        unsigned symbol = 0;
+        for (size_t posn = 0; posn < symbols.size(); ++posn) {
+            if (symbols[posn].name == reloc.symbol) {
+                symbol = posn + 1;
+                break;
+            }
+        }
+        put32(rela, reloc.offset);
+        put32(rela, (symbol << 8) | reloc.type);
+        put32(rela, 0);         // r_addend
+    }
+
+    // Build the section name table.
+    std::vector<unsigned char> shstrtab;
+    shstrtab.push_back(0);
+    unsigned textName = addString(shstrtab, ".text");
+    unsigned relaName = addString(shstrtab, ".rela.text");
+    std::vector<unsigned> dataNames;
+    for (size_t index = 0; index < m_sections.size(); ++index)
+        dataNames.push_back(addString(shstrtab, m_sections[index].name));
+    unsigned symtabName = addString(shstrtab, ".symtab");
+    unsigned strtabName = addString(shstrtab, ".strtab");
+    unsigned shstrtabName = addString(shstrtab, ".shstrtab");
+    unsigned symtabIndex = SECTION_DATA + m_sections.size();
+    unsigned sectionCount = symtabIndex + 3;
+
+    // Lay out the contents of the sections after the ELF header.
+    std::vector<unsigned char> body;
+    std::vector<unsigned char> headers;
+    unsigned offset;
+    headers.resize(ELF_SHDR_SIZE, 0); // Null section.
+    offset = ELF_HEADER_SIZE + body.size();
+    body.insert(body.end(), m_text.begin(), m_text.end());
+    putSectionHeader(headers, textName, SHT_PROGBITS,
+                     SHF_ALLOC | SHF_EXECINSTR, offset, m_text.size(),
+                     0, 0, 2, 0);
+    while ((body.size() % 4) != 0)
+        body.push_back(0);
+    offset = ELF_HEADER_SIZE + body.size();
+    body.insert(body.end(), rela.begin(), rela.end());
+    putSectionHeader(headers, relaName, SHT_RELA, SHF_INFO_LINK,
+                     offset, rela.size(), symtabIndex, SECTION_TEXT,
+                     4, ELF_RELA_SIZE);
+    for (size_t index = 0; index < m_sections.size(); ++index) {
+        const Section &sect = m_sections[index];
+        offset = ELF_HEADER_SIZE + body.size();
+        body.insert(body.end(), sect.data.begin(), sect.data.end());
+        putSectionHeader(headers, dataNames[index], sect.type, sect.flags,
+                         offset, sect.data.size(), 0, 0, sect.align, 0);
+    }
+    while ((body.size() % 4) != 0)
+        body.push_back(0);
+    offset = ELF_HEADER_SIZE + body.size();
+    body.insert(body.end(), symtab.begin(), symtab.end());
+    putSectionHeader(headers, symtabName, SHT_SYMTAB, 0, offset,
+                     symtab.size(), symtabIndex + 1, m_locals.size() + 1,
+                     4, ELF_SYM_SIZE);
+    offset = ELF_HEADER_SIZE + body.size();
+    body.insert(body.end(), strtab.begin(), strtab.end());
+    putSectionHeader(headers, strtabName, SHT_STRTAB, 0, offset,
+                     strtab.size(), 0, 0, 1, 0);
+    offset = ELF_HEADER_SIZE + body.size();
+    body.insert(body.end(), shstrtab.begin(), shstrtab.end());
+    putSectionHeader(headers, shstrtabName, SHT_STRTAB, 0, offset,
+                     shstrtab.size(), 0, 0, 1, 0);
+    while ((body.size() % 4) != 0)
+        body.push_back(0);
+
+    // Write the ELF header, followed by the body and section headers.
+    std::vector<unsigned char> header;
+    static unsigned char const ident[16] = {
+        0x7F, 'E', 'L', 'F', 1 /*ELFCLASS32*/, 1 /*ELFDATA2LSB*/,
+        1 /*EV_CURRENT*/, 0, 0, 0, 0, 0, 0, 0, 0, 0
+    };
+    header.insert(header.end(), ident, ident + sizeof(ident));
+    put16(header, ET_REL);
+    put16(header, EM_AVR);
+    put32(header, 1);                                   // e_version
+    put32(header, 0);                                   // e_entry
+    put32(header, 0);                                   // e_phoff
+    put32(header, ELF_HEADER_SIZE + body.size());       // e_shoff
+    put32(header, m_flags);
+    put16(header, ELF_HEADER_SIZE);
+    put16(header, 0);                                   // e_phentsize
+    put16(header, 0);                                   // e_phnum
+    put16(header, ELF_SHDR_SIZE);
+    put16(header, sectionCount);
+    put16(header, sectionCount - 1);                    // e_shstrndx
+    ostream.write((const char *)header.data(), header.size());
+    ostream.write((const char *)body.data(), body.size());
+    ostream.write((const char *)headers.data(), headers.size());
+}
+
+} // namespace AVR
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef GENAVR_ELF_H
+#define GENAVR_ELF_H
+
+#include "encoder.h"
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace AVR
+{
+
+/**
+ * \brief Writes relocatable ELF object files for AVR.
+ *
+ * Functions are placed one after the other in ".text" and S-box tables
+ * are placed in whichever data section Code::sbox_section() says.
+ * Calls between functions and references to tables are left as
+ * relocations for the linker to resolve.
+ */
+class ElfWriter
+{
+public:
+    explicit ElfWriter(unsigned flags);
+    ~ElfWriter();
+
+    void addFunction(const std::string &name, const Encoder &encoder);
+    void addTable(const std::string &name, const std::string &section,
+                  const Sbox &sbox, bool aligned);
+    void addUndefined(const std::string &name);
+
+    /**
+     * \brief Gets the size of the ".text" section in bytes.
+     */
+    unsigned textSize() const { return m_text.size(); }
+
+    void write(std::ostream &ostream);
+
+private:
+    struct Symbol
+    {
+        std::string name;
+        unsigned section;
+        unsigned value;
+        unsigned size;
+        unsigned char info;
+    };
+    struct Section
+    {
+        std::string name;
+        unsigned type;
+        unsigned flags;
+        unsigned align;
+        std::vector<unsigned char> data;
+    };
+
+    unsigned m_flags;
+    std::vector<unsigned char> m_text;
+    std::vector<Relocation> m_relocs;
+    std::vector<Section> m_sections;
+    std::vector<Symbol> m_locals;
+    std::vector<Symbol> m_globals;
+
+    int findGlobal(const std::string &name) const;
+};
+
+} // namespace AVR
+
+#endif
@@ -0,0 +1,459 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "encoder.h"
+#include <sstream>
+#include <stdexcept>
+#include <stdlib.h>
+
+namespace AVR
+{
+
+// I/O address of the RAMPZ register on devices that have it.
+#define RAMPZ_IO_ADDR 0x3B
+
+Encoder::Encoder()
+{
+}
+
+Encoder::~Encoder()
+{
+}
+
+// Determine if an instruction is 4 bytes in size.
+static bool isLongInsn(const std::string &mnemonic)
+{
+    return mnemonic == "call" || mnemonic == "jmp" ||
+           mnemonic == "lds" || mnemonic == "sts";
+}
+
+/**
+ * \brief Encodes the code for a function.
+ *
+ * \param code The code for the function, including the prologue
+ * and epilogue.
+ *
+ * Throws an exception if the code contains something that cannot be
+ * encoded, such as an "#if" fallback chain.
+ */
+void Encoder::encode(const Code &code)
+{
+    parse(code);
+    m_bytes.clear();
+    m_relocs.clear();
+    for (size_t index = 0; index < m_lines.size(); ++index)
+        encodeLine(index);
+}
+
+/**
+ * \brief Gets the size of the machine code for a function in bytes.
+ *
+ * \param code The code for the function.
+ *
+ * \return The size of the function's code.
+ */
+unsigned Encoder::size(const Code &code)
+{
+    Encoder encoder;
+    encoder.parse(code);
+    if (encoder.m_lines.empty())
+        return 0;
+    const Line &last = encoder.m_lines.back();
+    return last.address + (isLongInsn(last.mnemonic) ? 4 : 2);
+}
+
+// Splits the output of Code::write() into instructions and labels.
+void Encoder::parse(const Code &code)
+{
+    m_lines.clear();
+    m_labels.clear();
+    if (code.size() == 0)
+        return; // S-box tables only.
+    std::ostringstream stream;
+    code.write(stream);
+    std::istringstream lines(stream.str());
+    std::string text;
+    unsigned address = 0;
+    while (std::getline(lines, text)) {
+        if (text.empty() || text.rfind(".L", 0) == 0)
+            continue; // Blank line or the stack usage symbol.
+        if (text[0] == '#') {
+            throw std::invalid_argument
+                ("cannot encode preprocessor conditionals; use --mcu");
+        }
+        if (text[text.size() - 1] == ':') {
+            Label label;
+            label.name = text.substr(0, text.size() - 1);
+            label.position = m_lines.size();
+            label.address = address;
+            m_labels.push_back(label);
+            continue;
+        }
+        if (text[0] != '\t' || (text.size() > 1 && text[1] == '.')) {
+            throw std::invalid_argument
+                ("cannot encode '" + text + "'");
+        }
+        Line line;
+        size_t posn = text.find(' ', 1);
+        line.mnemonic = text.substr(1, posn == std::string::npos
+                                            ? std::string::npos : posn - 1);
+        if (posn != std::string::npos) {
+            std::string operands = text.substr(posn + 1);
+            while (!operands.empty() && operands[operands.size() - 1] == ' ')
+                operands.erase(operands.size() - 1);
+            while (!operands.empty()) {
+                size_t comma = operands.find(',');
+                line.operands.push_back(operands.substr(0, comma));
+                if (comma == std::string::npos)
+                    break;
+                operands = operands.substr(comma + 1);
+            }
+        }
+        line.address = address;
+        address += isLongInsn(line.mnemonic) ? 4 : 2;
+        m_lines.push_back(line);
+    }
+}
+
+// Appends a 16-bit instruction word to the machine code.
+void Encoder::emit(unsigned short word)
+{
+    m_bytes.push_back((unsigned char)word);
+    m_bytes.push_back((unsigned char)(word >> 8));
+}
+
+// Finds the address of a local numeric label like "12f" or "12b",
+// as referenced by the instruction at a specific position.
+unsigned Encoder::labelAddress(size_t position, const std::string &label) const
+{
+    std::string name = label.substr(0, label.size() - 1);
+    char dir = label[label.size() - 1];
+    if (dir == 'f') {
+        for (size_t index = 0; index < m_labels.size(); ++index) {
+            if (m_labels[index].position > position &&
+                    m_labels[index].name == name)
+                return m_labels[index].address;
+        }
+    } else if (dir == 'b') {
+        for (size_t index = m_labels.size(); index > 0; --index) {
+            if (m_labels[index - 1].position <= position &&
+                    m_labels[index - 1].name == name)
+                return m_labels[index - 1].address;
+        }
+    }
+    throw std::invalid_argument("unknown label '" + label + "'");
+}
+
+// Parses a register operand like "r24".
+static unsigned parseReg(const std::string &operand)
+{
+    if (operand.size() < 2 || operand[0] != 'r')
+        throw std::invalid_argument("invalid register '" + operand + "'");
+    char *end;
+    unsigned long reg = strtoul(operand.c_str() + 1, &end, 10);
+    if (*end != '\0' || reg >= 32)
+        throw std::invalid_argument("invalid register '" + operand + "'");
+    return (unsigned)reg;
+}
+
+// Parses a high register operand for instructions like "ldi".
+static unsigned parseHighReg(const std::string &operand)
+{
+    unsigned reg = parseReg(operand);
+    if (reg < 16) {
+        throw std::invalid_argument
+            ("register '" + operand + "' is not a high register");
+    }
+    return reg;
+}
+
+// Parses a numeric operand, or an I/O register reference.
+static unsigned parseValue(const std::string &operand)
+{
+    if (operand == "_SFR_IO_ADDR(RAMPZ)")
+        return RAMPZ_IO_ADDR;
+    char *end;
+    long value = strtol(operand.c_str(), &end, 0);
+    if (operand.empty() || *end != '\0')
+        throw std::invalid_argument("invalid value '" + operand + "'");
+    return (unsigned)value;
+}
+
+// Encodes an instruction with two general registers.
+static unsigned short encodeTwoReg(unsigned short opcode, unsigned d, unsigned r)
+{
+    return opcode | ((r & 0x10) << 5) | (d << 4) | (r & 0x0F);
+}
+
+// Encodes an instruction with a high register and an 8-bit immediate.
+static unsigned short encodeImm(unsigned short opcode, unsigned d, unsigned k)
+{
+    return opcode | ((k & 0xF0) << 4) | ((d - 16) << 4) | (k & 0x0F);
+}
+
+// Encodes the displacement for "ldd" and "std".
+static unsigned short encodeDisp(unsigned q)
+{
+    if (q > 63)
+        throw std::invalid_argument("displacement is out of range");
+    return ((q & 0x20) << 8) | ((q & 0x18) << 7) | (q & 0x07);
+}
+
+// Encodes one of the single-register instructions in the 0x94xx group.
+static bool encodeOneReg(const std::string &mnemonic, unsigned short &opcode)
+{
+    static const struct
+    {
+        const char *mnemonic;
+        unsigned short opcode;
+    } ops[] = {
+        {"com",  0x9400},
+        {"neg",  0x9401},
+        {"swap", 0x9402},
+        {"inc",  0x9403},
+        {"asr",  0x9405},
+        {"lsr",  0x9406},
+        {"ror",  0x9407},
+        {"dec",  0x940A},
+        {"pop",  0x900F},
+        {"push", 0x920F},
+        {0,      0}
+    };
+    for (int index = 0; ops[index].mnemonic; ++index) {
+        if (mnemonic == ops[index].mnemonic) {
+            opcode = ops[index].opcode;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Encodes one of the instructions with two general registers.
+static bool encodeTwoRegOp(const std::string &mnemonic, unsigned short &opcode)
+{
+    static const struct
+    {
+        const char *mnemonic;
+        unsigned short opcode;
+    } ops[] = {
+        {"cpc",  0x0400},
+        {"sbc",  0x0800},
+        {"add",  0x0C00},
+        {"cpse", 0x1000},
+        {"cp",   0x1400},
+        {"sub",  0x1800},
+        {"adc",  0x1C00},
+        {"and",  0x2000},
+        {"eor",  0x2400},
+        {"or",   0x2800},
+        {"mov",  0x2C00},
+        {0,      0}
+    };
+    for (int index = 0; ops[index].mnemonic; ++index) {
+        if (mnemonic == ops[index].mnemonic) {
+            opcode = ops[index].opcode;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Encodes one of the instructions with a high register and an immediate.
+static bool encodeImmOp(const std::string &mnemonic, unsigned short &opcode)
+{
+    static const struct
+    {
+        const char *mnemonic;
+        unsigned short opcode;
+    } ops[] = {
+        {"cpi",  0x3000},
+        {"sbci", 0x4000},
+        {"subi", 0x5000},
+        {"ori",  0x6000},
+        {"andi", 0x7000},
+        {"ldi",  0xE000},
+        {0,      0}
+    };
+    for (int index = 0; ops[index].mnemonic; ++index) {
+        if (mnemonic == ops[index].mnemonic) {
+            opcode = ops[index].opcode;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Encodes a pointer operand for "ld" and "st", like "X", "Y+", or "-Z".
+static unsigned short encodePtr(const std::string &ptr)
+{
+    if (ptr == "X")  return 0x900C;
+    if (ptr == "X+") return 0x900D;
+    if (ptr == "-X") return 0x900E;
+    if (ptr == "Y")  return 0x8008;
+    if (ptr == "Y+") return 0x9009;
+    if (ptr == "-Y") return 0x900A;
+    if (ptr == "Z")  return 0x8000;
+    if (ptr == "Z+") return 0x9001;
+    if (ptr == "-Z") return 0x9002;
+    throw std::invalid_argument("invalid pointer '" + ptr + "'");
+}
+
+// Encodes the instruction on a specific line.
+void Encoder::encodeLine(size_t index)
+{
+    const Line &line = m_lines[index];
+    const std::string &mnemonic = line.mnemonic;
+    const std::vector<std::string> &ops = line.operands;
+    unsigned short opcode;
+    if (encodeTwoRegOp(mnemonic, opcode) && ops.size() == 2) {
+        emit(encodeTwoReg(opcode, parseReg(ops[0]), parseReg(ops[1])));
+    } else if (encodeImmOp(mnemonic, opcode) && ops.size() == 2) {
+        unsigned d = parseHighReg(ops[0]);
+        const std::string &k = ops[1];
+        if (k.rfind("lo8(", 0) == 0 || k.rfind("hi8(", 0) == 0 ||
+                k.rfind("hh8(", 0) == 0) {
+            // Reference to a symbol; the linker fills in the immediate.
+            Relocation reloc;
+            reloc.offset = line.address;
+            if (k[0] == 'l')
+                reloc.type = R_AVR_LO8_LDI;
+            else if (k[1] == 'i')
+                reloc.type = R_AVR_HI8_LDI;
+            else
+                reloc.type = R_AVR_HH8_LDI;
+            reloc.symbol = k.substr(4, k.size() - 5);
+            m_relocs.push_back(reloc);
+            emit(encodeImm(opcode, d, 0));
+        } else {
+            emit(encodeImm(opcode, d, parseValue(k)));
+        }
+    } else if (encodeOneReg(mnemonic, opcode) && ops.size() == 1) {
+        emit(opcode | (parseReg(ops[0]) << 4));
+    } else if ((mnemonic == "lsl" || mnemonic == "rol") && ops.size() == 1) {
+        // Aliases for "add Rd,Rd" and "adc Rd,Rd".
+        unsigned d = parseReg(ops[0]);
+        emit(encodeTwoReg(mnemonic == "lsl" ? 0x0C00 : 0x1C00, d, d));
+    } else if ((mnemonic == "adiw" || mnemonic == "sbiw") && ops.size() == 2) {
+        unsigned d = parseReg(ops[0]);
+        unsigned k = parseValue(ops[1]);
+        if (d < 24 || (d & 1) != 0 || k > 63)
+            throw std::invalid_argument("invalid operands for " + mnemonic);
+        emit((mnemonic == "adiw" ? 0x9600 : 0x9700) | ((k & 0x30) << 2) |
+             (((d - 24) / 2) << 4) | (k & 0x0F));
+    } else if (mnemonic == "movw" && ops.size() == 2) {
+        unsigned d = parseReg(ops[0]);
+        unsigned r = parseReg(ops[1]);
+        if ((d & 1) != 0 || (r & 1) != 0)
+            throw std::invalid_argument("invalid operands for movw");
+        emit(0x0100 | ((d / 2) << 4) | (r / 2));
+    } else if ((mnemonic == "bld" || mnemonic == "bst") && ops.size() == 2) {
+        unsigned d = parseReg(ops[0]);
+        unsigned b = parseValue(ops[1]);
+        if (b > 7)
+            throw std::invalid_argument("invalid bit number");
+        emit((mnemonic == "bld" ? 0xF800 : 0xFA00) | (d << 4) | b);
+    } else if (mnemonic == "ld" && ops.size() == 2) {
+        emit(encodePtr(ops[1]) | (parseReg(ops[0]) << 4));
+    } else if (mnemonic == "st" && ops.size() == 2) {
+        emit((encodePtr(ops[0]) | 0x0200) | (parseReg(ops[1]) << 4));
+    } else if ((mnemonic == "ldd" || mnemonic == "std") && ops.size() == 2) {
+        bool load = (mnemonic == "ldd");
+        const std::string &ptr = load ? ops[1] : ops[0];
+        unsigned reg = parseReg(load ? ops[0] : ops[1]);
+        if (ptr.size() < 3 || (ptr[0] != 'Y' && ptr[0] != 'Z') ||
+                ptr[1] != '+')
+            throw std::invalid_argument("invalid pointer '" + ptr + "'");
+        opcode = (ptr[0] == 'Y') ? 0x8008 : 0x8000;
+        if (!load)
+            opcode |= 0x0200;
+        emit(opcode | encodeDisp(parseValue(ptr.substr(2))) | (reg << 4));
+    } else if ((mnemonic == "lpm" || mnemonic == "elpm") && ops.empty()) {
+        emit(mnemonic == "lpm" ? 0x95C8 : 0x95D8);
+    } else if ((mnemonic == "lpm" || mnemonic == "elpm") && ops.size() == 2) {
+        opcode = (mnemonic == "lpm") ? 0x9004 : 0x9006;
+        if (ops[1] == "Z+")
+            opcode |= 0x0001;
+        else if (ops[1] != "Z")
+            throw std::invalid_argument("invalid pointer '" + ops[1] + "'");
+        emit(opcode | (parseReg(ops[0]) << 4));
+    } else if (mnemonic == "in" && ops.size() == 2) {
+        unsigned a = parseValue(ops[1]);
+        if (a > 63)
+            throw std::invalid_argument("I/O address is out of range");
+        emit(0xB000 | ((a & 0x30) << 5) | (parseReg(ops[0]) << 4) | (a & 0x0F));
+    } else if (mnemonic == "out" && ops.size() == 2) {
+        unsigned a = parseValue(ops[0]);
+        if (a > 63)
+            throw std::invalid_argument("I/O address is out of range");
+        emit(0xB800 | ((a & 0x30) << 5) | (parseReg(ops[1]) << 4) | (a & 0x0F));
+    } else if (mnemonic == "ret" && ops.empty()) {
+        emit(0x9508);
+    } else if (mnemonic == "nop" && ops.empty()) {
+        emit(0x0000);
+    } else if (mnemonic == "cli" && ops.empty()) {
+        emit(0x94F8);
+    } else if ((mnemonic == "brcs" || mnemonic == "breq" ||
+                mnemonic == "brcc" || mnemonic == "brne") && ops.size() == 1) {
+        // Conditional branches on the C or Z flags to a local label.
+        int disp = ((int)labelAddress(index, ops[0]) -
+                    (int)(line.address + 2)) / 2;
+        if (disp < -64 || disp > 63)
+            throw std::invalid_argument("relative branch is too large");
+        opcode = (mnemonic == "brcs" || mnemonic == "breq") ? 0xF000 : 0xF400;
+        if (mnemonic == "breq" || mnemonic == "brne")
+            opcode |= 0x0001;
+        emit(opcode | ((disp & 0x7F) << 3));
+    } else if ((mnemonic == "rjmp" || mnemonic == "rcall") && ops.size() == 1) {
+        opcode = (mnemonic == "rjmp") ? 0xC000 : 0xD000;
+        const std::string &target = ops[0];
+        char last = target[target.size() - 1];
+        if (target[0] >= '0' && target[0] <= '9' &&
+                (last == 'f' || last == 'b')) {
+            // Local label within this function.
+            int disp = ((int)labelAddress(index, target) -
+                        (int)(line.address + 2)) / 2;
+            if (disp < -2048 || disp > 2047)
+                throw std::invalid_argument("relative branch is too large");
+            emit(opcode | (disp & 0x0FFF));
+        } else {
+            // Call to another function.
+            Relocation reloc;
+            reloc.offset = line.address;
+            reloc.type = R_AVR_13_PCREL;
+            reloc.symbol = target;
+            m_relocs.push_back(reloc);
+            emit(opcode);
+        }
+    } else if (mnemonic == "call" && ops.size() == 1) {
+        Relocation reloc;
+        reloc.offset = line.address;
+        reloc.type = R_AVR_CALL;
+        reloc.symbol = ops[0];
+        m_relocs.push_back(reloc);
+        emit(0x940E);
+        emit(0x0000);
+    } else {
+        throw std::invalid_argument("cannot encode '" + mnemonic + "'");
+    }
+}
+
+} // namespace AVR
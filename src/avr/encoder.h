@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef GENAVR_ENCODER_H
+#define GENAVR_ENCODER_H
+
+#include "code.h"
+#include <string>
+#include <vector>
+
+namespace AVR
+{
+
+/**
+ * \brief Relocation against a symbol in encoded machine code.
+ */
+struct Relocation
+{
+    unsigned offset;        /**< Offset of the instruction to relocate */
+    unsigned type;          /**< Type of relocation; e.g. R_AVR_CALL */
+    std::string symbol;     /**< Name of the symbol that is referenced */
+};
+
+// Relocation types from the AVR ELF ABI.
+#define R_AVR_13_PCREL  3
+#define R_AVR_CALL      18
+#define R_AVR_LO8_LDI   6
+#define R_AVR_HI8_LDI   7
+#define R_AVR_HH8_LDI   8
+
+/**
+ * \brief Encodes the code for a function into AVR machine code.
+ *
+ * The encoder works on the instruction sequence that Code::write()
+ * produces, so the machine code is always the same as what the
+ * assembler would produce from the generated assembly code.  The code
+ * must have been generated for a specific device with --mcu because
+ * "#if" fallback chains cannot be resolved without the preprocessor.
+ *
+ * Branches within the function are resolved directly.  Calls to other
+ * functions and references to S-box tables produce relocations.
+ */
+class Encoder
+{
+public:
+    Encoder();
+    ~Encoder();
+
+    void encode(const Code &code);
+
+    /**
+     * \brief Gets the bytes of machine code from the last call to encode().
+     */
+    const std::vector<unsigned char> &bytes() const { return m_bytes; }
+
+    /**
+     * \brief Gets the relocations from the last call to encode().
+     */
+    const std::vector<Relocation> &relocations() const { return m_relocs; }
+
+    static unsigned size(const Code &code);
+
+private:
+    struct Line
+    {
+        std::string mnemonic;
+        std::vector<std::string> operands;
+        unsigned address;
+    };
+    struct Label
+    {
+        std::string name;
+        size_t position;
+        unsigned address;
+    };
+
+    std::vector<unsigned char> m_bytes;
+    std::vector<Relocation> m_relocs;
+    std::vector<Line> m_lines;
+    std::vector<Label> m_labels;
+
+    void parse(const Code &code);
+    void emit(unsigned short word);
+    void encodeLine(size_t index);
+    unsigned labelAddress(size_t position, const std::string &label) const;
+};
+
+} // namespace AVR
+
+#endif
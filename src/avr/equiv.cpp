@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "equiv.h"
+#include "sat.h"
+#include <unordered_map>
+#include <queue>
+
+namespace AVR
+{
+
+// Equivalence checking works in three stages:
+//
+// 1. Both variants are executed symbolically into the same and-inverter
+//    graph, sharing the state inputs.  Structural hashing alone is often
+//    enough to prove that two variants are identical, because register
+//    allocation and memory layout disappear in the graph.
+//
+// 2. Random simulation looks for a cheap counterexample.
+//
+// 3. SAT sweeping rebuilds the graph, merging nodes that simulation
+//    suggests are equivalent once a SAT check proves it.  The checks are
+//    on a window of the logic cone around the two nodes, with the nodes
+//    outside the window left unconstrained.  This can only fail to prove
+//    a true equivalence; it can never prove a false one.  Once the inputs
+//    to two computations have been merged, structural hashing merges the
+//    rest of the computation for free.
+//
+// Finally, any output pairs that are still different are checked with
+// the full logic cone, which either proves them equivalent or produces
+// a genuine counterexample.
+
+#define EQUIV_SIM_WORDS 4
+#define EQUIV_SIM_ROUNDS 16
+#define EQUIV_WINDOW_MIN 64
+#define EQUIV_WINDOW_MAX 4096
+#define EQUIV_SWEEP_CONFLICTS 20000
+#define EQUIV_FINAL_CONFLICTS 200000
+
+// Simple 64-bit pseudorandom number generator for simulation patterns.
+static uint64_t equiv_random(uint64_t &seed)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+// Checks two literals for equivalence with a SAT solver, encoding up to
+// "window" nodes of the logic cone.  Returns the solver result for the
+// miter, so Unsat means that the literals are equivalent.  If "inputs" is
+// not null and the result is Sat, then the values of the primary inputs
+// in the counterexample are returned.
+static SatSolver::Result equiv_check
+    (const Aig &aig, AigLit x, AigLit y, unsigned window,
+     unsigned long conflicts, std::vector<bool> *inputs)
+{
+    // Collect the nodes in the window, highest nodes first so that the
+    // logic closest to the two literals is encoded.
+    SatSolver solver;
+    std::unordered_map<uint32_t, int> vars;
+    std::priority_queue<uint32_t> queue;
+    std::vector<uint32_t> ands;
+    queue.push(x >> 1);
+    queue.push(y >> 1);
+    vars[x >> 1] = solver.newVar();
+    if (vars.find(y >> 1) == vars.end())
+        vars[y >> 1] = solver.newVar();
+    while (!queue.empty()) {
+        uint32_t node = queue.top();
+        queue.pop();
+        if (node == 0 || aig.isInput(node) || ands.size() >= window)
+            continue;
+        ands.push_back(node);
+        uint32_t children[2] = {aig.fanin0(node) >> 1, aig.fanin1(node) >> 1};
+        for (int index = 0; index < 2; ++index) {
+            if (vars.find(children[index]) == vars.end()) {
+                vars[children[index]] = solver.newVar();
+                queue.push(children[index]);
+            }
+        }
+    }
+
+    // Encode the AND nodes and the constant node.
+    std::unordered_map<uint32_t, int>::const_iterator it = vars.find(0);
+    if (it != vars.end()) {
+        std::vector<int> unit(1, it->second * 2 + 1);
+        solver.addClause(unit);
+    }
+    for (size_t index = 0; index < ands.size(); ++index) {
+        uint32_t node = ands[index];
+        AigLit f0 = aig.fanin0(node);
+        AigLit f1 = aig.fanin1(node);
+        int v = vars[node] * 2;
+        int a = vars[f0 >> 1] * 2 + (f0 & 1);
+        int b = vars[f1 >> 1] * 2 + (f1 & 1);
+        solver.addClause(v ^ 1, a);
+        solver.addClause(v ^ 1, b);
+        solver.addClause(v, a ^ 1, b ^ 1);
+    }
+
+    // Assert that the two literals differ.
+    int lx = vars[x >> 1] * 2 + (x & 1);
+    int ly = vars[y >> 1] * 2 + (y & 1);
+    solver.addClause(lx, ly);
+    solver.addClause(lx ^ 1, ly ^ 1);
+    SatSolver::Result result = solver.solve(conflicts);
+    if (result == SatSolver::Sat && inputs) {
+        inputs->assign(aig.inputCount(), false);
+        for (unsigned index = 0; index < aig.inputCount(); ++index) {
+            it = vars.find(aig.inputNode(index));
+            if (it != vars.end())
+                (*inputs)[index] = solver.modelValue(it->second);
+        }
+    }
+    return result;
+}
+
+// Sweeps the graph, merging nodes that are proven equivalent.  The
+// merged versions of the literals in "outputs" are returned in place.
+static void equiv_sweep
+    (const Aig &aig, Aig &swept, std::vector<AigLit> &outputs, uint64_t &seed)
+{
+    // Simulate the original graph with random patterns to get a
+    // signature for every node.
+    unsigned count = aig.nodeCount();
+    std::vector<uint64_t> sigs(((size_t)count) * EQUIV_SIM_WORDS);
+    std::vector<uint64_t> patterns(aig.inputCount());
+    std::vector<uint64_t> values;
+    for (int word = 0; word < EQUIV_SIM_WORDS; ++word) {
+        for (size_t index = 0; index < patterns.size(); ++index)
+            patterns[index] = equiv_random(seed);
+        aig.simulate(patterns, values);
+        for (unsigned node = 0; node < count; ++node)
+            sigs[((size_t)node) * EQUIV_SIM_WORDS + word] = values[node];
+    }
+
+    // Only the nodes in the logic cones of the outputs need to be swept.
+    std::vector<bool> live(count, false);
+    for (size_t index = 0; index < outputs.size(); ++index)
+        live[outputs[index] >> 1] = true;
+    for (unsigned node = count; node-- > 1; ) {
+        if (live[node] && !aig.isInput(node)) {
+            live[aig.fanin0(node) >> 1] = true;
+            live[aig.fanin1(node) >> 1] = true;
+        }
+    }
+
+    // Rebuild the graph node by node.  Signatures are normalized so that
+    // the first pattern is always zero, which lets complementary nodes
+    // land in the same class.
+    std::vector<AigLit> map(count);
+    std::unordered_map<uint64_t, uint32_t> classes;
+    map[0] = Aig::False;
+    for (unsigned node = 0; node < count; ++node) {
+        if (node == 0) {
+            // Constant node.
+        } else if (aig.isInput(node)) {
+            // Inputs are always created, to keep them in the same order.
+            map[node] = swept.input();
+        } else if (!live[node]) {
+            continue;
+        } else {
+            AigLit f0 = aig.fanin0(node);
+            AigLit f1 = aig.fanin1(node);
+            map[node] = swept.andLit(map[f0 >> 1] ^ (f0 & 1),
+                                     map[f1 >> 1] ^ (f1 & 1));
+        }
+        const uint64_t *sig = &(sigs[((size_t)node) * EQUIV_SIM_WORDS]);
+        uint64_t phase = (sig[0] & 1) ? ~((uint64_t)0) : 0;
+        uint64_t hash = 0;
+        for (int word = 0; word < EQUIV_SIM_WORDS; ++word)
+            hash = (hash ^ (sig[word] ^ phase)) * 0x100000001B3ULL;
+        std::unordered_map<uint64_t, uint32_t>::const_iterator it;
+        it = classes.find(hash);
+        if (it == classes.end()) {
+            classes[hash] = node;
+            continue;
+        }
+
+        // Check that the signatures really are the same.
+        uint32_t rep = it->second;
+        const uint64_t *repSig = &(sigs[((size_t)rep) * EQUIV_SIM_WORDS]);
+        uint64_t repPhase = (repSig[0] & 1) ? ~((uint64_t)0) : 0;
+        bool same = true;
+        for (int word = 0; word < EQUIV_SIM_WORDS && same; ++word)
+            same = ((sig[word] ^ phase) == (repSig[word] ^ repPhase));
+        if (!same)
+            continue;
+        AigLit candidate = map[rep] ^ ((phase != repPhase) ? 1 : 0);
+        if (candidate == map[node] || aig.isInput(node))
+            continue;
+
+        // Prove the equivalence with progressively larger windows.
+        for (unsigned window = EQUIV_WINDOW_MIN; window <= EQUIV_WINDOW_MAX;
+                window *= 4) {
+            SatSolver::Result result = equiv_check
+                (swept, map[node], candidate, window,
+                 EQUIV_SWEEP_CONFLICTS, 0);
+            if (result == SatSolver::Unsat) {
+                map[node] = candidate;
+                break;
+            }
+        }
+    }
+    for (size_t index = 0; index < outputs.size(); ++index) {
+        AigLit lit = outputs[index];
+        outputs[index] = map[lit >> 1] ^ (lit & 1);
+    }
+}
+
+// Extracts the state bytes from the input values of a counterexample.
+static void equiv_counterexample
+    (const std::vector<bool> &inputs, unsigned state_len,
+     std::vector<unsigned char> &counterexample)
+{
+    counterexample.assign(state_len, 0);
+    for (unsigned posn = 0; posn < state_len * 8; ++posn) {
+        if (inputs[posn])
+            counterexample[posn / 8] |= (unsigned char)(1 << (posn % 8));
+    }
+}
+
+/**
+ * \brief Checks two permutation functions for equivalence.
+ *
+ * \param code1 The first function, which has already been generated.
+ * \param code2 The second function, which has already been generated.
+ * \param state_len Number of bytes in the state for both functions.
+ * \param output_len Number of bytes at the start of the state that are
+ * compared on output.  The rest of the state is scratch space.
+ * \param count Concrete count parameter to pass to both functions.
+ * \param counterexample Returns an input state that produces different
+ * outputs if the result is NotEquivalent.
+ *
+ * \return The result of the check.
+ *
+ * Throws an exception if either function cannot be executed symbolically;
+ * e.g. because it branches on secret data.
+ */
+EquivResult equivPermutation
+    (const Code &code1, const Code &code2, unsigned state_len,
+     unsigned output_len, unsigned count,
+     std::vector<unsigned char> &counterexample)
+{
+    // Execute both functions symbolically on the same input state.
+    Aig aig;
+    std::vector<AigLit> state1;
+    for (unsigned posn = 0; posn < state_len * 8; ++posn)
+        state1.push_back(aig.input());
+    std::vector<AigLit> state2(state1);
+    code1.symbolic_permutation(aig, state1, count);
+    code2.symbolic_permutation(aig, state2, count);
+    state1.resize(output_len * 8);
+    state2.resize(output_len * 8);
+    if (state1 == state2)
+        return Equivalent;
+
+    // Look for a counterexample with random simulation.
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    std::vector<uint64_t> patterns(aig.inputCount());
+    std::vector<uint64_t> values;
+    for (int round = 0; round < EQUIV_SIM_ROUNDS; ++round) {
+        for (size_t index = 0; index < patterns.size(); ++index)
+            patterns[index] = equiv_random(seed);
+        aig.simulate(patterns, values);
+        for (size_t index = 0; index < state1.size(); ++index) {
+            uint64_t diff = Aig::value(values, state1[index]) ^
+                            Aig::value(values, state2[index]);
+            if (diff) {
+                int bit = 0;
+                while (!((diff >> bit) & 1))
+                    ++bit;
+                std::vector<bool> inputs(patterns.size());
+                for (size_t input = 0; input < patterns.size(); ++input)
+                    inputs[input] = ((patterns[input] >> bit) & 1) != 0;
+                equiv_counterexample(inputs, state_len, counterexample);
+                return NotEquivalent;
+            }
+        }
+    }
+
+    // Sweep the graph to merge equivalent nodes.
+    Aig swept;
+    std::vector<AigLit> outputs(state1);
+    outputs.insert(outputs.end(), state2.begin(), state2.end());
+    equiv_sweep(aig, swept, outputs, seed);
+
+    // Check the remaining output pairs with their full logic cones.
+    EquivResult result = Equivalent;
+    size_t half = state1.size();
+    for (size_t index = 0; index < half; ++index) {
+        AigLit x = outputs[index];
+        AigLit y = outputs[index + half];
+        if (x == y)
+            continue;
+        std::vector<bool> inputs;
+        SatSolver::Result check = equiv_check
+            (swept, x, y, swept.nodeCount(), EQUIV_FINAL_CONFLICTS, &inputs);
+        if (check == SatSolver::Sat) {
+            equiv_counterexample(inputs, state_len, counterexample);
+            return NotEquivalent;
+        } else if (check == SatSolver::Unknown) {
+            result = EquivUnknown;
+        }
+    }
+    return result;
+}
+
+} // namespace AVR
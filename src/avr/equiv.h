@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef GENAVR_EQUIV_H
+#define GENAVR_EQUIV_H
+
+#include "code.h"
+#include <vector>
+
+namespace AVR
+{
+
+/**
+ * \brief Result of an equivalence check.
+ */
+enum EquivResult
+{
+    Equivalent,         /**< Proven to compute the same function */
+    NotEquivalent,      /**< Counterexample found */
+    EquivUnknown        /**< Resource limits reached without an answer */
+};
+
+EquivResult equivPermutation
+    (const Code &code1, const Code &code2, unsigned state_len,
+     unsigned output_len, unsigned count,
+     std::vector<unsigned char> &counterexample);
+
+} // namespace AVR
+
+#endif
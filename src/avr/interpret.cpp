@@ -25,6 +25,7 @@
 // particularly fast or even a complete AVR simulation.
 
 #include "code.h"
+#include "trace.h"
 #include <stdexcept>
 #include <cstring>
 #include <iostream>
@@ -45,6 +46,11 @@ struct AVRState
     int pc;
     Sbox sbox;
     int sbox_offset;
+    unsigned long cycles;
+    Trace *trace;
+    std::vector<unsigned char> *probes;
+    unsigned mem_address;
+    unsigned mem_count;
 
     AVRState()
     {
@@ -58,6 +64,11 @@ struct AVRState
         pc = 0;
         setPair(32, MEM_SIZE); // Initial stack pointer.
         sbox_offset = 0;
+        cycles = 0;
+        trace = 0;
+        probes = 0;
+        mem_address = 0;
+        mem_count = 0;
     }
 
     unsigned pair(int reg) const
@@ -105,6 +116,8 @@ unsigned char *AVRState::ptr(int reg, unsigned char offset)
     if (address < 0 || address >= MEM_SIZE) {
         throw std::invalid_argument("invalid memory address");
     }
+    if (mem_count++ == 0)
+        mem_address = address;
     return &(memory[address]);
 }
 
@@ -125,21 +138,245 @@ unsigned AVRState::alloc_buffer(const void *data, unsigned len)
     return result;
 }
 
-// Sets the program counter to a new value.
+// Sets the program counter to a new value.  Branch ranges are checked
+// by Code::relax_branches() before the code is run.
 void AVRState::setPC(int newPC)
 {
-    if ((pc < newPC && (newPC - pc) > 2000) ||
-            (pc > newPC && (pc - newPC) > 2000)) {
-        throw std::invalid_argument("relative branch is too large");
-    }
     pc = newPC;
 }
 
-// Executes a single instruction.
-static void exec_insn(AVRState &s, const Code &code, const Insn &insn)
+// Checks that an instruction is valid for the AVRrc reduced core.
+static void check_reduced_core(const Insn &insn)
+{
+    switch (insn.type()) {
+    case Insn::ADIW:
+    case Insn::MOVW:
+    case Insn::SBIW:
+    case Insn::LPM_SBOX:
+    case Insn::LPM_SETUP:
+    case Insn::LPM_SETUP2:
+    case Insn::LPM_SETLOW:
+    case Insn::LPM_SWITCH:
+    case Insn::LPM_ADJUST:
+    case Insn::LPM_OFFSET:
+    case Insn::LPM_CLEAN:
+        throw std::invalid_argument
+            ("instruction is not supported on the reduced core");
+    case Insn::LD_X: case Insn::LD_Y: case Insn::LD_Z:
+    case Insn::ST_X: case Insn::ST_Y: case Insn::ST_Z:
+        if (insn.offset() != 0 && insn.offset() != PRE_DEC &&
+                insn.offset() != POST_INC) {
+            throw std::invalid_argument
+                ("displacement addressing is not supported on the reduced core");
+        }
+        break;
+    default: break;
+    }
+
+    // r0 and r1 are aliases for r16 and r17, which cannot be used directly.
+    if ((insn.hasReg1() && insn.reg1() >= 2 && insn.reg1() < 18) ||
+            (insn.hasReg2() && insn.reg2() >= 2 && insn.reg2() < 18)) {
+        throw std::invalid_argument("register is not present on the reduced core");
+    }
+}
+
+// Gets the number of cycles for an instruction on the core that the code
+// was generated for.  Taken branches and skips add one more cycle, which
+// is handled by exec_insn().  The LPM pseudo-instructions are costed as
+// the sequences that Insn::write() expands them into.  If the device is
+// not known, then we assume that it has "LPM Rd,Z" but no RAMPZ.  Loads
+// from flash that is mapped into the data space have a wait state, so
+// they take as long as "lpm" does.  S-boxes that have been copied into
+// RAM are read with a plain "ld".
+static unsigned insn_cycles(const Code &code, const Insn &insn)
+{
+    bool xt = code.hasFlag(Code::XTCore);
+    bool rc = code.hasFlag(Code::ReducedCore);
+    bool ram = (code.sboxPlacement() == Code::SboxInRAM);
+    bool rampz = code.sbox_uses_rampz() && code.hasFlag(Code::DeviceSpecific);
+    bool lpmr0 = code.hasFlag(Code::DeviceSpecific) &&
+                 !code.hasFlag(Code::HasLPMX) && !code.sbox_in_data_space();
+    unsigned cycles;
+    switch (insn.type()) {
+    case Insn::ADIW:
+    case Insn::SBIW:
+    case Insn::JMP:
+    case Insn::POP:
+        return 2;
+    case Insn::CALL:
+        return xt ? 2 : 3;
+    case Insn::CALL_FUNC:
+        // "rcall" or "call" depending upon what the linker decided.
+        if (rc || code.function_is_near(insn.label()))
+            return xt ? 2 : 3;
+        if (code.hasFlag(Code::DeviceSpecific) &&
+                !code.hasFlag(Code::HasJmpCall))
+            return xt ? 2 : 3;
+        return xt ? 3 : 4;
+    case Insn::RET:
+        return rc ? 6 : 4;
+    case Insn::LD_X: case Insn::LD_Y: case Insn::LD_Z:
+        if (rc)
+            return (insn.offset() == PRE_DEC) ? 2 : 1;
+        return 2;
+    case Insn::ST_X: case Insn::ST_Y: case Insn::ST_Z:
+        if (rc)
+            return (insn.offset() == PRE_DEC) ? 2 : 1;
+        return xt ? 1 : 2;
+    case Insn::PUSH:
+        return (xt || rc) ? 1 : 2;
+    case Insn::LPM_SBOX:
+        cycles = ram ? 2 : 3;
+        if (insn.reg2() != POST_INC && insn.reg2() != 30)
+            ++cycles; // "mov r30,reg2" and then the load.
+        if (lpmr0) {
+            // Plain "lpm" into r0, then "inc r30" and "mov reg1,r0".
+            if (insn.reg2() == POST_INC)
+                ++cycles;
+            if (insn.reg1() != 0)
+                ++cycles;
+        }
+        return cycles;
+    case Insn::LPM_SETUP:
+        // "ldi", "in", "push", and "out" for RAMPZ if the device has it.
+        if (rampz)
+            return xt ? 6 : 7;
+        return 2;
+    case Insn::LPM_SETUP2:
+        if (rampz)
+            return xt ? 5 : 6;
+        return 1;
+    case Insn::LPM_SWITCH:
+        return rampz ? 4 : 2;
+    case Insn::LPM_CLEAN:
+        return rampz ? 3 : 0;
+    case Insn::LPM_OFFSET:
+        return 2;
+    case Insn::LABEL:
+    case Insn::PRINT:
+    case Insn::PRINTCH:
+    case Insn::PRINTLN:
+        return 0;
+    default: break;
+    }
+    return 1;
+}
+
+// Gets the mask of registers that are written by an instruction.
+// Changes to the stack pointer are not included.
+static uint32_t insn_written_regs(const Insn &insn)
+{
+    uint32_t mask = 0;
+    switch (insn.type()) {
+    case Insn::ADIW: case Insn::MOVW: case Insn::SBIW:
+        mask = ((uint32_t)3) << insn.reg1();
+        break;
+    case Insn::LD_X: case Insn::LD_Y: case Insn::LD_Z:
+    case Insn::ST_X: case Insn::ST_Y: case Insn::ST_Z:
+        if (insn.type() == Insn::LD_X || insn.type() == Insn::LD_Y ||
+                insn.type() == Insn::LD_Z)
+            mask = ((uint32_t)1) << insn.reg1();
+        if (insn.offset() == PRE_DEC || insn.offset() == POST_INC) {
+            if (insn.type() == Insn::LD_X || insn.type() == Insn::ST_X)
+                mask |= ((uint32_t)3) << 26;
+            else if (insn.type() == Insn::LD_Y || insn.type() == Insn::ST_Y)
+                mask |= ((uint32_t)3) << 28;
+            else
+                mask |= ((uint32_t)3) << 30;
+        }
+        break;
+    case Insn::LPM_SETUP: case Insn::LPM_SETUP2: case Insn::LPM_SWITCH:
+    case Insn::LPM_OFFSET:
+        mask = ((uint32_t)3) << 30;
+        break;
+    case Insn::LPM_ADJUST:
+        mask = ((uint32_t)1) << 31;
+        break;
+    case Insn::LPM_SBOX:
+        mask = (((uint32_t)1) << insn.reg1()) | (((uint32_t)1) << 30);
+        break;
+    case Insn::CALL_FUNC:
+        // Call-clobbered registers: r0, r18-r27, and r30-r31.
+        mask = 0xCFFC0001U;
+        break;
+    default:
+        if (insn.hasReg1() && insn.type() != Insn::BST &&
+                insn.type() != Insn::CP && insn.type() != Insn::CPC &&
+                insn.type() != Insn::CPI && insn.type() != Insn::CPSE &&
+                insn.type() != Insn::PRINT && insn.type() != Insn::PUSH)
+            mask = ((uint32_t)1) << insn.reg1();
+        break;
+    }
+    return mask;
+}
+
+// Records an instruction in the execution trace.
+static void trace_insn(AVRState &s, const Insn &insn, int pc)
+{
+    TraceEvent event;
+    event.cycles = (uint32_t)(s.cycles);
+    event.regs = insn_written_regs(insn);
+    event.pc = (uint16_t)pc;
+    event.address = (uint16_t)(s.mem_count ? s.mem_address : 0xFFFF);
+    event.type = (uint8_t)(insn.type());
+    event.flags = 0;
+    event.accesses = (uint8_t)(s.mem_count > 255 ? 255 : s.mem_count);
+    event.reserved = 0;
+    if (s.mem_count) {
+        switch (insn.type()) {
+        case Insn::CALL: case Insn::CALL_FUNC: case Insn::PUSH: case Insn::ST_X:
+        case Insn::ST_Y: case Insn::ST_Z:
+            event.flags = Trace::MemWrite;
+            break;
+        case Insn::LPM_SETUP: case Insn::LPM_SETUP2:
+            event.flags = Trace::MemWrite; // Fake RAMPZ push.
+            break;
+        default:
+            event.flags = Trace::MemRead;
+            break;
+        }
+    }
+    s.trace->record(event);
+}
+
+// Records the values of the registers that an instruction wrote as
+// probes for leakage testing.
+static void probe_insn(AVRState &s, const Insn &insn)
+{
+    uint32_t mask = insn_written_regs(insn);
+    for (int reg = 0; reg < 32; ++reg) {
+        if (mask & (((uint32_t)1) << reg))
+            s.probes->push_back(s.r[reg]);
+    }
+}
+
+// Gets the extra cycles for a branch on top of insn_cycles(), depending
+// upon the form that Code::relax_branches() chose for it.  A taken short
+// branch takes one extra cycle.  A long conditional branch is a reverse
+// branch that skips over "rjmp" or "jmp" when not taken, or falls through
+// to the jump when taken.  "jmp" and "call" take one more cycle than
+// "rjmp" and "rcall".
+static unsigned branch_cycles(const Insn &insn, unsigned char form, bool taken)
+{
+    if (insn.type() == Insn::JMP || insn.type() == Insn::CALL)
+        return (form == Code::BranchFar) ? 1 : 0;
+    if (form == Code::BranchShort)
+        return taken ? 1 : 0;
+    if (!taken)
+        return 1;
+    return (form == Code::BranchFar) ? 3 : 2;
+}
+
+// Executes a single instruction.  The form of a branch instruction is
+// needed to determine how many cycles it takes.
+static void exec_insn(AVRState &s, const Code &code, const Insn &insn,
+                      unsigned char form)
 {
     static char const hex[] = "0123456789abcdef";
     unsigned temp;
+    if (code.hasFlag(Code::ReducedCore))
+        check_reduced_core(insn);
+    s.cycles += insn_cycles(code, insn);
     switch (insn.type()) {
     case Insn::ADC:
         // Add with carry in.
@@ -197,29 +434,38 @@ static void exec_insn(AVRState &s, const Code &code, const Insn &insn)
         break; }
     case Insn::BRCC:
         // Branch if carry clear.
+        s.cycles += branch_cycles(insn, form, !s.c);
         if (!s.c)
             s.setPC(code.getLabel(insn.label()));
         break;
     case Insn::BRCS:
         // Branch if carry set.
+        s.cycles += branch_cycles(insn, form, s.c);
         if (s.c)
             s.setPC(code.getLabel(insn.label()));
         break;
     case Insn::BREQ:
         // Branch if equal / zero.
+        s.cycles += branch_cycles(insn, form, s.z);
         if (s.z)
             s.setPC(code.getLabel(insn.label()));
         break;
     case Insn::BRNE:
         // Branch if not equal.
+        s.cycles += branch_cycles(insn, form, !s.z);
         if (!s.z)
             s.setPC(code.getLabel(insn.label()));
         break;
     case Insn::CALL:
         // Call a local subroutine.
+        s.cycles += branch_cycles(insn, form, true);
         s.push16(s.pc);
         s.setPC(code.getLabel(insn.label()));
         break;
+    case Insn::CALL_FUNC:
+        // Call another function from the same template.
+        code.exec_call(s, insn.label());
+        break;
     case Insn::COM:
         // NOT a register.
         s.r[insn.reg1()] ^= 0xFF;
@@ -245,8 +491,10 @@ static void exec_insn(AVRState &s, const Code &code, const Insn &insn)
         break; }
     case Insn::CPSE:
         // Compare and skip if equal.
-        if (s.r[insn.reg1()] == s.r[insn.reg2()])
+        if (s.r[insn.reg1()] == s.r[insn.reg2()]) {
             ++(s.pc);
+            ++(s.cycles);
+        }
         break;
     case Insn::DEC:
         // Decrement a register.
@@ -267,6 +515,7 @@ static void exec_insn(AVRState &s, const Code &code, const Insn &insn)
         break;
     case Insn::JMP:
         // Unconditional jump to a label.
+        s.cycles += branch_cycles(insn, form, true);
         s.setPC(code.getLabel(insn.label()));
         break;
     case Insn::LABEL:
@@ -308,8 +557,11 @@ static void exec_insn(AVRState &s, const Code &code, const Insn &insn)
         s.setPair(30, 0xBE00);
 
         // Push a fake RAMPZ value on the stack to check for stacking
-        // errors later when we do the cleanup.
-        *s.ptr_sp(PRE_DEC) = 0xBA;
+        // errors later when we do the cleanup.  There is no RAMPZ when
+        // the S-boxes are read from RAM or from flash that is mapped
+        // into the data space, or when the device is known to lack it.
+        if (code.sbox_uses_rampz())
+            *s.ptr_sp(PRE_DEC) = 0xBA;
         break;
     case Insn::LPM_SETLOW:
         // Set the low byte of the S-box pointer.
@@ -331,6 +583,8 @@ static void exec_insn(AVRState &s, const Code &code, const Insn &insn)
         break;
     case Insn::LPM_CLEAN:
         // Pop the RAMPZ value, which we expect to be 0xBA.
+        if (!code.sbox_uses_rampz())
+            break;
         temp = *s.ptr_sp(POST_INC);
         if (temp != 0xBA)
             throw std::invalid_argument("RAMPZ stacking error");
@@ -479,6 +733,134 @@ static void exec_insn(AVRState &s, const Code &code, const Insn &insn)
     }
 }
 
+/**
+ * \brief Counts the cycles for a straight-line run of instructions
+ * without executing them.
+ *
+ * \param first Index of the first instruction to count.
+ *
+ * \return The number of cycles from \a first to the end of the code,
+ * according to the same timing model as cycles().  Branches are counted
+ * as not taken.
+ */
+unsigned long Code::straight_line_cycles(int first) const
+{
+    unsigned long cycles = 0;
+    for (int index = first; index < (int)(m_insns.size()); ++index)
+        cycles += insn_cycles(*this, m_insns[index]);
+    return cycles;
+}
+
+/**
+ * \brief Executes a call to another function from the same template.
+ *
+ * \param s The state of the interpreter for the caller.
+ * \param index Index of the called function.
+ *
+ * The prologue and epilogue that write() adds to the called function
+ * are emulated so that the arguments arrive in the expected registers
+ * and the call-saved registers are preserved for the caller.
+ */
+void Code::exec_call(AVRState &s, unsigned char index) const
+{
+    if (index >= m_calls.size())
+        throw std::invalid_argument("invalid function reference");
+    const Code *callee = m_callCode[index];
+    if (!callee) {
+        throw std::invalid_argument
+            ("call to unlinked function '" + m_calls[index] + "'");
+    }
+
+    // Push the return address and the registers that the callee saves.
+    unsigned saved = 0x0003FFFC;
+    if (callee->hasFlag(ReducedCore))
+        saved = 0x003C0000;
+    saved &= callee->m_usedRegs;
+    if (!callee->hasFlag(NoLocals) || callee->hasFlag(TempY))
+        saved |= 0x30000000;
+    s.push16(0xFFFF);
+    for (int reg = 0; reg < 32; ++reg) {
+        if (saved & (1U << reg))
+            *s.ptr_sp(PRE_DEC) = s.r[reg];
+    }
+
+    // Move the arguments into the pointer registers.
+    unsigned extras = 0;
+    unsigned arg1 = s.pair(24);
+    unsigned arg2 = s.pair(22);
+    unsigned arg3 = s.pair(20);
+    switch (callee->m_prologueType) {
+    case EncryptBlock:
+        s.push16(arg2);
+        extras = 2;
+        s.setPair(30, arg1);
+        s.setPair(26, arg3);
+        break;
+    case EncryptBlockKey2:
+        s.push16(arg1);
+        extras = 2;
+        s.setPair(30, arg2);
+        s.setPair(26, arg3);
+        break;
+    case KeySetup:
+        s.setPair(30, arg1);
+        s.setPair(26, arg2);
+        break;
+    case KeySetupReversed:
+        s.setPair(30, arg2);
+        s.setPair(26, arg1);
+        break;
+    case Permutation:
+        s.setPair(30, arg1);
+        break;
+    case PermutationMasked:
+        s.push16(arg3);
+        extras = 2;
+        s.setPair(30, arg1);
+        s.setPair(26, arg3);
+        break;
+    case TinyJAMBU:
+        s.setPair(26, arg1);
+        s.setPair(30, arg2);
+        break;
+    }
+    unsigned fp = s.pair(32) - callee->m_localsSize - 1;
+    if (saved & 0x30000000)
+        s.setPair(28, fp);
+    s.setPair(32, fp);
+
+    // Run the body of the callee.  The trace only covers the caller.
+    int pc = s.pc;
+    Trace *trace = s.trace;
+    s.pc = 0;
+    s.trace = 0;
+    int size = callee->m_insns.size();
+    std::vector<unsigned char> forms = callee->relax_branches();
+    while (s.pc != size) {
+        if (s.pc < 0 || s.pc > size)
+            throw std::invalid_argument("program counter out of range");
+        int callee_pc = (s.pc)++;
+        s.mem_count = 0;
+        exec_insn(s, *callee, callee->m_insns[callee_pc], forms[callee_pc]);
+    }
+    s.pc = pc;
+    s.trace = trace;
+    if (callee->hasFlag(TempR1))
+        s.r[1] = 0;
+    else if (s.r[1] != 0x00)
+        throw std::invalid_argument("r1 is non-zero at the end of the code");
+    if (s.pair(32) != fp)
+        throw std::invalid_argument("stack size is incorrect on code exit");
+
+    // Pop the stack frame, the saved registers, and the return address.
+    s.setPair(32, fp + callee->m_localsSize + 1 + extras);
+    for (int reg = 31; reg >= 0; --reg) {
+        if (saved & (1U << reg))
+            s.r[reg] = *s.ptr_sp(POST_INC);
+    }
+    s.setPair(32, s.pair(32) + 2);
+}
+
 /**
  * \brief Executes the code in this object as a key setup function.
  *
@@ -491,6 +873,10 @@ void Code::exec_setup_key(void *schedule, unsigned schedule_len,
                           const void *key, unsigned key_len)
 {
     AVRState s;
+    s.trace = m_trace;
+    s.probes = m_probes;
+    if (m_trace)
+        m_trace->begin(m_name);
     unsigned schedule_address = s.alloc_buffer(schedule_len);
     unsigned key_address = s.alloc_buffer(key, key_len);
     s.setPair(30, schedule_address);    // Z = schedule
@@ -499,16 +885,24 @@ void Code::exec_setup_key(void *schedule, unsigned schedule_len,
     unsigned fp = s.pair(32) - m_localsSize - 1;
     s.setPair(28, fp);                  // Y = frame pointer
     s.setPair(32, fp);
+    std::vector<unsigned char> forms = relax_branches();
     while (s.pc != (int)m_insns.size()) {
         if (s.pc < 0 || s.pc > (int)m_insns.size())
             throw std::invalid_argument("program counter out of range");
-        Insn insn = m_insns[(s.pc)++];
-        exec_insn(s, *this, insn);
+        int pc = (s.pc)++;
+        Insn insn = m_insns[pc];
+        s.mem_count = 0;
+        exec_insn(s, *this, insn, forms[pc]);
+        if (s.trace)
+            trace_insn(s, insn, pc);
+        if (s.probes)
+            probe_insn(s, insn);
     }
     if (s.r[1] != 0x00 && !hasFlag(TempR1))
         throw std::invalid_argument("r1 is non-zero at the end of the code");
     if (s.pair(32) != fp)
         throw std::invalid_argument("stack size is incorrect on code exit");
+    m_cycles = s.cycles;
     memcpy(schedule, &(s.memory[schedule_address]), schedule_len);
 }
 
@@ -529,6 +923,10 @@ void Code::exec_encrypt_block(const void *key, unsigned key_len,
                               unsigned tweak)
 {
     AVRState s;
+    s.trace = m_trace;
+    s.probes = m_probes;
+    if (m_trace)
+        m_trace->begin(m_name);
     unsigned key_address = s.alloc_buffer(key, key_len);
     unsigned output_address = s.alloc_buffer(output_len);
     unsigned input_address = s.alloc_buffer(input, input_len);
@@ -540,16 +938,24 @@ void Code::exec_encrypt_block(const void *key, unsigned key_len,
     s.setPair(28, fp);              // Y = frame pointer
     s.setPair(32, fp);
     s.setPair(18, tweak);
+    std::vector<unsigned char> forms = relax_branches();
     while (s.pc != (int)m_insns.size()) {
         if (s.pc < 0 || s.pc > (int)m_insns.size())
             throw std::invalid_argument("program counter out of range");
-        Insn insn = m_insns[(s.pc)++];
-        exec_insn(s, *this, insn);
+        int pc = (s.pc)++;
+        Insn insn = m_insns[pc];
+        s.mem_count = 0;
+        exec_insn(s, *this, insn, forms[pc]);
+        if (s.trace)
+            trace_insn(s, insn, pc);
+        if (s.probes)
+            probe_insn(s, insn);
     }
     if (s.r[1] != 0x00 && !hasFlag(TempR1))
         throw std::invalid_argument("r1 is non-zero at the end of the code");
     if (s.pair(32) != fp)
         throw std::invalid_argument("stack size is incorrect on code exit");
+    m_cycles = s.cycles;
     memcpy(output, &(s.memory[output_address]), output_len);
 }
 
@@ -572,6 +978,10 @@ void Code::exec_encrypt_block_with_tweak_ptr
              const  void *tweak, unsigned tweak_len)
 {
     AVRState s;
+    s.trace = m_trace;
+    s.probes = m_probes;
+    if (m_trace)
+        m_trace->begin(m_name);
     unsigned key_address = s.alloc_buffer(key, key_len);
     unsigned output_address = s.alloc_buffer(output_len);
     unsigned input_address = s.alloc_buffer(input, input_len);
@@ -584,16 +994,24 @@ void Code::exec_encrypt_block_with_tweak_ptr
     s.setPair(28, fp);              // Y = frame pointer
     s.setPair(32, fp);
     s.setPair(18, tweak_address);
+    std::vector<unsigned char> forms = relax_branches();
     while (s.pc != (int)m_insns.size()) {
         if (s.pc < 0 || s.pc > (int)m_insns.size())
             throw std::invalid_argument("program counter out of range");
-        Insn insn = m_insns[(s.pc)++];
-        exec_insn(s, *this, insn);
+        int pc = (s.pc)++;
+        Insn insn = m_insns[pc];
+        s.mem_count = 0;
+        exec_insn(s, *this, insn, forms[pc]);
+        if (s.trace)
+            trace_insn(s, insn, pc);
+        if (s.probes)
+            probe_insn(s, insn);
     }
     if (s.r[1] != 0x00 && !hasFlag(TempR1))
         throw std::invalid_argument("r1 is non-zero at the end of the code");
     if (s.pair(32) != fp)
         throw std::invalid_argument("stack size is incorrect on code exit");
+    m_cycles = s.cycles;
     memcpy(output, &(s.memory[output_address]), output_len);
 }
 
@@ -611,7 +1029,12 @@ void Code::exec_permutation
     (void *state, unsigned state_len, unsigned count,
      unsigned arg2, unsigned arg3, unsigned arg4)
 {
+    check_specialised(count);
     AVRState s;
+    s.trace = m_trace;
+    s.probes = m_probes;
+    if (m_trace)
+        m_trace->begin(m_name);
     unsigned state_address = s.alloc_buffer(state, state_len);
     s.setPair(30, state_address);   // Z = state
     s.push16(0xFFFF);               // return address
@@ -622,16 +1045,24 @@ void Code::exec_permutation
     s.setPair(20, arg2);
     s.setPair(18, arg3);
     s.setPair(16, arg4);
+    std::vector<unsigned char> forms = relax_branches();
     while (s.pc != (int)m_insns.size()) {
         if (s.pc < 0 || s.pc > (int)m_insns.size())
             throw std::invalid_argument("program counter out of range");
-        Insn insn = m_insns[(s.pc)++];
-        exec_insn(s, *this, insn);
+        int pc = (s.pc)++;
+        Insn insn = m_insns[pc];
+        s.mem_count = 0;
+        exec_insn(s, *this, insn, forms[pc]);
+        if (s.trace)
+            trace_insn(s, insn, pc);
+        if (s.probes)
+            probe_insn(s, insn);
     }
     if (s.r[1] != 0x00 && !hasFlag(TempR1))
         throw std::invalid_argument("r1 is non-zero at the end of the code");
     if (s.pair(32) != fp)
         throw std::invalid_argument("stack size is incorrect on code exit");
+    m_cycles = s.cycles;
     memcpy(state, &(s.memory[state_address]), state_len);
 }
 
@@ -648,7 +1079,12 @@ void Code::exec_masked_permutation
     (void *state, unsigned state_len, unsigned count,
      void *preserve, unsigned preserve_len)
 {
+    check_specialised(count);
     AVRState s;
+    s.trace = m_trace;
+    s.probes = m_probes;
+    if (m_trace)
+        m_trace->begin(m_name);
     unsigned state_address = s.alloc_buffer(state, state_len);
     unsigned preserve_address = s.alloc_buffer(preserve, preserve_len);
     s.setPair(30, state_address);   // Z = state
@@ -659,16 +1095,24 @@ void Code::exec_masked_permutation
     s.setPair(28, fp);              // Y = frame pointer
     s.setPair(32, fp);
     s.setPair(22, count);           // Pass the count parameter in r22:r23
+    std::vector<unsigned char> forms = relax_branches();
     while (s.pc != (int)m_insns.size()) {
         if (s.pc < 0 || s.pc > (int)m_insns.size())
             throw std::invalid_argument("program counter out of range");
-        Insn insn = m_insns[(s.pc)++];
-        exec_insn(s, *this, insn);
+        int pc = (s.pc)++;
+        Insn insn = m_insns[pc];
+        s.mem_count = 0;
+        exec_insn(s, *this, insn, forms[pc]);
+        if (s.trace)
+            trace_insn(s, insn, pc);
+        if (s.probes)
+            probe_insn(s, insn);
     }
     if (s.r[1] != 0x00 && !hasFlag(TempR1))
         throw std::invalid_argument("r1 is non-zero at the end of the code");
     if (s.pair(32) != fp)
         throw std::invalid_argument("stack size is incorrect on code exit");
+    m_cycles = s.cycles;
     memcpy(state, &(s.memory[state_address]), state_len);
     memcpy(preserve, &(s.memory[preserve_address]), preserve_len);
 }
@@ -686,7 +1130,12 @@ void Code::exec_tinyjambu
     (void *state, unsigned state_len, const void *key,
      unsigned key_len, unsigned rounds)
 {
+    check_specialised(rounds / 128);
     AVRState s;
+    s.trace = m_trace;
+    s.probes = m_probes;
+    if (m_trace)
+        m_trace->begin(m_name);
     unsigned state_address = s.alloc_buffer(state, state_len);
     unsigned key_address = s.alloc_buffer(key, key_len);
     s.setPair(26, state_address);   // X = state
@@ -696,16 +1145,24 @@ void Code::exec_tinyjambu
     unsigned fp = s.pair(32) - m_localsSize - 1;
     s.setPair(28, fp);              // Y = frame pointer
     s.setPair(32, fp);
+    std::vector<unsigned char> forms = relax_branches();
     while (s.pc != (int)m_insns.size()) {
         if (s.pc < 0 || s.pc > (int)m_insns.size())
             throw std::invalid_argument("program counter out of range");
-        Insn insn = m_insns[(s.pc)++];
-        exec_insn(s, *this, insn);
+        int pc = (s.pc)++;
+        Insn insn = m_insns[pc];
+        s.mem_count = 0;
+        exec_insn(s, *this, insn, forms[pc]);
+        if (s.trace)
+            trace_insn(s, insn, pc);
+        if (s.probes)
+            probe_insn(s, insn);
     }
     if (s.r[1] != 0x00 && !hasFlag(TempR1))
         throw std::invalid_argument("r1 is non-zero at the end of the code");
     if (s.pair(32) != fp)
         throw std::invalid_argument("stack size is incorrect on code exit");
+    m_cycles = s.cycles;
     memcpy(state, &(s.memory[state_address]), state_len);
 }
 
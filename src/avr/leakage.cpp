@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "leakage.h"
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+// The harness runs the code in the interpreter on two fixed inputs,
+// with fresh random shares and preserved randomness every time, and
+// records the value of every register that every instruction writes.
+// Each bit of each probe is then compared between the two inputs with
+// Welch's t-test, as in the TVLA methodology.  Under the first-order
+// probing model, no single intermediate value should depend on which
+// of the inputs was used.
+
+// Threshold for the absolute value of the t statistic.
+#define LEAKAGE_THRESHOLD 4.5
+
+// Size of the words in the masked state.  Share i of word w is at
+// offset (w * shares + i) * LEAKAGE_WORD_SIZE.
+#define LEAKAGE_WORD_SIZE 8
+
+namespace AVR
+{
+
+// Generates pseudorandom numbers with the SplitMix64 algorithm.  The
+// tests need to be repeatable, so this is used instead of rand().
+static uint64_t leakage_random(uint64_t &seed)
+{
+    uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * \brief Tests a masked permutation for first-order leakage.
+ *
+ * \param code The code for the masked permutation.
+ * \param state_len Length of the unmasked state in bytes, which must be
+ * a multiple of 8.
+ * \param shares Number of shares in the masked state.
+ * \param preserve_len Length of the preserved randomness in bytes.
+ * \param count Count parameter to pass to the permutation; e.g. the
+ * first round.
+ * \param runs Number of times to run the permutation.
+ * \param report Returns the details of the test.
+ *
+ * \return Returns true if no leakage was detected, or false otherwise.
+ *
+ * Only leakage of register values is checked.  Transitions between the
+ * old and new values of a register are not modelled.
+ */
+bool leakageMaskedPermutation
+    (Code &code, unsigned state_len, unsigned shares, unsigned preserve_len,
+     unsigned count, unsigned long runs, LeakageReport &report)
+{
+    if (!state_len || (state_len % LEAKAGE_WORD_SIZE) != 0 || shares < 1)
+        throw std::invalid_argument("invalid masked state size");
+
+    // The first class is the all-zero state and the second is random.
+    uint64_t seed = 0x6A09E667F3BCC908ULL;
+    std::vector<unsigned char> inputs[2];
+    for (unsigned index = 0; index < state_len; ++index) {
+        inputs[0].push_back(0);
+        inputs[1].push_back((unsigned char)leakage_random(seed));
+    }
+
+    // Run the code and count the one bits in every probe for each class.
+    std::vector<unsigned char> state(state_len * shares);
+    std::vector<unsigned char> preserve(preserve_len + 1);
+    std::vector<unsigned char> probes;
+    std::vector<unsigned long> ones[2];
+    unsigned long totals[2] = {0, 0};
+    unsigned long num_probes = 0;
+    for (unsigned long run = 0; run < runs; ++run) {
+        unsigned cls = (unsigned)(leakage_random(seed) & 1);
+        for (unsigned index = 0; index < state_len; ++index) {
+            unsigned word = index / LEAKAGE_WORD_SIZE;
+            unsigned offset = index % LEAKAGE_WORD_SIZE;
+            unsigned char value = inputs[cls][index];
+            for (unsigned share = 1; share < shares; ++share) {
+                unsigned char random = (unsigned char)leakage_random(seed);
+                state[(word * shares + share) * LEAKAGE_WORD_SIZE + offset]
+                    = random;
+                value ^= random;
+            }
+            state[word * shares * LEAKAGE_WORD_SIZE + offset] = value;
+        }
+        for (unsigned index = 0; index < preserve_len; ++index)
+            preserve[index] = (unsigned char)leakage_random(seed);
+        probes.clear();
+        code.setProbes(&probes);
+        try {
+            code.exec_masked_permutation
+                (state.data(), state.size(), count,
+                 preserve.data(), preserve_len);
+        } catch (...) {
+            code.setProbes(0);
+            throw;
+        }
+        code.setProbes(0);
+        if (run == 0) {
+            num_probes = probes.size();
+            ones[0].resize(num_probes * 8);
+            ones[1].resize(num_probes * 8);
+        } else if (probes.size() != num_probes) {
+            throw std::invalid_argument
+                ("the instructions that are executed depend upon the input");
+        }
+        for (unsigned long probe = 0; probe < num_probes; ++probe) {
+            unsigned char value = probes[probe];
+            for (unsigned bit = 0; bit < 8; ++bit) {
+                if (value & (1 << bit))
+                    ++(ones[cls][probe * 8 + bit]);
+            }
+        }
+        ++(totals[cls]);
+    }
+    if (totals[0] < 2 || totals[1] < 2)
+        throw std::invalid_argument("not enough runs for a leakage test");
+
+    // Compare the bit frequencies between the classes.
+    report.runs = runs;
+    report.probes = num_probes;
+    report.leaks = 0;
+    report.first = 0;
+    report.worst = 0;
+    report.max_t = 0.0;
+    for (unsigned long probe = 0; probe < num_probes; ++probe) {
+        bool leaks = false;
+        for (unsigned bit = 0; bit < 8; ++bit) {
+            double n0 = (double)(totals[0]);
+            double n1 = (double)(totals[1]);
+            double m0 = ones[0][probe * 8 + bit] / n0;
+            double m1 = ones[1][probe * 8 + bit] / n1;
+            double v0 = m0 * (1.0 - m0) * n0 / (n0 - 1.0);
+            double v1 = m1 * (1.0 - m1) * n1 / (n1 - 1.0);
+            double t;
+            if ((v0 + v1) == 0.0) {
+                // Constant in both classes, so the means say it all.
+                t = (m0 == m1) ? 0.0 : HUGE_VAL;
+            } else {
+                t = fabs(m0 - m1) / sqrt(v0 / n0 + v1 / n1);
+            }
+            if (t > report.max_t) {
+                report.max_t = t;
+                report.worst = probe;
+            }
+            if (t > LEAKAGE_THRESHOLD)
+                leaks = true;
+        }
+        if (leaks) {
+            if (!report.leaks)
+                report.first = probe;
+            ++(report.leaks);
+        }
+    }
+    return report.leaks == 0;
+}
+
+} // namespace AVR
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef GENAVR_LEAKAGE_H
+#define GENAVR_LEAKAGE_H
+
+#include "code.h"
+
+namespace AVR
+{
+
+/**
+ * \brief Results of a leakage test.
+ */
+struct LeakageReport
+{
+    unsigned long runs;     /**< Number of runs of the code */
+    unsigned long probes;   /**< Number of probes in every run */
+    unsigned long leaks;    /**< Number of probes that leak */
+    unsigned long first;    /**< Index of the first probe that leaks */
+    unsigned long worst;    /**< Index of the probe with the largest t */
+    double max_t;           /**< Largest absolute t statistic */
+};
+
+bool leakageMaskedPermutation
+    (Code &code, unsigned state_len, unsigned shares, unsigned preserve_len,
+     unsigned count, unsigned long runs, LeakageReport &report);
+
+} // namespace AVR
+
+#endif
@@ -0,0 +1,334 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "linker.h"
+#include <sstream>
+#include <stdexcept>
+
+namespace AVR
+{
+
+// Maximum distance in bytes that "rcall" can reach in either direction.
+#define RCALL_RANGE 4094
+
+Linker::Linker()
+    : m_textSize(0)
+{
+}
+
+Linker::~Linker()
+{
+}
+
+/**
+ * \brief Gets the maximum size of the code for a function in bytes.
+ *
+ * \param code The code for the function.
+ *
+ * \return The maximum size, including the prologue and epilogue.
+ *
+ * The size is computed from the output of Code::write().  All
+ * alternatives of "#if" blocks are counted, so the result is an
+ * upper bound on the size for any specific device.
+ */
+unsigned Linker::maxSize(const Code &code)
+{
+    if (code.size() == 0)
+        return 0; // S-box tables only, which are in a different section.
+    std::ostringstream stream;
+    code.write(stream);
+    std::istringstream lines(stream.str());
+    std::string line;
+    unsigned size = 0;
+    while (std::getline(lines, line)) {
+        if (line.size() < 2 || line[0] != '\t' || line[1] == '.')
+            continue; // Labels, directives, and preprocessor lines.
+        std::string mnemonic = line.substr(1, line.find(' ') - 1);
+        if (mnemonic == "call" || mnemonic == "jmp" ||
+                mnemonic == "lds" || mnemonic == "sts")
+            size += 4;
+        else
+            size += 2;
+    }
+    return size;
+}
+
+/**
+ * \brief Resolves the calls and S-box tables for the functions
+ * in this linker.
+ *
+ * Throws an exception if a function calls another function that is not
+ * part of the same template.
+ */
+void Linker::link()
+{
+    linkTables();
+    placeTables();
+    linkCalls();
+}
+
+// Resolves the calls between the functions in the template.
+void Linker::linkCalls()
+{
+    // Find the maximum size of the ".text" section, assuming the
+    // long form of all calls until we know better.
+    m_textSize = 0;
+    for (size_t index = 0; index < m_functions.size(); ++index)
+        m_textSize += maxSize(*(m_functions[index]));
+    bool near = (m_textSize <= RCALL_RANGE);
+
+    // Resolve the calls.  If the same name appears multiple times in
+    // the template under different conditions, then use the first.
+    for (size_t index = 0; index < m_functions.size(); ++index) {
+        Code *code = m_functions[index];
+        for (unsigned call = 0; call < code->function_count(); ++call) {
+            const std::string &name = code->function_name(call);
+            const Code *callee = 0;
+            for (size_t posn = 0; posn < m_functions.size(); ++posn) {
+                if (m_functions[posn]->size() != 0 &&
+                        m_functions[posn]->name() == name) {
+                    callee = m_functions[posn];
+                    break;
+                }
+            }
+            if (!callee) {
+                throw std::invalid_argument
+                    ("call to unknown function '" + name + "'");
+            }
+            code->link_function(call, callee, near);
+        }
+    }
+}
+
+// Hashes the contents of an S-box table with FNV-1a.
+static unsigned long hashSbox(const Sbox &sbox)
+{
+    unsigned long hash = 2166136261UL;
+    for (int index = 0; index < sbox.size(); ++index) {
+        hash ^= sbox.lookup(index);
+        hash = (hash * 16777619UL) & 0xFFFFFFFFUL;
+    }
+    return hash;
+}
+
+// Determine if one preprocessor context is nested inside another.
+static bool isNestedIn(const std::string &inner, const std::string &outer)
+{
+    return inner.compare(0, outer.size(), outer) == 0;
+}
+
+/**
+ * \brief Determine if a table must be aligned on a 256-byte boundary.
+ *
+ * Tables that are indexed by placing a value into the low byte of Z
+ * must be aligned.  Tables of 256 bytes or more, or that no function
+ * refers to, are also aligned to be safe.
+ */
+bool Linker::Table::aligned() const
+{
+    return indexed || !referenced || sbox.size() >= 256;
+}
+
+// Finds an existing table with specific contents and placement that is
+// visible from a particular preprocessor context.  Returns -1 if there
+// is no such table.
+int Linker::findTable
+    (const Sbox &sbox, unsigned long hash, const std::string &context,
+     Code::SboxPlacement placement) const
+{
+    for (size_t index = 0; index < m_tables.size(); ++index) {
+        const Table &table = m_tables[index];
+        if (table.hash == hash && table.sbox == sbox &&
+                table.placement == placement &&
+                isNestedIn(context, table.context))
+            return index;
+    }
+    return -1;
+}
+
+// Assigns symbols to the S-box tables that are defined by the template
+// and then points the references in the other functions at them.
+void Linker::linkTables()
+{
+    // Collect the unique tables from the functions that only define tables.
+    // A table is only shared with an earlier definition if the earlier
+    // definition will be present whenever the later one is, and if both
+    // definitions ask for the same placement.
+    m_tables.clear();
+    for (size_t index = 0; index < m_functions.size(); ++index) {
+        Code *code = m_functions[index];
+        if (code->size() != 0)
+            continue;
+        const std::map<unsigned char, Sbox> &sboxes = code->sboxes();
+        std::map<unsigned char, Sbox>::const_iterator it;
+        for (it = sboxes.begin(); it != sboxes.end(); ++it) {
+            unsigned long hash = hashSbox(it->second);
+            int posn = findTable(it->second, hash, m_contexts[index],
+                                 code->sboxPlacement());
+            if (posn < 0) {
+                Table table;
+                table.sbox = it->second;
+                table.name = "table_" + std::to_string(m_tables.size());
+                table.context = m_contexts[index];
+                table.owner = code;
+                table.placement = code->sboxPlacement();
+                table.hash = hash;
+                table.referenced = false;
+                table.indexed = false;
+                m_tables.push_back(table);
+                posn = m_tables.size() - 1;
+            }
+            code->sbox_set_name(it->first, m_tables[posn].name);
+        }
+    }
+
+    // Resolve the references to the tables.  References to tables that
+    // are not defined by the template keep their default names.
+    for (size_t index = 0; index < m_functions.size(); ++index) {
+        Code *code = m_functions[index];
+        if (code->size() == 0)
+            continue;
+        bool indexed = code->sbox_indexed();
+        const std::map<unsigned char, Sbox> &sboxes = code->sboxes();
+        std::map<unsigned char, Sbox>::const_iterator it;
+        for (it = sboxes.begin(); it != sboxes.end(); ++it) {
+            unsigned long hash = hashSbox(it->second);
+            int posn = findTable(it->second, hash, m_contexts[index],
+                                 code->sboxPlacement());
+            if (posn < 0) {
+                // Not visible from this context, so use any definition.
+                for (size_t other = 0; posn < 0 &&
+                        other < m_tables.size(); ++other) {
+                    const Table &candidate = m_tables[other];
+                    if (candidate.hash == hash &&
+                            candidate.sbox == it->second &&
+                            candidate.placement == code->sboxPlacement())
+                        posn = other;
+                }
+                if (posn < 0)
+                    continue;
+            }
+            Table &table = m_tables[posn];
+            table.referenced = true;
+            if (indexed)
+                table.indexed = true;
+            code->sbox_set_name(it->first, table.name);
+        }
+    }
+}
+
+// Resolves automatic S-box placement to either flash or RAM.  All of
+// the functions in a template that ask for automatic placement must agree
+// on where the tables live, so the decision is based on the total size
+// of those tables in the template.
+void Linker::placeTables()
+{
+    unsigned size = 0;
+    bool haveTables = false;
+    for (size_t index = 0; index < m_tables.size(); ++index) {
+        const Table &table = m_tables[index];
+        if (table.placement != Code::SboxAuto)
+            continue;
+        haveTables = true;
+        if (table.aligned())
+            size += (table.sbox.size() + 255) & ~255;
+        else
+            size += table.sbox.size();
+    }
+    for (size_t index = 0; index < m_functions.size(); ++index) {
+        Code *code = m_functions[index];
+        if (code->sboxPlacement() != Code::SboxAuto)
+            continue;
+        if (haveTables && size <= code->sboxBudget())
+            code->setSboxPlacement(Code::SboxInRAM, code->sboxBudget());
+        else
+            code->setSboxPlacement(Code::SboxInFlash, code->sboxBudget());
+    }
+}
+
+/**
+ * \brief Gets the S-box tables that are owned by a function, in the
+ * order in which they should be placed.
+ *
+ * \param code The code for the function.
+ *
+ * \return The tables to place.
+ *
+ * Aligned tables come first.  If an aligned table is not a multiple of
+ * 256 bytes in size, then unaligned tables are packed into the gap after
+ * it where they fit.  Any remaining unaligned tables come at the end.
+ */
+std::vector<Linker::Placement> Linker::tables(const Code &code) const
+{
+    std::vector<const Table *> aligned;
+    std::vector<const Table *> unaligned;
+    std::vector<Placement> result;
+    for (size_t index = 0; index < m_tables.size(); ++index) {
+        const Table &table = m_tables[index];
+        if (table.owner != &code)
+            continue;
+        if (table.aligned())
+            aligned.push_back(&table);
+        else
+            unaligned.push_back(&table);
+    }
+    for (size_t index = 0; index < aligned.size(); ++index) {
+        const Table *table = aligned[index];
+        result.push_back(Placement(table->name, table->sbox, true));
+        int gap = (256 - (table->sbox.size() % 256)) % 256;
+        size_t posn = 0;
+        while (gap > 0 && posn < unaligned.size()) {
+            const Table *fill = unaligned[posn];
+            if (fill->sbox.size() <= gap) {
+                result.push_back(Placement(fill->name, fill->sbox, false));
+                gap -= fill->sbox.size();
+                unaligned.erase(unaligned.begin() + posn);
+            } else {
+                ++posn;
+            }
+        }
+    }
+    for (size_t index = 0; index < unaligned.size(); ++index) {
+        const Table *table = unaligned[index];
+        result.push_back(Placement(table->name, table->sbox, false));
+    }
+    return result;
+}
+
+/**
+ * \brief Writes the S-box tables that are owned by a function.
+ *
+ * \param ostream The stream to write to.
+ * \param code The code for the function.
+ *
+ * \sa tables()
+ */
+void Linker::writeTables(std::ostream &ostream, const Code &code) const
+{
+    std::vector<Placement> list = tables(code);
+    for (size_t index = 0; index < list.size(); ++index) {
+        code.sbox_write(ostream, list[index].name, list[index].sbox,
+                        list[index].aligned);
+    }
+}
+
+} // namespace AVR
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef GENAVR_LINKER_H
+#define GENAVR_LINKER_H
+
+#include "code.h"
+#include <string>
+#include <vector>
+
+namespace AVR
+{
+
+/**
+ * \brief Links the functions that are generated from a single template.
+ *
+ * All functions in a template are assembled into the same ".text"
+ * section of the same object file, so they stay together in the final
+ * image.  Calls between them can use "rcall" instead of "call" when the
+ * whole section is within the range of "rcall", which saves 2 bytes
+ * and a cycle per call.
+ *
+ * The linker also assigns symbols to the S-box tables in the template.
+ * Tables with the same contents are emitted once and shared, and tables
+ * that are only read sequentially are packed into the alignment gaps
+ * that are left after tables smaller than 256 bytes.  If the functions
+ * ask for automatic S-box placement, then the tables are put into RAM
+ * when they all fit within the RAM budget.
+ */
+class Linker
+{
+public:
+    Linker();
+    ~Linker();
+
+    /**
+     * \brief Adds a function to this linker.
+     *
+     * \param code The code for the function, which must stay valid
+     * until the template has been processed.
+     * \param context Identifies the preprocessor conditionals in the
+     * template that the function is nested within, as a sequence of
+     * "block.branch/" entries.  The empty string is the top level.
+     *
+     * Functions should be added in the order in which they appear
+     * in the template.
+     */
+    void add(Code *code, const std::string &context = std::string())
+    {
+        m_functions.push_back(code);
+        m_contexts.push_back(context);
+    }
+
+    void link();
+
+    /**
+     * \brief Information about where to place an S-box table.
+     */
+    struct Placement
+    {
+        std::string name;   /**< Symbol for the table */
+        Sbox sbox;          /**< Contents of the table */
+        bool aligned;       /**< Table is aligned on a 256-byte boundary */
+
+        Placement(const std::string &n, const Sbox &s, bool a)
+            : name(n), sbox(s), aligned(a) {}
+    };
+
+    std::vector<Placement> tables(const Code &code) const;
+    void writeTables(std::ostream &ostream, const Code &code) const;
+
+    /**
+     * \brief Gets the maximum size of the ".text" section in bytes,
+     * as computed by the last call to link().
+     */
+    unsigned textSize() const { return m_textSize; }
+
+    static unsigned maxSize(const Code &code);
+
+private:
+    struct Table
+    {
+        Sbox sbox;
+        std::string name;
+        std::string context;
+        const Code *owner;
+        Code::SboxPlacement placement;
+        unsigned long hash;
+        bool referenced;
+        bool indexed;
+
+        bool aligned() const;
+    };
+
+    std::vector<Code *> m_functions;
+    std::vector<std::string> m_contexts;
+    std::vector<Table> m_tables;
+    unsigned m_textSize;
+
+    void linkCalls();
+    void linkTables();
+    void placeTables();
+    int findTable(const Sbox &sbox, unsigned long hash,
+                  const std::string &context,
+                  Code::SboxPlacement placement) const;
+};
+
+} // namespace AVR
+
+#endif
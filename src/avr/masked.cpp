@@ -0,0 +1,797 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "masked.h"
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
+namespace AVR
+{
+
+// Merges the sorted gadget numbers in "src" into "dest".
+static void masked_merge
+    (std::vector<unsigned> &dest, const std::vector<unsigned> &src)
+{
+    std::vector<unsigned> result;
+    std::set_union(dest.begin(), dest.end(), src.begin(), src.end(),
+                   std::back_inserter(result));
+    dest.swap(result);
+}
+
+/**
+ * \brief Constructs a subset of the bytes in a shared register.
+ *
+ * \param other The other shared register.
+ * \param offset Offset of the first byte of every share to include.
+ * \param count Number of bytes to include from every share.
+ */
+SharedReg::SharedReg
+        (const SharedReg &other, unsigned char offset, unsigned char count)
+{
+    for (unsigned index = 0; index < other.shares(); ++index)
+        m_shares.push_back(Reg(other.m_shares[index], offset, count));
+}
+
+/**
+ * \brief Gets a byte-reversed version of this shared register.
+ *
+ * \return The byte-reversed version, with every share reversed.
+ */
+SharedReg SharedReg::reversed() const
+{
+    SharedReg result;
+    for (unsigned index = 0; index < shares(); ++index)
+        result.m_shares.push_back(m_shares[index].reversed());
+    return result;
+}
+
+MaskedRandomPlan::MaskedRandomPlan()
+    : m_fresh(0)
+    , m_optimised(false)
+{
+}
+
+MaskedRandomPlan::~MaskedRandomPlan()
+{
+}
+
+/**
+ * \brief Assigns random bytes to the gadgets that were recorded.
+ *
+ * \param model The probing-security model to optimise for.
+ *
+ * For the first-order model, gadgets are assigned the lowest buffer
+ * offsets that do not overlap with the bytes of any earlier gadget
+ * that they conflict with.  This is a greedy colouring of the conflict
+ * graph in the order that the gadgets were generated.
+ */
+void MaskedRandomPlan::optimise(Model model)
+{
+    m_offsets.clear();
+    m_fresh = 0;
+    for (unsigned gadget = 0; gadget < m_sizes.size(); ++gadget) {
+        unsigned offset = m_fresh;
+        unsigned size = m_sizes[gadget];
+        if (model == FirstOrder) {
+            const std::vector<unsigned> &conflicts = m_conflicts[gadget];
+            bool moved;
+            offset = 0;
+            do {
+                moved = false;
+                for (unsigned index = 0; index < conflicts.size(); ++index) {
+                    unsigned other = conflicts[index];
+                    if (other >= gadget)
+                        continue;
+                    unsigned start = m_offsets[other];
+                    unsigned end = start + m_sizes[other];
+                    if (offset < end && start < (offset + size)) {
+                        offset = end;
+                        moved = true;
+                    }
+                }
+            } while (moved);
+        }
+        m_offsets.push_back(offset);
+        if ((offset + size) > m_fresh)
+            m_fresh = offset + size;
+    }
+    m_optimised = true;
+}
+
+/**
+ * \brief Constructs a masking layer over a code object.
+ *
+ * \param code The code to add the instructions to.
+ * \param shares The number of shares, which must be at least 1.
+ * With a single share, the code is the same as unmasked code.
+ * \param stride The distance in bytes between the shares of a value
+ * in memory.
+ */
+MaskedCode::MaskedCode(Code &code, unsigned shares, unsigned stride)
+    : m_code(code)
+    , m_shares(shares)
+    , m_stride(stride)
+    , m_bufferOffset(0)
+    , m_bufferSize(0)
+    , m_bufferUsed(0)
+    , m_randomFunc(0)
+    , m_randomArg(0)
+    , m_plan(0)
+    , m_gadget(0)
+{
+    if (shares < 1)
+        throw std::invalid_argument("masked code needs at least one share");
+}
+
+MaskedCode::~MaskedCode()
+{
+}
+
+/**
+ * \brief Allocates a shared register.
+ *
+ * \param size The size of each share in bytes.
+ *
+ * \return The shared register.
+ */
+SharedReg MaskedCode::allocateReg(unsigned size)
+{
+    SharedReg reg;
+    for (unsigned index = 0; index < m_shares; ++index)
+        reg.m_shares.push_back(m_code.allocateReg(size));
+    clearTaint(reg);
+    return reg;
+}
+
+/**
+ * \brief Releases all shares of a shared register.
+ *
+ * \param reg The shared register to release.
+ */
+void MaskedCode::releaseReg(const SharedReg &reg)
+{
+    for (unsigned index = 0; index < reg.shares(); ++index)
+        m_code.releaseReg(reg.m_shares[index]);
+    clearTaint(reg);
+}
+
+/**
+ * \brief Draws random bytes from a buffer in the local stack frame.
+ *
+ * \param offset Offset of the buffer in the local stack frame.
+ * \param size Size of the buffer in bytes.
+ *
+ * The caller is responsible for filling the buffer with random bytes
+ * and for refreshing it between passes through a loop.
+ */
+void MaskedCode::setRandomBuffer(unsigned offset, unsigned size)
+{
+    m_bufferOffset = offset;
+    m_bufferSize = size;
+    m_bufferUsed = 0;
+    m_bufferDrawn.assign(size, false);
+    m_randomFunc = 0;
+    m_randomArg = 0;
+}
+
+/**
+ * \brief Draws random bytes from a code generation callback.
+ *
+ * \param func The function that generates the code to load random bytes.
+ * \param arg Argument to pass to \a func.
+ *
+ * Every byte that is drawn from the callback is considered to be fresh.
+ */
+void MaskedCode::setRandomSource(MaskedRandomFunc func, void *arg)
+{
+    m_bufferSize = 0;
+    m_bufferUsed = 0;
+    m_bufferDrawn.clear();
+    m_randomFunc = func;
+    m_randomArg = arg;
+}
+
+/**
+ * \brief Sets the plan for the random bytes that gadgets use.
+ *
+ * \param plan The plan, or null to draw bytes from the buffer in order.
+ *
+ * If the plan has not been optimised yet, then the gadgets and their
+ * conflicts are recorded in it.  Otherwise the gadgets draw the bytes
+ * from the random buffer that the plan assigned to them.
+ */
+void MaskedCode::setRandomPlan(MaskedRandomPlan *plan)
+{
+    m_plan = plan;
+    m_gadget = 0;
+}
+
+/**
+ * \brief Loads random bytes into a register.
+ *
+ * \param reg The register to load.
+ */
+void MaskedCode::random(const Reg &reg)
+{
+    if (m_randomFunc) {
+        (*m_randomFunc)(m_code, reg, m_randomArg);
+        m_code.addRandomBytes(reg.size(), reg.size());
+        return;
+    }
+    if (!m_bufferSize)
+        throw std::invalid_argument("no source of randomness for masking");
+    for (int index = 0; index < reg.size(); ++index)
+        drawRandom(Reg(reg, index, 1), m_bufferUsed++);
+}
+
+/**
+ * \brief Moves the shares of one shared register into another.
+ *
+ * \param reg1 The destination register.
+ * \param reg2 The source register.
+ */
+void MaskedCode::move(const SharedReg &reg1, const SharedReg &reg2)
+{
+    checkShares(reg1);
+    checkShares(reg2);
+    for (unsigned index = 0; index < m_shares; ++index)
+        m_code.move(reg1.m_shares[index], reg2.m_shares[index]);
+    copyTaint(reg1, reg2);
+}
+
+/**
+ * \brief XOR's two shared registers.
+ *
+ * \param reg1 The destination register to XOR into.
+ * \param reg2 The source register to XOR from.
+ */
+void MaskedCode::logxor(const SharedReg &reg1, const SharedReg &reg2)
+{
+    checkShares(reg1);
+    checkShares(reg2);
+    for (unsigned index = 0; index < m_shares; ++index)
+        m_code.logxor(reg1.m_shares[index], reg2.m_shares[index]);
+    mergeTaint(reg1, reg2);
+}
+
+/**
+ * \brief XOR's an unmasked register into a shared register.
+ *
+ * \param reg1 The destination register to XOR into.
+ * \param reg2 The unmasked source register; e.g. a round constant.
+ */
+void MaskedCode::logxor(const SharedReg &reg1, const Reg &reg2)
+{
+    checkShares(reg1);
+    m_code.logxor(reg1.m_shares[0], reg2);
+}
+
+/**
+ * \brief XOR's a constant into a shared register.
+ *
+ * \param reg1 The destination register to XOR into.
+ * \param value The constant value.
+ */
+void MaskedCode::logxor(const SharedReg &reg1, unsigned long long value)
+{
+    checkShares(reg1);
+    m_code.logxor(reg1.m_shares[0], value);
+}
+
+/**
+ * \brief Complements a shared register.
+ *
+ * \param reg The register to complement.
+ */
+void MaskedCode::lognot(const SharedReg &reg)
+{
+    checkShares(reg);
+    m_code.lognot(reg.m_shares[0]);
+}
+
+/**
+ * \brief Rotates a shared register left by a number of bits.
+ *
+ * \param reg The register to rotate.
+ * \param bits The number of bits to rotate by.
+ */
+void MaskedCode::rol(const SharedReg &reg, unsigned bits)
+{
+    checkShares(reg);
+    for (unsigned index = 0; index < m_shares; ++index)
+        m_code.rol(reg.m_shares[index], bits);
+    spreadTaint(reg);
+}
+
+/**
+ * \brief Rotates a shared register right by a number of bits.
+ *
+ * \param reg The register to rotate.
+ * \param bits The number of bits to rotate by.
+ */
+void MaskedCode::ror(const SharedReg &reg, unsigned bits)
+{
+    checkShares(reg);
+    for (unsigned index = 0; index < m_shares; ++index)
+        m_code.ror(reg.m_shares[index], bits);
+    spreadTaint(reg);
+}
+
+/**
+ * \brief Performs a masked AND of two shared registers.
+ *
+ * \param reg1 The destination register to AND into.
+ * \param reg2 The source register to AND from.
+ *
+ * The result is computed into temporary registers, so this needs one
+ * more register of every share than logxor_and().
+ */
+void MaskedCode::logand(const SharedReg &reg1, const SharedReg &reg2)
+{
+    SharedReg temp = allocateReg(reg1.size());
+    for (unsigned index = 0; index < m_shares; ++index)
+        m_code.move(temp.m_shares[index], 0);
+    dom(temp, reg1, reg2, false, false);
+    move(reg1, temp);
+    releaseReg(temp);
+}
+
+/**
+ * \brief Performs a masked AND-NOT of two shared registers.
+ *
+ * \param reg1 The destination register to AND into.
+ * \param reg2 The source register to AND-NOT from.
+ *
+ * The result in reg1 will be set to (reg1 & ~reg2).
+ */
+void MaskedCode::logand_not(const SharedReg &reg1, const SharedReg &reg2)
+{
+    SharedReg temp = allocateReg(reg1.size());
+    for (unsigned index = 0; index < m_shares; ++index)
+        m_code.move(temp.m_shares[index], 0);
+    dom(temp, reg1, reg2, false, true);
+    move(reg1, temp);
+    releaseReg(temp);
+}
+
+/**
+ * \brief Performs a masked OR of two shared registers.
+ *
+ * \param reg1 The destination register to OR into.
+ * \param reg2 The source register to OR from.
+ */
+void MaskedCode::logor(const SharedReg &reg1, const SharedReg &reg2)
+{
+    SharedReg temp = allocateReg(reg1.size());
+    for (unsigned index = 0; index < m_shares; ++index)
+        m_code.move(temp.m_shares[index], 0);
+    dom(temp, reg1, reg2, true, true);
+    lognot(temp);
+    move(reg1, temp);
+    releaseReg(temp);
+}
+
+/**
+ * \brief Performs a masked XOR-AND between three shared registers.
+ *
+ * \param reg1 The destination register to XOR into.
+ * \param reg2 The first source register to AND.
+ * \param reg3 The second source register to AND.
+ *
+ * The result in reg1 will be set to (reg1 ^ (reg2 & reg3)).  The
+ * destination must not overlap with the sources.
+ */
+void MaskedCode::logxor_and
+    (const SharedReg &reg1, const SharedReg &reg2, const SharedReg &reg3)
+{
+    dom(reg1, reg2, reg3, false, false);
+}
+
+/**
+ * \brief Performs a masked XOR-AND-NOT between three shared registers.
+ *
+ * \param reg1 The destination register to XOR into.
+ * \param reg2 The first source register to AND.
+ * \param reg3 The second source register to AND-NOT.
+ *
+ * The result in reg1 will be set to (reg1 ^ (reg2 & ~reg3)).  The
+ * destination must not overlap with the sources.
+ */
+void MaskedCode::logxor_and_not
+    (const SharedReg &reg1, const SharedReg &reg2, const SharedReg &reg3)
+{
+    dom(reg1, reg2, reg3, false, true);
+}
+
+/**
+ * \brief Performs a masked XOR-OR between three shared registers.
+ *
+ * \param reg1 The destination register to XOR into.
+ * \param reg2 The first source register to OR.
+ * \param reg3 The second source register to OR.
+ *
+ * The result in reg1 will be set to (reg1 ^ (reg2 | reg3)).  The
+ * destination must not overlap with the sources.
+ */
+void MaskedCode::logxor_or
+    (const SharedReg &reg1, const SharedReg &reg2, const SharedReg &reg3)
+{
+    dom(reg1, reg2, reg3, true, true);
+    lognot(reg1);
+}
+
+/**
+ * \brief Loads a shared register from memory relative to Z.
+ *
+ * \param reg The register to load.
+ * \param offset Offset of share 0 from the Z pointer.
+ */
+void MaskedCode::ldz(const SharedReg &reg, unsigned offset)
+{
+    checkShares(reg);
+    for (unsigned index = 0; index < m_shares; ++index)
+        m_code.ldz_long(reg.m_shares[index], offset + index * m_stride);
+    loadTaint(m_ztaint, reg, offset, m_stride);
+}
+
+/**
+ * \brief Stores a shared register to memory relative to Z.
+ *
+ * \param reg The register to store.
+ * \param offset Offset of share 0 from the Z pointer.
+ */
+void MaskedCode::stz(const SharedReg &reg, unsigned offset)
+{
+    checkShares(reg);
+    for (unsigned index = 0; index < m_shares; ++index)
+        m_code.stz_long(reg.m_shares[index], offset + index * m_stride);
+    storeTaint(m_ztaint, reg, offset, m_stride);
+}
+
+/**
+ * \brief Loads a shared register from the local stack frame.
+ *
+ * \param reg The register to load.
+ * \param offset Offset of share 0 in the local stack frame.
+ *
+ * The shares are consecutive in the local stack frame, rather than
+ * being separated by the share stride.
+ */
+void MaskedCode::ldlocal(const SharedReg &reg, unsigned offset)
+{
+    checkShares(reg);
+    for (unsigned index = 0; index < m_shares; ++index)
+        m_code.ldlocal_long(reg.m_shares[index], offset + index * reg.size());
+    loadTaint(m_localTaint, reg, offset, reg.size());
+}
+
+/**
+ * \brief Stores a shared register to the local stack frame.
+ *
+ * \param reg The register to store.
+ * \param offset Offset of share 0 in the local stack frame.
+ *
+ * The shares are consecutive in the local stack frame, rather than
+ * being separated by the share stride.
+ */
+void MaskedCode::stlocal(const SharedReg &reg, unsigned offset)
+{
+    checkShares(reg);
+    for (unsigned index = 0; index < m_shares; ++index)
+        m_code.stlocal_long(reg.m_shares[index], offset + index * reg.size());
+    storeTaint(m_localTaint, reg, offset, reg.size());
+}
+
+/**
+ * \brief Checks that a shared register has the right number of shares.
+ *
+ * \param reg The register to check.
+ */
+void MaskedCode::checkShares(const SharedReg &reg) const
+{
+    if (reg.shares() != m_shares)
+        throw std::invalid_argument("shared register has the wrong number of shares");
+}
+
+/**
+ * \brief Generates a DOM gadget for "reg1 ^= reg2 & reg3".
+ *
+ * \param reg1 The destination register to XOR into.
+ * \param reg2 The first source register to AND.
+ * \param reg3 The second source register to AND.
+ * \param invert2 Use the complement of \a reg2.
+ * \param invert3 Use the complement of \a reg3.
+ *
+ * Share i of the result accumulates the product of share i of both
+ * inputs, plus the cross products of share i of \a reg2 with every
+ * other share j of \a reg3.  The cross products for (i, j) and (j, i)
+ * are masked with the same random value before they are accumulated,
+ * so that the random values cancel out when the shares are combined.
+ */
+void MaskedCode::dom(const SharedReg &reg1, const SharedReg &reg2,
+                     const SharedReg &reg3, bool invert2, bool invert3)
+{
+    checkShares(reg1);
+    checkShares(reg2);
+    checkShares(reg3);
+
+    // Record the gadget in the randomness plan, or look up its bytes.
+    unsigned gadget = m_gadget++;
+    unsigned size = reg1.size() * m_shares * (m_shares - 1) / 2;
+    bool planned = false;
+    if (m_plan && !m_plan->m_optimised) {
+        m_plan->m_sizes.push_back(size);
+        m_plan->m_conflicts.push_back(std::vector<unsigned>());
+        addConflicts(gadget, reg1);
+        addConflicts(gadget, reg2);
+        addConflicts(gadget, reg3);
+    } else if (m_plan) {
+        if (gadget >= m_plan->m_sizes.size() ||
+                m_plan->m_sizes[gadget] != size) {
+            throw std::invalid_argument
+                ("masked code does not match its randomness plan");
+        }
+        planned = !m_randomFunc;
+    }
+
+    // Complements only affect share 0, and are undone afterwards.
+    if (invert2)
+        m_code.lognot(reg2.m_shares[0]);
+    if (invert3)
+        m_code.lognot(reg3.m_shares[0]);
+
+    // Domain terms, which do not need any randomness.
+    Reg temp = m_code.allocateReg(reg1.size());
+    for (unsigned i = 0; i < m_shares; ++i) {
+        m_code.move(temp, reg2.m_shares[i]);
+        m_code.logand(temp, reg3.m_shares[i]);
+        m_code.logxor(reg1.m_shares[i], temp);
+    }
+
+    // Cross-domain terms, masked with fresh randomness before they are
+    // accumulated into the result.
+    if (m_shares > 1) {
+        Reg rand = m_code.allocateReg(reg1.size());
+        unsigned position = planned ? m_plan->m_offsets[gadget] : 0;
+        for (unsigned i = 0; i < m_shares; ++i) {
+            for (unsigned j = i + 1; j < m_shares; ++j) {
+                if (planned) {
+                    for (int index = 0; index < rand.size(); ++index)
+                        drawRandom(Reg(rand, index, 1), position++);
+                } else {
+                    random(rand);
+                }
+                m_code.move(temp, reg2.m_shares[i]);
+                m_code.logand(temp, reg3.m_shares[j]);
+                m_code.logxor(temp, rand);
+                m_code.logxor(reg1.m_shares[i], temp);
+                m_code.move(temp, reg2.m_shares[j]);
+                m_code.logand(temp, reg3.m_shares[i]);
+                m_code.logxor(temp, rand);
+                m_code.logxor(reg1.m_shares[j], temp);
+            }
+        }
+        m_code.releaseReg(rand);
+    }
+    m_code.releaseReg(temp);
+
+    if (invert2)
+        m_code.lognot(reg2.m_shares[0]);
+    if (invert3)
+        m_code.lognot(reg3.m_shares[0]);
+
+    // The result depends upon this gadget's randomness, and upon
+    // everything that the inputs depended upon.
+    std::vector<unsigned> taint(1, gadget);
+    const SharedReg *regs[3] = {&reg1, &reg2, &reg3};
+    for (unsigned index = 0; index < 3; ++index) {
+        for (unsigned share = 0; share < m_shares; ++share) {
+            const Reg &r = regs[index]->m_shares[share];
+            for (int posn = 0; posn < r.size(); ++posn)
+                masked_merge(taint, m_taint[r.reg(posn)]);
+        }
+    }
+    for (unsigned share = 0; share < m_shares; ++share) {
+        const Reg &r = reg1.m_shares[share];
+        for (int posn = 0; posn < r.size(); ++posn)
+            m_taint[r.reg(posn)] = taint;
+    }
+}
+
+/**
+ * \brief Loads a byte from the random buffer.
+ *
+ * \param reg The single-byte register to load.
+ * \param position Position in the buffer, which wraps around at the end.
+ */
+void MaskedCode::drawRandom(const Reg &reg, unsigned position)
+{
+    position %= m_bufferSize;
+    bool fresh = !m_bufferDrawn[position];
+    m_bufferDrawn[position] = true;
+    m_code.ldlocal_long(reg, m_bufferOffset + position);
+    m_code.addRandomBytes(1, fresh ? 1 : 0);
+}
+
+/**
+ * \brief Clears the dependencies of a shared register.
+ *
+ * \param reg The register.
+ */
+void MaskedCode::clearTaint(const SharedReg &reg)
+{
+    for (unsigned share = 0; share < reg.shares(); ++share) {
+        const Reg &r = reg.m_shares[share];
+        for (int posn = 0; posn < r.size(); ++posn)
+            m_taint[r.reg(posn)].clear();
+    }
+}
+
+/**
+ * \brief Copies the dependencies of one shared register to another.
+ *
+ * \param reg1 The destination register.
+ * \param reg2 The source register.
+ */
+void MaskedCode::copyTaint(const SharedReg &reg1, const SharedReg &reg2)
+{
+    for (unsigned share = 0; share < m_shares; ++share) {
+        const Reg &r1 = reg1.m_shares[share];
+        const Reg &r2 = reg2.m_shares[share];
+        for (int posn = 0; posn < r1.size() && posn < r2.size(); ++posn)
+            m_taint[r1.reg(posn)] = m_taint[r2.reg(posn)];
+    }
+}
+
+/**
+ * \brief Merges the dependencies of one shared register into another
+ * when they are XOR'ed together.
+ *
+ * \param reg1 The destination register.
+ * \param reg2 The source register.
+ *
+ * Gadgets that the two registers depend upon conflict with each other,
+ * because reusing random bytes between them could cancel the masks.
+ */
+void MaskedCode::mergeTaint(const SharedReg &reg1, const SharedReg &reg2)
+{
+    for (unsigned share = 0; share < m_shares; ++share) {
+        const Reg &r1 = reg1.m_shares[share];
+        const Reg &r2 = reg2.m_shares[share];
+        for (int posn = 0; posn < r1.size() && posn < r2.size(); ++posn) {
+            std::vector<unsigned> &taint1 = m_taint[r1.reg(posn)];
+            const std::vector<unsigned> &taint2 = m_taint[r2.reg(posn)];
+            for (unsigned x = 0; x < taint1.size(); ++x) {
+                for (unsigned y = 0; y < taint2.size(); ++y)
+                    addConflict(taint1[x], taint2[y]);
+            }
+            masked_merge(taint1, taint2);
+        }
+    }
+}
+
+/**
+ * \brief Spreads the dependencies of the bytes in every share of a
+ * register to all bytes of the share, after a rotation.
+ *
+ * \param reg The register.
+ */
+void MaskedCode::spreadTaint(const SharedReg &reg)
+{
+    for (unsigned share = 0; share < m_shares; ++share) {
+        const Reg &r = reg.m_shares[share];
+        std::vector<unsigned> taint;
+        for (int posn = 0; posn < r.size(); ++posn)
+            masked_merge(taint, m_taint[r.reg(posn)]);
+        for (int posn = 0; posn < r.size(); ++posn)
+            m_taint[r.reg(posn)] = taint;
+    }
+}
+
+/**
+ * \brief Records the dependencies of a shared register that is
+ * stored to memory.
+ *
+ * \param memory The dependencies of the memory bytes.
+ * \param reg The register that was stored.
+ * \param offset Offset of share 0 in memory.
+ * \param stride Distance between the shares in memory.
+ */
+void MaskedCode::storeTaint
+    (std::map<unsigned, std::vector<unsigned> > &memory,
+     const SharedReg &reg, unsigned offset, unsigned stride)
+{
+    for (unsigned share = 0; share < m_shares; ++share) {
+        const Reg &r = reg.m_shares[share];
+        for (int posn = 0; posn < r.size(); ++posn)
+            memory[offset + share * stride + posn] = m_taint[r.reg(posn)];
+    }
+}
+
+/**
+ * \brief Recovers the dependencies of a shared register that is
+ * loaded from memory.
+ *
+ * \param memory The dependencies of the memory bytes.
+ * \param reg The register that was loaded.
+ * \param offset Offset of share 0 in memory.
+ * \param stride Distance between the shares in memory.
+ *
+ * Bytes that were not stored by this object have no dependencies.
+ */
+void MaskedCode::loadTaint
+    (const std::map<unsigned, std::vector<unsigned> > &memory,
+     const SharedReg &reg, unsigned offset, unsigned stride)
+{
+    for (unsigned share = 0; share < m_shares; ++share) {
+        const Reg &r = reg.m_shares[share];
+        for (int posn = 0; posn < r.size(); ++posn) {
+            std::map<unsigned, std::vector<unsigned> >::const_iterator it;
+            it = memory.find(offset + share * stride + posn);
+            if (it != memory.end())
+                m_taint[r.reg(posn)] = it->second;
+            else
+                m_taint[r.reg(posn)].clear();
+        }
+    }
+}
+
+/**
+ * \brief Records that two gadgets must not share random bytes.
+ *
+ * \param gadget1 The first gadget.
+ * \param gadget2 The second gadget.
+ */
+void MaskedCode::addConflict(unsigned gadget1, unsigned gadget2)
+{
+    if (!m_plan || m_plan->m_optimised || gadget1 == gadget2)
+        return;
+    std::vector<unsigned> &conflicts1 = m_plan->m_conflicts[gadget1];
+    std::vector<unsigned> &conflicts2 = m_plan->m_conflicts[gadget2];
+    if (std::find(conflicts1.begin(), conflicts1.end(), gadget2)
+            == conflicts1.end()) {
+        conflicts1.push_back(gadget2);
+        conflicts2.push_back(gadget1);
+    }
+}
+
+/**
+ * \brief Records that a gadget conflicts with all gadgets that a
+ * shared register depends upon.
+ *
+ * \param gadget The gadget.
+ * \param reg The register.
+ */
+void MaskedCode::addConflicts(unsigned gadget, const SharedReg &reg)
+{
+    for (unsigned share = 0; share < m_shares; ++share) {
+        const Reg &r = reg.m_shares[share];
+        for (int posn = 0; posn < r.size(); ++posn) {
+            const std::vector<unsigned> &taint = m_taint[r.reg(posn)];
+            for (unsigned index = 0; index < taint.size(); ++index)
+                addConflict(gadget, taint[index]);
+        }
+    }
+}
+
+} // namespace AVR
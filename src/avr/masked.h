@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef GENAVR_MASKED_H
+#define GENAVR_MASKED_H
+
+#include "code.h"
+#include <map>
+#include <vector>
+
+namespace AVR
+{
+
+class MaskedCode;
+
+/**
+ * \brief Register that holds a value that has been split into shares.
+ *
+ * The value is the XOR of all shares.  Every share has the same size.
+ */
+class SharedReg
+{
+public:
+    SharedReg() {}
+    SharedReg(const SharedReg &other) : m_shares(other.m_shares) {}
+    SharedReg(const SharedReg &other, unsigned char offset,
+              unsigned char count = 0xFF);
+    ~SharedReg() {}
+
+    SharedReg &operator=(const SharedReg &other)
+    {
+        m_shares = other.m_shares;
+        return *this;
+    }
+
+    /**
+     * \brief Gets the number of shares in this register.
+     */
+    unsigned shares() const { return m_shares.size(); }
+
+    /**
+     * \brief Gets the number of bytes in each share of this register.
+     */
+    int size() const { return m_shares.empty() ? 0 : m_shares[0].size(); }
+
+    /**
+     * \brief Gets a specific share of this register.
+     *
+     * \param index The index of the share, between 0 and shares() - 1.
+     *
+     * \return The register for the share.
+     */
+    const Reg &share(unsigned index) const { return m_shares.at(index); }
+
+    SharedReg reversed() const;
+
+private:
+    std::vector<Reg> m_shares;
+
+    friend class MaskedCode;
+};
+
+/**
+ * \brief Function that generates code to load random bytes.
+ *
+ * \param code The code to add the instructions to.
+ * \param reg The register to load the random bytes into.
+ * \param arg Argument that was passed to MaskedCode::setRandomSource().
+ */
+typedef void (*MaskedRandomFunc)(Code &code, const Reg &reg, void *arg);
+
+/**
+ * \brief Plan for which random bytes the gadgets in masked code use.
+ *
+ * A plan is made by generating the code twice.  The first time, the
+ * MaskedCode object records the gadgets and which of them must not
+ * share random bytes.  Then optimise() assigns the random bytes, and
+ * the second time the gadgets draw the random bytes that they were
+ * assigned.  The generator must produce the same gadgets both times.
+ */
+class MaskedRandomPlan
+{
+public:
+    MaskedRandomPlan();
+    ~MaskedRandomPlan();
+
+    /**
+     * \brief Probing-security models that the plan can be optimised for.
+     */
+    enum Model
+    {
+        HigherOrder,    /**< Every gadget gets its own fresh random bytes */
+        FirstOrder      /**< Reuse between independent gadgets is allowed */
+    };
+
+    void optimise(Model model);
+
+    /**
+     * \brief Determine if the plan has been optimised yet.
+     */
+    bool isOptimised() const { return m_optimised; }
+
+    /**
+     * \brief Gets the number of gadgets in the plan.
+     */
+    unsigned gadgets() const { return m_sizes.size(); }
+
+    /**
+     * \brief Gets the number of fresh random bytes that the plan needs.
+     */
+    unsigned freshBytes() const { return m_fresh; }
+
+private:
+    std::vector<unsigned> m_sizes;
+    std::vector<std::vector<unsigned> > m_conflicts;
+    std::vector<unsigned> m_offsets;
+    unsigned m_fresh;
+    bool m_optimised;
+
+    friend class MaskedCode;
+};
+
+/**
+ * \brief Masking layer over a Code object.
+ *
+ * The operations take SharedReg values and generate the instructions
+ * for every share.  Linear operations are applied share-wise, with
+ * constants and complements applied to share 0 only.  Non-linear
+ * operations expand to domain-oriented masking (DOM) gadgets, which need
+ * one random byte for every pair of shares and every byte of the result.
+ *
+ * Random bytes either come from a buffer in the local stack frame,
+ * which is normally a copy of the "preserve" argument of a masked
+ * permutation, or from a callback that generates the code to produce
+ * them.  Bytes from a buffer are drawn in order, wrapping around at the
+ * end.  Counts of the bytes that are drawn, and how many of them
+ * are fresh, are recorded with Code::addRandomBytes() so that they can
+ * be reported for each variant.  A MaskedRandomPlan can be used to
+ * reduce the number of fresh bytes from a buffer.
+ *
+ * For the plan, the layer tracks which gadgets' random bytes each
+ * register and memory byte depends upon.  Two gadgets conflict if the
+ * inputs or destination of one depend upon the other, or if their
+ * results are XOR'ed together.  Operations that are performed directly
+ * on the underlying Code object are not tracked, so the generator must
+ * ensure that they do not line up bits that were masked with the same
+ * random bits.
+ *
+ * Values in the state that Z points to hold share i at the base offset
+ * plus i times the share stride that is passed to the constructor.
+ * Values in the local stack frame hold their shares consecutively.
+ */
+class MaskedCode
+{
+public:
+    MaskedCode(Code &code, unsigned shares, unsigned stride);
+    ~MaskedCode();
+
+    /**
+     * \brief Gets the underlying code object.
+     */
+    Code &code() const { return m_code; }
+
+    /**
+     * \brief Gets the number of shares for values in this masking layer.
+     */
+    unsigned shares() const { return m_shares; }
+
+    SharedReg allocateReg(unsigned size);
+    void releaseReg(const SharedReg &reg);
+
+    void setRandomBuffer(unsigned offset, unsigned size);
+    void setRandomSource(MaskedRandomFunc func, void *arg);
+    void setRandomPlan(MaskedRandomPlan *plan);
+    void random(const Reg &reg);
+
+    // Linear operations.
+    void move(const SharedReg &reg1, const SharedReg &reg2);
+    void logxor(const SharedReg &reg1, const SharedReg &reg2);
+    void logxor(const SharedReg &reg1, const Reg &reg2);
+    void logxor(const SharedReg &reg1, unsigned long long value);
+    void lognot(const SharedReg &reg);
+    void rol(const SharedReg &reg, unsigned bits);
+    void ror(const SharedReg &reg, unsigned bits);
+
+    // Non-linear operations.
+    void logand(const SharedReg &reg1, const SharedReg &reg2);
+    void logand_not(const SharedReg &reg1, const SharedReg &reg2);
+    void logor(const SharedReg &reg1, const SharedReg &reg2);
+    void logxor_and
+        (const SharedReg &reg1, const SharedReg &reg2, const SharedReg &reg3);
+    void logxor_and_not
+        (const SharedReg &reg1, const SharedReg &reg2, const SharedReg &reg3);
+    void logxor_or
+        (const SharedReg &reg1, const SharedReg &reg2, const SharedReg &reg3);
+
+    // Memory access, relative to Z or to the local stack frame.
+    void ldz(const SharedReg &reg, unsigned offset);
+    void stz(const SharedReg &reg, unsigned offset);
+    void ldlocal(const SharedReg &reg, unsigned offset);
+    void stlocal(const SharedReg &reg, unsigned offset);
+
+private:
+    Code &m_code;
+    unsigned m_shares;
+    unsigned m_stride;
+    unsigned m_bufferOffset;
+    unsigned m_bufferSize;
+    unsigned m_bufferUsed;
+    std::vector<bool> m_bufferDrawn;
+    MaskedRandomFunc m_randomFunc;
+    void *m_randomArg;
+    MaskedRandomPlan *m_plan;
+    unsigned m_gadget;
+    std::vector<unsigned> m_taint[32];
+    std::map<unsigned, std::vector<unsigned> > m_ztaint;
+    std::map<unsigned, std::vector<unsigned> > m_localTaint;
+
+    void checkShares(const SharedReg &reg) const;
+    void drawRandom(const Reg &reg, unsigned position);
+    void clearTaint(const SharedReg &reg);
+    void copyTaint(const SharedReg &reg1, const SharedReg &reg2);
+    void mergeTaint(const SharedReg &reg1, const SharedReg &reg2);
+    void spreadTaint(const SharedReg &reg);
+    void storeTaint(std::map<unsigned, std::vector<unsigned> > &memory,
+                    const SharedReg &reg, unsigned offset, unsigned stride);
+    void loadTaint(const std::map<unsigned, std::vector<unsigned> > &memory,
+                   const SharedReg &reg, unsigned offset, unsigned stride);
+    void addConflict(unsigned gadget1, unsigned gadget2);
+    void addConflicts(unsigned gadget, const SharedReg &reg);
+    void dom(const SharedReg &reg1, const SharedReg &reg2,
+             const SharedReg &reg3, bool invert2, bool invert3);
+};
+
+} // namespace AVR
+
+#endif
@@ -0,0 +1,316 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "code.h"
+#include <stdint.h>
+#include <unordered_map>
+
+namespace AVR
+{
+
+// Longest instruction sequence that we will try to outline.
+#define OUTLINE_MAX_LENGTH 128
+
+// Multiplier for hashing instruction sequences.
+#define OUTLINE_HASH_MULT 0x100000001B3ULL
+
+// Determines if an instruction can be moved into a subroutine.  Anything
+// that involves labels, the stack, or the return address cannot be moved,
+// nor can pseudo-instructions whose size depends upon the device.
+// Every instruction that can be moved is one word long.
+static bool outline_movable(const Insn &insn)
+{
+    switch (insn.type()) {
+    case Insn::ADC: case Insn::ADD: case Insn::ADIW: case Insn::AND:
+    case Insn::ANDI: case Insn::ASR: case Insn::BLD: case Insn::BST:
+    case Insn::COM: case Insn::CP: case Insn::CPC: case Insn::CPI:
+    case Insn::DEC: case Insn::EOR: case Insn::INC: case Insn::LD_X:
+    case Insn::LD_Y: case Insn::LD_Z: case Insn::LDI: case Insn::LSL:
+    case Insn::LSR: case Insn::MOV: case Insn::MOVW: case Insn::NEG:
+    case Insn::NOP: case Insn::OR: case Insn::ORI: case Insn::ROL:
+    case Insn::ROR: case Insn::SBC: case Insn::SUB: case Insn::SBCI:
+    case Insn::SUBI: case Insn::SBIW: case Insn::ST_X: case Insn::ST_Y:
+    case Insn::ST_Z: case Insn::SWAP:
+        return true;
+    default: break;
+    }
+    return false;
+}
+
+// Gets the key for comparing an instruction.  If "names" is not null,
+// then registers are renamed in the order that a sequence first uses them.
+static unsigned outline_key
+    (const Insn &insn, unsigned char *names, unsigned char &next)
+{
+    unsigned reg1 = insn.reg1();
+    unsigned reg2 = insn.reg2();
+    if (names) {
+        if (insn.hasReg1()) {
+            if (names[reg1] == 0xFF)
+                names[reg1] = next++;
+            reg1 = names[reg1];
+        }
+        if (insn.hasReg2()) {
+            if (names[reg2] == 0xFF)
+                names[reg2] = next++;
+            reg2 = names[reg2];
+        }
+    }
+    return (((unsigned)(insn.type())) << 16) | (reg1 << 8) | reg2;
+}
+
+// Determines if two sequences of instructions are the same, possibly
+// after renaming the registers.
+static bool outline_equal
+    (const std::vector<Insn> &insns, int posn1, int posn2,
+     unsigned length, bool renamed)
+{
+    unsigned char names1[32];
+    unsigned char names2[32];
+    unsigned char next1 = 0;
+    unsigned char next2 = 0;
+    for (int reg = 0; reg < 32; ++reg) {
+        names1[reg] = 0xFF;
+        names2[reg] = 0xFF;
+    }
+    for (unsigned index = 0; index < length; ++index) {
+        unsigned key1 = outline_key
+            (insns[posn1 + index], renamed ? names1 : 0, next1);
+        unsigned key2 = outline_key
+            (insns[posn2 + index], renamed ? names2 : 0, next2);
+        if (key1 != key2)
+            return false;
+    }
+    return true;
+}
+
+// Sequence of instructions to be outlined, with the positions of the
+// non-overlapping occurrences that will be replaced with calls.
+struct OutlineCandidate
+{
+    unsigned length;
+    int saving;
+    std::vector<int> positions;
+};
+
+// Finds the sequence that saves the most words when it is outlined.
+// "available" indicates the instructions that can still be outlined
+// and "overhead" is the number of extra words that outlining will cost.
+// If "renamed" is true, then look for sequences that differ only in the
+// registers that they use, but are not all exactly the same.
+static bool outline_find
+    (const std::vector<Insn> &insns, const std::vector<bool> &available,
+     bool renamed, int overhead, OutlineCandidate &best)
+{
+    // Find the length of the run of available instructions at each point.
+    int count = (int)(insns.size());
+    std::vector<unsigned> run(count + 1, 0);
+    for (int index = count - 1; index >= 0; --index)
+        run[index] = available[index] ? (run[index + 1] + 1) : 0;
+
+    // Hash every sequence that starts at each point, for all lengths.
+    typedef std::unordered_map<uint64_t, std::vector<int> > Groups;
+    std::vector<Groups> groups(OUTLINE_MAX_LENGTH + 1);
+    for (int index = 0; index < count; ++index) {
+        unsigned char names[32];
+        unsigned char next = 0;
+        for (int reg = 0; reg < 32; ++reg)
+            names[reg] = 0xFF;
+        uint64_t hash = 0;
+        for (unsigned length = 1; length <= run[index] &&
+                    length <= OUTLINE_MAX_LENGTH; ++length) {
+            const Insn &insn = insns[index + length - 1];
+            hash = hash * OUTLINE_HASH_MULT +
+                   outline_key(insn, renamed ? names : 0, next);
+            if (length >= 2)
+                groups[length][hash].push_back(index);
+        }
+    }
+
+    // Each call replaces a sequence of "length" words with one word,
+    // and the subroutine costs "length" words plus a "ret".
+    best.length = 0;
+    best.saving = 0;
+    best.positions.clear();
+    for (unsigned length = 2; length <= OUTLINE_MAX_LENGTH; ++length) {
+        Groups::const_iterator it;
+        for (it = groups[length].begin(); it != groups[length].end(); ++it) {
+            const std::vector<int> &group = it->second;
+            if (group.size() < 2)
+                continue;
+
+            // Hashes can collide, so check against the first sequence.
+            // Overlapping sequences cannot both be replaced.
+            std::vector<int> positions;
+            bool exact = true;
+            for (size_t posn = 0; posn < group.size(); ++posn) {
+                int start = group[posn];
+                if (!positions.empty()) {
+                    if (start < (int)(positions.back() + length))
+                        continue;
+                    if (!outline_equal(insns, positions[0], start,
+                                       length, renamed))
+                        continue;
+                    if (renamed && exact &&
+                            !outline_equal(insns, positions[0], start,
+                                           length, false))
+                        exact = false;
+                }
+                positions.push_back(start);
+            }
+            if (positions.size() < 2 || (renamed && exact))
+                continue;
+            int calls = (int)(positions.size());
+            int saving = (calls - 1) * (int)length - calls - 1 - overhead;
+            if (saving > best.saving) {
+                best.length = length;
+                best.saving = saving;
+                best.positions = positions;
+            }
+        }
+    }
+    return best.length != 0;
+}
+
+/**
+ * \brief Outlines repeated instruction sequences into local subroutines.
+ *
+ * \param min_saving The minimum number of words that a subroutine
+ * must save to be worth the cycles that its calls add.
+ *
+ * \return A report of the words that were saved and the cycles that
+ * were added.
+ *
+ * The sequence that saves the most words is replaced with "rcall"
+ * instructions to a new subroutine, and then the search is repeated
+ * until nothing else is worth outlining.  The subroutines are placed
+ * at the end of the code with a jump around them.
+ *
+ * Sequences that only differ in the registers that they use cannot
+ * share a subroutine without extra moves, so they are not outlined.
+ * The words that they could save are reported so that the generator
+ * can be changed to use the same registers each time.
+ *
+ * This should be done after the code has been specialised, because
+ * specialisation only follows the calls and not the subroutines.
+ */
+OutlineReport Code::outline(unsigned min_saving)
+{
+    OutlineReport report;
+    report.subroutines = 0;
+    report.calls = 0;
+    report.wordsBefore = code_words();
+    report.cyclesAdded = 0;
+    report.renamedWords = 0;
+
+    // Instructions that are skipped by "cpse" cannot be replaced with
+    // a call because the skip would land in the middle of the sequence.
+    int count = (int)(m_insns.size());
+    std::vector<bool> available(count);
+    for (int index = 0; index < count; ++index) {
+        available[index] = outline_movable(m_insns[index]) &&
+            !(index > 0 && m_insns[index - 1].type() == Insn::CPSE);
+    }
+
+    // Pick the sequences to outline.  There can only be 255 labels,
+    // and we need one more for the end of the subroutines.
+    std::vector<int> owner(count, -1);
+    std::vector<int> bodies;
+    std::vector<unsigned> lengths;
+    OutlineCandidate candidate;
+    while ((m_labels.size() + lengths.size() + 2) <= 255) {
+        int overhead = lengths.empty() ? 1 : 0;
+        if (!outline_find(m_insns, available, false, overhead, candidate) ||
+                candidate.saving < (int)min_saving)
+            break;
+        for (size_t posn = 0; posn < candidate.positions.size(); ++posn) {
+            int start = candidate.positions[posn];
+            owner[start] = (int)(lengths.size());
+            for (unsigned index = 0; index < candidate.length; ++index)
+                available[start + index] = false;
+        }
+        bodies.push_back(candidate.positions[0]);
+        lengths.push_back(candidate.length);
+        report.calls += candidate.positions.size();
+    }
+
+    // Find out how much more could be saved by renaming registers.
+    std::vector<bool> remaining(available);
+    while (outline_find(m_insns, remaining, true, 0, candidate) &&
+           candidate.saving >= (int)min_saving) {
+        for (size_t posn = 0; posn < candidate.positions.size(); ++posn) {
+            int start = candidate.positions[posn];
+            for (unsigned index = 0; index < candidate.length; ++index)
+                remaining[start + index] = false;
+        }
+        report.renamedWords += candidate.saving;
+    }
+    if (lengths.empty()) {
+        report.wordsAfter = report.wordsBefore;
+        m_outline = report;
+        return report;
+    }
+
+    // Replace the sequences with calls and then add the subroutines.
+    std::vector<unsigned char> labels;
+    for (size_t sub = 0; sub < lengths.size(); ++sub) {
+        m_labels.push_back(-1);
+        labels.push_back((unsigned char)(m_labels.size()));
+    }
+    m_labels.push_back(-1);
+    unsigned char end_label = (unsigned char)(m_labels.size());
+    std::vector<Insn> insns;
+    for (int index = 0; index < count; ++index) {
+        if (owner[index] >= 0) {
+            insns.push_back(Insn::branch(Insn::CALL, labels[owner[index]]));
+            index += lengths[owner[index]] - 1;
+        } else {
+            insns.push_back(m_insns[index]);
+        }
+    }
+    insns.push_back(Insn::branch(Insn::JMP, end_label));
+    for (size_t sub = 0; sub < lengths.size(); ++sub) {
+        insns.push_back(Insn::label(labels[sub]));
+        for (unsigned index = 0; index < lengths[sub]; ++index)
+            insns.push_back(m_insns[bodies[sub] + index]);
+        insns.push_back(Insn::bare(Insn::RET));
+    }
+    insns.push_back(Insn::label(end_label));
+    m_insns = insns;
+    for (size_t index = 0; index < m_insns.size(); ++index) {
+        if (m_insns[index].type() == Insn::LABEL)
+            m_labels[m_insns[index].label() - 1] = (int)index;
+    }
+
+    // Every call costs an "rcall" and a "ret", using the same timing
+    // model as the interpreter.  The jump around the subroutines is
+    // an "rjmp".
+    unsigned call_cycles = hasFlag(XTCore) ? 2 : 3;
+    call_cycles += hasFlag(ReducedCore) ? 6 : 4;
+    report.subroutines = lengths.size();
+    report.wordsAfter = code_words();
+    report.cyclesAdded = report.calls * call_cycles + 2;
+    m_outline = report;
+    return report;
+}
+
+} // namespace AVR
@@ -0,0 +1,403 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "permute.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace AVR
+{
+
+// Expands a permutation to cover every bit of a register, with the bits
+// from "size" onwards staying where they are.  Throws an exception if
+// the permutation is not valid.
+static std::vector<unsigned> permute_expand
+    (const Reg &reg, const unsigned char *perm, int size)
+{
+    int bits = reg.size() * 8;
+    if (size < 0 || size > bits || size > 240)
+        throw std::invalid_argument("invalid permutation size");
+    std::vector<unsigned> dest(bits);
+    std::vector<bool> used(bits, false);
+    for (int bit = 0; bit < bits; ++bit) {
+        unsigned posn = (bit < size) ? perm[bit] : (unsigned)bit;
+        if (posn >= (unsigned)(bit < size ? size : bits) || used[posn])
+            throw std::invalid_argument("invalid permutation data");
+        used[posn] = true;
+        dest[bit] = posn;
+    }
+    return dest;
+}
+
+// Determines if a permutation moves whole bytes, with the bits in each
+// byte rotated by the same amount.  Returns the byte that each output
+// byte comes from in "pattern" and the rotation of each output byte in
+// "rotations".
+static bool permute_bytes
+    (const std::vector<unsigned> &dest, std::vector<unsigned char> &pattern,
+     std::vector<unsigned char> &rotations)
+{
+    int bytes = (int)(dest.size() / 8);
+    pattern.assign(bytes, 0);
+    rotations.assign(bytes, 0);
+    for (int byte = 0; byte < bytes; ++byte) {
+        unsigned out = dest[byte * 8] / 8;
+        unsigned rotate = dest[byte * 8] % 8;
+        for (unsigned bit = 0; bit < 8; ++bit) {
+            if (dest[byte * 8 + bit] != (out * 8 + (bit + rotate) % 8))
+                return false;
+        }
+        pattern[out] = (unsigned char)byte;
+        rotations[out] = (unsigned char)rotate;
+    }
+    return true;
+}
+
+// Rotates a single byte left, using "swap" to handle most of a rotation
+// by 3 to 6 bits.
+static void permute_rotate_byte(Code &code, const Reg &reg, unsigned bits)
+{
+    if (bits >= 3 && bits <= 6) {
+        code.onereg(Insn::SWAP, reg.reg(0));
+        if (bits == 3)
+            code.ror(reg, 1);
+        else if (bits > 4)
+            code.rol(reg, bits - 4);
+    } else {
+        code.rol(reg, bits);
+    }
+}
+
+// Routes a permutation of "dest.size()" bits starting at bit "base"
+// through a Benes network.  The network for 2^k bits has 2k - 1 stages.
+// Stage "depth" and stage "2k - 2 - depth" exchange the two halves of
+// this part of the permutation, and the stages in between route the
+// halves recursively.  The bits to exchange are OR'ed into "masks".
+static void permute_benes
+    (const std::vector<unsigned> &dest, unsigned base, unsigned depth,
+     std::vector<unsigned long long> &masks)
+{
+    unsigned count = dest.size();
+    unsigned half = count / 2;
+    unsigned last = masks.size() - 1 - depth;
+    if (count == 2) {
+        if (dest[0] == 1)
+            masks[depth] |= 1ULL << base;
+        return;
+    }
+
+    // Choose the half of the network that each input bit goes through.
+    // The two bits of an input pair must go through different halves,
+    // and so must the two bits that end up in an output pair.  Following
+    // these constraints around each loop assigns all of the bits.
+    std::vector<unsigned> source(count);
+    for (unsigned bit = 0; bit < count; ++bit)
+        source[dest[bit]] = bit;
+    std::vector<int> side(count, -1);
+    for (unsigned start = 0; start < count; ++start) {
+        unsigned bit = start;
+        while (side[bit] < 0) {
+            side[bit] = 0;
+            side[bit ^ half] = 1;
+            bit = source[dest[bit ^ half] ^ half];
+        }
+    }
+
+    // Exchange the input pairs that start on the wrong side, and the
+    // output pairs that finish on the wrong side.
+    std::vector<unsigned> lower(half);
+    std::vector<unsigned> upper(half);
+    for (unsigned bit = 0; bit < count; ++bit) {
+        unsigned out = dest[bit];
+        if (bit < half && side[bit] == 1)
+            masks[depth] |= 1ULL << (base + bit);
+        if ((out >= half) != (side[bit] == 1))
+            masks[last] |= 1ULL << (base + out % half);
+        if (side[bit] == 0)
+            lower[bit % half] = out % half;
+        else
+            upper[bit % half] = out % half;
+    }
+    permute_benes(lower, base, depth + 1, masks);
+    permute_benes(upper, base + half, depth + 1, masks);
+}
+
+// Gets the shift for a stage in a Benes network with "stages" stages.
+static unsigned permute_benes_shift(unsigned stage, unsigned stages)
+{
+    unsigned middle = stages / 2;
+    if (stage <= middle)
+        return 1U << (middle - stage);
+    else
+        return 1U << (stage - middle);
+}
+
+// Performs one stage of a Benes network.  This is the same as
+// Code::swapmove(), except that we know the bits being exchanged are
+// either in the same byte (shifts of 1, 2, or 4) or in the same position
+// of two different bytes (shifts of 8 or more).  So we can work on one
+// byte at a time and skip the bytes that don't change.  Whole bytes that
+// are exchanged are renamed instead.
+static void permute_swapmove_stage
+    (Code &code, Reg &reg, unsigned long long mask, unsigned shift)
+{
+    Reg t = code.allocateHighReg(1);
+    int distance = (int)(shift / 8);
+    for (int index = 0; index < reg.size(); ++index) {
+        unsigned char bits = (unsigned char)(mask >> (index * 8));
+        if (bits == 0)
+            continue;
+        Reg x = Reg(reg, index, 1);
+        if (shift == 4) {
+            // t = (x ^ swap(x)) & bits; x ^= t; x ^= swap(t);
+            code.move(t, x);
+            code.onereg(Insn::SWAP, t.reg(0));
+            code.logxor(t, x);
+            code.logand(t, bits);
+            code.logxor(x, t);
+            code.onereg(Insn::SWAP, t.reg(0));
+            code.logxor(x, t);
+        } else if (shift < 8) {
+            // t = (x ^ (x >> shift)) & bits; x ^= t; x ^= (t << shift);
+            code.move(t, x);
+            code.lsr(t, shift);
+            code.logxor(t, x);
+            code.logand(t, bits);
+            code.logxor(x, t);
+            code.lsl(t, shift);
+            code.logxor(x, t);
+        } else if (bits == 0xFF) {
+            // Exchange two whole bytes by renaming them.
+            std::vector<unsigned char> pattern(reg.size());
+            for (int posn = 0; posn < reg.size(); ++posn)
+                pattern[posn] = (unsigned char)posn;
+            pattern[index] = (unsigned char)(index + distance);
+            pattern[index + distance] = (unsigned char)index;
+            reg = reg.shuffle(pattern.data());
+        } else {
+            // t = (x ^ y) & bits; x ^= t; y ^= t;
+            Reg y = Reg(reg, index + distance, 1);
+            code.move(t, x);
+            code.logxor(t, y);
+            code.logand(t, bits);
+            code.logxor(x, t);
+            code.logxor(y, t);
+        }
+    }
+    code.releaseReg(t);
+}
+
+/**
+ * \brief Gets the name of a bit permutation strategy.
+ *
+ * \param strategy The strategy.
+ *
+ * \return The name of the strategy, for reports.
+ */
+const char *permuteStrategyName(PermuteStrategy strategy)
+{
+    switch (strategy) {
+    case PermuteRename:     return "rename";
+    case PermuteRotate:     return "rotate";
+    case PermuteByteRotate: return "byte-rotate";
+    case PermuteSwapMove:   return "swapmove";
+    case PermuteBitByBit:   return "bit-by-bit";
+    default: break;
+    }
+    return "unknown";
+}
+
+/**
+ * \brief Determines the cost of every strategy for a bit permutation.
+ *
+ * \param code The code that the permutation will be added to.  It is
+ * not modified.
+ * \param reg The register to be permuted.
+ * \param perm Destination bit for each source bit, as for
+ * Code::bit_permute().
+ * \param size Size of the permutation in bits.  Bits from \a size
+ * onwards stay where they are.
+ * \param candidates Returns the cost of each strategy.
+ *
+ * Each strategy is tried on a copy of \a code, so the costs take the
+ * register allocation and the core into account.
+ */
+void permuteCandidates
+    (const Code &code, const Reg &reg, const unsigned char *perm, int size,
+     std::vector<PermuteCandidate> &candidates)
+{
+    permute_expand(reg, perm, size);
+    candidates.clear();
+    for (int index = 0; index < (int)PermuteStrategies; ++index) {
+        PermuteCandidate candidate;
+        candidate.strategy = (PermuteStrategy)index;
+        candidate.applicable = true;
+        candidate.cycles = 0;
+        candidate.words = 0;
+        Code scratch(code);
+        Reg temp(reg);
+        int start = scratch.size();
+        try {
+            permuteBitsWith(scratch, temp, perm, size, candidate.strategy);
+            candidate.cycles = scratch.straight_line_cycles(start);
+            candidate.words = scratch.size() - start;
+        } catch (std::invalid_argument &) {
+            candidate.applicable = false;
+        }
+        candidates.push_back(candidate);
+    }
+}
+
+/**
+ * \brief Performs a bit permutation with a specific strategy.
+ *
+ * \param code The code to add the permutation to.
+ * \param reg The register to be permuted.  The bytes may be renamed,
+ * in which case this is updated to refer to the permuted value.
+ * \param perm Destination bit for each source bit, as for
+ * Code::bit_permute().
+ * \param size Size of the permutation in bits.  Bits from \a size
+ * onwards stay where they are.
+ * \param strategy The strategy to use.
+ *
+ * Throws an exception if the strategy cannot perform the permutation.
+ * Swapmove networks need a register of 1, 2, 4, or 8 bytes.
+ */
+void permuteBitsWith
+    (Code &code, Reg &reg, const unsigned char *perm, int size,
+     PermuteStrategy strategy)
+{
+    std::vector<unsigned> dest = permute_expand(reg, perm, size);
+    unsigned bits = dest.size();
+    std::vector<unsigned char> pattern;
+    std::vector<unsigned char> rotations;
+    bool bytes = permute_bytes(dest, pattern, rotations);
+    bool rotation = true;
+    switch (strategy) {
+    case PermuteRename:
+        for (size_t index = 0; bytes && index < rotations.size(); ++index) {
+            if (rotations[index] != 0)
+                bytes = false;
+        }
+        if (!bytes)
+            break;
+        reg = reg.shuffle(pattern.data());
+        return;
+
+    case PermuteRotate:
+        for (unsigned bit = 0; rotation && bit < bits; ++bit) {
+            if (dest[bit] != (bit + dest[0]) % bits)
+                rotation = false;
+        }
+        if (!rotation)
+            break;
+        code.rol_lazy(reg, dest[0]);
+        code.materialise(reg);
+        return;
+
+    case PermuteByteRotate:
+        if (!bytes)
+            break;
+        reg = reg.shuffle(pattern.data());
+        for (int index = 0; index < reg.size(); ++index)
+            permute_rotate_byte(code, Reg(reg, index, 1), rotations[index]);
+        return;
+
+    case PermuteSwapMove: {
+        if (bits != 8 && bits != 16 && bits != 32 && bits != 64)
+            break;
+        unsigned stages = 1;
+        for (unsigned width = 2; width < bits; width *= 2)
+            stages += 2;
+        std::vector<unsigned long long> masks(stages, 0);
+        permute_benes(dest, 0, 0, masks);
+
+        // Check the network by running the bit positions through it.
+        std::vector<unsigned> state(bits);
+        for (unsigned bit = 0; bit < bits; ++bit)
+            state[bit] = bit;
+        for (unsigned stage = 0; stage < stages; ++stage) {
+            unsigned shift = permute_benes_shift(stage, stages);
+            for (unsigned bit = 0; bit < bits; ++bit) {
+                if ((masks[stage] >> bit) & 1)
+                    std::swap(state[bit], state[bit + shift]);
+            }
+        }
+        for (unsigned bit = 0; bit < bits; ++bit) {
+            if (state[dest[bit]] != bit)
+                throw std::invalid_argument("could not route the permutation");
+        }
+        for (unsigned stage = 0; stage < stages; ++stage) {
+            if (masks[stage] != 0) {
+                permute_swapmove_stage
+                    (code, reg, masks[stage], permute_benes_shift(stage, stages));
+            }
+        }
+        return; }
+
+    case PermuteBitByBit:
+        code.bit_permute(reg, perm, size);
+        return;
+
+    default: break;
+    }
+    throw std::invalid_argument("permutation strategy is not applicable");
+}
+
+/**
+ * \brief Performs a bit permutation with the cheapest strategy.
+ *
+ * \param code The code to add the permutation to.
+ * \param reg The register to be permuted.  The bytes may be renamed,
+ * in which case this is updated to refer to the permuted value.
+ * \param perm Destination bit for each source bit, as for
+ * Code::bit_permute().
+ * \param size Size of the permutation in bits.  Bits from \a size
+ * onwards stay where they are.
+ *
+ * \return The strategy that was used.
+ *
+ * The strategy with the fewest cycles is used, with the fewest words
+ * breaking ties.
+ */
+PermuteStrategy permuteBits
+    (Code &code, Reg &reg, const unsigned char *perm, int size)
+{
+    std::vector<PermuteCandidate> candidates;
+    permuteCandidates(code, reg, perm, size, candidates);
+    int best = -1;
+    for (int index = 0; index < (int)(candidates.size()); ++index) {
+        const PermuteCandidate &candidate = candidates[index];
+        if (!candidate.applicable)
+            continue;
+        if (best < 0 || candidate.cycles < candidates[best].cycles ||
+                (candidate.cycles == candidates[best].cycles &&
+                 candidate.words < candidates[best].words)) {
+            best = index;
+        }
+    }
+    PermuteStrategy strategy = candidates[best].strategy;
+    permuteBitsWith(code, reg, perm, size, strategy);
+    return strategy;
+}
+
+} // namespace AVR
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef GENAVR_PERMUTE_H
+#define GENAVR_PERMUTE_H
+
+#include "code.h"
+#include <vector>
+
+namespace AVR
+{
+
+/**
+ * \brief Strategies for performing a bit permutation on a register.
+ */
+enum PermuteStrategy
+{
+    PermuteRename,      /**< Rename the bytes with Reg::shuffle() */
+    PermuteRotate,      /**< Rotate the whole register */
+    PermuteByteRotate,  /**< Rename the bytes and rotate or SWAP each one */
+    PermuteSwapMove,    /**< Benes network of swapmove() steps */
+    PermuteBitByBit,    /**< Move one bit at a time with BST and BLD */
+    PermuteStrategies   /**< Number of strategies */
+};
+
+/**
+ * \brief Cost of performing a bit permutation with a specific strategy.
+ */
+struct PermuteCandidate
+{
+    PermuteStrategy strategy;   /**< Strategy that was tried */
+    bool applicable;            /**< Strategy can do this permutation */
+    unsigned cycles;            /**< Number of cycles if applicable */
+    unsigned words;             /**< Number of instruction words */
+};
+
+const char *permuteStrategyName(PermuteStrategy strategy);
+
+void permuteCandidates
+    (const Code &code, const Reg &reg, const unsigned char *perm, int size,
+     std::vector<PermuteCandidate> &candidates);
+
+void permuteBitsWith
+    (Code &code, Reg &reg, const unsigned char *perm, int size,
+     PermuteStrategy strategy);
+
+PermuteStrategy permuteBits
+    (Code &code, Reg &reg, const unsigned char *perm, int size);
+
+} // namespace AVR
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "code.h"
+#include <sstream>
+#include <stdexcept>
+
+namespace AVR
+{
+
+// Counts the instruction words in the assembly code for an instruction.
+// Only the longest alternative of an "#if" block is counted, so the
+// result is the largest size that the instruction can have on any device.
+static unsigned count_words(const std::string &text)
+{
+    std::vector<std::pair<unsigned, unsigned> > blocks;
+    unsigned words = 0;
+    size_t posn = 0;
+    while (posn < text.size()) {
+        size_t end = text.find('\n', posn);
+        if (end == std::string::npos)
+            end = text.size();
+        std::string line = text.substr(posn, end - posn);
+        posn = end + 1;
+        if (line.rfind("#if", 0) == 0) {
+            blocks.push_back(std::pair<unsigned, unsigned>(words, 0));
+            words = 0;
+        } else if (line.rfind("#el", 0) == 0) {
+            if (!blocks.empty() && words > blocks.back().second)
+                blocks.back().second = words;
+            words = 0;
+        } else if (line.rfind("#endif", 0) == 0) {
+            if (!blocks.empty()) {
+                if (words < blocks.back().second)
+                    words = blocks.back().second;
+                words += blocks.back().first;
+                blocks.pop_back();
+            }
+        } else if (line.size() > 1 && line[0] == '\t' && line[1] != '.') {
+            std::string mnemonic = line.substr(1, line.find(' ') - 1);
+            if (mnemonic == "call" || mnemonic == "jmp" ||
+                    mnemonic == "lds" || mnemonic == "sts")
+                words += 2;
+            else
+                words += 1;
+        }
+    }
+    return words;
+}
+
+// Gets the size of a non-branch instruction in words.
+static unsigned insn_words(const Code &code, const Insn &insn, int offset)
+{
+    switch (insn.type()) {
+    case Insn::LABEL: case Insn::PRINT: case Insn::PRINTCH:
+    case Insn::PRINTLN:
+        return 0;
+    case Insn::CALL_FUNC: case Insn::LPM_SBOX: case Insn::LPM_SETUP:
+    case Insn::LPM_SETUP2: case Insn::LPM_SETLOW: case Insn::LPM_SWITCH:
+    case Insn::LPM_ADJUST: case Insn::LPM_OFFSET: case Insn::LPM_CLEAN: {
+        // Pseudo-instructions expand into sequences that depend upon
+        // the device, so measure what Insn::write() actually produces.
+        std::ostringstream stream;
+        insn.write(stream, code, offset);
+        return count_words(stream.str()); }
+    default: break;
+    }
+    return 1;
+}
+
+/**
+ * \brief Chooses the cheapest form for every branch in this code.
+ *
+ * \return A vector with one BranchForm value for each instruction.
+ * Entries for instructions that are not branches are BranchShort.
+ *
+ * Every branch starts in its short form and is lengthened only when its
+ * target is out of range, based on the actual sizes of the instructions
+ * in words.  Lengthening a branch can push other branches out of range,
+ * so this is repeated until nothing changes.  Conditional branches reach
+ * 63 words, "rjmp" and "rcall" reach 2K words, and "jmp" and "call"
+ * reach everywhere on devices that have them.
+ *
+ * Throws an exception if a branch cannot reach its target on the
+ * device that the code is being generated for.
+ */
+std::vector<unsigned char> Code::relax_branches() const
+{
+    int count = (int)(m_insns.size());
+    std::vector<unsigned char> forms(count, BranchShort);
+    std::vector<int> words(count);
+    for (int index = 0; index < count; ++index) {
+        switch (m_insns[index].type()) {
+        case Insn::BRCC: case Insn::BRCS: case Insn::BREQ: case Insn::BRNE:
+        case Insn::CALL: case Insn::JMP:
+            words[index] = 1;
+            break;
+        default:
+            words[index] = insn_words(*this, m_insns[index], index);
+            break;
+        }
+    }
+    bool can_jmp = !hasFlag(ReducedCore) &&
+                   (!hasFlag(DeviceSpecific) || hasFlag(HasJmpCall));
+    std::vector<int> address(count + 1);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        address[0] = 0;
+        for (int index = 0; index < count; ++index)
+            address[index + 1] = address[index] + words[index];
+        for (int index = 0; index < count; ++index) {
+            const Insn &insn = m_insns[index];
+            bool conditional = false;
+            switch (insn.type()) {
+            case Insn::BRCC: case Insn::BRCS: case Insn::BREQ:
+            case Insn::BRNE:
+                conditional = true;
+                break;
+            case Insn::CALL: case Insn::JMP:
+                break;
+            default:
+                continue;
+            }
+            if (forms[index] == BranchFar)
+                continue;
+
+            // The displacement is relative to the word after the
+            // instruction that performs the jump, which is always the
+            // last word of the sequence.
+            int disp = address[getLabel(insn.label())] -
+                       (address[index] + words[index]);
+            if (conditional && forms[index] == BranchShort &&
+                    (disp < -64 || disp > 63)) {
+                forms[index] = BranchLong;
+                words[index] = 2;
+                changed = true;
+            } else if (disp < -2048 || disp > 2047) {
+                if (!can_jmp)
+                    throw std::invalid_argument("relative branch is too large");
+                forms[index] = BranchFar;
+                words[index] = conditional ? 3 : 2;
+                changed = true;
+            }
+        }
+    }
+    return forms;
+}
+
+/**
+ * \brief Gets the size of this code in instruction words.
+ *
+ * \return The number of words, with every branch in the form that
+ * relax_branches() chose for it.  The prologue and epilogue that
+ * write() adds are not included.
+ */
+unsigned Code::code_words() const
+{
+    std::vector<unsigned char> forms = relax_branches();
+    unsigned words = 0;
+    for (int index = 0; index < (int)(m_insns.size()); ++index) {
+        const Insn &insn = m_insns[index];
+        switch (insn.type()) {
+        case Insn::BRCC: case Insn::BRCS: case Insn::BREQ: case Insn::BRNE:
+            if (forms[index] == BranchFar)
+                words += 3;
+            else if (forms[index] == BranchLong)
+                words += 2;
+            else
+                words += 1;
+            break;
+        case Insn::CALL: case Insn::JMP:
+            words += (forms[index] == BranchFar) ? 2 : 1;
+            break;
+        default:
+            words += insn_words(*this, insn, index);
+            break;
+        }
+    }
+    return words;
+}
+
+} // namespace AVR
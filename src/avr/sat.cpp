@@ -0,0 +1,507 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "sat.h"
+#include <algorithm>
+
+namespace AVR
+{
+
+// Variable values are 0 for false, 1 for true, and 2 for unassigned.
+#define SAT_UNDEF 2
+#define SAT_NO_REASON (-1)
+
+// Restarts follow the Luby sequence in units of this many conflicts.
+#define SAT_RESTART_UNIT 100
+
+// Number of conflicts before the first reduction of the learnt clauses,
+// and the increase in the interval after each reduction.
+#define SAT_REDUCE_FIRST 2000
+#define SAT_REDUCE_INC 300
+
+// Gets element "index" of the Luby sequence 1, 1, 2, 1, 1, 2, 4, ...
+static unsigned long sat_luby(unsigned long index)
+{
+    unsigned long size = 1;
+    unsigned long power = 1;
+    while (size < index + 1) {
+        size = 2 * size + 1;
+        power *= 2;
+    }
+    while (size - 1 != index) {
+        size = (size - 1) / 2;
+        power /= 2;
+        index %= size;
+    }
+    return power;
+}
+
+// Orders learnt clauses so that the least useful ones come first.
+struct SatLearntOrder
+{
+    int lbd;
+    size_t size;
+    int clause;
+
+    bool operator<(const SatLearntOrder &other) const
+    {
+        if (lbd != other.lbd)
+            return lbd > other.lbd;
+        if (size != other.size)
+            return size > other.size;
+        return clause < other.clause;
+    }
+};
+
+SatSolver::SatSolver()
+    : m_propagated(0)
+    , m_bump(1.0)
+    , m_conflicts(0)
+    , m_ok(true)
+{
+}
+
+SatSolver::~SatSolver()
+{
+}
+
+/**
+ * \brief Creates a new variable.
+ *
+ * \return The index of the variable.
+ */
+int SatSolver::newVar()
+{
+    int var = m_value.size();
+    m_value.push_back(SAT_UNDEF);
+    m_level.push_back(0);
+    m_reason.push_back(SAT_NO_REASON);
+    m_activity.push_back(0.0);
+    m_phase.push_back(0);
+    m_seen.push_back(0);
+    m_heapIndex.push_back(-1);
+    m_watches.push_back(std::vector<int>());
+    m_watches.push_back(std::vector<int>());
+    heapInsert(var);
+    return var;
+}
+
+/**
+ * \brief Adds a clause to the problem.
+ *
+ * \param lits The literals in the clause.
+ *
+ * Clauses must be added before solve() is called.
+ */
+void SatSolver::addClause(const std::vector<int> &lits)
+{
+    if (!m_ok)
+        return;
+    std::vector<int> clause(lits);
+    std::sort(clause.begin(), clause.end());
+    size_t out = 0;
+    for (size_t index = 0; index < clause.size(); ++index) {
+        int lit = clause[index];
+        int value = litValue(lit);
+        if (value == 1 || (out > 0 && clause[out - 1] == (lit ^ 1)))
+            return; // Clause is already satisfied or is a tautology.
+        if (value == 0 || (out > 0 && clause[out - 1] == lit))
+            continue; // Literal is false at level 0, or a duplicate.
+        clause[out++] = lit;
+    }
+    clause.resize(out);
+    if (clause.empty()) {
+        m_ok = false;
+    } else if (clause.size() == 1) {
+        assign(clause[0], SAT_NO_REASON);
+        if (propagate() != SAT_NO_REASON)
+            m_ok = false;
+    } else {
+        m_clauses.push_back(clause);
+        m_lbd.push_back(0);
+        attach(m_clauses.size() - 1);
+    }
+}
+
+// Watches the first two literals of a clause.
+void SatSolver::attach(int clause)
+{
+    const std::vector<int> &c = m_clauses[clause];
+    m_watches[c[0]].push_back(clause);
+    m_watches[c[1]].push_back(clause);
+}
+
+// Assigns a literal to true.
+void SatSolver::assign(int lit, int reason)
+{
+    int var = lit >> 1;
+    m_value[var] = (char)((lit & 1) ^ 1);
+    m_level[var] = level();
+    m_reason[var] = reason;
+    m_trail.push_back(lit);
+}
+
+// Propagates unit clauses.  Returns the conflicting clause or SAT_NO_REASON.
+int SatSolver::propagate()
+{
+    while (m_propagated < m_trail.size()) {
+        int falseLit = m_trail[m_propagated++] ^ 1;
+        std::vector<int> &watches = m_watches[falseLit];
+        size_t in = 0, out = 0;
+        while (in < watches.size()) {
+            int clause = watches[in++];
+            std::vector<int> &c = m_clauses[clause];
+
+            // Make sure that the false literal is in position 1.
+            if (c[0] == falseLit) {
+                c[0] = c[1];
+                c[1] = falseLit;
+            }
+
+            // If the other watch is true, then the clause is satisfied.
+            if (litValue(c[0]) == 1) {
+                watches[out++] = clause;
+                continue;
+            }
+
+            // Look for a new literal to watch.
+            bool found = false;
+            for (size_t index = 2; index < c.size(); ++index) {
+                if (litValue(c[index]) != 0) {
+                    c[1] = c[index];
+                    c[index] = falseLit;
+                    m_watches[c[1]].push_back(clause);
+                    found = true;
+                    break;
+                }
+            }
+            if (found)
+                continue;
+
+            // The clause is unit or conflicting.
+            watches[out++] = clause;
+            if (litValue(c[0]) == 0) {
+                while (in < watches.size())
+                    watches[out++] = watches[in++];
+                watches.resize(out);
+                return clause;
+            }
+            assign(c[0], clause);
+        }
+        watches.resize(out);
+    }
+    return SAT_NO_REASON;
+}
+
+// Analyzes a conflict to produce a first-UIP learnt clause.
+void SatSolver::analyze(int conflict, std::vector<int> &learnt, int &backLevel)
+{
+    int pathCount = 0;
+    int lit = -1;
+    int index = m_trail.size() - 1;
+    learnt.clear();
+    learnt.push_back(-1);
+    do {
+        const std::vector<int> &c = m_clauses[conflict];
+        for (size_t posn = (lit == -1) ? 0 : 1; posn < c.size(); ++posn) {
+            int q = c[posn];
+            int var = q >> 1;
+            if (!m_seen[var] && m_level[var] > 0) {
+                bumpVar(var);
+                m_seen[var] = 1;
+                if (m_level[var] >= level())
+                    ++pathCount;
+                else
+                    learnt.push_back(q);
+            }
+        }
+        while (!m_seen[m_trail[index] >> 1])
+            --index;
+        lit = m_trail[index--];
+        conflict = m_reason[lit >> 1];
+        m_seen[lit >> 1] = 0;
+        --pathCount;
+    } while (pathCount > 0);
+    learnt[0] = lit ^ 1;
+
+    // Remove literals that are implied by the other literals in the
+    // learnt clause; i.e. all of their reasons are already in the clause.
+    std::vector<int> original(learnt);
+    size_t out = 1;
+    for (size_t posn = 1; posn < learnt.size(); ++posn) {
+        int var = learnt[posn] >> 1;
+        int reason = m_reason[var];
+        bool redundant = (reason != SAT_NO_REASON);
+        if (redundant) {
+            const std::vector<int> &c = m_clauses[reason];
+            for (size_t index = 1; index < c.size() && redundant; ++index) {
+                int other = c[index] >> 1;
+                if (!m_seen[other] && m_level[other] > 0)
+                    redundant = false;
+            }
+        }
+        if (!redundant)
+            learnt[out++] = learnt[posn];
+    }
+    for (size_t posn = 1; posn < original.size(); ++posn)
+        m_seen[original[posn] >> 1] = 0;
+    learnt.resize(out);
+
+    // Find the level to backtrack to and clear the "seen" flags.
+    backLevel = 0;
+    size_t maxPosn = 1;
+    for (size_t posn = 1; posn < learnt.size(); ++posn) {
+        int var = learnt[posn] >> 1;
+        m_seen[var] = 0;
+        if (m_level[var] > backLevel) {
+            backLevel = m_level[var];
+            maxPosn = posn;
+        }
+    }
+    if (learnt.size() > 1)
+        std::swap(learnt[1], learnt[maxPosn]);
+}
+
+// Backtracks to a specific decision level.
+void SatSolver::backtrack(int toLevel)
+{
+    if (level() <= toLevel)
+        return;
+    int limit = m_trailLimits[toLevel];
+    for (int index = m_trail.size() - 1; index >= limit; --index) {
+        int var = m_trail[index] >> 1;
+        m_phase[var] = m_value[var];
+        m_value[var] = SAT_UNDEF;
+        m_reason[var] = SAT_NO_REASON;
+        if (m_heapIndex[var] < 0)
+            heapInsert(var);
+    }
+    m_trail.resize(limit);
+    m_trailLimits.resize(toLevel);
+    m_propagated = m_trail.size();
+}
+
+// Computes the literal block distance of a learnt clause, which is the
+// number of distinct decision levels among its literals.
+int SatSolver::computeLbd(const std::vector<int> &clause)
+{
+    std::vector<int> levels;
+    for (size_t index = 0; index < clause.size(); ++index)
+        levels.push_back(m_level[clause[index] >> 1]);
+    std::sort(levels.begin(), levels.end());
+    return std::unique(levels.begin(), levels.end()) - levels.begin();
+}
+
+// Deletes half of the learnt clauses, keeping those with a low literal
+// block distance.  Must be called at decision level 0, where no learnt
+// clause can be the reason for an assignment that matters.
+void SatSolver::reduceLearnts()
+{
+    std::vector<SatLearntOrder> order;
+    for (size_t index = 0; index < m_learnts.size(); ++index) {
+        SatLearntOrder entry;
+        entry.clause = m_learnts[index];
+        entry.lbd = m_lbd[entry.clause];
+        entry.size = m_clauses[entry.clause].size();
+        order.push_back(entry);
+    }
+    std::sort(order.begin(), order.end());
+    m_learnts.clear();
+    for (size_t index = 0; index < order.size(); ++index) {
+        int clause = order[index].clause;
+        if (index < order.size() / 2 && order[index].lbd > 2)
+            std::vector<int>().swap(m_clauses[clause]);
+        else
+            m_learnts.push_back(clause);
+    }
+
+    // Remove the deleted clauses from the watch lists and reasons.
+    for (size_t lit = 0; lit < m_watches.size(); ++lit) {
+        std::vector<int> &watches = m_watches[lit];
+        size_t out = 0;
+        for (size_t index = 0; index < watches.size(); ++index) {
+            if (!m_clauses[watches[index]].empty())
+                watches[out++] = watches[index];
+        }
+        watches.resize(out);
+    }
+    for (size_t var = 0; var < m_reason.size(); ++var) {
+        if (m_reason[var] != SAT_NO_REASON && m_clauses[m_reason[var]].empty())
+            m_reason[var] = SAT_NO_REASON;
+    }
+}
+
+// Bumps the activity of a variable that was involved in a conflict.
+void SatSolver::bumpVar(int var)
+{
+    m_activity[var] += m_bump;
+    if (m_activity[var] > 1e100) {
+        for (size_t index = 0; index < m_activity.size(); ++index)
+            m_activity[index] *= 1e-100;
+        m_bump *= 1e-100;
+    }
+    if (m_heapIndex[var] >= 0)
+        heapUp(m_heapIndex[var]);
+}
+
+void SatSolver::heapUp(int pos)
+{
+    int var = m_heap[pos];
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (m_activity[m_heap[parent]] >= m_activity[var])
+            break;
+        m_heap[pos] = m_heap[parent];
+        m_heapIndex[m_heap[pos]] = pos;
+        pos = parent;
+    }
+    m_heap[pos] = var;
+    m_heapIndex[var] = pos;
+}
+
+void SatSolver::heapDown(int pos)
+{
+    int var = m_heap[pos];
+    int size = m_heap.size();
+    for (;;) {
+        int child = pos * 2 + 1;
+        if (child >= size)
+            break;
+        if ((child + 1) < size &&
+                m_activity[m_heap[child + 1]] > m_activity[m_heap[child]])
+            ++child;
+        if (m_activity[m_heap[child]] <= m_activity[var])
+            break;
+        m_heap[pos] = m_heap[child];
+        m_heapIndex[m_heap[pos]] = pos;
+        pos = child;
+    }
+    m_heap[pos] = var;
+    m_heapIndex[var] = pos;
+}
+
+void SatSolver::heapInsert(int var)
+{
+    m_heap.push_back(var);
+    heapUp(m_heap.size() - 1);
+}
+
+int SatSolver::heapPop()
+{
+    int var = m_heap[0];
+    m_heapIndex[var] = -1;
+    int last = m_heap.back();
+    m_heap.pop_back();
+    if (!m_heap.empty()) {
+        m_heap[0] = last;
+        m_heapIndex[last] = 0;
+        heapDown(0);
+    }
+    return var;
+}
+
+/**
+ * \brief Solves the problem.
+ *
+ * \param conflictLimit Maximum number of conflicts before giving up.
+ *
+ * \return The result of solving.
+ */
+SatSolver::Result SatSolver::solve(unsigned long conflictLimit)
+{
+    if (!m_ok)
+        return Unsat;
+    unsigned long conflicts = 0;
+    unsigned long restarts = 0;
+    unsigned long restartLimit = SAT_RESTART_UNIT;
+    unsigned long restartCount = 0;
+    unsigned long reduceInterval = SAT_REDUCE_FIRST;
+    unsigned long reduceCount = 0;
+    std::vector<int> learnt;
+    for (;;) {
+        int conflict = propagate();
+        if (conflict != SAT_NO_REASON) {
+            // Learn a new clause from the conflict.
+            ++conflicts;
+            ++m_conflicts;
+            ++restartCount;
+            ++reduceCount;
+            if (level() == 0) {
+                m_ok = false;
+                return Unsat;
+            }
+            int backLevel;
+            analyze(conflict, learnt, backLevel);
+            backtrack(backLevel);
+            if (learnt.size() == 1) {
+                assign(learnt[0], SAT_NO_REASON);
+            } else {
+                m_clauses.push_back(learnt);
+                m_lbd.push_back(computeLbd(learnt));
+                m_learnts.push_back(m_clauses.size() - 1);
+                attach(m_clauses.size() - 1);
+                assign(learnt[0], m_clauses.size() - 1);
+            }
+            m_bump *= 1.05;
+            if (conflicts >= conflictLimit) {
+                backtrack(0);
+                return Unknown;
+            }
+            continue;
+        }
+
+        // Restart periodically with the Luby schedule, and throw away
+        // the less useful learnt clauses every now and then.
+        if (restartCount >= restartLimit) {
+            backtrack(0);
+            restartCount = 0;
+            restartLimit = SAT_RESTART_UNIT * sat_luby(++restarts);
+            if (reduceCount >= reduceInterval) {
+                reduceLearnts();
+                reduceCount = 0;
+                reduceInterval += SAT_REDUCE_INC;
+            }
+        }
+
+        // Pick the next decision variable.
+        int var = -1;
+        while (!m_heap.empty()) {
+            int candidate = heapPop();
+            if (m_value[candidate] == SAT_UNDEF) {
+                var = candidate;
+                break;
+            }
+        }
+        if (var < 0) {
+            // All variables are assigned, so we have a model.
+            m_model.resize(m_value.size());
+            for (size_t index = 0; index < m_value.size(); ++index)
+                m_model[index] = (m_value[index] == 1);
+            backtrack(0);
+            return Sat;
+        }
+        m_trailLimits.push_back(m_trail.size());
+        assign(var * 2 + (m_phase[var] ? 0 : 1), SAT_NO_REASON);
+    }
+}
+
+} // namespace AVR
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef GENAVR_SAT_H
+#define GENAVR_SAT_H
+
+#include <vector>
+#include <stddef.h>
+
+namespace AVR
+{
+
+/**
+ * \brief Small conflict-driven clause learning SAT solver.
+ *
+ * Literals are "2 * var" for the positive literal and "2 * var + 1"
+ * for the negated literal.  The solver is intended for the modest
+ * problems that come up during equivalence checking and S-box synthesis;
+ * it has no preprocessing.  Learnt clauses with a high literal block
+ * distance are periodically deleted to keep propagation fast.
+ */
+class SatSolver
+{
+public:
+    SatSolver();
+    ~SatSolver();
+
+    /**
+     * \brief Result of solving.
+     */
+    enum Result
+    {
+        Sat,        /**< Satisfiable; the model is available */
+        Unsat,      /**< Unsatisfiable */
+        Unknown     /**< The conflict limit was reached */
+    };
+
+    int newVar();
+    void addClause(const std::vector<int> &lits);
+    void addClause(int a, int b)
+        { std::vector<int> c; c.push_back(a); c.push_back(b); addClause(c); }
+    void addClause(int a, int b, int c)
+        { std::vector<int> cl; cl.push_back(a); cl.push_back(b);
+          cl.push_back(c); addClause(cl); }
+    Result solve(unsigned long conflictLimit);
+
+    /**
+     * \brief Gets the value of a variable in the model after solve()
+     * returns Sat.
+     *
+     * \param var The variable.
+     *
+     * \return The value of the variable.
+     */
+    bool modelValue(int var) const { return m_model[var]; }
+
+    /**
+     * \brief Gets the number of conflicts across all calls to solve().
+     */
+    unsigned long conflicts() const { return m_conflicts; }
+
+private:
+    std::vector<std::vector<int> > m_clauses;
+    std::vector<int> m_learnts;
+    std::vector<int> m_lbd;
+    std::vector<std::vector<int> > m_watches;
+    std::vector<char> m_value;
+    std::vector<int> m_level;
+    std::vector<int> m_reason;
+    std::vector<double> m_activity;
+    std::vector<char> m_phase;
+    std::vector<char> m_seen;
+    std::vector<bool> m_model;
+    std::vector<int> m_trail;
+    std::vector<int> m_trailLimits;
+    std::vector<int> m_heap;
+    std::vector<int> m_heapIndex;
+    size_t m_propagated;
+    double m_bump;
+    unsigned long m_conflicts;
+    bool m_ok;
+
+    int litValue(int lit) const
+    {
+        char v = m_value[lit >> 1];
+        return (v == 2) ? 2 : (v ^ (lit & 1));
+    }
+    int level() const { return m_trailLimits.size(); }
+    void assign(int lit, int reason);
+    int propagate();
+    void analyze(int conflict, std::vector<int> &learnt, int &backLevel);
+    void backtrack(int toLevel);
+    int computeLbd(const std::vector<int> &clause);
+    void reduceLearnts();
+    void attach(int clause);
+    void bumpVar(int var);
+    void heapUp(int pos);
+    void heapDown(int pos);
+    void heapInsert(int var);
+    int heapPop();
+};
+
+} // namespace AVR
+
+#endif
@@ -0,0 +1,578 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "code.h"
+
+namespace AVR
+{
+
+// Values of the registers and the Z and C flags that are known at a
+// specific point in the code.  -1 indicates that a value is not known.
+struct KnownState
+{
+    bool reached;
+    short r[32];
+    signed char z;
+    signed char c;
+
+    KnownState() : reached(false), z(-1), c(-1)
+    {
+        for (int reg = 0; reg < 32; ++reg)
+            r[reg] = -1;
+    }
+
+    void forget()
+    {
+        for (int reg = 0; reg < 32; ++reg)
+            r[reg] = -1;
+        z = -1;
+        c = -1;
+    }
+
+    bool merge(const KnownState &other);
+};
+
+// Merges the state from another path into this state.  Returns true
+// if this state has changed as a result.
+bool KnownState::merge(const KnownState &other)
+{
+    if (!reached) {
+        *this = other;
+        reached = true;
+        return true;
+    }
+    bool changed = false;
+    for (int reg = 0; reg < 32; ++reg) {
+        if (r[reg] != -1 && r[reg] != other.r[reg]) {
+            r[reg] = -1;
+            changed = true;
+        }
+    }
+    if (z != -1 && z != other.z) {
+        z = -1;
+        changed = true;
+    }
+    if (c != -1 && c != other.c) {
+        c = -1;
+        changed = true;
+    }
+    return changed;
+}
+
+// Sets the result of an instruction and the Z flag.
+static void set_result(KnownState &s, unsigned char reg, int value)
+{
+    if (value < 0) {
+        s.r[reg] = -1;
+        s.z = -1;
+    } else {
+        s.r[reg] = value & 0xFF;
+        s.z = ((value & 0xFF) == 0);
+    }
+}
+
+// Computes the state after a subtraction with carry in.  The Z flag
+// can only be set by a chained subtraction if it was already set.
+static int sub_with_carry(KnownState &s, int a, int b, bool carry)
+{
+    if (a < 0 || b < 0 || (carry && s.c < 0)) {
+        s.z = -1;
+        s.c = -1;
+        return -1;
+    }
+    int cin = carry ? s.c : 0;
+    int diff = a - b - cin;
+    bool zero = ((diff & 0xFF) == 0);
+    if (!carry)
+        s.z = zero;
+    else if (!zero)
+        s.z = 0;
+    else if (s.z != 1)
+        s.z = -1;
+    s.c = (diff < 0);
+    return diff & 0xFF;
+}
+
+// Applies the effect of an instruction to the known state.  Anything
+// that is not understood makes the affected values unknown.
+static void transfer(const Insn &insn, KnownState &s)
+{
+    int a = insn.hasReg1() ? s.r[insn.reg1()] : -1;
+    int b = -1;
+    if (insn.hasReg2())
+        b = s.r[insn.reg2()];
+    switch (insn.type()) {
+    case Insn::ADC: case Insn::ADD:
+        if (insn.type() == Insn::ADC && s.c < 0)
+            a = -1;
+        if (a >= 0 && b >= 0) {
+            int sum = a + b + (insn.type() == Insn::ADC ? s.c : 0);
+            set_result(s, insn.reg1(), sum);
+            s.c = (sum > 0xFF);
+        } else {
+            set_result(s, insn.reg1(), -1);
+            s.c = -1;
+        }
+        break;
+    case Insn::AND: case Insn::EOR: case Insn::OR:
+        if (insn.type() == Insn::EOR && insn.reg1() == insn.reg2()) {
+            set_result(s, insn.reg1(), 0);
+        } else if (a >= 0 && b >= 0) {
+            if (insn.type() == Insn::AND)
+                set_result(s, insn.reg1(), a & b);
+            else if (insn.type() == Insn::EOR)
+                set_result(s, insn.reg1(), a ^ b);
+            else
+                set_result(s, insn.reg1(), a | b);
+        } else {
+            set_result(s, insn.reg1(), -1);
+        }
+        break;
+    case Insn::ANDI:
+        set_result(s, insn.reg1(), a >= 0 ? (a & insn.value()) : -1);
+        break;
+    case Insn::ORI:
+        set_result(s, insn.reg1(), a >= 0 ? (a | insn.value()) : -1);
+        break;
+    case Insn::ASR: case Insn::LSR:
+        if (a >= 0) {
+            s.c = a & 1;
+            if (insn.type() == Insn::ASR)
+                set_result(s, insn.reg1(), (a >> 1) | (a & 0x80));
+            else
+                set_result(s, insn.reg1(), a >> 1);
+        } else {
+            set_result(s, insn.reg1(), -1);
+            s.c = -1;
+        }
+        break;
+    case Insn::LSL:
+        if (a >= 0) {
+            s.c = (a >> 7) & 1;
+            set_result(s, insn.reg1(), a << 1);
+        } else {
+            set_result(s, insn.reg1(), -1);
+            s.c = -1;
+        }
+        break;
+    case Insn::ROL: case Insn::ROR:
+        if (a >= 0 && s.c >= 0) {
+            int cin = s.c;
+            if (insn.type() == Insn::ROL) {
+                s.c = (a >> 7) & 1;
+                set_result(s, insn.reg1(), (a << 1) | cin);
+            } else {
+                s.c = a & 1;
+                set_result(s, insn.reg1(), (a >> 1) | (cin << 7));
+            }
+        } else {
+            set_result(s, insn.reg1(), -1);
+            s.c = -1;
+        }
+        break;
+    case Insn::COM:
+        set_result(s, insn.reg1(), a >= 0 ? (~a & 0xFF) : -1);
+        s.c = 1;
+        break;
+    case Insn::NEG:
+        set_result(s, insn.reg1(), a >= 0 ? ((-a) & 0xFF) : -1);
+        s.c = (a >= 0) ? (a != 0) : -1;
+        break;
+    case Insn::INC:
+        set_result(s, insn.reg1(), a >= 0 ? (a + 1) : -1);
+        break;
+    case Insn::DEC:
+        set_result(s, insn.reg1(), a >= 0 ? (a - 1) : -1);
+        break;
+    case Insn::SWAP:
+        if (a >= 0)
+            s.r[insn.reg1()] = ((a << 4) & 0xF0) | ((a >> 4) & 0x0F);
+        break;
+    case Insn::CP: case Insn::CPC:
+        sub_with_carry(s, a, b, insn.type() == Insn::CPC);
+        break;
+    case Insn::CPI:
+        sub_with_carry(s, a, insn.value(), false);
+        break;
+    case Insn::SUB: case Insn::SBC:
+        s.r[insn.reg1()] = sub_with_carry(s, a, b, insn.type() == Insn::SBC);
+        break;
+    case Insn::SUBI: case Insn::SBCI:
+        s.r[insn.reg1()] =
+            sub_with_carry(s, a, insn.value(), insn.type() == Insn::SBCI);
+        break;
+    case Insn::LDI:
+        s.r[insn.reg1()] = insn.value();
+        break;
+    case Insn::MOV:
+        s.r[insn.reg1()] = b;
+        break;
+    case Insn::MOVW:
+        s.r[insn.reg1()] = b;
+        s.r[insn.reg1() + 1] = s.r[insn.reg2() + 1];
+        break;
+    case Insn::ADIW: case Insn::SBIW:
+        s.r[insn.reg1()] = -1;
+        s.r[insn.reg1() + 1] = -1;
+        s.z = -1;
+        s.c = -1;
+        break;
+    case Insn::BLD: case Insn::POP:
+        s.r[insn.reg1()] = -1;
+        break;
+    case Insn::LD_X: case Insn::LD_Y: case Insn::LD_Z:
+    case Insn::ST_X: case Insn::ST_Y: case Insn::ST_Z:
+        if (insn.type() == Insn::LD_X || insn.type() == Insn::LD_Y ||
+                insn.type() == Insn::LD_Z) {
+            s.r[insn.reg1()] = -1;
+        }
+        if (insn.offset() == PRE_DEC || insn.offset() == POST_INC) {
+            int ptr = 30;
+            if (insn.type() == Insn::LD_X || insn.type() == Insn::ST_X)
+                ptr = 26;
+            else if (insn.type() == Insn::LD_Y || insn.type() == Insn::ST_Y)
+                ptr = 28;
+            s.r[ptr] = -1;
+            s.r[ptr + 1] = -1;
+        }
+        break;
+    case Insn::BRCC: case Insn::BRCS: case Insn::BREQ: case Insn::BRNE:
+    case Insn::BST: case Insn::CPSE: case Insn::JMP: case Insn::LABEL:
+    case Insn::NOP: case Insn::PRINT: case Insn::PRINTCH:
+    case Insn::PRINTLN: case Insn::PUSH: case Insn::RET:
+        break;
+    default:
+        // Calls, S-box lookups, and anything else that we don't track.
+        s.forget();
+        break;
+    }
+}
+
+// Determines if the outcome of a conditional branch is known.
+// Returns 1 if the branch is always taken, 0 if never taken,
+// or -1 if the outcome cannot be determined.
+static int branch_outcome(const Insn &insn, const KnownState &s)
+{
+    switch (insn.type()) {
+    case Insn::BRCC: return s.c < 0 ? -1 : !s.c;
+    case Insn::BRCS: return s.c;
+    case Insn::BREQ: return s.z;
+    case Insn::BRNE: return s.z < 0 ? -1 : !s.z;
+    default: break;
+    }
+    return -1;
+}
+
+#define FLAG_Z  1
+#define FLAG_C  2
+
+// Gets the Z and C flags that are read by an instruction.  Instructions
+// that we don't track are assumed to read both.
+static int flags_read(const Insn &insn)
+{
+    switch (insn.type()) {
+    case Insn::BREQ: case Insn::BRNE:
+        return FLAG_Z;
+    case Insn::ADC: case Insn::BRCC: case Insn::BRCS: case Insn::ROL:
+    case Insn::ROR:
+        return FLAG_C;
+    case Insn::CPC: case Insn::SBC: case Insn::SBCI:
+        return FLAG_Z | FLAG_C;
+    case Insn::ADD: case Insn::ADIW: case Insn::AND: case Insn::ANDI:
+    case Insn::ASR: case Insn::BLD: case Insn::BST: case Insn::CALL:
+    case Insn::COM: case Insn::CP: case Insn::CPI: case Insn::CPSE:
+    case Insn::DEC: case Insn::EOR: case Insn::INC: case Insn::JMP:
+    case Insn::LABEL: case Insn::LD_X: case Insn::LD_Y: case Insn::LD_Z:
+    case Insn::LDI: case Insn::LSL: case Insn::LSR: case Insn::MOV:
+    case Insn::MOVW: case Insn::NEG: case Insn::NOP: case Insn::OR:
+    case Insn::ORI: case Insn::POP: case Insn::PRINT: case Insn::PRINTCH:
+    case Insn::PRINTLN: case Insn::PUSH: case Insn::SBIW: case Insn::ST_X:
+    case Insn::ST_Y: case Insn::ST_Z: case Insn::SUB: case Insn::SUBI:
+    case Insn::SWAP:
+        return 0;
+    default: break;
+    }
+    return FLAG_Z | FLAG_C;
+}
+
+// Gets the Z and C flags that are always written by an instruction.
+static int flags_written(const Insn &insn)
+{
+    switch (insn.type()) {
+    case Insn::ADC: case Insn::ADD: case Insn::ADIW: case Insn::ASR:
+    case Insn::COM: case Insn::CP: case Insn::CPC: case Insn::CPI:
+    case Insn::LSL: case Insn::LSR: case Insn::NEG: case Insn::ROL:
+    case Insn::ROR: case Insn::SBC: case Insn::SBCI: case Insn::SBIW:
+    case Insn::SUB: case Insn::SUBI:
+        return FLAG_Z | FLAG_C;
+    case Insn::AND: case Insn::ANDI: case Insn::DEC: case Insn::EOR:
+    case Insn::INC: case Insn::OR: case Insn::ORI:
+        return FLAG_Z;
+    default: break;
+    }
+    return 0;
+}
+
+// Removes comparisons whose results are never used, which happens when
+// all of the branches that tested the result have been folded away.
+static bool remove_dead_compares(const Code &code, std::vector<Insn> &insns)
+{
+    // Determine which flags are live after each instruction using a
+    // backwards analysis.  The flags are dead at the end of the function.
+    // We don't know where a subroutine returns to, so all flags are
+    // assumed to be live at a "ret".
+    int count = (int)(insns.size());
+    std::vector<int> live_in(count + 1, 0);
+    std::vector<int> live_out(count, 0);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int index = count - 1; index >= 0; --index) {
+            const Insn &insn = insns[index];
+            int out = 0;
+            switch (insn.type()) {
+            case Insn::JMP: case Insn::CALL:
+                out = live_in[code.getLabel(insn.label())];
+                break;
+            case Insn::BRCC: case Insn::BRCS: case Insn::BREQ:
+            case Insn::BRNE:
+                out = live_in[code.getLabel(insn.label())] |
+                      live_in[index + 1];
+                break;
+            case Insn::CPSE:
+                out = live_in[index + 1];
+                if (index + 2 <= count)
+                    out |= live_in[index + 2];
+                break;
+            case Insn::RET:
+                out = FLAG_Z | FLAG_C;
+                break;
+            default:
+                out = live_in[index + 1];
+                break;
+            }
+            int in = flags_read(insn) | (out & ~flags_written(insn));
+            if (out != live_out[index] || in != live_in[index]) {
+                live_out[index] = out;
+                live_in[index] = in;
+                changed = true;
+            }
+        }
+    }
+
+    // Remove the comparisons that don't produce any live flags.
+    std::vector<Insn> result;
+    bool removed = false;
+    for (int index = 0; index < count; ++index) {
+        Insn::Type type = insns[index].type();
+        if ((type == Insn::CP || type == Insn::CPC || type == Insn::CPI) &&
+                live_out[index] == 0) {
+            removed = true;
+            continue;
+        }
+        result.push_back(insns[index]);
+    }
+    if (removed)
+        insns = result;
+    return removed;
+}
+
+/**
+ * \brief Specialises the code for a fixed value of its parameter.
+ *
+ * \param value The value of the "count" or "rounds" parameter that
+ * the specialised function will always be called with.
+ *
+ * The parameter value is propagated through the code at generation
+ * time.  Conditional branches whose outcome becomes known are replaced
+ * with unconditional jumps or removed, and code that can no longer be
+ * reached is deleted.  Round count dispatch chains in the generated
+ * code collapse to a straight line for the requested value.
+ *
+ * The interpreter will refuse to run the specialised code with any
+ * other parameter value by throwing SpecialisationMismatch.
+ */
+void Code::specialise(unsigned value)
+{
+    if (m_paramReg < 0) {
+        throw std::invalid_argument
+            ("function does not have a parameter that can be specialised");
+    }
+    if (value > 0xFF)
+        throw std::invalid_argument("specialised parameter must be 0 to 255");
+    m_paramValue = (int)value;
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        // Propagate the known values forwards through the code until
+        // nothing changes.  Index size() is the epilogue.
+        int count = (int)(m_insns.size());
+        std::vector<KnownState> states(count + 1);
+        std::vector<int> worklist;
+        KnownState entry;
+        entry.reached = true;
+        entry.r[ZERO_REG] = 0;
+        entry.r[m_paramReg] = value;
+        states[0] = entry;
+        worklist.push_back(0);
+        while (!worklist.empty()) {
+            int index = worklist.back();
+            worklist.pop_back();
+            if (index >= count)
+                continue;
+            const Insn &insn = m_insns[index];
+            KnownState s = states[index];
+            transfer(insn, s);
+            int next[2] = {-1, -1};
+            switch (insn.type()) {
+            case Insn::JMP:
+                next[0] = getLabel(insn.label());
+                break;
+            case Insn::BRCC: case Insn::BRCS: case Insn::BREQ:
+            case Insn::BRNE: {
+                int outcome = branch_outcome(insn, states[index]);
+                if (outcome != 0)
+                    next[0] = getLabel(insn.label());
+                if (outcome != 1)
+                    next[1] = index + 1;
+                break; }
+            case Insn::CPSE:
+                next[0] = index + 1;
+                next[1] = index + 2;
+                break;
+            case Insn::CALL:
+                // The subroutine starts with the state of the caller.
+                // Nothing is known about the registers on return.
+                next[0] = getLabel(insn.label());
+                if (states[next[0]].merge(s))
+                    worklist.push_back(next[0]);
+                next[0] = index + 1;
+                s.forget();
+                break;
+            case Insn::RET:
+                break;
+            default:
+                next[0] = index + 1;
+                break;
+            }
+            for (int posn = 0; posn < 2; ++posn) {
+                if (next[posn] >= 0 && next[posn] <= count &&
+                        states[next[posn]].merge(s)) {
+                    worklist.push_back(next[posn]);
+                }
+            }
+        }
+
+        // Fold the branches, remove unreachable code, and remove
+        // loads of values that are already in their registers.
+        std::vector<Insn> insns;
+        for (int index = 0; index < count; ++index) {
+            const Insn &insn = m_insns[index];
+            const KnownState &s = states[index];
+            if (insn.type() == Insn::LABEL) {
+                insns.push_back(insn);
+                continue;
+            }
+            if (!s.reached) {
+                changed = true;
+                continue;
+            }
+            int outcome = branch_outcome(insn, s);
+            if (outcome == 1) {
+                insns.push_back(Insn::branch(Insn::JMP, insn.label()));
+                changed = true;
+            } else if (outcome == 0) {
+                changed = true;
+            } else if (insn.type() == Insn::LDI &&
+                       s.r[insn.reg1()] == insn.value()) {
+                changed = true;
+            } else {
+                insns.push_back(insn);
+            }
+        }
+
+        // Remove jumps to labels that immediately follow the jump.
+        for (size_t index = 0; index < insns.size(); ++index) {
+            if (insns[index].type() != Insn::JMP)
+                continue;
+            size_t posn = index + 1;
+            while (posn < insns.size() &&
+                   insns[posn].type() == Insn::LABEL &&
+                   insns[posn].label() != insns[index].label()) {
+                ++posn;
+            }
+            if (posn < insns.size() && insns[posn].type() == Insn::LABEL) {
+                insns.erase(insns.begin() + index);
+                --index;
+                changed = true;
+            }
+        }
+
+        // Remove labels that are no longer referenced and then
+        // rebuild the label table for the compacted code.
+        std::vector<bool> referenced(m_labels.size() + 1, false);
+        for (size_t index = 0; index < insns.size(); ++index) {
+            Insn::Type type = insns[index].type();
+            if (type == Insn::JMP || type == Insn::CALL ||
+                    type == Insn::BRCC || type == Insn::BRCS ||
+                    type == Insn::BREQ || type == Insn::BRNE) {
+                referenced[insns[index].label()] = true;
+            }
+        }
+        m_insns.clear();
+        for (size_t index = 0; index < m_labels.size(); ++index)
+            m_labels[index] = -1;
+        for (size_t index = 0; index < insns.size(); ++index) {
+            if (insns[index].type() == Insn::LABEL) {
+                if (!referenced[insns[index].label()])
+                    continue;
+                m_labels[insns[index].label() - 1] = (int)(m_insns.size());
+            }
+            m_insns.push_back(insns[index]);
+        }
+
+        // Now that the branches have been folded, look for comparisons
+        // that are no longer needed.  The label table must be rebuilt
+        // again if anything was removed.
+        if (remove_dead_compares(*this, m_insns)) {
+            for (size_t index = 0; index < m_insns.size(); ++index) {
+                if (m_insns[index].type() == Insn::LABEL)
+                    m_labels[m_insns[index].label() - 1] = (int)index;
+            }
+            changed = true;
+        }
+    }
+}
+
+// Throws SpecialisationMismatch if the code has been specialised for a
+// different parameter value than the one it is about to be run with.
+void Code::check_specialised(unsigned value) const
+{
+    if (m_paramValue >= 0 && (unsigned)m_paramValue != value) {
+        throw SpecialisationMismatch
+            ("code was specialised for a different parameter value");
+    }
+}
+
+} // namespace AVR
@@ -0,0 +1,629 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "code.h"
+#include "aig.h"
+#include <stdexcept>
+
+namespace AVR
+{
+
+// Symbolic execution mirrors the interpreter in interpret.cpp, except
+// that every register and memory bit is a literal in an and-inverter graph.
+// Control flow must be concrete: the program counter, pointer registers,
+// and the flags tested by branches must not depend upon symbolic inputs.
+// Loops with concrete trip counts are unrolled as they are executed.
+
+#define SYM_MEM_SIZE 4096
+#define SYM_MAX_STEPS 10000000
+
+// Symbolic version of a byte: bit 0 is the least significant.
+struct SymByte
+{
+    AigLit bit[8];
+};
+
+struct SymState
+{
+    Aig &aig;
+    SymByte r[34]; // r0 .. r31 plus stack low and stack high.
+    AigLit c;
+    AigLit z;
+    AigLit t;
+    std::map<unsigned, SymByte> memory;
+    int pc;
+    Sbox sbox;
+    SymByte sbox_low;
+    SymByte sbox_high;
+
+    explicit SymState(Aig &g) : aig(g), pc(0)
+    {
+        // Registers start with unknown values, except for r1.
+        for (int reg = 0; reg < 34; ++reg)
+            r[reg] = unknown();
+        r[1] = constant(0);
+        c = aig.input();
+        z = aig.input();
+        t = aig.input();
+        setPair(32, SYM_MEM_SIZE);
+        sbox_low = constant(0);
+        sbox_high = constant(0);
+    }
+
+    SymByte constant(unsigned char value) const
+    {
+        SymByte b;
+        for (int bit = 0; bit < 8; ++bit)
+            b.bit[bit] = aig.constant((value >> bit) & 1);
+        return b;
+    }
+
+    SymByte unknown()
+    {
+        SymByte b;
+        for (int bit = 0; bit < 8; ++bit)
+            b.bit[bit] = aig.input();
+        return b;
+    }
+
+    static bool isConcrete(const SymByte &b, unsigned &value)
+    {
+        value = 0;
+        for (int bit = 0; bit < 8; ++bit) {
+            if (!Aig::isConstant(b.bit[bit]))
+                return false;
+            value |= ((unsigned)(b.bit[bit])) << bit;
+        }
+        return true;
+    }
+
+    static unsigned concrete(const SymByte &b, const char *what)
+    {
+        unsigned value;
+        if (!isConcrete(b, value)) {
+            throw std::invalid_argument
+                (std::string(what) + " depends upon symbolic data");
+        }
+        return value;
+    }
+
+    static bool concreteFlag(AigLit lit)
+    {
+        if (!Aig::isConstant(lit))
+            throw std::invalid_argument("branch depends upon symbolic data");
+        return lit == Aig::True;
+    }
+
+    unsigned pair(int reg) const
+    {
+        return concrete(r[reg + 1], "pointer") * 256U +
+               concrete(r[reg], "pointer");
+    }
+
+    void setPair(int reg, unsigned value)
+    {
+        r[reg]     = constant((unsigned char)value);
+        r[reg + 1] = constant((unsigned char)(value >> 8));
+    }
+
+    AigLit isZero(const SymByte &b)
+    {
+        AigLit any = Aig::False;
+        for (int bit = 0; bit < 8; ++bit)
+            any = aig.orLit(any, b.bit[bit]);
+        return Aig::invert(any);
+    }
+
+    SymByte invert(const SymByte &b)
+    {
+        SymByte result;
+        for (int bit = 0; bit < 8; ++bit)
+            result.bit[bit] = Aig::invert(b.bit[bit]);
+        return result;
+    }
+
+    // Adds two bytes and a carry in; returns the carry out in "carry".
+    SymByte add(const SymByte &a, const SymByte &b, AigLit &carry)
+    {
+        SymByte result;
+        for (int bit = 0; bit < 8; ++bit) {
+            AigLit x = a.bit[bit];
+            AigLit y = b.bit[bit];
+            AigLit xy = aig.xorLit(x, y);
+            result.bit[bit] = aig.xorLit(xy, carry);
+            carry = aig.orLit(aig.andLit(x, y), aig.andLit(carry, xy));
+        }
+        return result;
+    }
+
+    // Subtracts b and a borrow in from a; returns the borrow out in "borrow".
+    SymByte sub(const SymByte &a, const SymByte &b, AigLit &borrow)
+    {
+        AigLit carry = Aig::invert(borrow);
+        SymByte result = add(a, invert(b), carry);
+        borrow = Aig::invert(carry);
+        return result;
+    }
+
+    unsigned address(int reg, unsigned char offset);
+    SymByte load(unsigned address);
+    void store(unsigned address, const SymByte &value)
+    {
+        memory[address] = value;
+    }
+
+    void push(const SymByte &value) { store(address(32, PRE_DEC), value); }
+    SymByte pop() { return load(address(32, POST_INC)); }
+
+    void setPC(int newPC);
+};
+
+// Gets the address for a memory access via a pointer register.
+unsigned SymState::address(int reg, unsigned char offset)
+{
+    int addr = (int)pair(reg);
+    if (offset == PRE_DEC) {
+        --addr;
+        setPair(reg, addr);
+    } else if (offset == POST_INC) {
+        setPair(reg, addr + 1);
+    } else {
+        addr += offset;
+    }
+    if (addr < 0 || addr >= SYM_MEM_SIZE) {
+        throw std::invalid_argument("invalid memory address");
+    }
+    return addr;
+}
+
+// Loads a byte from memory.  Uninitialized memory is an unknown value.
+SymByte SymState::load(unsigned address)
+{
+    std::map<unsigned, SymByte>::const_iterator it = memory.find(address);
+    if (it != memory.end())
+        return it->second;
+    SymByte value = unknown();
+    memory[address] = value;
+    return value;
+}
+
+// Sets the program counter to a new value.  Branch ranges are checked
+// by Code::relax_branches() when the code is written.
+void SymState::setPC(int newPC)
+{
+    pc = newPC;
+}
+
+// Looks up a symbolic index in an S-box, using a multiplexer tree
+// when the index is not concrete.  Out of range entries are zero.
+static SymByte sym_lookup(SymState &s, const SymByte &low, const SymByte &high)
+{
+    unsigned lowValue, highValue;
+    if (SymState::isConcrete(low, lowValue) &&
+            SymState::isConcrete(high, highValue)) {
+        return s.constant(s.sbox.lookup(highValue * 256 + lowValue));
+    }
+    int size = s.sbox.size();
+    int bits = 0;
+    while ((1 << bits) < size)
+        ++bits;
+    AigLit index[16];
+    for (int bit = 0; bit < 8; ++bit) {
+        index[bit] = low.bit[bit];
+        index[bit + 8] = high.bit[bit];
+    }
+    SymByte result;
+    for (int bit = 0; bit < 8; ++bit) {
+        std::vector<AigLit> level;
+        for (int entry = 0; entry < (1 << bits); ++entry) {
+            unsigned char value = (entry < size) ? s.sbox.lookup(entry) : 0;
+            level.push_back(s.aig.constant((value >> bit) & 1));
+        }
+        for (int sel = 0; sel < bits; ++sel) {
+            std::vector<AigLit> next;
+            for (size_t entry = 0; entry < level.size(); entry += 2) {
+                next.push_back(s.aig.mux
+                    (index[sel], level[entry + 1], level[entry]));
+            }
+            level.swap(next);
+        }
+        result.bit[bit] = level[0];
+    }
+    return result;
+}
+
+// Executes a single instruction symbolically.
+static void sym_insn(SymState &s, const Code &code, const Insn &insn)
+{
+    Aig &aig = s.aig;
+    SymByte temp;
+    AigLit carry;
+    unsigned char reg1 = insn.reg1();
+    unsigned char reg2 = insn.reg2();
+    switch (insn.type()) {
+    case Insn::ADC:
+        // Add with carry in.
+        carry = s.c;
+        s.r[reg1] = s.add(s.r[reg1], s.r[reg2], carry);
+        s.c = carry;
+        s.z = s.isZero(s.r[reg1]);
+        break;
+    case Insn::ADD:
+        // Add with no carry in.
+        carry = Aig::False;
+        s.r[reg1] = s.add(s.r[reg1], s.r[reg2], carry);
+        s.c = carry;
+        s.z = s.isZero(s.r[reg1]);
+        break;
+    case Insn::ADIW:
+        // Add immediate to word.
+        carry = Aig::False;
+        s.r[reg1] = s.add(s.r[reg1], s.constant(insn.value()), carry);
+        s.r[reg1 + 1] = s.add(s.r[reg1 + 1], s.constant(0), carry);
+        s.c = carry;
+        s.z = aig.andLit(s.isZero(s.r[reg1]), s.isZero(s.r[reg1 + 1]));
+        break;
+    case Insn::AND:
+    case Insn::ANDI:
+        // AND registers or AND with immediate.
+        temp = (insn.type() == Insn::AND) ? s.r[reg2] : s.constant(reg2);
+        for (int bit = 0; bit < 8; ++bit)
+            s.r[reg1].bit[bit] = aig.andLit(s.r[reg1].bit[bit], temp.bit[bit]);
+        s.z = s.isZero(s.r[reg1]);
+        break;
+    case Insn::ASR:
+        // Arithmetic shift right.
+        temp = s.r[reg1];
+        s.c = temp.bit[0];
+        for (int bit = 0; bit < 7; ++bit)
+            s.r[reg1].bit[bit] = temp.bit[bit + 1];
+        s.z = s.isZero(s.r[reg1]);
+        break;
+    case Insn::BLD:
+        // Loads the contents of T into a register bit.
+        s.r[reg1].bit[insn.value()] = s.t;
+        break;
+    case Insn::BST:
+        // Stores the contents of a register bit into T.
+        s.t = s.r[reg1].bit[insn.value()];
+        break;
+    case Insn::BRCC:
+        // Branch if carry clear.
+        if (!SymState::concreteFlag(s.c))
+            s.setPC(code.getLabel(insn.label()));
+        break;
+    case Insn::BRCS:
+        // Branch if carry set.
+        if (SymState::concreteFlag(s.c))
+            s.setPC(code.getLabel(insn.label()));
+        break;
+    case Insn::BREQ:
+        // Branch if equal / zero.
+        if (SymState::concreteFlag(s.z))
+            s.setPC(code.getLabel(insn.label()));
+        break;
+    case Insn::BRNE:
+        // Branch if not equal.
+        if (!SymState::concreteFlag(s.z))
+            s.setPC(code.getLabel(insn.label()));
+        break;
+    case Insn::CALL:
+        // Call a local subroutine.
+        s.push(s.constant((unsigned char)(s.pc >> 8)));
+        s.push(s.constant((unsigned char)(s.pc)));
+        s.setPC(code.getLabel(insn.label()));
+        break;
+    case Insn::CALL_FUNC:
+        throw std::invalid_argument
+            ("calls to other functions cannot be executed symbolically");
+    case Insn::COM:
+        // NOT a register.
+        s.r[reg1] = s.invert(s.r[reg1]);
+        s.z = s.isZero(s.r[reg1]);
+        break;
+    case Insn::CP:
+    case Insn::CPC:
+    case Insn::CPI:
+        // Compare with or without carry in, or with an immediate.
+        carry = (insn.type() == Insn::CPC) ? s.c : Aig::False;
+        temp = (insn.type() == Insn::CPI) ? s.constant(reg2) : s.r[reg2];
+        temp = s.sub(s.r[reg1], temp, carry);
+        s.c = carry;
+        s.z = s.isZero(temp);
+        break;
+    case Insn::CPSE:
+        // Compare and skip if equal.
+        carry = Aig::False;
+        if (SymState::concreteFlag(s.isZero(s.sub(s.r[reg1], s.r[reg2], carry))))
+            ++(s.pc);
+        break;
+    case Insn::DEC:
+        // Decrement a register.
+        carry = Aig::False;
+        s.r[reg1] = s.add(s.r[reg1], s.constant(0xFF), carry);
+        s.z = s.isZero(s.r[reg1]);
+        break;
+    case Insn::EOR:
+        // EOR registers.
+        for (int bit = 0; bit < 8; ++bit)
+            s.r[reg1].bit[bit] = aig.xorLit(s.r[reg1].bit[bit], s.r[reg2].bit[bit]);
+        s.z = s.isZero(s.r[reg1]);
+        break;
+    case Insn::INC:
+        // Increment a register.
+        carry = Aig::True;
+        s.r[reg1] = s.add(s.r[reg1], s.constant(0), carry);
+        s.z = s.isZero(s.r[reg1]);
+        break;
+    case Insn::JMP:
+        // Unconditional jump to a label.
+        s.setPC(code.getLabel(insn.label()));
+        break;
+    case Insn::LABEL:
+        // Label - nothing to do.
+        break;
+    case Insn::LD_X:
+        // Load from an X pointer offset.
+        s.r[reg1] = s.load(s.address(26, insn.offset()));
+        break;
+    case Insn::LD_Y:
+        // Load from a Y pointer offset.
+        s.r[reg1] = s.load(s.address(28, insn.offset()));
+        break;
+    case Insn::LD_Z:
+        // Load from a Z pointer offset.
+        s.r[reg1] = s.load(s.address(30, insn.offset()));
+        break;
+    case Insn::LDI:
+        // Load immediate into register.
+        s.r[reg1] = s.constant(insn.value());
+        break;
+    case Insn::LPM_SBOX:
+        // Load a value from an S-box table in program memory.
+        if (reg2 == POST_INC) {
+            s.r[reg1] = sym_lookup(s, s.sbox_low, s.sbox_high);
+            carry = Aig::True;
+            s.sbox_low = s.add(s.sbox_low, s.constant(0), carry);
+            s.sbox_high = s.add(s.sbox_high, s.constant(0), carry);
+        } else {
+            carry = Aig::False;
+            temp = s.add(s.r[reg2], s.sbox_low, carry);
+            s.r[reg1] = sym_lookup
+                (s, temp, s.add(s.sbox_high, s.constant(0), carry));
+        }
+        break;
+    case Insn::LPM_SETUP:
+    case Insn::LPM_SETUP2:
+        // Set up the S-box.
+        s.sbox = code.sbox_get(insn.value());
+        s.sbox_low = s.constant(0);
+        s.sbox_high = s.constant(0);
+        s.setPair(30, 0xBE00);
+        if (code.sbox_uses_rampz())
+            s.push(s.constant(0xBA));
+        break;
+    case Insn::LPM_SETLOW:
+        // Set the low byte of the S-box pointer.
+        s.sbox_low = s.r[reg2];
+        s.sbox_high = s.constant(0);
+        break;
+    case Insn::LPM_SWITCH:
+        // Switch to a different S-box.
+        s.sbox = code.sbox_get(insn.value());
+        s.sbox_low = s.constant(0);
+        s.sbox_high = s.constant(0);
+        s.setPair(30, 0xBE00);
+        break;
+    case Insn::LPM_ADJUST:
+        // Adjust the high byte of the S-box pointer for large S-boxes.
+        s.sbox_low = s.constant(0);
+        s.sbox_high = s.r[reg1];
+        break;
+    case Insn::LPM_OFFSET:
+        // Adjust the S-box pointer by an offset.
+        carry = Aig::False;
+        s.sbox_low = s.add(s.sbox_low, s.constant(insn.value()), carry);
+        s.sbox_high = s.add(s.sbox_high, s.constant(0), carry);
+        break;
+    case Insn::LPM_CLEAN:
+        // Pop the RAMPZ value, which we expect to be 0xBA.
+        if (!code.sbox_uses_rampz())
+            break;
+        if (SymState::concrete(s.pop(), "RAMPZ") != 0xBA)
+            throw std::invalid_argument("RAMPZ stacking error");
+        break;
+    case Insn::LSL:
+        // Logical shift left.
+        temp = s.r[reg1];
+        s.c = temp.bit[7];
+        s.r[reg1].bit[0] = Aig::False;
+        for (int bit = 1; bit < 8; ++bit)
+            s.r[reg1].bit[bit] = temp.bit[bit - 1];
+        s.z = s.isZero(s.r[reg1]);
+        break;
+    case Insn::LSR:
+        // Logical shift right.
+        temp = s.r[reg1];
+        s.c = temp.bit[0];
+        for (int bit = 0; bit < 7; ++bit)
+            s.r[reg1].bit[bit] = temp.bit[bit + 1];
+        s.r[reg1].bit[7] = Aig::False;
+        s.z = s.isZero(s.r[reg1]);
+        break;
+    case Insn::MOV:
+        // Move the contents of a register.
+        s.r[reg1] = s.r[reg2];
+        break;
+    case Insn::MOVW:
+        // Move the contents of a register pair.
+        s.r[reg1]     = s.r[reg2];
+        s.r[reg1 + 1] = s.r[reg2 + 1];
+        break;
+    case Insn::NEG:
+        // Negate a register.
+        s.c = Aig::invert(s.isZero(s.r[reg1]));
+        carry = Aig::True;
+        s.r[reg1] = s.add(s.invert(s.r[reg1]), s.constant(0), carry);
+        s.z = s.isZero(s.r[reg1]);
+        break;
+    case Insn::NOP:
+        // No operation - nothing to do.
+        break;
+    case Insn::OR:
+    case Insn::ORI:
+        // OR registers or OR with immediate.
+        temp = (insn.type() == Insn::OR) ? s.r[reg2] : s.constant(reg2);
+        for (int bit = 0; bit < 8; ++bit)
+            s.r[reg1].bit[bit] = aig.orLit(s.r[reg1].bit[bit], temp.bit[bit]);
+        s.z = s.isZero(s.r[reg1]);
+        break;
+    case Insn::POP:
+        // Pop from the stack.
+        s.r[reg1] = s.pop();
+        break;
+    case Insn::PUSH:
+        // Push onto the stack.
+        s.push(s.r[reg1]);
+        break;
+    case Insn::PRINT:
+    case Insn::PRINTCH:
+    case Insn::PRINTLN:
+        // Diagnostics are ignored during symbolic execution.
+        break;
+    case Insn::RET:
+        // Return from a subroutine.
+        s.pc = SymState::concrete(s.pop(), "return address");
+        s.pc |= ((int)SymState::concrete(s.pop(), "return address")) << 8;
+        break;
+    case Insn::ROL:
+        // Bitwise rotate left.
+        temp = s.r[reg1];
+        s.r[reg1].bit[0] = s.c;
+        for (int bit = 1; bit < 8; ++bit)
+            s.r[reg1].bit[bit] = temp.bit[bit - 1];
+        s.c = temp.bit[7];
+        s.z = s.isZero(s.r[reg1]);
+        break;
+    case Insn::ROR:
+        // Bitwise rotate right.
+        temp = s.r[reg1];
+        for (int bit = 0; bit < 7; ++bit)
+            s.r[reg1].bit[bit] = temp.bit[bit + 1];
+        s.r[reg1].bit[7] = s.c;
+        s.c = temp.bit[0];
+        s.z = s.isZero(s.r[reg1]);
+        break;
+    case Insn::SBC:
+    case Insn::SUB:
+    case Insn::SBCI:
+    case Insn::SUBI:
+        // Subtract registers or an immediate, with or without carry.
+        carry = (insn.type() == Insn::SBC || insn.type() == Insn::SBCI)
+                    ? s.c : Aig::False;
+        temp = (insn.type() == Insn::SBC || insn.type() == Insn::SUB)
+                    ? s.r[reg2] : s.constant(reg2);
+        s.r[reg1] = s.sub(s.r[reg1], temp, carry);
+        s.c = carry;
+        s.z = s.isZero(s.r[reg1]);
+        break;
+    case Insn::SBIW:
+        // Subtract immediate from word.
+        carry = Aig::False;
+        s.r[reg1] = s.sub(s.r[reg1], s.constant(insn.value()), carry);
+        s.r[reg1 + 1] = s.sub(s.r[reg1 + 1], s.constant(0), carry);
+        s.c = carry;
+        s.z = aig.andLit(s.isZero(s.r[reg1]), s.isZero(s.r[reg1 + 1]));
+        break;
+    case Insn::ST_X:
+        // Store to an X pointer offset.
+        s.store(s.address(26, insn.offset()), s.r[reg1]);
+        break;
+    case Insn::ST_Y:
+        // Store to a Y pointer offset.
+        s.store(s.address(28, insn.offset()), s.r[reg1]);
+        break;
+    case Insn::ST_Z:
+        // Store to a Z pointer offset.
+        s.store(s.address(30, insn.offset()), s.r[reg1]);
+        break;
+    case Insn::SWAP:
+        // Swap the nibbles in a register.
+        temp = s.r[reg1];
+        for (int bit = 0; bit < 8; ++bit)
+            s.r[reg1].bit[bit] = temp.bit[bit ^ 4];
+        break;
+    }
+}
+
+/**
+ * \brief Executes the code in this object symbolically as a permutation.
+ *
+ * \param aig The and-inverter graph to add the computation to.
+ * \param state On entry, the literals for the bits of the input state,
+ * eight per byte starting with the least significant bit of the first
+ * byte.  On exit, the literals for the bits of the output state.
+ * \param count Concrete count parameter for the number of rounds.
+ *
+ * The calling convention is the same as exec_permutation().  Registers
+ * and memory that are read before they are written become new unknown
+ * inputs to the graph, so the output will depend upon them if the code
+ * reads uninitialized data.  Throws an exception if control flow or
+ * memory addresses depend upon the symbolic state.
+ */
+void Code::symbolic_permutation
+    (Aig &aig, std::vector<AigLit> &state, unsigned count) const
+{
+    SymState s(aig);
+    unsigned state_len = state.size() / 8;
+    unsigned state_address = 0x01F2;
+    for (unsigned posn = 0; posn < state_len; ++posn) {
+        SymByte b;
+        for (int bit = 0; bit < 8; ++bit)
+            b.bit[bit] = state[posn * 8 + bit];
+        s.store(state_address + posn, b);
+    }
+    s.setPair(30, state_address);   // Z = state
+    s.push(s.constant(0xFF));       // return address
+    s.push(s.constant(0xFF));
+    unsigned fp = s.pair(32) - m_localsSize - 1;
+    s.setPair(28, fp);              // Y = frame pointer
+    s.setPair(32, fp);
+    s.setPair(22, count);           // Pass the count parameter in r22:r23
+    unsigned long steps = 0;
+    while (s.pc != (int)m_insns.size()) {
+        if (s.pc < 0 || s.pc > (int)m_insns.size())
+            throw std::invalid_argument("program counter out of range");
+        if (++steps > SYM_MAX_STEPS)
+            throw std::invalid_argument("too many steps in symbolic execution");
+        const Insn &insn = m_insns[(s.pc)++];
+        sym_insn(s, *this, insn);
+    }
+    if (s.pair(32) != fp)
+        throw std::invalid_argument("stack size is incorrect on code exit");
+    for (unsigned posn = 0; posn < state_len; ++posn) {
+        SymByte b = s.load(state_address + posn);
+        for (int bit = 0; bit < 8; ++bit)
+            state[posn * 8 + bit] = b.bit[bit];
+    }
+}
+
+} // namespace AVR
@@ -0,0 +1,935 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "synth.h"
+#include "sat.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace AVR
+{
+
+// S-box circuits are synthesised with SAT in the style of Stoffelen's
+// "Optimizing S-box Implementations for Several Criteria using SAT
+// Solvers", in three stages:
+//
+// 1. A straight-line circuit where every gate produces a new signal is
+//    built greedily one output bit at a time, using the smallest number
+//    of extra gates for each bit.  All orders of the output bits are
+//    tried for small S-boxes.  Each of these SAT problems is small.
+//
+// 2. The SAT solver tries to find a straight-line circuit for all output
+//    bits at once with fewer gates than the greedy one.
+//
+// 3. The best circuit is converted into two-address form, with moves
+//    where an operand is still needed afterwards and the temporaries
+//    allocated as needed.  A second SAT encoding that describes the
+//    contents of every variable after every two-address instruction
+//    then tries to find shorter sequences.  If that problem becomes
+//    unsatisfiable, then the circuit is minimal for the instruction set.
+//
+// All of the operations are single-cycle, single-word instructions on
+// AVR, so the number of instructions is also the cost.
+
+#define SYNTH_OPS 5
+
+// Number of extra two-address instructions to try when the greedy
+// circuits need more temporaries than are available.
+#define SYNTH_SLACK 3
+
+// Adds clauses that force exactly one of a set of literals to be true.
+static void synth_exactly_one(SatSolver &solver, const std::vector<int> &lits)
+{
+    solver.addClause(lits);
+    for (size_t i = 0; i < lits.size(); ++i) {
+        for (size_t j = i + 1; j < lits.size(); ++j)
+            solver.addClause(lits[i] ^ 1, lits[j] ^ 1);
+    }
+}
+
+// Adds clauses for "lit1 implies (a == b)".
+static void synth_implies_equal(SatSolver &solver, int lit1, int a, int b)
+{
+    solver.addClause(lit1 ^ 1, a ^ 1, b);
+    solver.addClause(lit1 ^ 1, a, b ^ 1);
+}
+
+// Evaluates a circuit on all inputs at once.  Bit x of each word is the
+// value of the variable when the S-box input is x.
+static std::vector<uint64_t> synth_simulate(const SboxCircuit &circuit)
+{
+    unsigned points = 1U << circuit.bits;
+    std::vector<uint64_t> values(circuit.bits + circuit.temps, 0);
+    for (unsigned var = 0; var < circuit.bits; ++var) {
+        for (unsigned x = 0; x < points; ++x) {
+            if ((x >> var) & 1)
+                values[var] |= ((uint64_t)1) << x;
+        }
+    }
+    for (size_t index = 0; index < circuit.gates.size(); ++index) {
+        const SboxGate &gate = circuit.gates[index];
+        switch (gate.op) {
+        case SboxGate::Move: values[gate.dest] = values[gate.src]; break;
+        case SboxGate::And:  values[gate.dest] &= values[gate.src]; break;
+        case SboxGate::Or:   values[gate.dest] |= values[gate.src]; break;
+        case SboxGate::Xor:  values[gate.dest] ^= values[gate.src]; break;
+        case SboxGate::Not:  values[gate.dest] = ~values[gate.dest]; break;
+        }
+    }
+    return values;
+}
+
+// Gets the truth table for one of the output bits of an S-box.
+static uint64_t synth_output
+    (const std::vector<unsigned char> &table, unsigned bit)
+{
+    uint64_t value = 0;
+    for (size_t x = 0; x < table.size(); ++x) {
+        if ((table[x] >> bit) & 1)
+            value |= ((uint64_t)1) << x;
+    }
+    return value;
+}
+
+// Gate in a straight-line circuit, which produces a new signal.  Signals
+// 0 to bits - 1 are the S-box inputs and the rest are gate outputs.
+struct SynthSsaGate
+{
+    SboxGate::Op op;    // And, Or, Xor, or Not.
+    unsigned a;         // First input signal.
+    unsigned b;         // Second input signal; same as "a" for Not.
+};
+
+// Operations that are used in straight-line circuits.
+static SboxGate::Op const synth_ssa_ops[] = {
+    SboxGate::And, SboxGate::Or, SboxGate::Xor, SboxGate::Not
+};
+#define SYNTH_SSA_OPS 4
+
+// Evaluates a gate on truth tables.
+static uint64_t synth_eval(SboxGate::Op op, uint64_t a, uint64_t b)
+{
+    switch (op) {
+    case SboxGate::And:  return a & b;
+    case SboxGate::Or:   return a | b;
+    case SboxGate::Xor:  return a ^ b;
+    case SboxGate::Not:  return ~a;
+    default:             return b;
+    }
+}
+
+// Tries to find exactly "count" new gates that compute all of the
+// "targets" from the "signals" that are already available.  On success,
+// the gates are appended to "gates", their values are appended to
+// "signals", and "found" gets the signal for each target.
+static SatSolver::Result synth_solve_gates
+    (std::vector<uint64_t> &signals, const std::vector<uint64_t> &targets,
+     unsigned points, unsigned count, unsigned long conflict_limit,
+     std::vector<SynthSsaGate> &gates, std::vector<unsigned> &found)
+{
+    SatSolver solver;
+    unsigned first = signals.size();
+    std::vector<std::vector<int> > val;
+    std::vector<std::vector<int> > sel_a(count);
+    std::vector<std::vector<int> > sel_b(count);
+    std::vector<std::vector<int> > ops(count);
+    std::vector<int> lits;
+
+    // The existing signals are constants.
+    int truth = solver.newVar() * 2;
+    lits.assign(1, truth);
+    solver.addClause(lits);
+    for (unsigned sig = 0; sig < first; ++sig) {
+        std::vector<int> values;
+        for (unsigned x = 0; x < points; ++x)
+            values.push_back(((signals[sig] >> x) & 1) ? truth : truth ^ 1);
+        val.push_back(values);
+    }
+
+    // Encode the new gates.  The inputs to two-input gates are in
+    // increasing order to break symmetry.
+    for (unsigned gate = 0; gate < count; ++gate) {
+        unsigned nsigs = first + gate;
+        for (unsigned sig = 0; sig < nsigs; ++sig) {
+            sel_a[gate].push_back(solver.newVar() * 2);
+            sel_b[gate].push_back(solver.newVar() * 2);
+        }
+        for (unsigned index = 0; index < SYNTH_SSA_OPS; ++index)
+            ops[gate].push_back(solver.newVar() * 2);
+        synth_exactly_one(solver, sel_a[gate]);
+        synth_exactly_one(solver, sel_b[gate]);
+        synth_exactly_one(solver, ops[gate]);
+        int op_not = ops[gate][3];
+        for (unsigned sig = 0; sig < nsigs; ++sig) {
+            synth_implies_equal(solver, op_not, sel_a[gate][sig], sel_b[gate][sig]);
+            for (unsigned other = 0; other <= sig; ++other) {
+                solver.addClause(op_not, sel_a[gate][sig] ^ 1,
+                                 sel_b[gate][other] ^ 1);
+            }
+        }
+        std::vector<int> values;
+        for (unsigned x = 0; x < points; ++x) {
+            int a = solver.newVar() * 2;
+            int b = solver.newVar() * 2;
+            int y = solver.newVar() * 2;
+            for (unsigned sig = 0; sig < nsigs; ++sig) {
+                synth_implies_equal(solver, sel_a[gate][sig], a, val[sig][x]);
+                synth_implies_equal(solver, sel_b[gate][sig], b, val[sig][x]);
+            }
+            int o = ops[gate][0] ^ 1;
+            solver.addClause(o, y ^ 1, a);
+            solver.addClause(o, y ^ 1, b);
+            lits.clear();
+            lits.push_back(o);
+            lits.push_back(y);
+            lits.push_back(a ^ 1);
+            lits.push_back(b ^ 1);
+            solver.addClause(lits);
+            o = ops[gate][1] ^ 1;
+            solver.addClause(o, y, a ^ 1);
+            solver.addClause(o, y, b ^ 1);
+            lits.clear();
+            lits.push_back(o);
+            lits.push_back(y ^ 1);
+            lits.push_back(a);
+            lits.push_back(b);
+            solver.addClause(lits);
+            o = ops[gate][2] ^ 1;
+            for (int index = 0; index < 4; ++index) {
+                bool ya = (index & 1) != 0;
+                bool yb = (index & 2) != 0;
+                lits.clear();
+                lits.push_back(o);
+                lits.push_back(ya ? a ^ 1 : a);
+                lits.push_back(yb ? b ^ 1 : b);
+                lits.push_back((ya ^ yb) ? y : y ^ 1);
+                solver.addClause(lits);
+            }
+            synth_implies_equal(solver, op_not, y, a ^ 1);
+            values.push_back(y);
+        }
+        val.push_back(values);
+    }
+
+    // Every target must be one of the signals, and every new gate
+    // must be used by a later gate or be a target.
+    unsigned nsigs = first + count;
+    std::vector<std::vector<int> > outs(targets.size());
+    for (size_t target = 0; target < targets.size(); ++target) {
+        for (unsigned sig = 0; sig < nsigs; ++sig) {
+            int m = solver.newVar() * 2;
+            outs[target].push_back(m);
+            for (unsigned x = 0; x < points; ++x) {
+                int v = val[sig][x];
+                solver.addClause(m ^ 1, ((targets[target] >> x) & 1) ? v : v ^ 1);
+            }
+        }
+        synth_exactly_one(solver, outs[target]);
+    }
+    for (unsigned gate = 0; gate < count; ++gate) {
+        unsigned sig = first + gate;
+        lits.clear();
+        for (unsigned later = gate + 1; later < count; ++later) {
+            lits.push_back(sel_a[later][sig]);
+            lits.push_back(sel_b[later][sig]);
+        }
+        for (size_t target = 0; target < targets.size(); ++target)
+            lits.push_back(outs[target][sig]);
+        solver.addClause(lits);
+    }
+
+    // Solve and extract the gates from the model.
+    SatSolver::Result result = solver.solve(conflict_limit);
+    if (result != SatSolver::Sat)
+        return result;
+    for (unsigned gate = 0; gate < count; ++gate) {
+        SynthSsaGate g;
+        g.op = SboxGate::Not;
+        g.a = 0;
+        g.b = 0;
+        for (unsigned sig = 0; sig < (first + gate); ++sig) {
+            if (solver.modelValue(sel_a[gate][sig] >> 1))
+                g.a = sig;
+            if (solver.modelValue(sel_b[gate][sig] >> 1))
+                g.b = sig;
+        }
+        for (unsigned index = 0; index < SYNTH_SSA_OPS; ++index) {
+            if (solver.modelValue(ops[gate][index] >> 1))
+                g.op = synth_ssa_ops[index];
+        }
+        gates.push_back(g);
+        signals.push_back(synth_eval(g.op, signals[g.a], signals[g.b]));
+    }
+    found.clear();
+    for (size_t target = 0; target < targets.size(); ++target) {
+        for (unsigned sig = 0; sig < nsigs; ++sig) {
+            if (solver.modelValue(outs[target][sig] >> 1))
+                found.push_back(sig);
+        }
+    }
+    return SatSolver::Sat;
+}
+
+// Builds a straight-line circuit one output bit at a time, in the
+// given order, using the smallest number of extra gates for each bit.
+static bool synth_greedy
+    (const std::vector<unsigned char> &table, unsigned bits,
+     const std::vector<unsigned> &order, unsigned max_gates,
+     unsigned long conflict_limit, std::vector<SynthSsaGate> &gates,
+     std::vector<unsigned> &outputs)
+{
+    std::vector<uint64_t> signals;
+    for (unsigned var = 0; var < bits; ++var) {
+        uint64_t value = 0;
+        for (unsigned x = 0; x < table.size(); ++x) {
+            if ((x >> var) & 1)
+                value |= ((uint64_t)1) << x;
+        }
+        signals.push_back(value);
+    }
+    gates.clear();
+    outputs.assign(bits, 0);
+    for (unsigned index = 0; index < bits; ++index) {
+        unsigned bit = order[index];
+        std::vector<uint64_t> targets(1, synth_output(table, bit));
+        std::vector<unsigned> found;
+        unsigned count = 0;
+        for (;;) {
+            if ((gates.size() + count) > max_gates)
+                return false;
+            SatSolver::Result result = synth_solve_gates
+                (signals, targets, table.size(), count, conflict_limit,
+                 gates, found);
+            if (result == SatSolver::Sat)
+                break;
+            ++count;
+        }
+        outputs[bit] = found[0];
+    }
+    return true;
+}
+
+// Converts a straight-line circuit into two-address form.  The gates are
+// scheduled in an order that lets them overwrite an input whose signal
+// is not needed afterwards as often as possible.  Otherwise a gate needs
+// a copy of its first input in a free variable first.  Returns false if
+// there are not enough temporaries.
+static bool synth_two_address
+    (unsigned bits, unsigned temps, const std::vector<SynthSsaGate> &gates,
+     const std::vector<unsigned> &outputs, SboxCircuit &circuit)
+{
+    unsigned nsigs = bits + gates.size();
+    unsigned nvars = bits + temps;
+    std::vector<unsigned> uses(nsigs, 0);
+    std::vector<int> location(nsigs, -1);
+    std::vector<int> owner(nvars, -1);
+    std::vector<bool> done(gates.size(), false);
+    for (size_t index = 0; index < gates.size(); ++index) {
+        ++(uses[gates[index].a]);
+        if (gates[index].b != gates[index].a)
+            ++(uses[gates[index].b]);
+    }
+    for (unsigned bit = 0; bit < bits; ++bit)
+        ++(uses[outputs[bit]]);
+    for (unsigned var = 0; var < bits; ++var) {
+        if (uses[var] > 0) {
+            location[var] = var;
+            owner[var] = var;
+        }
+    }
+    circuit.bits = bits;
+    circuit.temps = temps;
+    circuit.gates.clear();
+    circuit.outputs.clear();
+    for (size_t step = 0; step < gates.size(); ++step) {
+        // Find the first free variable in case we need it.
+        unsigned free_var;
+        for (free_var = 0; free_var < nvars && owner[free_var] >= 0; ++free_var)
+            ; // Keep looking.
+
+        // Choose the ready gate that does not need a copy and that frees
+        // up the most variables.
+        int best = -1;
+        int best_score = -1;
+        for (size_t index = 0; index < gates.size(); ++index) {
+            const SynthSsaGate &g = gates[index];
+            if (done[index] || location[g.a] < 0 || location[g.b] < 0)
+                continue;
+            bool in_place = uses[g.a] == 1 ||
+                (g.op != SboxGate::Not && uses[g.b] == 1);
+            if (!in_place && free_var >= nvars)
+                continue;
+            int score = (in_place ? 4 : 0) + (uses[g.a] == 1 ? 1 : 0) +
+                        (g.b != g.a && uses[g.b] == 1 ? 1 : 0);
+            if (score > best_score) {
+                best = index;
+                best_score = score;
+            }
+        }
+        if (best < 0)
+            return false;
+        const SynthSsaGate &g = gates[best];
+        done[best] = true;
+
+        // Overwrite the input that is no longer needed, or a copy.
+        unsigned dest_sig = g.a;
+        unsigned src_sig = g.b;
+        if (uses[g.a] != 1 && g.op != SboxGate::Not && uses[g.b] == 1) {
+            dest_sig = g.b;
+            src_sig = g.a;
+        }
+        SboxGate gate;
+        gate.op = g.op;
+        if (uses[dest_sig] == 1) {
+            gate.dest = location[dest_sig];
+        } else {
+            SboxGate move;
+            move.op = SboxGate::Move;
+            move.dest = free_var;
+            move.src = location[dest_sig];
+            circuit.gates.push_back(move);
+            gate.dest = free_var;
+        }
+        gate.src = (g.op == SboxGate::Not) ? gate.dest : location[src_sig];
+        circuit.gates.push_back(gate);
+
+        // Free the variables of the signals that are no longer needed.
+        if (--(uses[g.a]) == 0)
+            owner[location[g.a]] = -1;
+        if (g.b != g.a && --(uses[g.b]) == 0)
+            owner[location[g.b]] = -1;
+        unsigned sig = bits + best;
+        location[sig] = gate.dest;
+        owner[gate.dest] = sig;
+    }
+
+    // Copy any output that shares a signal with an earlier output.
+    for (unsigned bit = 0; bit < bits; ++bit) {
+        unsigned var = location[outputs[bit]];
+        for (unsigned prev = 0; prev < bit; ++prev) {
+            if (circuit.outputs[prev] != var)
+                continue;
+            for (var = 0; var < nvars && owner[var] >= 0; ++var)
+                ; // Find the first free variable.
+            if (var >= nvars)
+                return false;
+            SboxGate move;
+            move.op = SboxGate::Move;
+            move.dest = var;
+            move.src = location[outputs[bit]];
+            circuit.gates.push_back(move);
+            owner[var] = outputs[bit];
+            break;
+        }
+        circuit.outputs.push_back(var);
+    }
+    return true;
+}
+
+// Tries to find a two-address circuit with exactly "count" gates.
+static SatSolver::Result synth_solve_two_address
+    (const std::vector<unsigned char> &table, unsigned bits, unsigned temps,
+     unsigned count, unsigned long conflict_limit, SboxCircuit &circuit)
+{
+    SatSolver solver;
+    unsigned nvars = bits + temps;
+    unsigned points = 1U << bits;
+
+    // Contents of each variable and whether it has been written yet.
+    // Temporaries start off as zero, but are never read before they
+    // are written so that their real initial contents do not matter.
+    std::vector<int> val((count + 1) * nvars * points);
+    std::vector<int> def((count + 1) * nvars);
+    for (unsigned var = 0; var < nvars; ++var) {
+        for (unsigned x = 0; x < points; ++x) {
+            int v = solver.newVar() * 2;
+            val[var * points + x] = v;
+            bool bit = var < bits && ((x >> var) & 1) != 0;
+            std::vector<int> unit(1, bit ? v : v ^ 1);
+            solver.addClause(unit);
+        }
+        int d = solver.newVar() * 2;
+        def[var] = d;
+        std::vector<int> unit(1, var < bits ? d : d ^ 1);
+        solver.addClause(unit);
+    }
+
+    // Encode the gates.
+    std::vector<int> dests(count * nvars);
+    std::vector<int> srcs(count * nvars);
+    std::vector<int> ops(count * SYNTH_OPS);
+    for (unsigned step = 1; step <= count; ++step) {
+        int *dest = &(dests[(step - 1) * nvars]);
+        int *src = &(srcs[(step - 1) * nvars]);
+        int *op = &(ops[(step - 1) * SYNTH_OPS]);
+        const int *prev_val = &(val[(step - 1) * nvars * points]);
+        int *next_val = &(val[step * nvars * points]);
+        const int *prev_def = &(def[(step - 1) * nvars]);
+        int *next_def = &(def[step * nvars]);
+        std::vector<int> lits;
+        for (unsigned var = 0; var < nvars; ++var)
+            dest[var] = solver.newVar() * 2;
+        for (unsigned var = 0; var < nvars; ++var)
+            src[var] = solver.newVar() * 2;
+        for (unsigned index = 0; index < SYNTH_OPS; ++index)
+            op[index] = solver.newVar() * 2;
+        lits.assign(dest, dest + nvars);
+        synth_exactly_one(solver, lits);
+        lits.assign(src, src + nvars);
+        synth_exactly_one(solver, lits);
+        lits.assign(op, op + SYNTH_OPS);
+        synth_exactly_one(solver, lits);
+
+        // "Not" has the source the same as the destination, and the
+        // two-operand gates never have them the same.  Values that are
+        // read must have been written previously.
+        int op_not = op[SboxGate::Not];
+        for (unsigned var = 0; var < nvars; ++var) {
+            solver.addClause(op_not ^ 1, dest[var] ^ 1, src[var]);
+            solver.addClause(op_not, dest[var] ^ 1, src[var] ^ 1);
+            solver.addClause(src[var] ^ 1, prev_def[var]);
+            solver.addClause(op[SboxGate::And] ^ 1, dest[var] ^ 1, prev_def[var]);
+            solver.addClause(op[SboxGate::Or] ^ 1, dest[var] ^ 1, prev_def[var]);
+            solver.addClause(op[SboxGate::Xor] ^ 1, dest[var] ^ 1, prev_def[var]);
+            next_def[var] = solver.newVar() * 2;
+            solver.addClause(next_def[var] ^ 1, prev_def[var], dest[var]);
+            solver.addClause(next_def[var], prev_def[var] ^ 1);
+            solver.addClause(next_def[var], dest[var] ^ 1);
+        }
+
+        // Break symmetry by using the temporaries in order.
+        for (unsigned var = bits + 1; var < nvars; ++var)
+            solver.addClause(next_def[var] ^ 1, next_def[var - 1]);
+
+        // Rule out sequences that could be shorter, or that are the same
+        // as other sequences with the gates in a different order.  If two
+        // gates in a row are independent, then they must be in order of
+        // destination.  A value must not be overwritten by "Move" without
+        // being used first, and "Not" must not be applied twice in a row.
+        if (step > 1) {
+            const int *prev_dest = &(dests[(step - 2) * nvars]);
+            const int *prev_src = &(srcs[(step - 2) * nvars]);
+            const int *prev_op = &(ops[(step - 2) * SYNTH_OPS]);
+            for (unsigned u = 0; u < nvars; ++u) {
+                for (unsigned w = 0; w < u; ++w) {
+                    lits.clear();
+                    lits.push_back(prev_dest[u] ^ 1);
+                    lits.push_back(dest[w] ^ 1);
+                    lits.push_back(src[u]);
+                    lits.push_back(prev_src[w]);
+                    solver.addClause(lits);
+                }
+                solver.addClause
+                    (prev_dest[u] ^ 1, dest[u] ^ 1, op[SboxGate::Move] ^ 1);
+                lits.clear();
+                lits.push_back(prev_dest[u] ^ 1);
+                lits.push_back(dest[u] ^ 1);
+                lits.push_back(prev_op[SboxGate::Not] ^ 1);
+                lits.push_back(op_not ^ 1);
+                solver.addClause(lits);
+            }
+        }
+
+        // Compute the result of the gate on every input and update
+        // the destination variable.
+        for (unsigned x = 0; x < points; ++x) {
+            int a = solver.newVar() * 2;
+            int b = solver.newVar() * 2;
+            int y = solver.newVar() * 2;
+            for (unsigned var = 0; var < nvars; ++var) {
+                synth_implies_equal(solver, dest[var], a, prev_val[var * points + x]);
+                synth_implies_equal(solver, src[var], b, prev_val[var * points + x]);
+            }
+            synth_implies_equal(solver, op[SboxGate::Move], y, b);
+            synth_implies_equal(solver, op_not, y, a ^ 1);
+            int o = op[SboxGate::And] ^ 1;
+            solver.addClause(o, y ^ 1, a);
+            solver.addClause(o, y ^ 1, b);
+            lits.clear();
+            lits.push_back(o);
+            lits.push_back(y);
+            lits.push_back(a ^ 1);
+            lits.push_back(b ^ 1);
+            solver.addClause(lits);
+            o = op[SboxGate::Or] ^ 1;
+            solver.addClause(o, y, a ^ 1);
+            solver.addClause(o, y, b ^ 1);
+            lits.clear();
+            lits.push_back(o);
+            lits.push_back(y ^ 1);
+            lits.push_back(a);
+            lits.push_back(b);
+            solver.addClause(lits);
+            o = op[SboxGate::Xor] ^ 1;
+            for (int index = 0; index < 4; ++index) {
+                // Rule out every assignment where y != a ^ b.
+                bool ya = (index & 1) != 0;
+                bool yb = (index & 2) != 0;
+                int na = ya ? a ^ 1 : a;
+                int nb = yb ? b ^ 1 : b;
+                lits.clear();
+                lits.push_back(o);
+                lits.push_back(na);
+                lits.push_back(nb);
+                lits.push_back((ya ^ yb) ? y : y ^ 1);
+                solver.addClause(lits);
+            }
+            for (unsigned var = 0; var < nvars; ++var) {
+                int prev = prev_val[var * points + x];
+                int next = solver.newVar() * 2;
+                next_val[var * points + x] = next;
+                synth_implies_equal(solver, dest[var], next, y);
+                synth_implies_equal(solver, dest[var] ^ 1, next, prev);
+            }
+        }
+    }
+
+    // Every output bit must end up in a separate written variable.
+    std::vector<int> outs(bits * nvars);
+    const int *final_val = &(val[count * nvars * points]);
+    const int *final_def = &(def[count * nvars]);
+    for (unsigned bit = 0; bit < bits; ++bit) {
+        std::vector<int> lits;
+        for (unsigned var = 0; var < nvars; ++var) {
+            int m = solver.newVar() * 2;
+            outs[bit * nvars + var] = m;
+            lits.push_back(m);
+            solver.addClause(m ^ 1, final_def[var]);
+            for (unsigned x = 0; x < points; ++x) {
+                int v = final_val[var * points + x];
+                solver.addClause(m ^ 1, ((table[x] >> bit) & 1) ? v : v ^ 1);
+            }
+        }
+        synth_exactly_one(solver, lits);
+    }
+    for (unsigned var = 0; var < nvars; ++var) {
+        for (unsigned bit1 = 0; bit1 < bits; ++bit1) {
+            for (unsigned bit2 = bit1 + 1; bit2 < bits; ++bit2) {
+                solver.addClause(outs[bit1 * nvars + var] ^ 1,
+                                 outs[bit2 * nvars + var] ^ 1);
+            }
+        }
+    }
+
+    // Solve and extract the circuit from the model.
+    SatSolver::Result result = solver.solve(conflict_limit);
+    if (result != SatSolver::Sat)
+        return result;
+    circuit.bits = bits;
+    circuit.temps = temps;
+    circuit.gates.clear();
+    circuit.outputs.clear();
+    for (unsigned step = 0; step < count; ++step) {
+        SboxGate gate;
+        gate.op = SboxGate::Move;
+        gate.dest = 0;
+        gate.src = 0;
+        for (unsigned var = 0; var < nvars; ++var) {
+            if (solver.modelValue(dests[step * nvars + var] >> 1))
+                gate.dest = var;
+            if (solver.modelValue(srcs[step * nvars + var] >> 1))
+                gate.src = var;
+        }
+        for (unsigned index = 0; index < SYNTH_OPS; ++index) {
+            if (solver.modelValue(ops[step * SYNTH_OPS + index] >> 1))
+                gate.op = (SboxGate::Op)index;
+        }
+        circuit.gates.push_back(gate);
+    }
+    for (unsigned bit = 0; bit < bits; ++bit) {
+        for (unsigned var = 0; var < nvars; ++var) {
+            if (solver.modelValue(outs[bit * nvars + var] >> 1))
+                circuit.outputs.push_back(var);
+        }
+    }
+    return SatSolver::Sat;
+}
+
+// Removes gates whose results are never used.
+static void synth_remove_dead_gates(SboxCircuit &circuit)
+{
+    std::vector<bool> live(circuit.bits + circuit.temps, false);
+    for (unsigned bit = 0; bit < circuit.bits; ++bit)
+        live[circuit.outputs[bit]] = true;
+    std::vector<SboxGate> gates;
+    for (size_t index = circuit.gates.size(); index > 0; --index) {
+        const SboxGate &gate = circuit.gates[index - 1];
+        if (!live[gate.dest])
+            continue;
+        if (gate.op == SboxGate::Move)
+            live[gate.dest] = false;
+        live[gate.src] = true;
+        gates.insert(gates.begin(), gate);
+    }
+    circuit.gates = gates;
+}
+
+// Checks that a circuit computes the S-box, as a guard against bugs
+// in the encoding or the solver.
+static void synth_check
+    (const std::vector<unsigned char> &table, const SboxCircuit &circuit)
+{
+    std::vector<uint64_t> values = synth_simulate(circuit);
+    unsigned points = table.size();
+    uint64_t mask = (points == 64) ? ~((uint64_t)0)
+                                   : ((((uint64_t)1) << points) - 1);
+    for (unsigned bit = 0; bit < circuit.bits; ++bit) {
+        if ((values[circuit.outputs[bit]] & mask) != synth_output(table, bit))
+            throw std::logic_error("synthesised circuit is incorrect");
+    }
+}
+
+/**
+ * \brief Synthesises a bitsliced circuit for an S-box.
+ *
+ * \param table The S-box lookup table, with 2, 4, 8, 16, 32, or 64 entries.
+ * \param temps The number of temporary variables that may be used.
+ * \param max_gates The maximum number of gates to try.
+ * \param conflict_limit The maximum number of SAT conflicts to spend on
+ * each gate count.
+ * \param circuit Returns the circuit.
+ *
+ * \return The result of the synthesis.  If the SAT solver runs out of
+ * conflicts while trying to improve on a circuit, then the best circuit
+ * so far is returned but it is not known to be minimal.
+ *
+ * Throws std::invalid_argument if the table is not a valid S-box.
+ */
+SynthResult synthesiseSbox
+    (const std::vector<unsigned char> &table, unsigned temps,
+     unsigned max_gates, unsigned long conflict_limit,
+     SboxCircuit &circuit)
+{
+    unsigned bits = 0;
+    while (bits < 6 && (1U << bits) < table.size())
+        ++bits;
+    if (bits == 0 || (1U << bits) != table.size())
+        throw std::invalid_argument("S-box size must be a power of two");
+    for (size_t x = 0; x < table.size(); ++x) {
+        if (table[x] >= table.size())
+            throw std::invalid_argument("S-box value is out of range");
+    }
+
+    // Each gate computes at most one new function, so we need at least
+    // one gate for every output that is not already an input bit.
+    SboxCircuit inputs;
+    inputs.bits = bits;
+    inputs.temps = 0;
+    std::vector<uint64_t> start = synth_simulate(inputs);
+    unsigned min_gates = 0;
+    for (unsigned bit = 0; bit < bits; ++bit) {
+        uint64_t value = synth_output(table, bit);
+        unsigned var;
+        for (var = 0; var < bits; ++var) {
+            if (start[var] == value)
+                break;
+        }
+        if (var >= bits)
+            ++min_gates;
+    }
+
+    // Build greedy circuits one output bit at a time.  All orders of the
+    // output bits are tried for S-boxes with up to 4 bits, and rotations
+    // of the natural order for larger S-boxes.
+    std::vector<SynthSsaGate> best_gates;
+    bool found = false;
+    unsigned unlimited = max_gates + 1;
+    std::vector<unsigned> order;
+    for (unsigned bit = 0; bit < bits; ++bit)
+        order.push_back(bit);
+    unsigned rotations = 0;
+    do {
+        std::vector<SynthSsaGate> gates;
+        std::vector<unsigned> outputs;
+        if (synth_greedy(table, bits, order, max_gates, conflict_limit,
+                         gates, outputs)) {
+            SboxCircuit candidate;
+            if (synth_two_address(bits, temps, gates, outputs, candidate)) {
+                if (!found || candidate.gates.size() < circuit.gates.size()) {
+                    circuit = candidate;
+                    best_gates = gates;
+                    found = true;
+                }
+            } else if (synth_two_address(bits, bits + gates.size(), gates,
+                                         outputs, candidate) &&
+                       candidate.gates.size() < unlimited) {
+                unlimited = candidate.gates.size();
+            }
+        }
+        if (bits > 4) {
+            std::rotate(order.begin(), order.begin() + 1, order.end());
+            if (++rotations >= bits)
+                break;
+        }
+    } while (bits > 4 || std::next_permutation(order.begin(), order.end()));
+
+    // Try to find a straight-line circuit for all bits at once that is
+    // smaller than the best greedy one.
+    if (found) {
+        std::vector<uint64_t> targets;
+        for (unsigned bit = 0; bit < bits; ++bit)
+            targets.push_back(synth_output(table, bit));
+        unsigned count = best_gates.size();
+        while (count > min_gates) {
+            --count;
+            std::vector<uint64_t> signals(start);
+            std::vector<SynthSsaGate> gates;
+            std::vector<unsigned> outputs;
+            if (synth_solve_gates(signals, targets, table.size(), count,
+                                  conflict_limit, gates, outputs)
+                    != SatSolver::Sat)
+                break;
+            SboxCircuit candidate;
+            if (synth_two_address(bits, temps, gates, outputs, candidate) &&
+                    candidate.gates.size() < circuit.gates.size())
+                circuit = candidate;
+        }
+    }
+
+    // If none of the greedy circuits fit in the temporaries, then work up
+    // from the size that they would have had with enough temporaries,
+    // as the shortfall is usually made up with a few extra instructions.
+    unsigned count = circuit.gates.size();
+    unsigned floor = min_gates;
+    bool proven = true;
+    if (!found) {
+        unsigned limit = std::min(unlimited + SYNTH_SLACK, max_gates);
+        for (count = unlimited; count <= limit && !found; ++count) {
+            SatSolver::Result result = synth_solve_two_address
+                (table, bits, temps, count, conflict_limit, circuit);
+            if (result == SatSolver::Sat)
+                found = true;
+            else if (result == SatSolver::Unsat && proven)
+                floor = count + 1;
+            else
+                proven = false;
+        }
+        if (!found)
+            return SynthFailed;
+        synth_remove_dead_gates(circuit);
+        count = circuit.gates.size();
+    }
+
+    // Look for shorter two-address sequences directly, starting with one
+    // instruction less than the best so far and working down until the
+    // problem is unsatisfiable.  Satisfiable problems with spare gates
+    // are a lot easier to solve than the tight ones, which is why we
+    // don't start at the bottom and work up.
+    while (count > floor) {
+        --count;
+        SboxCircuit candidate;
+        SatSolver::Result result = synth_solve_two_address
+            (table, bits, temps, count, conflict_limit, candidate);
+        if (result == SatSolver::Unsat)
+            break;
+        if (result == SatSolver::Unknown) {
+            proven = false;
+            break;
+        }
+        synth_remove_dead_gates(candidate);
+        circuit = candidate;
+        count = candidate.gates.size();
+    }
+    synth_check(table, circuit);
+    return proven ? SynthOptimal : SynthFound;
+}
+
+/**
+ * \brief Applies an S-box circuit to a set of registers.
+ *
+ * \param code The code to add the instructions to.
+ * \param vars The registers for the variables, inputs first and
+ * then temporaries.  The registers are normally bitsliced, with each
+ * byte holding the same bit of eight S-box inputs.
+ *
+ * On exit, output bit j is in the register vars[outputs[j]].
+ */
+void SboxCircuit::apply(Code &code, const std::vector<Reg> &vars) const
+{
+    if (vars.size() != bits + temps)
+        throw std::invalid_argument("wrong number of S-box registers");
+    for (size_t index = 0; index < gates.size(); ++index) {
+        const SboxGate &gate = gates[index];
+        switch (gate.op) {
+        case SboxGate::Move: code.move(vars[gate.dest], vars[gate.src]); break;
+        case SboxGate::And:  code.logand(vars[gate.dest], vars[gate.src]); break;
+        case SboxGate::Or:   code.logor(vars[gate.dest], vars[gate.src]); break;
+        case SboxGate::Xor:  code.logxor(vars[gate.dest], vars[gate.src]); break;
+        case SboxGate::Not:  code.lognot(vars[gate.dest]); break;
+        }
+    }
+}
+
+// Writes the name of a circuit variable.
+static void synth_write_var(std::ostream &out, unsigned bits, unsigned var)
+{
+    if (var < bits)
+        out << 'x' << var;
+    else
+        out << 't' << (var - bits);
+}
+
+/**
+ * \brief Writes an S-box circuit as a C++ function that generates code.
+ *
+ * \param out The stream to write to.
+ * \param name The name of the function to write.
+ *
+ * The function is in the same style as the hand-written S-box functions
+ * in the generators, so it can be pasted into a new generator directly.
+ */
+void SboxCircuit::write(std::ostream &out, const char *name) const
+{
+    out << "static void " << name << "(Code &code";
+    for (unsigned var = 0; var < (bits + temps); ++var) {
+        out << ", const Reg &";
+        synth_write_var(out, bits, var);
+    }
+    out << ")\n{\n";
+    for (size_t index = 0; index < gates.size(); ++index) {
+        const SboxGate &gate = gates[index];
+        switch (gate.op) {
+        case SboxGate::Move: out << "    code.move("; break;
+        case SboxGate::And:  out << "    code.logand("; break;
+        case SboxGate::Or:   out << "    code.logor("; break;
+        case SboxGate::Xor:  out << "    code.logxor("; break;
+        case SboxGate::Not:  out << "    code.lognot("; break;
+        }
+        synth_write_var(out, bits, gate.dest);
+        if (gate.op != SboxGate::Not) {
+            out << ", ";
+            synth_write_var(out, bits, gate.src);
+        }
+        out << ");\n";
+    }
+    if (!gates.empty())
+        out << '\n';
+    out << "    // Outputs:";
+    for (unsigned bit = 0; bit < bits; ++bit) {
+        out << " y" << bit << " = ";
+        synth_write_var(out, bits, outputs[bit]);
+        out << (bit == (bits - 1) ? ".\n" : ",");
+    }
+    out << "}\n";
+}
+
+} // namespace AVR
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef GENAVR_SYNTH_H
+#define GENAVR_SYNTH_H
+
+#include "code.h"
+#include <ostream>
+#include <vector>
+
+namespace AVR
+{
+
+/**
+ * \brief Single two-address instruction in a bitsliced S-box circuit.
+ */
+struct SboxGate
+{
+    /**
+     * \brief Operations that a gate can perform.
+     */
+    enum Op
+    {
+        Move,       /**< dest = src */
+        And,        /**< dest &= src */
+        Or,         /**< dest |= src */
+        Xor,        /**< dest ^= src */
+        Not         /**< dest = ~dest */
+    };
+
+    Op op;                  /**< Operation to perform */
+    unsigned char dest;     /**< Destination variable */
+    unsigned char src;      /**< Source variable; same as dest for Not */
+};
+
+/**
+ * \brief Bitsliced circuit that computes an S-box with two-address
+ * AVR instructions.
+ *
+ * Variables 0 to bits - 1 hold the input bits of the S-box, with bit 0
+ * the least significant.  The remaining variables are temporaries whose
+ * initial contents are never used.  After the gates have been applied,
+ * output bit j of the S-box is in variable outputs[j].
+ */
+struct SboxCircuit
+{
+    unsigned bits;                      /**< Number of input/output bits */
+    unsigned temps;                     /**< Number of temporaries */
+    std::vector<SboxGate> gates;        /**< Gates to apply in order */
+    std::vector<unsigned char> outputs; /**< Variable for each output bit */
+
+    void apply(Code &code, const std::vector<Reg> &vars) const;
+    void write(std::ostream &out, const char *name) const;
+};
+
+/**
+ * \brief Result of synthesising an S-box circuit.
+ */
+enum SynthResult
+{
+    SynthOptimal,       /**< Circuit found and proven to be minimal */
+    SynthFound,         /**< Circuit found but may not be minimal */
+    SynthFailed         /**< No circuit found within the limits */
+};
+
+SynthResult synthesiseSbox
+    (const std::vector<unsigned char> &table, unsigned temps,
+     unsigned max_gates, unsigned long conflict_limit,
+     SboxCircuit &circuit);
+
+} // namespace AVR
+
+#endif
@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "trace.h"
+#include "code.h"
+#include <cstring>
+
+namespace AVR
+{
+
+// The binary trace format is as follows, with all integers little-endian:
+//
+//      "GCTRACE" 0x00          Magic number.
+//      u32 version             Version of the format, currently 1.
+//      u32 num_names           Number of run names.
+//      names                   u16 length followed by the bytes of the name.
+//      u32 num_events          Number of events.
+//      events                  16 bytes for each event.
+//
+// Each event consists of u32 cycles, u32 regs, u16 pc, u16 address,
+// u8 type, u8 flags, u8 accesses, and u8 reserved.
+
+static char const trace_magic[8] = {'G', 'C', 'T', 'R', 'A', 'C', 'E', 0};
+
+#define TRACE_VERSION 1
+
+/**
+ * \brief Constructs a new trace recorder.
+ *
+ * \param capacity Number of events to keep in ring mode, or zero to
+ * record every event in full mode.
+ */
+Trace::Trace(unsigned capacity)
+    : m_capacity(capacity)
+    , m_next(0)
+    , m_wrapped(false)
+{
+    if (capacity)
+        m_events.reserve(capacity);
+}
+
+Trace::~Trace()
+{
+}
+
+/**
+ * \brief Marks the start of a new run of the interpreter.
+ *
+ * \param name Name of the function that is being run.
+ */
+void Trace::begin(const std::string &name)
+{
+    TraceEvent event;
+    memset(&event, 0, sizeof(event));
+    event.type = RunStart;
+    event.pc = (uint16_t)m_names.size();
+    m_names.push_back(name);
+    record(event);
+}
+
+/**
+ * \brief Gets the events in this trace in the order they were recorded.
+ *
+ * \return A copy of the events, oldest first.
+ */
+std::vector<TraceEvent> Trace::events() const
+{
+    if (!m_wrapped)
+        return m_events;
+    std::vector<TraceEvent> result(m_events.begin() + m_next, m_events.end());
+    result.insert(result.end(), m_events.begin(), m_events.begin() + m_next);
+    return result;
+}
+
+static void write_u8(std::ostream &ostream, unsigned value)
+{
+    ostream.put((char)value);
+}
+
+static void write_u16(std::ostream &ostream, unsigned value)
+{
+    write_u8(ostream, value & 0xFF);
+    write_u8(ostream, (value >> 8) & 0xFF);
+}
+
+static void write_u32(std::ostream &ostream, uint32_t value)
+{
+    write_u16(ostream, value & 0xFFFF);
+    write_u16(ostream, (value >> 16) & 0xFFFF);
+}
+
+/**
+ * \brief Writes this trace to a stream in the compact binary format.
+ *
+ * \param ostream The stream to write to, which should be in binary mode.
+ */
+void Trace::write(std::ostream &ostream) const
+{
+    ostream.write(trace_magic, sizeof(trace_magic));
+    write_u32(ostream, TRACE_VERSION);
+    write_u32(ostream, m_names.size());
+    for (size_t index = 0; index < m_names.size(); ++index) {
+        const std::string &name = m_names[index];
+        write_u16(ostream, name.size());
+        ostream.write(name.data(), name.size());
+    }
+    std::vector<TraceEvent> list = events();
+    write_u32(ostream, list.size());
+    for (size_t index = 0; index < list.size(); ++index) {
+        const TraceEvent &event = list[index];
+        write_u32(ostream, event.cycles);
+        write_u32(ostream, event.regs);
+        write_u16(ostream, event.pc);
+        write_u16(ostream, event.address);
+        write_u8(ostream, event.type);
+        write_u8(ostream, event.flags);
+        write_u8(ostream, event.accesses);
+        write_u8(ostream, event.reserved);
+    }
+}
+
+static bool read_bytes(std::istream &istream, unsigned char *data, size_t len)
+{
+    istream.read((char *)data, len);
+    return (size_t)(istream.gcount()) == len;
+}
+
+static bool read_u16(std::istream &istream, uint16_t &value)
+{
+    unsigned char data[2];
+    if (!read_bytes(istream, data, sizeof(data)))
+        return false;
+    value = data[0] | (((uint16_t)(data[1])) << 8);
+    return true;
+}
+
+static bool read_u32(std::istream &istream, uint32_t &value)
+{
+    uint16_t low, high;
+    if (!read_u16(istream, low) || !read_u16(istream, high))
+        return false;
+    value = low | (((uint32_t)high) << 16);
+    return true;
+}
+
+/**
+ * \brief Reads a trace from a stream in the compact binary format.
+ *
+ * \param istream The stream to read from, which should be in binary mode.
+ *
+ * \return Returns true if the trace was read, or false if the stream
+ * does not contain a valid trace.
+ *
+ * The trace will be in full mode after it has been read.
+ */
+bool Trace::read(std::istream &istream)
+{
+    unsigned char magic[sizeof(trace_magic)];
+    uint32_t version, count;
+    m_capacity = 0;
+    m_next = 0;
+    m_wrapped = false;
+    m_events.clear();
+    m_names.clear();
+    if (!read_bytes(istream, magic, sizeof(magic)) ||
+            memcmp(magic, trace_magic, sizeof(magic)) != 0)
+        return false;
+    if (!read_u32(istream, version) || version != TRACE_VERSION)
+        return false;
+    if (!read_u32(istream, count))
+        return false;
+    for (uint32_t index = 0; index < count; ++index) {
+        uint16_t len;
+        if (!read_u16(istream, len))
+            return false;
+        std::string name(len, '\0');
+        if (len && !read_bytes(istream, (unsigned char *)&(name[0]), len))
+            return false;
+        m_names.push_back(name);
+    }
+    if (!read_u32(istream, count))
+        return false;
+    m_events.reserve(count);
+    for (uint32_t index = 0; index < count; ++index) {
+        TraceEvent event;
+        unsigned char data[4];
+        if (!read_u32(istream, event.cycles) ||
+                !read_u32(istream, event.regs) ||
+                !read_u16(istream, event.pc) ||
+                !read_u16(istream, event.address) ||
+                !read_bytes(istream, data, sizeof(data)))
+            return false;
+        event.type = data[0];
+        event.flags = data[1];
+        event.accesses = data[2];
+        event.reserved = data[3];
+        m_events.push_back(event);
+    }
+    return true;
+}
+
+// Writes a string to a JSON output stream with escaping.
+static void write_json_string(std::ostream &ostream, const std::string &str)
+{
+    static char const hex[] = "0123456789abcdef";
+    ostream << '"';
+    for (size_t index = 0; index < str.size(); ++index) {
+        unsigned char ch = (unsigned char)(str[index]);
+        if (ch == '"' || ch == '\\') {
+            ostream << '\\' << (char)ch;
+        } else if (ch < 0x20) {
+            ostream << "\\u00" << hex[ch >> 4] << hex[ch & 0x0F];
+        } else {
+            ostream << (char)ch;
+        }
+    }
+    ostream << '"';
+}
+
+// Statistics for a region of the trace between two labels.
+struct TraceRegion
+{
+    std::string name;
+    unsigned long long start;
+    unsigned long long end;
+    unsigned insns;
+    unsigned reads;
+    unsigned writes;
+
+    void reset(const std::string &n, unsigned long long ts)
+    {
+        name = n;
+        start = ts;
+        end = ts;
+        insns = 0;
+        reads = 0;
+        writes = 0;
+    }
+};
+
+// Writes a region to a JSON output stream as a Chrome trace event.
+static void write_json_region
+    (std::ostream &ostream, const TraceRegion &region, bool &first)
+{
+    if (!region.insns)
+        return;
+    if (!first)
+        ostream << ",";
+    first = false;
+    ostream << std::endl << "{\"name\":";
+    write_json_string(ostream, region.name);
+    ostream << ",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":" << region.start
+            << ",\"dur\":" << (region.end - region.start)
+            << ",\"args\":{\"insns\":" << region.insns
+            << ",\"reads\":" << region.reads
+            << ",\"writes\":" << region.writes << "}}";
+}
+
+/**
+ * \brief Writes this trace in the Chrome trace event JSON format.
+ *
+ * \param ostream The stream to write to.
+ *
+ * The output can be loaded into "chrome://tracing" or Perfetto.  Each run
+ * becomes a slice named after its function, with nested slices for the
+ * regions of code between labels.  Timestamps are in cycles, with the
+ * runs laid end to end in the order that they were executed.
+ */
+void Trace::writeJSON(std::ostream &ostream) const
+{
+    std::vector<TraceEvent> list = events();
+    TraceRegion run, region;
+    unsigned long long base = 0;
+    unsigned long long last = 0;
+    bool inRun = false;
+    bool first = true;
+    ostream << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    for (size_t index = 0; index < list.size(); ++index) {
+        const TraceEvent &event = list[index];
+        if (event.type == RunStart) {
+            // Finish the previous run and start the next one.
+            if (inRun) {
+                write_json_region(ostream, region, first);
+                write_json_region(ostream, run, first);
+                base = run.end;
+            }
+            std::string name = "run";
+            if (event.pc < m_names.size())
+                name = m_names[event.pc];
+            run.reset(name, base);
+            region.reset("entry", base);
+            last = base;
+            inRun = true;
+            continue;
+        }
+        unsigned long long ts = base + event.cycles;
+        if (!inRun) {
+            // The start of the run was lost when the ring buffer wrapped.
+            run.reset("(truncated)", ts);
+            region.reset("(truncated)", ts);
+            last = ts;
+            inRun = true;
+        }
+        if (event.type == Insn::LABEL) {
+            // Labels start a new region, named after the label's offset
+            // in the same way as the generated assembly code.
+            region.end = last;
+            write_json_region(ostream, region, first);
+            region.reset("label " + std::to_string(event.pc), last);
+        }
+        ++(region.insns);
+        ++(run.insns);
+        if (event.flags & MemRead) {
+            region.reads += event.accesses;
+            run.reads += event.accesses;
+        }
+        if (event.flags & MemWrite) {
+            region.writes += event.accesses;
+            run.writes += event.accesses;
+        }
+        region.end = ts;
+        run.end = ts;
+        last = ts;
+    }
+    if (inRun) {
+        write_json_region(ostream, region, first);
+        write_json_region(ostream, run, first);
+    }
+    ostream << std::endl << "]}" << std::endl;
+}
+
+} // namespace AVR
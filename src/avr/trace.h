@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef GENAVR_TRACE_H
+#define GENAVR_TRACE_H
+
+#include <vector>
+#include <string>
+#include <istream>
+#include <ostream>
+#include <stdint.h>
+
+namespace AVR
+{
+
+/**
+ * \brief Single event in an interpreter execution trace.
+ *
+ * Events are fixed-size so that recording one is little more than
+ * a copy into a pre-allocated buffer.
+ */
+struct TraceEvent
+{
+    uint32_t cycles;    /**< Cumulative cycles after the instruction */
+    uint32_t regs;      /**< Bit mask of the registers that were written */
+    uint16_t pc;        /**< Index of the instruction, or the run name */
+    uint16_t address;   /**< First memory address touched by the insn */
+    uint8_t type;       /**< Insn::Type, or Trace::RunStart */
+    uint8_t flags;      /**< Trace::MemRead and Trace::MemWrite */
+    uint8_t accesses;   /**< Number of memory bytes touched by the insn */
+    uint8_t reserved;   /**< Reserved for future use; always zero */
+};
+
+/**
+ * \brief Records the execution of generated code in the interpreter.
+ *
+ * The trace can either record everything ("full" mode) or only the
+ * most recent events ("ring" mode), which keeps memory usage bounded
+ * when tracing an entire set of known answer tests.
+ */
+class Trace
+{
+public:
+    explicit Trace(unsigned capacity = 0);
+    ~Trace();
+
+    /**
+     * \brief Special event type that marks the start of a new run.
+     *
+     * The "pc" field of the event is the index of the run's name.
+     */
+    static const uint8_t RunStart = 0xFF;
+
+    /**
+     * \brief Flag that indicates that an event read from memory.
+     */
+    static const uint8_t MemRead = 0x01;
+
+    /**
+     * \brief Flag that indicates that an event wrote to memory.
+     */
+    static const uint8_t MemWrite = 0x02;
+
+    /**
+     * \brief Determine if this trace is a ring buffer.
+     *
+     * \return Returns true for ring mode or false for full mode.
+     */
+    bool isRing() const { return m_capacity != 0; }
+
+    void begin(const std::string &name);
+    void record(const TraceEvent &event)
+    {
+        if (!m_capacity) {
+            m_events.push_back(event);
+        } else if (m_events.size() < m_capacity) {
+            m_events.push_back(event);
+        } else {
+            m_events[m_next] = event;
+            m_wrapped = true;
+        }
+        if (m_capacity && ++m_next >= m_capacity)
+            m_next = 0;
+    }
+
+    std::vector<TraceEvent> events() const;
+    const std::vector<std::string> &names() const { return m_names; }
+
+    void write(std::ostream &ostream) const;
+    bool read(std::istream &istream);
+    void writeJSON(std::ostream &ostream) const;
+
+private:
+    unsigned m_capacity;
+    unsigned m_next;
+    bool m_wrapped;
+    std::vector<TraceEvent> m_events;
+    std::vector<std::string> m_names;
+};
+
+} // namespace AVR
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "unroll.h"
+#include <stdexcept>
+
+namespace AVR
+{
+
+static int unroll_gcd(int a, int b)
+{
+    while (b != 0) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/**
+ * \brief Constructs a plan for unrolling a round loop.
+ *
+ * \param perm Moves that the loop performs at the bottom of each round.
+ * The value in logical slot i moves to logical slot perm[i].
+ *
+ * Throws an exception if \a perm is not a permutation.
+ */
+RoundUnroller::RoundUnroller(const std::vector<int> &perm)
+    : m_perm(perm)
+    , m_period(1)
+{
+    int size = (int)perm.size();
+    std::vector<bool> used(size, false);
+    for (int slot = 0; slot < size; ++slot) {
+        if (perm[slot] < 0 || perm[slot] >= size || used[perm[slot]])
+            throw std::invalid_argument("invalid slot permutation");
+        used[perm[slot]] = true;
+    }
+
+    // The period is the LCM of the lengths of the cycles.
+    std::vector<bool> seen(size, false);
+    for (int slot = 0; slot < size; ++slot) {
+        if (seen[slot])
+            continue;
+        int length = 0;
+        int posn = slot;
+        while (!seen[posn]) {
+            seen[posn] = true;
+            posn = perm[posn];
+            ++length;
+        }
+        m_period = m_period / unroll_gcd(m_period, length) * length;
+    }
+}
+
+/**
+ * \brief Destroys this plan.
+ */
+RoundUnroller::~RoundUnroller()
+{
+}
+
+/**
+ * \brief Gets the layout at the start of a round of the unrolled loop.
+ *
+ * \param round The round number, which may be greater than the period.
+ *
+ * \return Physical slot for each logical slot.  Round 0 and every
+ * multiple of period() have the identity layout.
+ */
+std::vector<int> RoundUnroller::layout(int round) const
+{
+    std::vector<int> result(m_perm.size());
+    for (int slot = 0; slot < (int)result.size(); ++slot)
+        result[slot] = slot;
+    round %= m_period;
+    while (round-- > 0)
+        rename(result, m_perm);
+    return result;
+}
+
+/**
+ * \brief Renames the slots in a layout instead of moving the values.
+ *
+ * \param layout The layout to update.
+ * \param perm The value in logical slot i moves to logical slot perm[i].
+ *
+ * This can also be used for moves part way through a round body, with
+ * \a perm covering only the slots that move at that point.
+ */
+void RoundUnroller::rename(std::vector<int> &layout, const std::vector<int> &perm)
+{
+    std::vector<int> old(layout);
+    for (int slot = 0; slot < (int)perm.size(); ++slot)
+        layout[perm[slot]] = old[slot];
+}
+
+/**
+ * \brief Determines if unrolling the loop is worth the extra code size.
+ *
+ * \param loopWords Number of words in the round body with the moves.
+ * \param loopCycles Number of cycles for the round body with the moves.
+ * \param bodyWords Number of words in one renamed copy of the round body.
+ * \param bodyCycles Number of cycles for one renamed copy.
+ * \param maxExtraWords Maximum number of extra words that the caller
+ * is willing to spend on the unrolled copies.
+ *
+ * \return Returns true if the renamed copies save cycles and fit in
+ * the budget.
+ */
+bool RoundUnroller::worthwhile
+    (unsigned loopWords, unsigned long loopCycles,
+     unsigned bodyWords, unsigned long bodyCycles,
+     unsigned maxExtraWords) const
+{
+    if (bodyCycles >= loopCycles)
+        return false;
+    unsigned words = bodyWords * m_period;
+    if (words <= loopWords)
+        return true;
+    return (words - loopWords) <= maxExtraWords;
+}
+
+} // namespace AVR
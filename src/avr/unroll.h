@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef GENAVR_UNROLL_H
+#define GENAVR_UNROLL_H
+
+#include <vector>
+
+namespace AVR
+{
+
+/**
+ * \brief Plans the unrolling of a round loop whose state layout rotates.
+ *
+ * Some round functions finish by moving the state words around; e.g.
+ * a plane shift or a swap of two rows.  A loop has to perform those
+ * moves at the bottom of each round so that every iteration sees the
+ * same layout.  If the round body is instead unrolled once for each
+ * step of the permutation's period, each copy can use renamed slots
+ * and the moves disappear.
+ *
+ * Slots are numbered from 0 and can stand for registers or words in
+ * memory.  A layout maps each logical slot to the physical slot that
+ * currently holds its value.
+ */
+class RoundUnroller
+{
+public:
+    explicit RoundUnroller(const std::vector<int> &perm);
+    ~RoundUnroller();
+
+    /**
+     * \brief Gets the period of the permutation, which is the number
+     * of copies of the round body that an unrolled loop needs.
+     */
+    int period() const { return m_period; }
+
+    /**
+     * \brief Gets the number of slots in the permutation.
+     */
+    int slots() const { return (int)m_perm.size(); }
+
+    std::vector<int> layout(int round) const;
+
+    static void rename(std::vector<int> &layout, const std::vector<int> &perm);
+
+    bool worthwhile
+        (unsigned loopWords, unsigned long loopCycles,
+         unsigned bodyWords, unsigned long bodyCycles,
+         unsigned maxExtraWords) const;
+
+private:
+    std::vector<int> m_perm;
+    int m_period;
+};
+
+} // namespace AVR
+
+#endif
@@ -23,21 +23,53 @@
 #include "registry.h"
 #include "copyright.h"
 #include "testvector.h"
+#include "mappedfile.h"
 #include "avr/code.h"
+#include "avr/trace.h"
+#include "avr/diff.h"
+#include "avr/equiv.h"
+#include "avr/leakage.h"
+#include "avr/linker.h"
+#include "avr/elf.h"
+#include "avr/permute.h"
+#include "avr/synth.h"
 #include <iostream>
 #include <fstream>
+#include <list>
+#include <map>
 #include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <atomic>
+#include <exception>
+#include <thread>
 #include <getopt.h>
 
-#define short_options "c:D:lo:th"
+#define short_options "c:dD:eEJ:klm:o:O:ps:S:tT:r:j:yh"
 static struct option long_options[] = {
     {"copyright",   required_argument,  0,  'c'},
     {"define",      required_argument,  0,  'D'},
+    {"diff",        no_argument,        0,  'd'},
+    {"dispatch",    required_argument,  0,  'S'},
+    {"elf",         no_argument,        0,  'E'},
+    {"equiv",       no_argument,        0,  'e'},
+    {"jobs",        required_argument,  0,  'J'},
+    {"leakage",     no_argument,        0,  'k'},
     {"list",        no_argument,        0,  'l'},
+    {"mcu",         required_argument,  0,  'm'},
+    {"outline",     required_argument,  0,  'O'},
     {"output",      required_argument,  0,  'o'},
+    {"permute-bits", no_argument,       0,  'p'},
+    {"sbox-placement", required_argument, 0, 's'},
     {"test",        no_argument,        0,  't'},
+    {"trace",       required_argument,  0,  'T'},
+    {"trace-ring",  required_argument,  0,  'r'},
+    {"trace-json",  required_argument,  0,  'j'},
+    {"synth-sbox",  no_argument,        0,  'y'},
     {"help",        no_argument,        0,  'h'},
-    {0,             0,                  0,    0}
+    {0,            0,                  0,    0}
 };
 
 static void usage(const char *progname)
@@ -45,22 +77,79 @@ static void usage(const char *progname)
     std::cerr << "Usage: " << progname
         << " [options] TEMPLATE [TEST-VECTORS]"
         << std::endl;
+    std::cerr << "       " << progname
+        << " --diff OLD-DIR NEW-DIR"
+        << std::endl;
+    std::cerr << "       " << progname
+        << " --equiv NAME1 NAME2 STATE-SIZE [OUTPUT-SIZE [COUNT]]"
+        << std::endl;
+    std::cerr << "       " << progname
+        << " --leakage NAME STATE-SIZE SHARES PRESERVE-SIZE [COUNT [RUNS]]"
+        << std::endl;
+    std::cerr << "       " << progname
+        << " --permute-bits PERM"
+        << std::endl;
+    std::cerr << "       " << progname
+        << " --synth-sbox TABLE [TEMPS [MAX-GATES]]"
+        << std::endl;
     std::cerr << std::endl;
     std::cerr << "    --copyright FILE, -c FILE" << std::endl;
     std::cerr << "        Use the contents of FILE for Copyright messages." << std::endl;
     std::cerr << std::endl;
-    std::cerr << "    --define NAME, -D NAME" << std::endl;
-    std::cerr << "        Define the option NAME." << std::endl;
+    std::cerr << "    --define NAME[=VALUE], -D NAME[=VALUE]" << std::endl;
+    std::cerr << "        Define the option NAME, or set the template variable NAME to VALUE." << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "    --diff, -d" << std::endl;
+    std::cerr << "        Compare the generated code in OLD-DIR and NEW-DIR." << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "    --dispatch FILE, -S FILE" << std::endl;
+    std::cerr << "        Write a C dispatch table and selectors for the function variants to FILE." << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "    --elf, -E" << std::endl;
+    std::cerr << "        Write a relocatable ELF object instead of assembly code; requires --mcu." << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "    --equiv, -e" << std::endl;
+    std::cerr << "        Prove that two permutation functions are equivalent." << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "    --jobs COUNT, -J COUNT" << std::endl;
+    std::cerr << "        Generate up to COUNT function bodies at once; the default is one per CPU." << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "    --leakage, -k" << std::endl;
+    std::cerr << "        Test a masked permutation function for first-order leakage." << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "    --mcu NAME, -m NAME" << std::endl;
+    std::cerr << "        Generate code for a specific device or core instead of using \"#if\" fallbacks." << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "    --outline WORDS, -O WORDS" << std::endl;
+    std::cerr << "        Move repeated code into subroutines when that saves at least WORDS words." << std::endl;
     std::cerr << std::endl;
     std::cerr << "    --output FILE, -o FILE" << std::endl;
     std::cerr << "        Set the name of the output FILE, or '-' for standard output." << std::endl;
     std::cerr << std::endl;
+    std::cerr << "    --permute-bits, -p" << std::endl;
+    std::cerr << "        Compare the ways to perform the comma-separated bit permutation PERM." << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "    --sbox-placement MODE, -s MODE" << std::endl;
+    std::cerr << "        Place S-box tables in 'flash', 'ram', or 'auto[:BYTES]' for RAM if they fit." << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "    --synth-sbox, -y" << std::endl;
+    std::cerr << "        Synthesise a bitsliced circuit for the comma-separated S-box TABLE." << std::endl;
+    std::cerr << std::endl;
     std::cerr << "    --list, -l" << std::endl;
     std::cerr << "        List all supported algorithms." << std::endl;
     std::cerr << std::endl;
     std::cerr << "    --test, -t" << std::endl;
     std::cerr << "        Run tests on the algorithms instead of generating code." << std::endl;
     std::cerr << std::endl;
+    std::cerr << "    --trace FILE, -T FILE" << std::endl;
+    std::cerr << "        Write an execution trace of the tests to FILE." << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "    --trace-ring COUNT, -r COUNT" << std::endl;
+    std::cerr << "        Only keep the last COUNT events in the execution trace." << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "    --trace-json FILE, -j FILE" << std::endl;
+    std::cerr << "        Convert the execution trace in FILE into Chrome trace JSON." << std::endl;
+    std::cerr << std::endl;
     std::cerr << "    TEMPLATE" << std::endl;
     std::cerr << "        Name of the file containing the generator template." << std::endl;
     std::cerr << std::endl;
@@ -69,12 +158,96 @@ static void usage(const char *progname)
     std::cerr << std::endl;
 }
 
+// Execution trace recorder for the tests, or null if not tracing.
+static AVR::Trace *trace = 0;
+
+// Placement of S-box tables and the RAM budget for automatic placement.
+static AVR::Code::SboxPlacement sboxPlacement = AVR::Code::SboxInFlash;
+static unsigned sboxBudget = 512;
+
+static bool parseSboxPlacement
+    (const std::string &mode, AVR::Code::SboxPlacement &placement,
+     unsigned &budget);
+
+// Information about a device or core that code can be generated for.
+// The "arch" field is the architecture number for ELF object files.
+struct McuInfo
+{
+    const char *name;
+    const char *core;
+    unsigned arch;
+    bool movw;
+    bool lpmx;
+    bool rampz;
+    bool jmpcall;
+};
+static McuInfo const mcus[] = {
+    // Cores, by the names that avr-gcc uses for them.
+    {"avr2",        "avr2",     2,      false,  false,  false,  false},
+    {"avr25",       "avr25",    25,     true,   true,   false,  false},
+    {"avr31",       "avr31",    31,     false,  false,  true,   true},
+    {"avr35",       "avr35",    35,     true,   true,   false,  true},
+    {"avr4",        "avr4",     4,      true,   true,   false,  false},
+    {"avr5",        "avr5",     5,      true,   true,   false,  true},
+    {"avr51",       "avr51",    51,     true,   true,   true,   true},
+    {"avr6",        "avr6",     6,      true,   true,   true,   true},
+    {"avrrc",       "avrrc",    100,    false,  false,  false,  false},
+    {"avrxt",       "avrxt",    103,    true,   true,   false,  true},
+
+    // Some popular devices.
+    {"at90s8515",   "avr2",     2,      false,  false,  false,  false},
+    {"at90usb162",  "avr35",    35,     true,   true,   false,  true},
+    {"atmega103",   "avr31",    31,     false,  false,  true,   true},
+    {"atmega128",   "avr51",    51,     true,   true,   true,   true},
+    {"atmega1284p", "avr51",    51,     true,   true,   true,   true},
+    {"atmega2560",  "avr6",     6,      true,   true,   true,   true},
+    {"atmega32",    "avr5",     5,      true,   true,   false,  true},
+    {"atmega328p",  "avr5",     5,      true,   true,   false,  true},
+    {"atmega4809",  "avrxt",    103,    true,   true,   false,  true},
+    {"atmega644p",  "avr5",     5,      true,   true,   false,  true},
+    {"atmega8",     "avr4",     4,      true,   true,   false,  false},
+    {"attiny10",    "avrrc",    100,    false,  false,  false,  false},
+    {"attiny1614",  "avrxt",    103,    true,   true,   false,  false},
+    {"attiny26",    "avr2",     2,      false,  false,  false,  false},
+    {"attiny85",    "avr25",    25,     true,   true,   false,  false},
+    {0,             0,          0,      false,  false,  false,  false}
+};
+
+// Device to generate code for, or null to use "#if" fallbacks.
+static const McuInfo *mcu = 0;
+
+// Name of the file to write C dispatch stubs to, or empty for none.
+static std::string dispatchFilename;
+
+// Maximum number of function bodies to generate at once, or zero to
+// use one thread per CPU.
+static unsigned jobs = 0;
+
+// Minimum number of words that outlining repeated code must save,
+// or zero to leave the code as it was generated.
+static unsigned outlineSaving = 0;
+
 static void listAlgorithms(std::ostream &out);
+static int convertTrace(std::ostream &out, const std::string &filename);
+static int checkEquivalence
+    (std::ostream &out, const std::string &name1, const std::string &name2,
+     unsigned state_len, unsigned output_len, unsigned count);
+static int checkLeakage
+    (std::ostream &out, const std::string &name, unsigned state_len,
+     unsigned shares, unsigned preserve_len, unsigned count,
+     unsigned long runs);
+static int comparePermutations(std::ostream &out, const char *table);
+static int synthesiseSbox
+    (std::ostream &out, const char *table, unsigned temps, unsigned max_gates);
 static bool generateAndRunTests
-    (std::ostream &out, std::istream &templateFile, bool testMode,
+    (std::ostream &out, const gencrypto::MappedFile &templateFile,
+     bool testMode,
      const gencrypto::TestVectorFile &tests,
      const std::vector<std::string> &options,
      const std::string &copyrightFilename);
+static bool generateElf
+    (std::ostream &out, const gencrypto::MappedFile &templateFile,
+     const std::vector<std::string> &options);
 
 int main(int argc, char *argv[])
 {
@@ -84,8 +257,17 @@ int main(int argc, char *argv[])
     std::string copyrightFilename;
     std::string templateFilename;
     std::string testVectorFilename;
+    std::string traceFilename;
+    std::string traceJsonFilename;
+    unsigned traceRing = 0;
     bool list = false;
     bool test = false;
+    bool diff = false;
+    bool equiv = false;
+    bool leakage = false;
+    bool permute = false;
+    bool synth = false;
+    bool elf = false;
     int opt;
 
     // Parse the command-line options.
@@ -99,18 +281,85 @@ int main(int argc, char *argv[])
             options.push_back(optarg);
             break;
 
+        case 'd':
+            diff = true;
+            break;
+
+        case 'e':
+            equiv = true;
+            break;
+
+        case 'E':
+            elf = true;
+            break;
+
+        case 'J':
+            jobs = (unsigned)atoi(optarg);
+            break;
+
+        case 'k':
+            leakage = true;
+            break;
+
         case 'l':
             list = true;
             break;
 
+        case 'm':
+            for (mcu = mcus; mcu->name; ++mcu) {
+                if (!strcmp(mcu->name, optarg))
+                    break;
+            }
+            if (!mcu->name) {
+                std::cerr << optarg << ": unknown MCU" << std::endl;
+                return 1;
+            }
+            break;
+
         case 'o':
             outputFilename = optarg;
             break;
 
+        case 'O':
+            outlineSaving = (unsigned)atoi(optarg);
+            break;
+
+        case 'p':
+            permute = true;
+            break;
+
+        case 'S':
+            dispatchFilename = optarg;
+            break;
+
+        case 's':
+            if (!parseSboxPlacement(optarg, sboxPlacement, sboxBudget)) {
+                std::cerr << optarg << ": invalid S-box placement"
+                          << std::endl;
+                return 1;
+            }
+            break;
+
         case 't':
             test = true;
             break;
 
+        case 'T':
+            traceFilename = optarg;
+            break;
+
+        case 'r':
+            traceRing = (unsigned)atoi(optarg);
+            break;
+
+        case 'j':
+            traceJsonFilename = optarg;
+            break;
+
+        case 'y':
+            synth = true;
+            break;
+
         case 'h':
         default:
             usage(progname);
@@ -120,11 +369,41 @@ int main(int argc, char *argv[])
     if (options.empty()) {
         options.push_back("default");
     }
+    if (elf && (!mcu || test)) {
+        std::cerr << "--elf requires --mcu and cannot be used with --test"
+                  << std::endl;
+        return 1;
+    }
 
     // Generation requires a template.  Testing also requires test vectors.
-    std::ifstream templateFile;
+    gencrypto::MappedFile templateFile;
     std::ifstream testVectorFile;
-    if (!list) {
+    if (diff) {
+        if ((optind + 2) != argc) {
+            usage(progname);
+            return 1;
+        }
+    } else if (equiv) {
+        if ((optind + 3) > argc || (optind + 5) < argc) {
+            usage(progname);
+            return 1;
+        }
+    } else if (leakage) {
+        if ((optind + 4) > argc || (optind + 6) < argc) {
+            usage(progname);
+            return 1;
+        }
+    } else if (permute) {
+        if ((optind + 1) != argc) {
+            usage(progname);
+            return 1;
+        }
+    } else if (synth) {
+        if (optind >= argc || (optind + 3) < argc) {
+            usage(progname);
+            return 1;
+        }
+    } else if (!list && traceJsonFilename.empty()) {
         if (optind >= argc) {
             usage(progname);
             return 1;
@@ -134,20 +413,21 @@ int main(int argc, char *argv[])
             usage(progname);
             return 1;
         }
-        if (test) {
+        if ((optind + 1) < argc) {
             testVectorFilename = argv[optind + 1];
         }
-        templateFile.open(templateFilename);
-        if (!templateFile.is_open()) {
+        if (!templateFile.open(templateFilename)) {
             std::cerr << templateFilename
                       << ": could not open the template file"
                       << std::endl;
             return 1;
         }
-        if (test) {
+        if (test || (!dispatchFilename.empty() &&
+                     !testVectorFilename.empty())) {
+            // The dispatch stubs use the test vectors to measure cycles.
             testVectorFile.open(testVectorFilename);
-            if (!templateFile.is_open()) {
-                std::cerr << templateFilename
+            if (!testVectorFile.is_open()) {
+                std::cerr << testVectorFilename
                           << ": could not open the test vector file"
                           << std::endl;
                 return 1;
@@ -160,10 +440,14 @@ int main(int argc, char *argv[])
               gencrypto::Registration::registrations.end());
 
     // Open the output stream.
+    // The output is only flushed when the buffer fills up or at the end.
     std::ostream *out = &std::cout;
+    std::vector<char> outputBuffer(65536);
     std::ofstream file;
     if (outputFilename != "-") {
-        file.open(outputFilename);
+        file.rdbuf()->pubsetbuf(outputBuffer.data(), outputBuffer.size());
+        file.open(outputFilename, elf ? std::ios::out | std::ios::binary
+                                      : std::ios::out);
         if (!file.is_open()) {
             std::cerr << outputFilename
                       << ": could not open the output file"
@@ -179,22 +463,89 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    // Are we converting an execution trace into JSON?
+    if (!traceJsonFilename.empty()) {
+        return convertTrace(*out, traceJsonFilename);
+    }
+
+    // Are we comparing the generated code in two directories?
+    if (diff) {
+        return AVR::asmDiffDirectories(*out, argv[optind], argv[optind + 1])
+            ? 0 : 1;
+    }
+
+    // Are we checking two functions for equivalence?
+    if (equiv) {
+        unsigned state_len = (unsigned)atoi(argv[optind + 2]);
+        unsigned output_len = state_len;
+        unsigned count = 0;
+        if ((optind + 3) < argc)
+            output_len = (unsigned)atoi(argv[optind + 3]);
+        if ((optind + 4) < argc)
+            count = (unsigned)atoi(argv[optind + 4]);
+        return checkEquivalence
+            (*out, argv[optind], argv[optind + 1], state_len, output_len, count);
+    }
+
+    // Are we testing a masked function for leakage?
+    if (leakage) {
+        unsigned count = 0;
+        unsigned long runs = 2000;
+        if ((optind + 4) < argc)
+            count = (unsigned)atoi(argv[optind + 4]);
+        if ((optind + 5) < argc)
+            runs = (unsigned long)atol(argv[optind + 5]);
+        return checkLeakage
+            (*out, argv[optind], (unsigned)atoi(argv[optind + 1]),
+             (unsigned)atoi(argv[optind + 2]),
+             (unsigned)atoi(argv[optind + 3]), count, runs);
+    }
+
+    // Are we comparing the strategies for a bit permutation?
+    if (permute)
+        return comparePermutations(*out, argv[optind]);
+
+    // Are we synthesising an S-box circuit?
+    if (synth) {
+        unsigned temps = 2;
+        unsigned max_gates = 40;
+        if ((optind + 1) < argc)
+            temps = (unsigned)atoi(argv[optind + 1]);
+        if ((optind + 2) < argc)
+            max_gates = (unsigned)atoi(argv[optind + 2]);
+        return synthesiseSbox(*out, argv[optind], temps, max_gates);
+    }
+
     // Load the test vectors if necessary.
     gencrypto::TestVectorFile testVectors;
-    if (test) {
+    if (testVectorFile.is_open()) {
         testVectors.load(testVectorFile);
         testVectorFile.close();
     }
 
+    // Are we generating an ELF object file?
+    if (elf) {
+        return generateElf(*out, templateFile, options) ? 0 : 1;
+    }
+
     // Process the lines from the template and generate the output.
     // Alternatively, run tests for all function names in the template.
-    if (generateAndRunTests
-            (*out, templateFile, test, testVectors,
-             options, copyrightFilename)) {
-        return 0;
-    } else {
-        return 1;
+    AVR::Trace recorder(traceRing);
+    if (test && !traceFilename.empty())
+        trace = &recorder;
+    bool ok = generateAndRunTests
+        (*out, templateFile, test, testVectors, options, copyrightFilename);
+    if (trace) {
+        std::ofstream traceFile(traceFilename, std::ios::binary);
+        if (!traceFile.is_open()) {
+            std::cerr << traceFilename
+                      << ": could not open the trace file"
+                      << std::endl;
+            return 1;
+        }
+        trace->write(traceFile);
     }
+    return ok ? 0 : 1;
 }
 
 static void listAlgorithms(std::ostream &out)
@@ -207,15 +558,340 @@ static void listAlgorithms(std::ostream &out)
     }
 }
 
+static int convertTrace(std::ostream &out, const std::string &filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << filename << ": could not open the trace file"
+                  << std::endl;
+        return 1;
+    }
+    AVR::Trace recorder;
+    if (!recorder.read(file)) {
+        std::cerr << filename << ": invalid trace file" << std::endl;
+        return 1;
+    }
+    recorder.writeJSON(out);
+    return 0;
+}
+
+// Parses the argument to the "--sbox-placement" option.
+static bool parseSboxPlacement
+    (const std::string &mode, AVR::Code::SboxPlacement &placement,
+     unsigned &budget)
+{
+    if (mode == "flash") {
+        placement = AVR::Code::SboxInFlash;
+    } else if (mode == "ram") {
+        placement = AVR::Code::SboxInRAM;
+    } else if (mode == "auto") {
+        placement = AVR::Code::SboxAuto;
+    } else if (mode.rfind("auto:", 0) == 0 && mode.size() > 5 &&
+               mode.find_first_not_of("0123456789", 5) == std::string::npos) {
+        placement = AVR::Code::SboxAuto;
+        budget = (unsigned)atol(mode.c_str() + 5);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Determine if a function can be generated for the selected device.
+// The reduced and AVRxt cores need their own variants of the functions,
+// but avr5 functions can be adapted to the other classic cores.
+static bool mcuSupports(const gencrypto::Registration &info)
+{
+    if (!mcu)
+        return true;
+    std::string core(mcu->core);
+    if (info.platform() == "avrrc" || core == "avrrc")
+        return info.platform() == core;
+    if (info.platform() == "avrxt")
+        return core == "avrxt";
+    return true;
+}
+
+// Sets up the code generator flags for the platform of a function.
+static void setupPlatform(AVR::Code &code, const gencrypto::Registration &info)
+{
+    code.setSboxPlacement(sboxPlacement, sboxBudget);
+    if (mcu) {
+        // Fix the device features at generation time.
+        code.setFlag(AVR::Code::DeviceSpecific);
+        if (!mcu->movw)
+            code.clearFlag(AVR::Code::MoveWord);
+        if (mcu->lpmx)
+            code.setFlag(AVR::Code::HasLPMX);
+        if (mcu->rampz)
+            code.setFlag(AVR::Code::HasRAMPZ);
+        if (mcu->jmpcall)
+            code.setFlag(AVR::Code::HasJmpCall);
+    }
+    if (info.platform() == "avrrc") {
+        // Reduced AVR core: no MOVW, ADIW, SBIW, LDD, STD, or r0-r15.
+        code.clearFlag(AVR::Code::MoveWord);
+        code.setFlag(AVR::Code::ReducedCore);
+    } else if (info.platform() == "avrxt") {
+        // Modern AVR core: avr5 timings differ and flash is mapped.
+        code.setFlag(AVR::Code::XTCore);
+        code.setFlag(AVR::Code::FlashMapped);
+    }
+}
+
+// Writes a buffer in hexadecimal.
+static void writeHex(std::ostream &out, const unsigned char *data, size_t len)
+{
+    static char const hex[] = "0123456789abcdef";
+    for (size_t index = 0; index < len; ++index) {
+        out << hex[(data[index] >> 4) & 0x0F];
+        out << hex[data[index] & 0x0F];
+    }
+}
+
+static int synthesiseSbox
+    (std::ostream &out, const char *table, unsigned temps, unsigned max_gates)
+{
+    // Parse the comma-separated table, in decimal or 0x hexadecimal.
+    std::vector<unsigned char> values;
+    while (*table != '\0') {
+        char *end;
+        unsigned long value = strtoul(table, &end, 0);
+        if (end == table || value > 255 || (*end != ',' && *end != '\0')) {
+            std::cerr << table << ": invalid S-box table" << std::endl;
+            return 1;
+        }
+        values.push_back((unsigned char)value);
+        table = (*end == ',') ? end + 1 : end;
+    }
+
+    // Search for the smallest circuit.
+    AVR::SboxCircuit circuit;
+    AVR::SynthResult result;
+    try {
+        result = AVR::synthesiseSbox
+            (values, temps, max_gates, 100000, circuit);
+    } catch (std::invalid_argument &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    if (result == AVR::SynthFailed) {
+        std::cerr << "could not find a circuit with " << max_gates
+                  << " gates or less" << std::endl;
+        return 1;
+    }
+    out << "// " << circuit.gates.size() << " gates with " << temps
+        << (temps == 1 ? " temporary" : " temporaries");
+    if (result == AVR::SynthOptimal)
+        out << " (minimal)";
+    out << '\n';
+    circuit.write(out, "sbox");
+    return 0;
+}
+
+static int comparePermutations(std::ostream &out, const char *table)
+{
+    // Parse the comma-separated destination bits, in decimal or hex.
+    std::vector<unsigned char> perm;
+    while (*table != '\0') {
+        char *end;
+        unsigned long value = strtoul(table, &end, 0);
+        if (end == table || value > 239 || (*end != ',' && *end != '\0')) {
+            std::cerr << table << ": invalid bit permutation" << std::endl;
+            return 1;
+        }
+        perm.push_back((unsigned char)value);
+        table = (*end == ',') ? end + 1 : end;
+    }
+
+    // Cost the strategies within a permutation function that loads the
+    // bits from the state, permutes them, and stores them back again.
+    unsigned bytes = (perm.size() + 7) / 8;
+    AVR::Code base;
+    AVR::Reg reg;
+    std::vector<AVR::PermuteCandidate> candidates;
+    try {
+        base.prologue_permutation("permute_bits", 0);
+        reg = base.allocateReg(bytes);
+        base.ldz(reg, 0);
+        AVR::permuteCandidates
+            (base, reg, perm.data(), perm.size(), candidates);
+    } catch (std::invalid_argument &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    // Report the costs and check that each strategy gets it right.
+    bool ok = true;
+    for (size_t index = 0; index < candidates.size(); ++index) {
+        const AVR::PermuteCandidate &candidate = candidates[index];
+        out << AVR::permuteStrategyName(candidate.strategy) << ": ";
+        if (!candidate.applicable) {
+            out << "not applicable" << std::endl;
+            continue;
+        }
+        out << candidate.cycles << " cycles, " << candidate.words
+            << " words";
+        AVR::Code code(base);
+        AVR::Reg permuted(reg);
+        AVR::permuteBitsWith
+            (code, permuted, perm.data(), perm.size(), candidate.strategy);
+        code.stz(permuted, 0);
+        uint64_t seed = 0x9E3779B97F4A7C15ULL;
+        bool correct = true;
+        for (int run = 0; run < 64 && correct; ++run) {
+            unsigned char input[32];
+            unsigned char output[32];
+            unsigned char expected[32];
+            for (unsigned posn = 0; posn < bytes; ++posn) {
+                seed ^= seed << 13;
+                seed ^= seed >> 7;
+                seed ^= seed << 17;
+                input[posn] = (unsigned char)seed;
+            }
+            memcpy(output, input, bytes);
+            memcpy(expected, input, bytes);
+            for (size_t bit = 0; bit < perm.size(); ++bit)
+                expected[perm[bit] / 8] &= ~(1 << (perm[bit] % 8));
+            for (size_t bit = 0; bit < perm.size(); ++bit) {
+                if ((input[bit / 8] >> (bit % 8)) & 1)
+                    expected[perm[bit] / 8] |= 1 << (perm[bit] % 8);
+            }
+            code.exec_permutation(output, bytes);
+            correct = !memcmp(output, expected, bytes);
+        }
+        if (!correct) {
+            out << " (FAILED)";
+            ok = false;
+        }
+        out << std::endl;
+    }
+    AVR::Code code(base);
+    out << "best: "
+        << AVR::permuteStrategyName
+                (AVR::permuteBits(code, reg, perm.data(), perm.size()))
+        << std::endl;
+    return ok ? 0 : 1;
+}
+
+static int checkLeakage
+    (std::ostream &out, const std::string &name, unsigned state_len,
+     unsigned shares, unsigned preserve_len, unsigned count,
+     unsigned long runs)
+{
+    // Generate the code for the function.
+    gencrypto::Registration info = gencrypto::Registration::find(name);
+    if (info.empty() || !info.generateAVR()) {
+        std::cerr << name << ": unknown function" << std::endl;
+        return 1;
+    }
+    AVR::Code code;
+    setupPlatform(code, info);
+    info.generateAVR()(code);
+
+    // Run the leakage test.
+    AVR::LeakageReport report;
+    bool ok;
+    try {
+        ok = AVR::leakageMaskedPermutation
+            (code, state_len, shares, preserve_len, count, runs, report);
+    } catch (std::invalid_argument &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    out << name;
+    if (ok) {
+        out << ": no first-order leakage detected";
+    } else {
+        out << ": " << report.leaks << " leaking probes, the first at probe "
+            << report.first;
+    }
+    out << " (" << report.runs << " runs, " << report.probes
+        << " probes, max |t| = " << report.max_t << " at probe "
+        << report.worst << ")" << std::endl;
+    return ok ? 0 : 1;
+}
+
+static int checkEquivalence
+    (std::ostream &out, const std::string &name1, const std::string &name2,
+     unsigned state_len, unsigned output_len, unsigned count)
+{
+    // Generate the code for both functions.
+    gencrypto::Registration info1 = gencrypto::Registration::find(name1);
+    gencrypto::Registration info2 = gencrypto::Registration::find(name2);
+    if (info1.empty() || !info1.generateAVR()) {
+        std::cerr << name1 << ": unknown function" << std::endl;
+        return 1;
+    }
+    if (info2.empty() || !info2.generateAVR()) {
+        std::cerr << name2 << ": unknown function" << std::endl;
+        return 1;
+    }
+    if (!state_len || output_len > state_len) {
+        std::cerr << "invalid state or output size" << std::endl;
+        return 1;
+    }
+    AVR::Code code1, code2;
+    setupPlatform(code1, info1);
+    setupPlatform(code2, info2);
+    info1.generateAVR()(code1);
+    info2.generateAVR()(code2);
+
+    // Prove equivalence or find a counterexample.
+    std::vector<unsigned char> counterexample;
+    AVR::EquivResult result;
+    try {
+        result = AVR::equivPermutation
+            (code1, code2, state_len, output_len, count, counterexample);
+    } catch (std::invalid_argument &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    out << name1 << " and " << name2;
+    if (result == AVR::Equivalent) {
+        out << " are equivalent" << std::endl;
+        return 0;
+    } else if (result == AVR::EquivUnknown) {
+        out << ": could not prove equivalence" << std::endl;
+        return 1;
+    }
+
+    // Run the counterexample through the interpreter to show the outputs.
+    out << " are not equivalent" << std::endl;
+    out << "input:  ";
+    writeHex(out, counterexample.data(), state_len);
+    out << std::endl;
+    std::vector<unsigned char> state1(counterexample);
+    std::vector<unsigned char> state2(counterexample);
+    try {
+        code1.exec_permutation(state1.data(), state_len, count);
+        code2.exec_permutation(state2.data(), state_len, count);
+    } catch (std::invalid_argument &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    out << "output: ";
+    writeHex(out, state1.data(), output_len);
+    out << std::endl;
+    out << "output: ";
+    writeHex(out, state2.data(), output_len);
+    out << std::endl;
+    if (std::equal(state1.begin(), state1.begin() + output_len,
+                   state2.begin())) {
+        out << "the difference depends upon uninitialized registers or memory"
+            << std::endl;
+    }
+    return 1;
+}
+
 static bool generateAndTestFunction
     (std::ostream &out, const gencrypto::Registration &info,
-     bool testMode, const gencrypto::TestVectorFile &tests,
+     AVR::Code *code, const AVR::Linker &linker, bool testMode,
+     const gencrypto::TestVectorFile &tests,
      const std::vector<std::string> &options)
 {
     (void)options;
-    if (info.generateAVR()) {
-        AVR::Code code;
-        info.generateAVR()(code);
+    if (code) {
+        code->setTrace(trace);
         if (testMode && info.testAVR()) {
             gencrypto::TestVectorList vectors = tests.testsFor(info.name());
             gencrypto::TestVectorList::const_iterator it;
@@ -223,23 +899,54 @@ static bool generateAndTestFunction
             for (it = vectors.cbegin(); it != vectors.cend(); ++it) {
                 out << info.qualifiedName() << "["
                     << it->name() << "] ... " << std::flush;
-                if (info.testAVR()(code, *it)) {
-                    out << "ok" << std::endl;
+                bool passed;
+                try {
+                    passed = info.testAVR()(*code, *it);
+                } catch (AVR::SpecialisationMismatch &) {
+                    out << "skipped (specialised)" << std::endl;
+                    continue;
+                }
+                if (passed) {
+                    out << "ok";
+                    if (code->cycles() != 0)
+                        out << " (" << code->cycles() << " cycles)";
+                    out << std::endl;
                 } else {
                     out << "FAILED" << std::endl;
                     ok = false;
                 }
             }
+            if (code->randomBytesDrawn() != 0) {
+                // Report the randomness usage of masked code.  Loop bodies
+                // are only counted once, so this is per pass through them.
+                out << info.qualifiedName() << " draws "
+                    << code->randomBytesDrawn() << " random bytes per pass ("
+                    << code->randomBytesFresh() << " fresh)" << std::endl;
+            }
+            const AVR::OutlineReport &outlined = code->outlineReport();
+            if (outlined.wordsBefore != 0) {
+                // Report the size that was saved by outlining, and the
+                // cost of the calls for one pass through the code.
+                out << info.qualifiedName() << " outlined "
+                    << outlined.subroutines << " subroutines with "
+                    << outlined.calls << " calls, saving "
+                    << (outlined.wordsBefore - outlined.wordsAfter) * 2
+                    << " of " << outlined.wordsBefore * 2
+                    << " bytes for " << outlined.cyclesAdded
+                    << " extra cycles per pass";
+                if (outlined.renamedWords != 0) {
+                    out << " (" << outlined.renamedWords * 2
+                        << " more bytes with renamed registers)";
+                }
+                out << std::endl;
+            }
             return ok;
         } else if (!testMode) {
-            if (code.size() != 0) {
-                code.write(out);
+            if (code->size() != 0) {
+                code->write(out);
             } else {
                 // No code, but there may be S-boxes to write.
-                unsigned count = code.sbox_count();
-                for (unsigned index = 0; index < count; ++index) {
-                    code.sbox_write(out, index, code.sbox_get(index));
-                }
+                linker.writeTables(out, *code);
             }
         }
     } else if (info.generate()) {
@@ -252,28 +959,124 @@ static bool generateAndTestFunction
     return true;
 }
 
-// Trim whitespace from the end of a string.
-static std::string rtrim(const std::string &str)
+// Line from a template after the conditionals have been applied.
+// The overrides for "%%function-body(overrides):name" directives are
+// split off so that the text is always "%%function-body:name".
+struct TemplateLine
+{
+    int linenum;
+    std::string text;
+    std::string overrides;
+};
+
+// Variables that are substituted into the lines of a template.
+typedef std::map<std::string, std::string> TemplateVars;
+
+// Removes the "%%if(option):" prefixes from a template line.
+static std::string stripConditions(const std::string &line)
 {
-    std::string temp(str);
-    temp.erase(temp.find_last_not_of(" \t\r\n") + 1);
+    std::string temp(line);
+    while (temp.rfind("%%if(", 0) == 0) {
+        size_t index = temp.find("):");
+        if (index == std::string::npos)
+            break;
+        temp = temp.substr(index + 2);
+    }
     return temp;
 }
 
-static bool generateAndRunTests
-    (std::ostream &out, std::istream &templateFile, bool testMode,
-     const gencrypto::TestVectorFile &tests,
-     const std::vector<std::string> &options,
-     const std::string &copyrightFilename)
+// Substitutes "${name}" references to template variables in a line.
+static bool substituteVars
+    (std::string &line, const TemplateVars &vars, int linenum)
 {
-    std::string line;
-    int linenum = 0;
-    bool success = true;
-    bool skip;
-    while (std::getline(templateFile, line)) {
-        ++linenum;
-        skip = false;
-        line = rtrim(line);
+    size_t posn = 0;
+    while ((posn = line.find("${", posn)) != std::string::npos) {
+        size_t end = line.find('}', posn);
+        if (end == std::string::npos)
+            break;
+        std::string name = line.substr(posn + 2, end - posn - 2);
+        TemplateVars::const_iterator it = vars.find(name);
+        if (it == vars.end()) {
+            std::cerr << "line " << linenum << ": unknown variable '"
+                      << name << "'" << std::endl;
+            return false;
+        }
+        line.replace(posn, end - posn + 1, it->second);
+        posn += it->second.size();
+    }
+    return true;
+}
+
+// Expands the values for a "%%for" loop.  A value that contains '*' is
+// matched against the qualified names of the registered functions and
+// expands to the part of each name that matched the '*', in sorted order.
+static std::vector<std::string> expandForValues(const std::string &list)
+{
+    std::vector<std::string> values;
+    std::string remaining(list);
+    for (;;) {
+        size_t comma = remaining.find(',');
+        std::string value = remaining.substr(0, comma);
+        size_t star = value.find('*');
+        if (star == std::string::npos) {
+            values.push_back(value);
+        } else {
+            std::string prefix = value.substr(0, star);
+            std::string suffix = value.substr(star + 1);
+            std::vector<gencrypto::Registration>::const_iterator it;
+            for (it = gencrypto::Registration::registrations.cbegin();
+                    it != gencrypto::Registration::registrations.cend();
+                    ++it) {
+                std::string name = it->qualifiedName();
+                if (name.size() < prefix.size() + suffix.size() ||
+                        name.compare(0, prefix.size(), prefix) != 0 ||
+                        name.compare(name.size() - suffix.size(),
+                                     suffix.size(), suffix) != 0)
+                    continue;
+                std::string match = name.substr
+                    (prefix.size(),
+                     name.size() - prefix.size() - suffix.size());
+                if (std::find(values.begin(), values.end(), match)
+                        == values.end())
+                    values.push_back(match);
+            }
+        }
+        if (comma == std::string::npos)
+            break;
+        remaining = remaining.substr(comma + 1);
+    }
+    return values;
+}
+
+// Finds the "%%endfor" that matches the "%%for" at a specific position.
+// Returns the size of the template if there is no matching "%%endfor".
+static size_t findEndFor(const std::vector<TemplateLine> &raw, size_t start)
+{
+    int nesting = 0;
+    for (size_t index = start; index < raw.size(); ++index) {
+        std::string line = stripConditions(raw[index].text);
+        if (line.rfind("%%for(", 0) == 0) {
+            ++nesting;
+        } else if (line == "%%endfor") {
+            if (--nesting == 0)
+                return index;
+        }
+    }
+    return raw.size();
+}
+
+// Expands the "%%if", "%%set", and "%%for" directives in a range of lines.
+static bool expandTemplate
+    (const std::vector<TemplateLine> &raw, size_t start, size_t end,
+     const std::vector<std::string> &options, TemplateVars vars,
+     std::vector<TemplateLine> &lines)
+{
+    for (size_t posn = start; posn < end; ++posn) {
+        int linenum = raw[posn].linenum;
+        std::string line = raw[posn].text;
+        bool skip = false;
+        if (!substituteVars(line, vars, linenum))
+            return false;
         while (line.rfind("%%if(", 0) == 0) {
             // "%%if(option)" directive.  Check if the option is set.
             // There may be multiple conditions which are AND'ed together.
@@ -292,10 +1095,511 @@ static bool generateAndRunTests
                 break;
             }
         }
+        if (line.rfind("%%for(", 0) == 0) {
+            // "%%for(name):value1,value2,..." directive.  Repeat the
+            // lines up to the matching "%%endfor" for each value.
+            size_t endfor = findEndFor(raw, posn);
+            size_t index = line.find("):");
+            if (endfor >= end || index == std::string::npos) {
+                std::cerr << "line " << linenum << ": invalid loop '"
+                          << line << "'" << std::endl;
+                return false;
+            }
+            if (!skip) {
+                std::string name = line.substr(6, index - 6);
+                std::vector<std::string> values =
+                    expandForValues(line.substr(index + 2));
+                for (size_t value = 0; value < values.size(); ++value) {
+                    vars[name] = values[value];
+                    if (!expandTemplate(raw, posn + 1, endfor,
+                                        options, vars, lines))
+                        return false;
+                }
+                vars.erase(name);
+            }
+            posn = endfor;
+            continue;
+        }
         if (skip) {
             // Conditional is false, so skip this line.
             continue;
         }
+        TemplateLine tline;
+        tline.linenum = linenum;
+        if (line.rfind("%%set(", 0) == 0) {
+            // "%%set(name):value" directive.  Set a variable.
+            size_t index = line.find("):");
+            if (index == std::string::npos) {
+                std::cerr << "line " << linenum << ": invalid variable '"
+                          << line << "'" << std::endl;
+                return false;
+            }
+            vars[line.substr(6, index - 6)] = line.substr(index + 2);
+            continue;
+        } else if (line == "%%endfor") {
+            std::cerr << "line " << linenum << ": '%%endfor' without '%%for'"
+                      << std::endl;
+            return false;
+        } else if (line.rfind("%%function-body(", 0) == 0) {
+            // "%%function-body(overrides):name" directive.
+            size_t index = line.find("):");
+            if (index == std::string::npos) {
+                std::cerr << "line " << linenum << ": invalid directive '"
+                          << line << "'" << std::endl;
+                return false;
+            }
+            tline.overrides = line.substr(16, index - 16);
+            line = "%%function-body:" + line.substr(index + 2);
+        }
+        tline.text = line;
+        lines.push_back(tline);
+    }
+    return true;
+}
+
+// Reads the lines of a template that are enabled by the options, and
+// expands the loops and variables in the template.  Options of the
+// form "name=value" set the initial value of a template variable.
+static bool readTemplate
+    (const gencrypto::MappedFile &templateFile,
+     const std::vector<std::string> &options,
+     std::vector<TemplateLine> &lines)
+{
+    // Trailing whitespace is trimmed in place so that each line is only
+    // copied once, straight out of the file.
+    std::vector<TemplateLine> raw;
+    size_t posn = 0;
+    const char *line;
+    size_t len;
+    int linenum = 0;
+    while (templateFile.nextLine(posn, line, len)) {
+        while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t' ||
+                           line[len - 1] == '\r')) {
+            --len;
+        }
+        raw.push_back(TemplateLine());
+        raw.back().linenum = ++linenum;
+        raw.back().text.assign(line, len);
+    }
+    TemplateVars vars;
+    for (size_t index = 0; index < options.size(); ++index) {
+        size_t equals = options[index].find('=');
+        if (equals != std::string::npos) {
+            vars[options[index].substr(0, equals)] =
+                options[index].substr(equals + 1);
+        }
+    }
+    return expandTemplate(raw, 0, raw.size(), options, vars, lines);
+}
+
+// Applies the overrides from a "%%function-body(overrides):name" directive
+// to the code generator before the function is generated.  A "rounds" or
+// "count" override is returned in "param" so that the function can be
+// specialised for that value after it has been generated.  An "outline"
+// override replaces the minimum saving in "outline" for this function.
+static bool applyOverrides
+    (AVR::Code &code, const std::string &overrides, int linenum, int &param,
+     unsigned &outline)
+{
+    param = -1;
+    std::string remaining(overrides);
+    while (!remaining.empty()) {
+        size_t comma = remaining.find(',');
+        std::string option = remaining.substr(0, comma);
+        remaining = (comma == std::string::npos)
+                        ? std::string() : remaining.substr(comma + 1);
+        size_t equals = option.find('=');
+        std::string name = option.substr(0, equals);
+        std::string value = (equals == std::string::npos)
+                                ? std::string() : option.substr(equals + 1);
+        if (name == "sbox-placement") {
+            AVR::Code::SboxPlacement placement;
+            unsigned budget = code.sboxBudget();
+            if (!parseSboxPlacement(value, placement, budget)) {
+                std::cerr << "line " << linenum
+                          << ": invalid S-box placement '"
+                          << value << "'" << std::endl;
+                return false;
+            }
+            code.setSboxPlacement(placement, budget);
+        } else if (name == "rounds" || name == "count") {
+            char *end = 0;
+            unsigned long number = strtoul(value.c_str(), &end, 0);
+            if (value.empty() || *end != '\0' || number > 255) {
+                std::cerr << "line " << linenum << ": invalid " << name
+                          << " value '" << value << "'" << std::endl;
+                return false;
+            }
+            param = (int)number;
+        } else if (name == "outline") {
+            char *end = 0;
+            unsigned long number = strtoul(value.c_str(), &end, 0);
+            if (value.empty()) {
+                number = 1;
+            } else if (*end != '\0') {
+                std::cerr << "line " << linenum << ": invalid " << name
+                          << " value '" << value << "'" << std::endl;
+                return false;
+            }
+            outline = (unsigned)number;
+        } else {
+            std::cerr << "line " << linenum << ": unknown override '"
+                      << name << "'" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Function body from a template that is waiting to be generated.
+struct BodyJob
+{
+    size_t index;
+    gencrypto::Registration info;
+    AVR::Code *code;
+    std::string context;
+    int param;
+    unsigned outline;
+    std::exception_ptr error;
+};
+
+// Worker thread that runs generators until there are no jobs left.
+static void bodyWorker(std::vector<BodyJob> *pending, std::atomic<size_t> *next)
+{
+    size_t posn;
+    while ((posn = (*next)++) < pending->size()) {
+        BodyJob &job = (*pending)[posn];
+        try {
+            job.info.generateAVR()(*(job.code));
+        } catch (...) {
+            job.error = std::current_exception();
+        }
+    }
+}
+
+// Runs the generators for a list of function bodies.  Each job has its
+// own Code object, so the jobs can be spread across multiple threads.
+static void runBodyJobs(std::vector<BodyJob> &pending)
+{
+    unsigned threads = jobs;
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads > pending.size())
+        threads = pending.size();
+    std::atomic<size_t> next(0);
+    if (threads <= 1) {
+        bodyWorker(&pending, &next);
+        return;
+    }
+    std::vector<std::thread> pool;
+    for (unsigned thread = 0; thread < threads; ++thread)
+        pool.push_back(std::thread(bodyWorker, &pending, &next));
+    for (unsigned thread = 0; thread < threads; ++thread)
+        pool[thread].join();
+}
+
+// Generates the code for all function bodies in a template up front
+// so that calls between the functions can be linked together.
+static bool generateBodies
+    (const std::vector<TemplateLine> &lines, std::list<AVR::Code> &codes,
+     std::vector<AVR::Code *> &bodies, AVR::Linker &linker)
+{
+    // We track the nesting of preprocessor conditionals in the template
+    // so that S-box tables are only shared between functions when the
+    // definition will be present for both.
+    bodies.assign(lines.size(), (AVR::Code *)0);
+    std::vector<std::pair<int, int> > conditionals;
+    std::vector<BodyJob> pending;
+    int blocks = 0;
+    for (size_t index = 0; index < lines.size(); ++index) {
+        const std::string &line = lines[index].text;
+        if (line.rfind("#if", 0) == 0) {
+            conditionals.push_back(std::pair<int, int>(blocks++, 0));
+            continue;
+        } else if (line.rfind("#elif", 0) == 0 || line.rfind("#else", 0) == 0) {
+            if (!conditionals.empty())
+                ++(conditionals.back().second);
+            continue;
+        } else if (line.rfind("#endif", 0) == 0) {
+            if (!conditionals.empty())
+                conditionals.pop_back();
+            continue;
+        }
+        if (line.rfind("%%function-body:", 0) != 0)
+            continue;
+        gencrypto::Registration info =
+            gencrypto::Registration::find(line.substr(16));
+        if (info.empty() || !info.generateAVR())
+            continue;
+        if (!mcuSupports(info)) {
+            std::cerr << "line " << lines[index].linenum << ": function '"
+                      << info.qualifiedName() << "' is not supported on '"
+                      << mcu->name << "'" << std::endl;
+            return false;
+        }
+        BodyJob job;
+        codes.push_back(AVR::Code());
+        job.index = index;
+        job.info = info;
+        job.code = &(codes.back());
+        job.outline = outlineSaving;
+        setupPlatform(*(job.code), info);
+        if (!applyOverrides(*(job.code), lines[index].overrides,
+                            lines[index].linenum, job.param, job.outline))
+            return false;
+        for (size_t posn = 0; posn < conditionals.size(); ++posn) {
+            job.context += std::to_string(conditionals[posn].first) + "." +
+                           std::to_string(conditionals[posn].second) + "/";
+        }
+        pending.push_back(job);
+    }
+
+    // Generate the function bodies, possibly in parallel.  Everything
+    // after this point happens in template order so that the output is
+    // the same no matter how many threads were used.
+    runBodyJobs(pending);
+    for (size_t posn = 0; posn < pending.size(); ++posn) {
+        BodyJob &job = pending[posn];
+        if (job.error)
+            std::rethrow_exception(job.error);
+        if (job.param >= 0) {
+            try {
+                job.code->specialise(job.param);
+            } catch (std::invalid_argument &e) {
+                std::cerr << "line " << lines[job.index].linenum << ": "
+                          << job.info.qualifiedName() << ": " << e.what()
+                          << std::endl;
+                return false;
+            }
+        }
+        if (job.outline != 0)
+            job.code->outline(job.outline);
+        linker.add(job.code, job.context);
+        bodies[job.index] = job.code;
+    }
+    try {
+        linker.link();
+    } catch (std::invalid_argument &e) {
+        std::cerr << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Finds the assembly symbol for a function body in a template, which is
+// the closest label before the "%%function-body" directive.  Returns an
+// empty string if there is no label.
+static std::string bodySymbol
+    (const std::vector<TemplateLine> &lines, size_t index)
+{
+    while (index > 0) {
+        const std::string &line = lines[--index].text;
+        if (line.rfind("%%function-body:", 0) == 0)
+            break;
+        if (line.size() < 2 || line[line.size() - 1] != ':')
+            continue;
+        std::string name = line.substr(0, line.size() - 1);
+        if (name.find_first_not_of
+                ("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+                 "0123456789_") == std::string::npos &&
+                !isdigit((unsigned char)name[0]))
+            return name;
+    }
+    return std::string();
+}
+
+// Gets the number of masking shares for a function variant; e.g. "3shares".
+static unsigned variantShares(const std::string &variant)
+{
+    size_t posn = variant.find("shares");
+    if (posn == std::string::npos || posn == 0 ||
+            variant.find_first_not_of("0123456789") != posn)
+        return 1;
+    return (unsigned)atoi(variant.c_str());
+}
+
+// Variant of a function for the dispatch stubs.
+struct DispatchVariant
+{
+    std::string symbol;
+    std::string qualifiedName;
+    unsigned long cycles;
+    unsigned size;
+    unsigned shares;
+};
+
+// Writes C dispatch tables and selectors for the functions in a template
+// that have several variants with their own symbols.  The cycle counts
+// are measured with the test vectors if there are any.
+static bool writeDispatch
+    (std::ostream &out, const std::vector<TemplateLine> &lines,
+     const std::vector<AVR::Code *> &bodies,
+     const gencrypto::TestVectorFile &tests)
+{
+    // Collect the variants of each function in template order.
+    std::vector<std::string> names;
+    std::map<std::string, std::vector<DispatchVariant> > groups;
+    for (size_t index = 0; index < lines.size(); ++index) {
+        AVR::Code *code = bodies[index];
+        if (!code || code->size() == 0)
+            continue;
+        gencrypto::Registration info =
+            gencrypto::Registration::find(lines[index].text.substr(16));
+        DispatchVariant variant;
+        variant.symbol = bodySymbol(lines, index);
+        variant.qualifiedName = info.qualifiedName();
+        variant.cycles = 0;
+        variant.size = AVR::Linker::maxSize(*code);
+        variant.shares = variantShares(info.variant());
+        if (variant.symbol.empty()) {
+            std::cerr << "line " << lines[index].linenum
+                      << ": function '" << variant.qualifiedName
+                      << "' does not have a label" << std::endl;
+            return false;
+        }
+        if (info.testAVR()) {
+            gencrypto::TestVectorList vectors = tests.testsFor(info.name());
+            gencrypto::TestVectorList::const_iterator it;
+            for (it = vectors.cbegin(); it != vectors.cend(); ++it) {
+                if (!info.testAVR()(*code, *it)) {
+                    std::cerr << variant.qualifiedName << "["
+                              << it->name() << "] failed" << std::endl;
+                    return false;
+                }
+                if (code->cycles() > variant.cycles)
+                    variant.cycles = code->cycles();
+            }
+        }
+        std::vector<DispatchVariant> &group = groups[info.name()];
+        if (group.empty())
+            names.push_back(info.name());
+        for (size_t posn = 0; posn < group.size(); ++posn) {
+            if (group[posn].symbol == variant.symbol) {
+                std::cerr << "line " << lines[index].linenum
+                          << ": variants of '" << info.name()
+                          << "' must have different labels to be dispatched"
+                          << std::endl;
+                return false;
+            }
+        }
+        group.push_back(variant);
+    }
+
+    // Write the common definitions, which may already be present if the
+    // output from several templates is combined.
+    out << "/* Dispatch stubs generated by gencrypto; do not edit. */\n";
+    out << '\n';
+    out << "#include <stdint.h>\n";
+    out << '\n';
+    out << "#ifndef GENCRYPTO_DISPATCH_TYPES\n";
+    out << "#define GENCRYPTO_DISPATCH_TYPES\n";
+    out << '\n';
+    out << "/* Policies for selecting a variant of a function */\n";
+    out << "#define GENCRYPTO_POLICY_SPEED 0\n";
+    out << "#define GENCRYPTO_POLICY_SIZE  1\n";
+    out << '\n';
+    out << "typedef struct\n";
+    out << "{\n";
+    out << "    void (*func)(void); /* Entry point; cast to the real prototype */\n";
+    out << "    uint32_t cycles;    /* Cycles for the test vectors; 0 if unknown */\n";
+    out << "    uint16_t size;      /* Size of the code in bytes */\n";
+    out << "    uint8_t shares;     /* Number of masking shares; 1 if unmasked */\n";
+    out << "} gencrypto_variant_t;\n";
+    out << '\n';
+    out << "#endif\n";
+    out << '\n';
+    out << "/* Build-time policy for the *_default() selectors */\n";
+    out << "#ifndef GENCRYPTO_POLICY\n";
+    out << "#define GENCRYPTO_POLICY GENCRYPTO_POLICY_SPEED\n";
+    out << "#endif\n";
+    out << "#ifndef GENCRYPTO_MIN_SHARES\n";
+    out << "#define GENCRYPTO_MIN_SHARES 1\n";
+    out << "#endif\n";
+
+    // Write the table and the selectors for each function with variants.
+    bool found = false;
+    for (size_t index = 0; index < names.size(); ++index) {
+        const std::string &name = names[index];
+        const std::vector<DispatchVariant> &group = groups[name];
+        if (group.size() < 2)
+            continue;
+        found = true;
+        out << '\n';
+        for (size_t posn = 0; posn < group.size(); ++posn) {
+            out << "extern void " << group[posn].symbol << "(void);"
+                << '\n';
+        }
+        out << '\n';
+        out << "const gencrypto_variant_t " << name << "_variants["
+            << group.size() << "] = {\n";
+        for (size_t posn = 0; posn < group.size(); ++posn) {
+            const DispatchVariant &variant = group[posn];
+            out << "    {" << variant.symbol << ", " << variant.cycles
+                << "UL, " << variant.size << ", " << variant.shares
+                << "}, /* " << variant.qualifiedName << " */\n";
+        }
+        out << "};\n";
+        out << '\n';
+        out << "const gencrypto_variant_t *" << name << "_select\n";
+        out << "    (uint8_t policy, uint8_t min_shares)\n";
+        out << "{\n";
+        out << "    const gencrypto_variant_t *best = 0;\n";
+        out << "    uint8_t index;\n";
+        out << "    for (index = 0; index < " << group.size()
+            << "; ++index) {\n";
+        out << "        const gencrypto_variant_t *v = &" << name
+            << "_variants[index];\n";
+        out << "        if (v->shares < min_shares)\n";
+        out << "            continue;\n";
+        out << "        if (!best)\n";
+        out << "            best = v;\n";
+        out << "        else if (policy == GENCRYPTO_POLICY_SIZE && v->size < best->size)\n";
+        out << "            best = v;\n";
+        out << "        else if (policy == GENCRYPTO_POLICY_SPEED && v->cycles != 0 &&\n";
+        out << "                 (best->cycles == 0 || v->cycles < best->cycles))\n";
+        out << "            best = v;\n";
+        out << "    }\n";
+        out << "    return best;\n";
+        out << "}\n";
+        out << '\n';
+        out << "const gencrypto_variant_t *" << name << "_default(void)"
+            << '\n';
+        out << "{\n";
+        out << "    return " << name
+            << "_select(GENCRYPTO_POLICY, GENCRYPTO_MIN_SHARES);\n";
+        out << "}\n";
+    }
+    if (!found) {
+        std::cerr << "no functions with multiple variants to dispatch"
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool generateAndRunTests
+    (std::ostream &out, const gencrypto::MappedFile &templateFile,
+     bool testMode,
+     const gencrypto::TestVectorFile &tests,
+     const std::vector<std::string> &options,
+     const std::string &copyrightFilename)
+{
+    std::vector<TemplateLine> lines;
+    if (!readTemplate(templateFile, options, lines))
+        return false;
+
+    // Generate and link the code for all function bodies.
+    std::list<AVR::Code> codes;
+    std::vector<AVR::Code *> bodies;
+    AVR::Linker linker;
+    if (!generateBodies(lines, codes, bodies, linker))
+        return false;
+
+    // Process the lines from the template and generate the output.
+    bool success = true;
+    for (size_t index = 0; index < lines.size(); ++index) {
+        int linenum = lines[index].linenum;
+        const std::string &line = lines[index].text;
         if (line.size() >= 2 && line[0] == '%' && line[1] == '%') {
             // Process a directive in the template.
             if (line.rfind("%%copyright", 0) == 0) {
@@ -312,14 +1616,15 @@ static bool generateAndRunTests
                                       << std::endl;
                             return false;
                         }
-                        while (std::getline(copyright, line)) {
-                            out << line << std::endl;
+                        std::string text;
+                        while (std::getline(copyright, text)) {
+                            out << text << '\n';
                         }
                         copyright.close();
                     }
                 }
             } else if (line.rfind("%%function-body:", 0) == 0) {
-                // Generate code for the function body and optionally test it.
+                // Output the code for the function body and optionally test it.
                 std::string name = line.substr(16);
                 gencrypto::Registration info =
                     gencrypto::Registration::find(name);
@@ -328,7 +1633,8 @@ static bool generateAndRunTests
                               << name << "'" << std::endl;
                     return false;
                 } else if (!generateAndTestFunction
-                        (out, info, testMode, tests, options)) {
+                        (out, info, bodies[index], linker, testMode,
+                         tests, options)) {
                     if (!testMode) {
                         std::cerr << "line " << linenum << ": function '"
                                   << name << "' failed" << std::endl;
@@ -346,8 +1652,180 @@ static bool generateAndRunTests
             }
         } else if (!testMode) {
             // Copy this line as-is to the output.
-            out << line << std::endl;
+            out << line << '\n';
+        }
+    }
+
+    // Write the dispatch stubs for the function variants if requested.
+    if (success && !testMode && !dispatchFilename.empty()) {
+        std::ofstream dispatch(dispatchFilename);
+        if (!dispatch.is_open()) {
+            std::cerr << dispatchFilename
+                      << ": could not open the dispatch file" << std::endl;
+            return false;
         }
+        success = writeDispatch(dispatch, lines, bodies, tests);
     }
     return success;
 }
+
+// Evaluates a preprocessor condition in a template.  Only "defined(NAME)"
+// terms and comparisons of "__AVR_ARCH__" with a number, optionally negated
+// and combined with "&&" or "||", are understood.  Any other term is
+// assumed to be true.
+static bool evalCondition
+    (const std::string &expr, const std::vector<std::string> &defines)
+{
+    size_t posn = expr.find("||");
+    if (posn != std::string::npos) {
+        return evalCondition(expr.substr(0, posn), defines) ||
+               evalCondition(expr.substr(posn + 2), defines);
+    }
+    posn = expr.find("&&");
+    if (posn != std::string::npos) {
+        return evalCondition(expr.substr(0, posn), defines) &&
+               evalCondition(expr.substr(posn + 2), defines);
+    }
+    std::string term;
+    for (size_t index = 0; index < expr.size(); ++index) {
+        if (expr[index] != ' ' && expr[index] != '\t' &&
+                expr[index] != '(' && expr[index] != ')')
+            term += expr[index];
+    }
+    bool negate = false;
+    while (!term.empty() && term[0] == '!') {
+        negate = !negate;
+        term = term.substr(1);
+    }
+    bool result;
+    if (term.rfind("defined", 0) == 0) {
+        term = term.substr(7);
+        result = std::find(defines.begin(), defines.end(), term)
+                        != defines.end();
+    } else if (term.rfind("__AVR_ARCH__", 0) == 0 && mcu) {
+        term = term.substr(12);
+        size_t digits = term.find_first_of("0123456789");
+        if (digits == std::string::npos)
+            return true;
+        std::string op = term.substr(0, digits);
+        unsigned value = (unsigned)atoi(term.c_str() + digits);
+        if (op == ">=")
+            result = (mcu->arch >= value);
+        else if (op == "<=")
+            result = (mcu->arch <= value);
+        else if (op == ">")
+            result = (mcu->arch > value);
+        else if (op == "<")
+            result = (mcu->arch < value);
+        else if (op == "==")
+            result = (mcu->arch == value);
+        else if (op == "!=")
+            result = (mcu->arch != value);
+        else
+            return true;
+    } else {
+        return true;
+    }
+    return negate ? !result : result;
+}
+
+// Generates an ELF object file containing the functions in a template
+// that are enabled for the selected device.  The preprocessor conditionals
+// in the template are evaluated with the options and the device's builtin
+// macros like "__AVR__" defined.
+static bool generateElf
+    (std::ostream &out, const gencrypto::MappedFile &templateFile,
+     const std::vector<std::string> &options)
+{
+    std::vector<TemplateLine> lines;
+    if (!readTemplate(templateFile, options, lines))
+        return false;
+    std::list<AVR::Code> codes;
+    std::vector<AVR::Code *> bodies;
+    AVR::Linker linker;
+    if (!generateBodies(lines, codes, bodies, linker))
+        return false;
+
+    // Find the function bodies that are enabled by the conditionals.
+    std::vector<std::string> defines(options);
+    defines.push_back("__AVR__");
+    if (!strcmp(mcu->core, "avrxt"))
+        defines.push_back("__AVR_XMEGA__");
+    else if (!strcmp(mcu->core, "avrrc"))
+        defines.push_back("__AVR_TINY__");
+    std::vector<std::pair<bool, bool> > conditionals; // (active, taken)
+    AVR::ElfWriter writer(mcu->arch);
+    bool copyData = false;
+    for (size_t index = 0; index < lines.size(); ++index) {
+        const std::string &line = lines[index].text;
+        bool parent = conditionals.empty() || conditionals.back().first;
+        if (line.rfind("#ifdef", 0) == 0 || line.rfind("#ifndef", 0) == 0) {
+            bool negate = (line[3] == 'n');
+            std::string name = line.substr(negate ? 7 : 6);
+            bool result = evalCondition("defined(" + name + ")", defines);
+            if (negate)
+                result = !result;
+            conditionals.push_back(std::make_pair(parent && result, result));
+        } else if (line.rfind("#if", 0) == 0) {
+            bool result = evalCondition(line.substr(3), defines);
+            conditionals.push_back(std::make_pair(parent && result, result));
+        } else if (line.rfind("#elif", 0) == 0 && !conditionals.empty()) {
+            bool taken = conditionals.back().second;
+            conditionals.pop_back();
+            parent = conditionals.empty() || conditionals.back().first;
+            bool result = !taken && evalCondition(line.substr(5), defines);
+            conditionals.push_back
+                (std::make_pair(parent && result, taken || result));
+        } else if (line.rfind("#else", 0) == 0 && !conditionals.empty()) {
+            bool taken = conditionals.back().second;
+            conditionals.pop_back();
+            parent = conditionals.empty() || conditionals.back().first;
+            conditionals.push_back(std::make_pair(parent && !taken, true));
+        } else if (line.rfind("#endif", 0) == 0 && !conditionals.empty()) {
+            conditionals.pop_back();
+        } else if (line.rfind("#define", 0) == 0 && parent) {
+            std::string name = line.substr(7);
+            name.erase(0, name.find_first_not_of(" \t"));
+            defines.push_back(name.substr(0, name.find_first_of(" \t(")));
+        } else if (line.rfind("%%function-body:", 0) == 0 && parent &&
+                       bodies[index]) {
+            // Add the code for the function, or its S-box tables.
+            AVR::Code *code = bodies[index];
+            try {
+                if (code->size() != 0) {
+                    std::string symbol = bodySymbol(lines, index);
+                    if (symbol.empty())
+                        symbol = code->name();
+                    if (symbol.empty()) {
+                        throw std::invalid_argument
+                            ("function '" + line.substr(16) +
+                             "' does not have a name");
+                    }
+                    AVR::Encoder encoder;
+                    encoder.encode(*code);
+                    writer.addFunction(symbol, encoder);
+                } else {
+                    std::vector<AVR::Linker::Placement> tables =
+                        linker.tables(*code);
+                    for (size_t posn = 0; posn < tables.size(); ++posn) {
+                        writer.addTable(tables[posn].name,
+                                        code->sbox_section(),
+                                        tables[posn].sbox,
+                                        tables[posn].aligned);
+                    }
+                    if (!tables.empty() &&
+                            code->sboxPlacement() == AVR::Code::SboxInRAM)
+                        copyData = true;
+                }
+            } catch (std::invalid_argument &e) {
+                std::cerr << "line " << lines[index].linenum << ": "
+                          << e.what() << std::endl;
+                return false;
+            }
+        }
+    }
+    if (copyData)
+        writer.addUndefined("__do_copy_data");
+    writer.write(out);
+    return true;
+}
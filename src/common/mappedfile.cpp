@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif
+#include "mappedfile.h"
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#if defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace gencrypto
+{
+
+MappedFile::MappedFile()
+    : m_data(0)
+    , m_size(0)
+    , m_mapped(false)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+/**
+ * \brief Opens a file and makes its contents available.
+ *
+ * \param filename The name of the file to open.
+ *
+ * \return Returns true if the file was opened, or false otherwise.
+ */
+bool MappedFile::open(const std::string &filename)
+{
+    close();
+#if defined(HAVE_SYS_MMAN_H)
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size == 0) {
+            ::close(fd);
+            return true;
+        }
+        void *addr = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            ::close(fd);
+            m_data = (const char *)addr;
+            m_size = (size_t)st.st_size;
+            m_mapped = true;
+            return true;
+        }
+    }
+    ::close(fd);
+#endif
+
+    // Fall back to reading the whole file into a buffer.  This also
+    // handles pipes and other files that cannot be mapped.
+    std::ifstream file(filename, std::ios::in | std::ios::binary);
+    if (!file.is_open())
+        return false;
+    m_buffer.assign(std::istreambuf_iterator<char>(file),
+                    std::istreambuf_iterator<char>());
+    m_data = m_buffer.empty() ? 0 : m_buffer.data();
+    m_size = m_buffer.size();
+    return true;
+}
+
+/**
+ * \brief Closes the file and releases its contents.
+ */
+void MappedFile::close()
+{
+#if defined(HAVE_SYS_MMAN_H)
+    if (m_mapped)
+        munmap((void *)m_data, m_size);
+#endif
+    m_data = 0;
+    m_size = 0;
+    m_mapped = false;
+    m_buffer.clear();
+}
+
+/**
+ * \brief Gets the next line from the file.
+ *
+ * \param posn Position in the file to start at, which is updated to
+ * point at the start of the following line.  Set to zero to start
+ * at the beginning of the file.
+ * \param line Returns a pointer to the start of the line.
+ * \param len Returns the length of the line, not including the newline.
+ *
+ * \return Returns false if there are no more lines in the file.
+ */
+bool MappedFile::nextLine(size_t &posn, const char *&line, size_t &len) const
+{
+    if (posn >= m_size)
+        return false;
+    line = m_data + posn;
+    const char *end = (const char *)memchr(line, '\n', m_size - posn);
+    len = end ? (size_t)(end - line) : (m_size - posn);
+    posn += len;
+    if (posn < m_size)
+        ++posn; // Skip the newline.
+    return true;
+}
+
+} // namespace gencrypto
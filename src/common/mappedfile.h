@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef GENCRYPTO_MAPPEDFILE_H
+#define GENCRYPTO_MAPPEDFILE_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+namespace gencrypto
+{
+
+/**
+ * \brief Read-only view of the contents of a file.
+ *
+ * The file is mapped into memory where the platform supports it, or
+ * read into a buffer otherwise.  The lines can then be iterated over
+ * without copying them.
+ */
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    bool open(const std::string &filename);
+    void close();
+
+    /**
+     * \brief Gets a pointer to the contents of the file.
+     */
+    const char *data() const { return m_data; }
+
+    /**
+     * \brief Gets the size of the file in bytes.
+     */
+    size_t size() const { return m_size; }
+
+    bool nextLine(size_t &posn, const char *&line, size_t &len) const;
+
+private:
+    const char *m_data;
+    size_t m_size;
+    bool m_mapped;
+    std::vector<char> m_buffer;
+
+    // Disable copying.
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+};
+
+} // namespace gencrypto
+
+#endif
@@ -22,25 +22,11 @@
 
 #include "avr/code.h"
 #include "common/registry.h"
+#include "keccak/keccakp-complement.h"
 #include <cstring>
 
 using namespace AVR;
 
-static Reg shuffle_left(const Reg &in, int bytes)
-{
-    bytes %= 8;
-    switch (bytes) {
-    case 0: default: return in;
-    case 1: return in.shuffle(7, 0, 1, 2, 3, 4, 5, 6);
-    case 2: return in.shuffle(6, 7, 0, 1, 2, 3, 4, 5);
-    case 3: return in.shuffle(5, 6, 7, 0, 1, 2, 3, 4);
-    case 4: return in.shuffle(4, 5, 6, 7, 0, 1, 2, 3);
-    case 5: return in.shuffle(3, 4, 5, 6, 7, 0, 1, 2);
-    case 6: return in.shuffle(2, 3, 4, 5, 6, 7, 0, 1);
-    case 7: return in.shuffle(1, 2, 3, 4, 5, 6, 7, 0);
-    }
-}
-
 // Adjusts the Z pointer so that "posn" can be accessed by an offset
 // from Z that is between 0 and 63.  We have to do this because we
 // cannot easily access the entire 200 byte state from Z otherwise.
@@ -64,30 +50,40 @@ static void rho_pi_1600
     (Code &code, int out_posn, int rotate, int in_posn, int &z_offset)
 {
     Reg temp = code.allocateReg(8);
-    Reg out;
+    Reg out = temp;
     adjust_z_offset(code, z_offset, in_posn);
     code.ldz(temp, in_posn - z_offset);
-    int shift = (rotate % 8);
-    if (shift == 0) {
-        out = shuffle_left(temp, rotate / 8);
-    } else if (shift <= 4) {
-        code.rol(temp, shift);
-        out = shuffle_left(temp, rotate / 8);
-    } else {
-        code.ror(temp, 8 - shift);
-        out = shuffle_left(temp, ((rotate + 8) / 8));
-    }
+    code.rol_lazy(out, rotate);
+    code.materialise(out);
     adjust_z_offset(code, z_offset, out_posn);
     code.stz(out, out_posn - z_offset);
     code.releaseReg(temp);
 }
 
+// Complements the lanes in memory that are in the lane complementing
+// pattern and then moves the Z pointer back to the start of the state.
+static void complement_lanes_1600(Code &code, int &z_offset)
+{
+    Reg temp = code.allocateReg(8);
+    for (int index = 0; index < 25; ++index) {
+        if (!KeccakComplement::inPattern(index / 5, index % 5))
+            continue;
+        adjust_z_offset(code, z_offset, index * 8);
+        code.ldz(temp, index * 8 - z_offset);
+        code.lognot(temp);
+        code.stz(temp, index * 8 - z_offset);
+    }
+    code.releaseReg(temp);
+    adjust_z_offset_to(code, z_offset, 0);
+}
+
 /**
  * \brief Generates the AVR code for the Keccak-p[1600] permutation.
  *
  * \param code The code block to generate into.
+ * \param complement Set to true to use the lane complementing transform.
  */
-static void gen_avr_keccakp_1600_permutation(Code &code)
+static void gen_avr_keccakp_1600(Code &code, bool complement)
 {
     static uint64_t const RC[24] = {
         0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808AULL,
@@ -117,6 +113,8 @@ static void gen_avr_keccakp_1600_permutation(Code &code)
     unsigned char subroutine = 0;
     unsigned char end_label = 0;
     z_offset = 0;
+    if (complement)
+        complement_lanes_1600(code, z_offset);
     code.ldz(A00, posn_A(0, 0)); // Pre-load A(0, 0) into registers.
     for (round = 0; round < 24; ++round) {
         // Perform the bulk of the round by calling the subroutine.
@@ -136,6 +134,7 @@ static void gen_avr_keccakp_1600_permutation(Code &code)
     //          for j in 0..4:
     //              A(j, i) ^= D
     code.label(subroutine);
+    KeccakComplement lanes;
     Reg C = code.allocateReg(8);
     for (index = 0; index < 5; ++index) {
         adjust_z_offset_to(code, z_offset, posn_A(0, index));
@@ -164,6 +163,7 @@ static void gen_avr_keccakp_1600_permutation(Code &code)
             }
         }
     }
+    lanes.theta();
 
     // Place a leapfrog here to help jmp(end_label) reach the end.
     code.leapfrogDown(end_label);
@@ -199,6 +199,7 @@ static void gen_avr_keccakp_1600_permutation(Code &code)
     adjust_z_offset(code, z_offset, posn_A(2, 0));
     code.stz(C, posn_A(2, 0) - z_offset);
     code.releaseReg(C);
+    lanes.rho_pi();
 
     // Place a leapfrog here to help jmp(end_label) reach the end.
     code.leapfrogDown(end_label);
@@ -229,6 +230,21 @@ static void gen_avr_keccakp_1600_permutation(Code &code)
             code.ldz(B3, index2 + 24);
             code.ldz(B4, index2 + 32);
 
+            // Use the lane complementing forms of chi if requested.
+            if (complement) {
+                lanes.chi(code, A, index, 0, B0, B1, B2);
+                code.stz(A, index2);
+                lanes.chi(code, A, index, 1, B1, B2, B3);
+                code.stz(A, index2 + 8);
+                lanes.chi(code, A, index, 2, B2, B3, B4);
+                code.stz(A, index2 + 16);
+                lanes.chi(code, A, index, 3, B3, B4, B0);
+                code.stz(A, index2 + 24);
+                Reg A4 = lanes.chi(code, A, index, 4, B4, B0, B1, true);
+                code.stz(A4, index2 + 32);
+                continue;
+            }
+
             // A0 = B0 ^ ((~B1) & B2)
             code.move(A, B1);
             code.lognot(A);
@@ -279,6 +295,18 @@ static void gen_avr_keccakp_1600_permutation(Code &code)
     // A(0, 0) is still in registers, so store it back.
     code.label(end_label);
     code.stz(A00, posn_A(0, 0));
+    if (complement)
+        complement_lanes_1600(code, z_offset);
+}
+
+static void gen_avr_keccakp_1600_permutation(Code &code)
+{
+    gen_avr_keccakp_1600(code, false);
+}
+
+static void gen_avr_keccakp_1600_permutation_complement(Code &code)
+{
+    gen_avr_keccakp_1600(code, true);
 }
 
 static bool test_avr_keccakp_1600_permutation
@@ -294,3 +322,6 @@ static bool test_avr_keccakp_1600_permutation
 GENCRYPTO_REGISTER_AVR("keccakp_1600_permute", 0, "avr5",
                        gen_avr_keccakp_1600_permutation,
                        test_avr_keccakp_1600_permutation);
+GENCRYPTO_REGISTER_AVR("keccakp_1600_permute", "complement", "avr5",
+                       gen_avr_keccakp_1600_permutation_complement,
+                       test_avr_keccakp_1600_permutation);
@@ -22,6 +22,7 @@
 
 #include "avr/code.h"
 #include "common/registry.h"
+#include "keccak/keccakp-complement.h"
 #include <cstring>
 
 using namespace AVR;
@@ -33,12 +34,22 @@ static void rho_pi_200
     code.move(out_reg, in_reg);
 }
 
+// Complements the lanes that are in the lane complementing pattern.
+static void complement_lanes_200(Code &code, const Reg &A)
+{
+    for (int index = 0; index < 25; ++index) {
+        if (KeccakComplement::inPattern(index / 5, index % 5))
+            code.lognot(Reg(A, index, 1));
+    }
+}
+
 /**
  * \brief Generates the AVR code for the Keccak-p[200] permutation.
  *
  * \param code The code block to generate into.
+ * \param complement Set to true to use the lane complementing transform.
  */
-static void gen_avr_keccakp_200_permutation(Code &code)
+static void gen_avr_keccakp_200(Code &code, bool complement)
 {
     static uint8_t const RC[18] = {
         0x01, 0x82, 0x8A, 0x00, 0x8B, 0x01, 0x81, 0x09,
@@ -55,6 +66,8 @@ static void gen_avr_keccakp_200_permutation(Code &code)
     // Allocate 25 bytes for the core state and load it from Z.
     Reg A = code.allocateReg(25);
     code.ldz(A, 0);
+    if (complement)
+        complement_lanes_200(code, A);
 
     // Push Z on the stack so we can use it for temporaries.
     code.push(Reg::z_ptr());
@@ -83,6 +96,7 @@ static void gen_avr_keccakp_200_permutation(Code &code)
 
     // Step mapping theta.
     code.label(subroutine);
+    KeccakComplement lanes;
     for (index = 0; index < 5; ++index) {
         code.move(C[index], state_A(0, index));
         code.logxor(C[index], state_A(1, index));
@@ -98,6 +112,7 @@ static void gen_avr_keccakp_200_permutation(Code &code)
         for (index2 = 0; index2 < 5; ++index2)
             code.tworeg(Insn::EOR, state_A(index2, index).reg(0), TEMP_REG);
     }
+    lanes.theta();
 
     // Step mappings rho and pi combined into a single step.
     code.move(C[0], state_A(0, 1));
@@ -126,6 +141,7 @@ static void gen_avr_keccakp_200_permutation(Code &code)
     rho_pi_200(code, state_A(1, 2), 3, state_A(2, 0));
     code.rol(C[0], 1);
     code.move(state_A(2, 0), C[0]);
+    lanes.rho_pi();
 
     // Step mapping chi.
     for (index = 0; index < 5; ++index) {
@@ -136,9 +152,14 @@ static void gen_avr_keccakp_200_permutation(Code &code)
         code.move(C[4], state_A(index, 4));
         for (index2 = 0; index2 < 5; ++index2) {
             Reg s = state_A(index, index2);
-            code.move(s, C[(index2 + 2) % 5]);
-            code.logand_not(s, C[(index2 + 1) % 5]);
-            code.logxor(s, C[index2]);
+            if (complement) {
+                lanes.chi(code, s, index, index2, C[index2],
+                          C[(index2 + 1) % 5], C[(index2 + 2) % 5]);
+            } else {
+                code.move(s, C[(index2 + 2) % 5]);
+                code.logand_not(s, C[(index2 + 1) % 5]);
+                code.logxor(s, C[index2]);
+            }
         }
     }
 
@@ -148,9 +169,21 @@ static void gen_avr_keccakp_200_permutation(Code &code)
     // Restore Z from the stack and store the "A" state back again.
     code.label(end_label);
     code.pop(Reg::z_ptr());
+    if (complement)
+        complement_lanes_200(code, A);
     code.stz(A, 0);
 }
 
+static void gen_avr_keccakp_200_permutation(Code &code)
+{
+    gen_avr_keccakp_200(code, false);
+}
+
+static void gen_avr_keccakp_200_permutation_complement(Code &code)
+{
+    gen_avr_keccakp_200(code, true);
+}
+
 static bool test_avr_keccakp_200_permutation
     (Code &code, const gencrypto::TestVector &vec)
 {
@@ -164,3 +197,6 @@ static bool test_avr_keccakp_200_permutation
 GENCRYPTO_REGISTER_AVR("keccakp_200_permute", 0, "avr5",
                        gen_avr_keccakp_200_permutation,
                        test_avr_keccakp_200_permutation);
+GENCRYPTO_REGISTER_AVR("keccakp_200_permute", "complement", "avr5",
+                       gen_avr_keccakp_200_permutation_complement,
+                       test_avr_keccakp_200_permutation);
@@ -22,6 +22,7 @@
 
 #include "avr/code.h"
 #include "common/registry.h"
+#include "keccak/keccakp-complement.h"
 #include <cstring>
 
 using namespace AVR;
@@ -46,12 +47,30 @@ static void rho_pi_400
     }
 }
 
+// Complements the lanes that are in the lane complementing pattern.
+// The first row is in A[0..4] and the rest of the state is in memory.
+static void complement_lanes_400(Code &code, const Reg *A, const Reg &temp)
+{
+    for (int index = 0; index < 25; ++index) {
+        if (!KeccakComplement::inPattern(index / 5, index % 5))
+            continue;
+        if (index < 5) {
+            code.lognot(A[index]);
+        } else {
+            code.ldz(temp, index * 2);
+            code.lognot(temp);
+            code.stz(temp, index * 2);
+        }
+    }
+}
+
 /**
  * \brief Generates the AVR code for the Keccak-p[400] permutation.
  *
  * \param code The code block to generate into.
+ * \param complement Set to true to use the lane complementing transform.
  */
-static void gen_avr_keccakp_400_permutation(Code &code)
+static void gen_avr_keccakp_400(Code &code, bool complement)
 {
     static uint16_t const RC[20] = {
         0x0001, 0x8082, 0x808A, 0x8000, 0x808B, 0x0001, 0x8081, 0x8009,
@@ -93,6 +112,8 @@ static void gen_avr_keccakp_400_permutation(Code &code)
     code.ldz(A[2], posn_A(0, 2));
     code.ldz(A[3], posn_A(0, 3));
     code.ldz(A[4], posn_A(0, 4));
+    if (complement)
+        complement_lanes_400(code, A, D);
     for (round = 0; round < 20; ++round) {
         // Skip this round if it is before the starting round.
         unsigned char next_label = 0;
@@ -110,6 +131,7 @@ static void gen_avr_keccakp_400_permutation(Code &code)
 
     // Step mapping theta.
     code.label(subroutine);
+    KeccakComplement lanes;
     for (index = 0; index < 5; ++index) {
         code.move(C[index], A[index]);
         code.ldz_xor(C[index], posn_A(1, index));
@@ -128,6 +150,7 @@ static void gen_avr_keccakp_400_permutation(Code &code)
                 code.ldz_xor_in(D, posn_A(index2, index));
         }
     }
+    lanes.theta();
 
     // Step mappings rho and pi combined into a single step.
     code.move(D, A[1]); // D = A[0][1]
@@ -156,6 +179,7 @@ static void gen_avr_keccakp_400_permutation(Code &code)
     rho_pi_400(code, A, C[0], posn_A(1, 2),  3, posn_A(2, 0));
     code.rol(D, 1);
     code.stz(D, posn_A(2, 0));
+    lanes.rho_pi();
 
     // Step mapping chi.
     for (index = 0; index < 5; ++index) {
@@ -173,7 +197,13 @@ static void gen_avr_keccakp_400_permutation(Code &code)
             code.ldz(C[4], posn_A(index, 4));
         }
         for (index2 = 0; index2 < 5; ++index2) {
-            if (index == 0) {
+            if (complement) {
+                Reg dest = (index == 0) ? A[index2] : D;
+                lanes.chi(code, dest, index, index2, C[index2],
+                          C[(index2 + 1) % 5], C[(index2 + 2) % 5]);
+                if (index != 0)
+                    code.stz(D, posn_A(index, index2));
+            } else if (index == 0) {
                 code.move(A[index2], C[(index2 + 2) % 5]);
                 code.logand_not(A[index2], C[(index2 + 1) % 5]);
                 code.logxor(A[index2], C[index2]);
@@ -191,6 +221,8 @@ static void gen_avr_keccakp_400_permutation(Code &code)
 
     // First row is still in registers, so store it back.
     code.label(end_label);
+    if (complement)
+        complement_lanes_400(code, A, D);
     code.stz(A[0], posn_A(0, 0));
     code.stz(A[1], posn_A(0, 1));
     code.stz(A[2], posn_A(0, 2));
@@ -198,6 +230,16 @@ static void gen_avr_keccakp_400_permutation(Code &code)
     code.stz(A[4], posn_A(0, 4));
 }
 
+static void gen_avr_keccakp_400_permutation(Code &code)
+{
+    gen_avr_keccakp_400(code, false);
+}
+
+static void gen_avr_keccakp_400_permutation_complement(Code &code)
+{
+    gen_avr_keccakp_400(code, true);
+}
+
 static bool test_avr_keccakp_400_permutation
     (Code &code, const gencrypto::TestVector &vec)
 {
@@ -214,3 +256,6 @@ static bool test_avr_keccakp_400_permutation
 GENCRYPTO_REGISTER_AVR("keccakp_400_permute", 0, "avr5",
                        gen_avr_keccakp_400_permutation,
                        test_avr_keccakp_400_permutation);
+GENCRYPTO_REGISTER_AVR("keccakp_400_permute", "complement", "avr5",
+                       gen_avr_keccakp_400_permutation_complement,
+                       test_avr_keccakp_400_permutation);
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "keccak/keccakp-complement.h"
+#include <cstring>
+
+using namespace AVR;
+
+/**
+ * \brief Constructs the complement masks for the start of a round.
+ */
+KeccakComplement::KeccakComplement()
+{
+    for (int row = 0; row < 5; ++row) {
+        for (int col = 0; col < 5; ++col)
+            m_mask[row * 5 + col] = inPattern(row, col);
+    }
+}
+
+/**
+ * \brief Determine if a lane is complemented between rounds.
+ *
+ * \param row Row of the lane, 0 to 4.
+ * \param col Column of the lane, 0 to 4.
+ *
+ * \return Returns true if the lane is complemented.
+ *
+ * This is the standard pattern from the Keccak implementation overview,
+ * which complements A(0, 1), A(0, 2), A(1, 3), A(2, 2), A(3, 2), and
+ * A(4, 0).  A(0, 0) is never complemented so the round constant can be
+ * XOR'ed into it as-is.
+ */
+bool KeccakComplement::inPattern(int row, int col)
+{
+    static unsigned char const pattern[5] = {
+        0x06, 0x08, 0x04, 0x04, 0x01
+    };
+    return ((pattern[row] >> col) & 1) != 0;
+}
+
+/**
+ * \brief Updates the complement masks for the theta step mapping.
+ *
+ * Each column parity C[i] is complemented if an odd number of lanes in
+ * the column are complemented.  D = C[i - 1] ^ (C[i + 1] <<< 1) is then
+ * complemented if exactly one of its inputs is, which flips the mask
+ * on every lane in column i.
+ */
+void KeccakComplement::theta()
+{
+    bool C[5];
+    int row, col;
+    for (col = 0; col < 5; ++col) {
+        C[col] = false;
+        for (row = 0; row < 5; ++row)
+            C[col] ^= m_mask[row * 5 + col];
+    }
+    for (col = 0; col < 5; ++col) {
+        bool D = C[(col + 4) % 5] ^ C[(col + 1) % 5];
+        for (row = 0; row < 5; ++row)
+            m_mask[row * 5 + col] ^= D;
+    }
+}
+
+/**
+ * \brief Updates the complement masks for the rho and pi step mappings.
+ *
+ * Rotating a complemented lane leaves it complemented, so only the
+ * movement of the lanes by pi matters.
+ */
+void KeccakComplement::rho_pi()
+{
+    bool prev[25];
+    memcpy(prev, m_mask, sizeof(prev));
+    for (int row = 0; row < 5; ++row) {
+        for (int col = 0; col < 5; ++col)
+            m_mask[((col * 2 + row * 3) % 5) * 5 + row] = prev[row * 5 + col];
+    }
+}
+
+/**
+ * \brief Generates the code for one output lane of the chi step mapping.
+ *
+ * \param code The code block to generate into.
+ * \param dest The destination register for the output lane.
+ * \param row Row of the output lane.
+ * \param col Column of the output lane.
+ * \param b0 The input lane at (row, col).
+ * \param b1 The input lane at (row, col + 1).
+ * \param b2 The input lane at (row, col + 2).
+ * \param in_place Set to true to compute the output lane in place in
+ * either \a b1 or \a b2 instead of in \a dest.  Both are destroyed.
+ *
+ * \return The register that contains the output lane; either \a dest
+ * or one of \a b1 or \a b2 if \a in_place is true.
+ *
+ * The output is b0 ^ (~b1 & b2), complemented if A(row, col) is in the
+ * pattern.  When exactly one of b1 and b2 is complemented, the AND-NOT
+ * becomes a plain AND or OR and no NOT is required unless the output
+ * ends up with the wrong polarity.  When both or neither of b1 and b2
+ * are complemented, a single NOT is required and we choose the form
+ * that gives the correct output polarity.
+ */
+Reg KeccakComplement::chi
+    (Code &code, const Reg &dest, int row, int col,
+     const Reg &b0, const Reg &b1, const Reg &b2, bool in_place) const
+{
+    bool m0 = m_mask[row * 5 + col];
+    bool m1 = m_mask[row * 5 + (col + 1) % 5];
+    bool m2 = m_mask[row * 5 + (col + 2) % 5];
+    bool invert = (inPattern(row, col) != m0);
+    bool use_or, not_first;
+    bool first_is_b1;
+    if (m1 != m2) {
+        // x1 & x2 == ~b1 & b2 or x1 | x2 == ~(~b1 & b2).
+        use_or = m2;
+        not_first = false;
+        first_is_b1 = true;
+    } else {
+        // ~x1 & x2, x1 & ~x2, ~x1 | x2, or x1 | ~x2.
+        use_or = invert;
+        not_first = true;
+        first_is_b1 = (m1 == use_or);
+    }
+    const Reg &first = first_is_b1 ? b1 : b2;
+    const Reg &second = first_is_b1 ? b2 : b1;
+    Reg result = in_place ? first : dest;
+    if (!in_place)
+        code.move(result, first);
+    if (not_first)
+        code.lognot(result);
+    if (use_or)
+        code.logor(result, second);
+    else
+        code.logand(result, second);
+    code.logxor(result, b0);
+    if (use_or != invert)
+        code.lognot(result);
+    return result;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2022 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef GENCRYPTO_KECCAKP_COMPLEMENT_H
+#define GENCRYPTO_KECCAKP_COMPLEMENT_H
+
+#include "avr/code.h"
+
+/**
+ * \brief Tracks which lanes of a Keccak-p state are complemented.
+ *
+ * The lane complementing transform stores a fixed set of lanes inverted
+ * between rounds so that most of the NOT operations in chi disappear.
+ * Theta and rho/pi are linear, so the complement masks can be tracked
+ * through them at generation time and each output lane of chi is then
+ * computed with whichever AND/OR form needs the fewest NOTs.
+ *
+ * Lanes are indexed by row and column in the same manner as the
+ * generators; i.e. the lane A(row, col) is at index row * 5 + col.
+ * A new object should be created at the start of each round, when the
+ * lanes in the pattern are the ones that are complemented.
+ */
+class KeccakComplement
+{
+public:
+    KeccakComplement();
+
+    static bool inPattern(int row, int col);
+
+    void theta();
+    void rho_pi();
+
+    /**
+     * \brief Determine if a lane is currently complemented.
+     *
+     * \param row Row of the lane, 0 to 4.
+     * \param col Column of the lane, 0 to 4.
+     */
+    bool isComplemented(int row, int col) const
+        { return m_mask[row * 5 + col]; }
+
+    AVR::Reg chi(AVR::Code &code, const AVR::Reg &dest, int row, int col,
+                 const AVR::Reg &b0, const AVR::Reg &b1,
+                 const AVR::Reg &b2, bool in_place = false) const;
+
+private:
+    bool m_mask[25];
+};
+
+#endif
@@ -175,7 +175,7 @@ static void gen_sha256_step(Code &code, struct sha256_state &st)
     code.move(st.temp3, st.ereg);
     code.ror(st.temp3, 1); // 25 = 24 + 1
     code.logxor(st.temp2.shuffle(1, 2, 3, 0), st.temp3.shuffle(3, 0, 1, 2));
-    code.add(st.temp1, st.temp2.shuffle(1, 2, 3, 0));
+    code.add_rol(st.temp1, st.temp2, 24);
     // temp1 += ((e & f) ^ ((~e) & g));
     code.ldlocal(st.temp2, st.f);
     code.logand(st.temp2, st.ereg);
@@ -602,3 +602,38 @@ GENCRYPTO_REGISTER_AVR("sha256_transform", "small", "avr5",
                        test_sha256_transform);
 GENCRYPTO_REGISTER_AVR("sha256_rc_table", 0, "avr5",
                        gen_sha256_rc_table, 0);
+
+// AVRxt has the same instruction set as avr5 as far as SHA-256 is concerned.
+// The timing model and round constant access are handled by the generator.
+
+static void gen_avrxt_sha256_transform_fully_unrolled(Code &code)
+{
+    gen_sha256_transform_fully_unrolled(code);
+}
+
+static void gen_avrxt_sha256_transform_partially_unrolled(Code &code)
+{
+    gen_sha256_transform_partially_unrolled(code);
+}
+
+static void gen_avrxt_sha256_transform_small(Code &code)
+{
+    gen_sha256_transform_small(code);
+}
+
+static void gen_avrxt_sha256_rc_table(Code &code)
+{
+    gen_sha256_rc_table(code);
+}
+
+GENCRYPTO_REGISTER_AVR("sha256_transform", "full", "avrxt",
+                       gen_avrxt_sha256_transform_fully_unrolled,
+                       test_sha256_transform);
+GENCRYPTO_REGISTER_AVR("sha256_transform", "partial", "avrxt",
+                       gen_avrxt_sha256_transform_partially_unrolled,
+                       test_sha256_transform);
+GENCRYPTO_REGISTER_AVR("sha256_transform", "small", "avrxt",
+                       gen_avrxt_sha256_transform_small,
+                       test_sha256_transform);
+GENCRYPTO_REGISTER_AVR("sha256_rc_table", 0, "avrxt",
+                       gen_avrxt_sha256_rc_table, 0);
@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2021 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "avr/code.h"
+#include "common/registry.h"
+#include <cstring>
+
+using namespace AVR;
+
+/**
+ * \brief Generates 32 steps of the TinyJAMBU permutation for AVRrc.
+ *
+ * \param code The code block to generate into.
+ * \param s0 Word number of the state word to update.
+ * \param koffset Word offset of the key word to use.
+ *
+ * The reduced core does not have enough registers to hold the entire
+ * state so each 32-bit feedback value is computed from memory.
+ */
+static void gen_tinyjambu_steps_32_rc(Code &code, int s0, int koffset)
+{
+    // Byte offsets of the state words, relative to Z.
+    int s1 = ((s0 + 1) % 4) * 4;
+    int s2 = ((s0 + 2) % 4) * 4;
+    int s3 = ((s0 + 3) % 4) * 4;
+    s0 *= 4;
+
+    // Allocate the accumulator and a 40-bit window for the shifted words.
+    Reg acc = code.allocateReg(4);
+    Reg window = code.allocateReg(5);
+
+    // t2 = (s2 >> 6)  | (s3 << 26);
+    code.ldz(Reg(window, 0, 4), s2);
+    code.ldz(Reg(window, 4, 1), s3);
+    code.lsl(window, 2);
+    code.move(acc, Reg(window, 1, 4));
+
+    // t3 = (s2 >> 21) | (s3 << 11);
+    // Note: We assume that the key is inverted so we can avoid the NOT.
+    code.ldz(Reg(window, 0, 2), s2 + 2);
+    code.ldz(Reg(window, 2, 3), s3);
+    code.lsl(window, 3);
+    code.logand(acc, Reg(window, 1, 4));
+
+    // t4 = (s2 >> 27) | (s3 << 5);
+    code.ldz(Reg(window, 0, 1), s2 + 3);
+    code.ldz(Reg(window, 1, 4), s3);
+    code.lsr(window, 3);
+    code.logxor(acc, Reg(window, 0, 4));
+
+    // t1 = (s1 >> 15) | (s2 << 17);
+    code.ldz(Reg(window, 0, 3), s1 + 1);
+    code.ldz(Reg(window, 3, 2), s2);
+    code.lsl(window, 1);
+    code.logxor(acc, Reg(window, 1, 4));
+
+    // s0 ^= t1 ^ ~(t2 & t3) ^ t4 ^ k[koffset];
+    code.ldz_xor(acc, s0);
+    code.ldz_xor(acc, 16 + koffset * 4);
+    code.stz(acc, s0);
+
+    // Release the temporary working registers.
+    code.releaseReg(window);
+    code.releaseReg(acc);
+}
+
+/**
+ * \brief Generates the AVRrc code for the TinyJAMBU permutation.
+ *
+ * \param code The code block to generate into.
+ * \param name Name of the function to generate.
+ * \param key_words Number of words in the key: 4, 6, or 8.
+ */
+static void gen_tinyjambu_permutation_rc
+    (Code &code, const char *name, int key_words)
+{
+    // Set up the function prologue.  Z points to the state, which
+    // stays in memory because there aren't enough registers for it.
+    Reg rounds = code.prologue_permutation_with_count(name, 0);
+    code.setFlag(Code::NoLocals);
+    code.setFlag(Code::TempY);
+
+    // Perform all permutation rounds.  Each round has 128 steps
+    // but it may be unrolled 2 or 3 times based on the key size.
+    unsigned char top_label = 0;
+    unsigned char end_label = 0;
+    code.label(top_label);
+
+    // Unroll the inner part of the loop.
+    int inner_rounds;
+    if (key_words == 4)
+        inner_rounds = 1;
+    else if (key_words == 6)
+        inner_rounds = 3;
+    else
+        inner_rounds = 2;
+    for (int inner = 0; inner < inner_rounds; ++inner) {
+        // Perform the 128 steps of this inner round, 32 at a time.
+        int koffset = inner * 4;
+        gen_tinyjambu_steps_32_rc(code, 0, koffset % key_words);
+        gen_tinyjambu_steps_32_rc(code, 1, (koffset + 1) % key_words);
+        gen_tinyjambu_steps_32_rc(code, 2, (koffset + 2) % key_words);
+        gen_tinyjambu_steps_32_rc(code, 3, (koffset + 3) % key_words);
+
+        // Check for early bail-out between the inner rounds.
+        if (inner < (inner_rounds - 1)) {
+            code.syncPointers();
+            code.dec(rounds);
+            code.breq(end_label);
+        }
+    }
+
+    // Decrement the round counter at the bottom of the round loop.
+    code.syncPointers();
+    code.dec(rounds);
+    code.brne(top_label);
+    code.label(end_label);
+}
+
+/**
+ * \brief Generates the AVRrc code for the TinyJAMBU-128 permutation.
+ *
+ * \param code The code block to generate into.
+ */
+static void gen_avrrc_tinyjambu_permutation_128(Code &code)
+{
+    gen_tinyjambu_permutation_rc(code, "tinyjambu_permutation_128", 4);
+}
+
+/**
+ * \brief Generates the AVRrc code for the TinyJAMBU-192 permutation.
+ *
+ * \param code The code block to generate into.
+ */
+static void gen_avrrc_tinyjambu_permutation_192(Code &code)
+{
+    gen_tinyjambu_permutation_rc(code, "tinyjambu_permutation_192", 6);
+}
+
+/**
+ * \brief Generates the AVRrc code for the TinyJAMBU-256 permutation.
+ *
+ * \param code The code block to generate into.
+ */
+static void gen_avrrc_tinyjambu_permutation_256(Code &code)
+{
+    gen_tinyjambu_permutation_rc(code, "tinyjambu_permutation_256", 8);
+}
+
+/**
+ * \brief Inverts a TinyJAMBU key.
+ *
+ * \param out Output key.
+ * \param in Input key.
+ * \param count Number of bytes in the key.
+ */
+static void invert_key
+    (unsigned char *out, const unsigned char *in, unsigned count)
+{
+    while (count > 0) {
+        *out++ = ~(*in++);
+        --count;
+    }
+}
+
+static bool test_avrrc_tinyjambu_permutation_128
+    (Code &code, const gencrypto::TestVector &vec)
+{
+    unsigned char state[32];
+    unsigned char key[16];
+    if (!vec.populate(state, 16, "Input"))
+        return false;
+    if (!vec.populate(key, sizeof(key), "Key"))
+        return false;
+    invert_key(state + 16, key, 16);
+    code.exec_permutation(state, 32, 1024 / 128);
+    return vec.check(state, 16, "Output");
+}
+
+static bool test_avrrc_tinyjambu_permutation_192
+    (Code &code, const gencrypto::TestVector &vec)
+{
+    unsigned char state[40];
+    unsigned char key[24];
+    if (!vec.populate(state, 16, "Input"))
+        return false;
+    if (!vec.populate(key, sizeof(key), "Key"))
+        return false;
+    invert_key(state + 16, key, 24);
+    code.exec_permutation(state, 40, 1152 / 128);
+    return vec.check(state, 16, "Output");
+}
+
+static bool test_avrrc_tinyjambu_permutation_256
+    (Code &code, const gencrypto::TestVector &vec)
+{
+    unsigned char state[48];
+    unsigned char key[32];
+    if (!vec.populate(state, 16, "Input"))
+        return false;
+    if (!vec.populate(key, sizeof(key), "Key"))
+        return false;
+    invert_key(state + 16, key, 32);
+    code.exec_permutation(state, 48, 1280 / 128);
+    return vec.check(state, 16, "Output");
+}
+
+GENCRYPTO_REGISTER_AVR("tinyjambu_permutation_128", 0, "avrrc",
+                       gen_avrrc_tinyjambu_permutation_128,
+                       test_avrrc_tinyjambu_permutation_128);
+GENCRYPTO_REGISTER_AVR("tinyjambu_permutation_192", 0, "avrrc",
+                       gen_avrrc_tinyjambu_permutation_192,
+                       test_avrrc_tinyjambu_permutation_192);
+GENCRYPTO_REGISTER_AVR("tinyjambu_permutation_256", 0, "avrrc",
+                       gen_avrrc_tinyjambu_permutation_256,
+                       test_avrrc_tinyjambu_permutation_256);
@@ -21,8 +21,10 @@
  */
 
 #include "avr/code.h"
+#include "avr/unroll.h"
 #include "common/registry.h"
 #include <cstring>
+#include <vector>
 
 using namespace AVR;
 
@@ -38,73 +40,38 @@ static uint16_t const xoodoo_rc[XOODOO_ROUNDS] = {
 // Offset of a word in the Xoodoo state.
 #define XOODOO_WORD(row, col) ((row) * 16 + (col) * 4)
 
-static void gen_avr_xoodoo_permutation(Code &code)
-{
-    // Set up the function prologue with 0 bytes of local variable storage.
-    // Z points to the permutation state on input and output.
-    Reg count = code.prologue_permutation_with_count("xoodoo_permute", 0);
-    code.setFlag(Code::TempY);
-
-    // We need a 16-bit high register for the round constant.
-    Reg rc = code.allocateHighReg(2);
+// Offset of a word in the Xoodoo state after the slots have been renamed.
+#define XOODOO_SLOT(layout, row, col) ((layout)[(row) * 4 + (col)] * 4)
 
-    // Unroll the main loop with the bulk of the permutation in a subroutine.
-    // Round count values of 12 and 6 are the most likely.
-    unsigned char round_labels[XOODOO_ROUNDS] = {0};
-    unsigned char subroutine = 0;
-    unsigned char end_label = 0;
-    code.compare(count, XOODOO_ROUNDS);
-    code.breq(round_labels[0]);
-    code.compare(count, 6);
-    code.breq(round_labels[6]);
-    for (int round = 1; round < XOODOO_ROUNDS; ++round) {
-        if (round == 6)
-            continue;
-        code.compare(count, round);
-        code.breq(round_labels[XOODOO_ROUNDS - round]);
-    }
-    code.jmp(end_label); // 0 rounds or > 12 rounds.
-    code.releaseReg(count);
-    for (int round = 1; round < XOODOO_ROUNDS; ++round) {
-        if (round != 6)
-            code.label(round_labels[round]);
-        code.move(rc, xoodoo_rc[round]);
-        code.call(subroutine);
-    }
-    code.jmp(end_label);
+// Number of extra words that the unrolled variant may spend to avoid
+// the plane shifts in memory.
+#define XOODOO_UNROLL_WORDS 4096
 
-    // Special-case for 12 rounds which allows us to optimise the
-    // loading of the round constants from one round to the next.
-    code.label(round_labels[0]);
-    for (int round = 0; round < XOODOO_ROUNDS; ++round) {
-        if (round > 0 &&
-              (xoodoo_rc[round] & 0xFF00) == (xoodoo_rc[round - 1] & 0xFF00)) {
-            // The high byte is the same as last time so no need to change it.
-            code.move(Reg(rc, 0, 1), xoodoo_rc[round]);
-        } else {
-            code.move(rc, xoodoo_rc[round]);
-        }
-        code.call(subroutine);
-    }
-    code.jmp(end_label);
+// Gets a slot permutation for the 12 words of the state that leaves
+// every word where it is.
+static std::vector<int> xoodoo_identity()
+{
+    std::vector<int> perm(12);
+    for (int slot = 0; slot < 12; ++slot)
+        perm[slot] = slot;
+    return perm;
+}
 
-    // Special-case for 6 rounds which allows us to optimise the
-    // loading of the round constants from one round to the next.
-    code.label(round_labels[6]);
-    for (int round = 6; round < XOODOO_ROUNDS; ++round) {
-        if (round > 6 &&
-              (xoodoo_rc[round] & 0xFF00) == (xoodoo_rc[round - 1] & 0xFF00)) {
-            // The high byte is the same as last time so no need to change it.
-            code.move(Reg(rc, 0, 1), xoodoo_rc[round]);
-        } else {
-            code.move(rc, xoodoo_rc[round]);
-        }
-        code.call(subroutine);
-    }
-    code.jmp(end_label);
+// Adds a plane shift to a slot permutation.  Word (plane, col) moves
+// to (plane, col + shift).
+static void xoodoo_plane_shift(std::vector<int> &perm, int plane, int shift)
+{
+    for (int col = 0; col < 4; ++col)
+        perm[plane * 4 + col] = plane * 4 + ((col + shift) % 4);
+}
 
-    // Start of the subroutine.
-    code.label(subroutine);
+// Generates a single round of Xoodoo.  If "rename" is false, then the
+// plane shifts are performed by moving words in memory and the layout
+// must be the identity.  If "rename" is true, then the words are accessed
+// through the layout and the plane shifts only rename the slots.
+static void gen_xoodoo_round
+    (Code &code, const Reg &rc, std::vector<int> layout, bool rename)
+{
     Reg x0 = code.allocateReg(4);
     Reg x1 = code.allocateReg(4);
     Reg x2 = code.allocateReg(4);
@@ -114,13 +81,13 @@ static void gen_avr_xoodoo_permutation(Code &code)
 
     // Step theta: Mix column parity.
     // t1 = x03 ^ x13 ^ x23;
-    code.ldz(t1, XOODOO_WORD(0, 3));
-    code.ldz_xor(t1, XOODOO_WORD(1, 3));
-    code.ldz_xor(t1, XOODOO_WORD(2, 3));
+    code.ldz(t1, XOODOO_SLOT(layout, 0, 3));
+    code.ldz_xor(t1, XOODOO_SLOT(layout, 1, 3));
+    code.ldz_xor(t1, XOODOO_SLOT(layout, 2, 3));
     // t2 = x00 ^ x10 ^ x20;
-    code.ldz(x0, XOODOO_WORD(0, 0));
-    code.ldz(x1, XOODOO_WORD(1, 0));
-    code.ldz(x2, XOODOO_WORD(2, 0));
+    code.ldz(x0, XOODOO_SLOT(layout, 0, 0));
+    code.ldz(x1, XOODOO_SLOT(layout, 1, 0));
+    code.ldz(x2, XOODOO_SLOT(layout, 2, 0));
     code.move(t2, x0);
     code.logxor(t2, x1);
     code.logxor(t2, x2);
@@ -143,14 +110,14 @@ static void gen_avr_xoodoo_permutation(Code &code)
     code.logxor(x0, t1);
     code.logxor(x1, t1);
     code.logxor(x2, t1);
-    code.stz(x0, XOODOO_WORD(0, 0));
-    code.stz(x1, XOODOO_WORD(1, 0));
-    code.stz(x2, XOODOO_WORD(2, 0));
+    code.stz(x0, XOODOO_SLOT(layout, 0, 0));
+    code.stz(x1, XOODOO_SLOT(layout, 1, 0));
+    code.stz(x2, XOODOO_SLOT(layout, 2, 0));
     t1 = t1save;
     // t1 = x01 ^ x11 ^ x21;
-    code.ldz(x0, XOODOO_WORD(0, 1));
-    code.ldz(x1, XOODOO_WORD(1, 1));
-    code.ldz(x2, XOODOO_WORD(2, 1));
+    code.ldz(x0, XOODOO_SLOT(layout, 0, 1));
+    code.ldz(x1, XOODOO_SLOT(layout, 1, 1));
+    code.ldz(x2, XOODOO_SLOT(layout, 2, 1));
     code.move(t1, x0);
     code.logxor(t1, x1);
     code.logxor(t1, x2);
@@ -164,14 +131,14 @@ static void gen_avr_xoodoo_permutation(Code &code)
     code.logxor(x0, t2);
     code.logxor(x1, t2);
     code.logxor(x2, t2);
-    code.stz(x0, XOODOO_WORD(0, 1));
-    code.stz(x1, XOODOO_WORD(1, 1));
-    code.stz(x2, XOODOO_WORD(2, 1));
+    code.stz(x0, XOODOO_SLOT(layout, 0, 1));
+    code.stz(x1, XOODOO_SLOT(layout, 1, 1));
+    code.stz(x2, XOODOO_SLOT(layout, 2, 1));
     t2 = t2save;
     // t2 = x02 ^ x12 ^ x22;
-    code.ldz(x0, XOODOO_WORD(0, 2));
-    code.ldz(x1, XOODOO_WORD(1, 2));
-    code.ldz(x2, XOODOO_WORD(2, 2));
+    code.ldz(x0, XOODOO_SLOT(layout, 0, 2));
+    code.ldz(x1, XOODOO_SLOT(layout, 1, 2));
+    code.ldz(x2, XOODOO_SLOT(layout, 2, 2));
     code.move(t2, x0);
     code.logxor(t2, x1);
     code.logxor(t2, x2);
@@ -185,108 +152,273 @@ static void gen_avr_xoodoo_permutation(Code &code)
     code.logxor(x0, t1);
     code.logxor(x1, t1);
     code.logxor(x2, t1);
-    code.stz(x0, XOODOO_WORD(0, 2));
-    code.stz(x1, XOODOO_WORD(1, 2));
-    code.stz(x2, XOODOO_WORD(2, 2));
+    code.stz(x0, XOODOO_SLOT(layout, 0, 2));
+    code.stz(x1, XOODOO_SLOT(layout, 1, 2));
+    code.stz(x2, XOODOO_SLOT(layout, 2, 2));
     t1 = t1save;
     // x03 ^= t2; x13 ^= t2; x23 ^= t2;
-    code.ldz_xor_in(t2, XOODOO_WORD(0, 3));
-    code.ldz(t1, XOODOO_WORD(1, 3));
+    code.ldz_xor_in(t2, XOODOO_SLOT(layout, 0, 3));
+    code.ldz(t1, XOODOO_SLOT(layout, 1, 3));
     code.logxor(t1, t2); // Leave x13 in t1 for use in rho-west below.
-    code.ldz(t3, XOODOO_WORD(2, 3));
+    code.ldz(t3, XOODOO_SLOT(layout, 2, 3));
     code.logxor(t3, t2); // Leave x23 in t3 for use in rho-west below.
     t2 = t2save;
 
     // Step rho-west: Plane shift.
     // t1 = x13; x13 = x12; x12 = x11; x11 = x10; x10 = t1;
-    code.ldz(t2, XOODOO_WORD(1, 2));
-    code.stz(t2, XOODOO_WORD(1, 3));
-    code.ldz(t2, XOODOO_WORD(1, 1));
-    code.stz(t2, XOODOO_WORD(1, 2));
-    code.ldz(t2, XOODOO_WORD(1, 0));
-    code.stz(t2, XOODOO_WORD(1, 1));
-    code.stz(t1, XOODOO_WORD(1, 0));
+    if (rename) {
+        // Store x13 back where it came from, which becomes x10.
+        std::vector<int> west = xoodoo_identity();
+        xoodoo_plane_shift(west, 1, 1);
+        code.stz(t1, XOODOO_SLOT(layout, 1, 3));
+        RoundUnroller::rename(layout, west);
+    } else {
+        code.ldz(t2, XOODOO_WORD(1, 2));
+        code.stz(t2, XOODOO_WORD(1, 3));
+        code.ldz(t2, XOODOO_WORD(1, 1));
+        code.stz(t2, XOODOO_WORD(1, 2));
+        code.ldz(t2, XOODOO_WORD(1, 0));
+        code.stz(t2, XOODOO_WORD(1, 1));
+        code.stz(t1, XOODOO_WORD(1, 0));
+    }
     // x20 = leftRotate11(x20);
-    code.ldz(t1, XOODOO_WORD(2, 0));
+    code.ldz(t1, XOODOO_SLOT(layout, 2, 0));
     code.rol(t1, 11);
-    code.stz(t1, XOODOO_WORD(2, 0));
+    code.stz(t1, XOODOO_SLOT(layout, 2, 0));
     // x21 = leftRotate11(x21);
-    code.ldz(t1, XOODOO_WORD(2, 1));
+    code.ldz(t1, XOODOO_SLOT(layout, 2, 1));
     code.rol(t1, 11);
-    code.stz(t1, XOODOO_WORD(2, 1));
+    code.stz(t1, XOODOO_SLOT(layout, 2, 1));
     // x22 = leftRotate11(x22);
-    code.ldz(t1, XOODOO_WORD(2, 2));
+    code.ldz(t1, XOODOO_SLOT(layout, 2, 2));
     code.rol(t1, 11);
-    code.stz(t1, XOODOO_WORD(2, 2));
+    code.stz(t1, XOODOO_SLOT(layout, 2, 2));
     // x23 = leftRotate11(x23);
     code.rol(t3, 11);
-    code.stz(t3, XOODOO_WORD(2, 3));
+    code.stz(t3, XOODOO_SLOT(layout, 2, 3));
 
     // Step iota: Add the round constant to the state.
-    code.ldz(x0, XOODOO_WORD(0, 0));
+    code.ldz(x0, XOODOO_SLOT(layout, 0, 0));
     code.logxor(x0, rc);
 
     // Step chi: Non-linear layer.
     for (int col = 0; col < 4; ++col) {
         // x0c ^= (~x1c) & x2c;
         if (col != 0)
-            code.ldz(x0, XOODOO_WORD(0, col));
-        code.ldz(x1, XOODOO_WORD(1, col));
-        code.ldz(x2, XOODOO_WORD(2, col));
+            code.ldz(x0, XOODOO_SLOT(layout, 0, col));
+        code.ldz(x1, XOODOO_SLOT(layout, 1, col));
+        code.ldz(x2, XOODOO_SLOT(layout, 2, col));
         code.move(t1, x2);
         code.logand_not(t1, x1);
         code.logxor(x0, t1);
-        code.stz(x0, XOODOO_WORD(0, col));
+        code.stz(x0, XOODOO_SLOT(layout, 0, col));
 
         // x1c ^= (~x2c) & x0c;
         code.move(t1, x0);
         code.logand_not(t1, x2);
         code.logxor(x1, t1);
-        code.stz(x1, XOODOO_WORD(1, col));
+        code.stz(x1, XOODOO_SLOT(layout, 1, col));
 
         // x2c ^= (~x0c) & x1c;
+        // The leftRotate8() from rho-east is applied as we store.
         code.logand_not(x1, x0);
         code.logxor(x2, x1);
-        code.stz(x2, XOODOO_WORD(2, col));
+        code.stz(x2.shuffle(3, 0, 1, 2), XOODOO_SLOT(layout, 2, col));
     }
 
     // Step rho-east: Plane shift.
     // x10 = leftRotate1(x10);
-    code.ldz(t1, XOODOO_WORD(1, 0));
+    code.ldz(t1, XOODOO_SLOT(layout, 1, 0));
     code.rol(t1, 1);
-    code.stz(t1, XOODOO_WORD(1, 0));
+    code.stz(t1, XOODOO_SLOT(layout, 1, 0));
     // x11 = leftRotate1(x11);
-    code.ldz(t1, XOODOO_WORD(1, 1));
+    code.ldz(t1, XOODOO_SLOT(layout, 1, 1));
     code.rol(t1, 1);
-    code.stz(t1, XOODOO_WORD(1, 1));
+    code.stz(t1, XOODOO_SLOT(layout, 1, 1));
     // x12 = leftRotate1(x12);
-    code.ldz(t1, XOODOO_WORD(1, 2));
+    code.ldz(t1, XOODOO_SLOT(layout, 1, 2));
     code.rol(t1, 1);
-    code.stz(t1, XOODOO_WORD(1, 2));
+    code.stz(t1, XOODOO_SLOT(layout, 1, 2));
     // x13 = leftRotate1(x13);
-    code.ldz(t1, XOODOO_WORD(1, 3));
+    code.ldz(t1, XOODOO_SLOT(layout, 1, 3));
     code.rol(t1, 1);
-    code.stz(t1, XOODOO_WORD(1, 3));
-    // t1 = leftRotate8(x22);
-    code.ldz(t1, XOODOO_WORD(2, 2));
-    // t2 = leftRotate8(x23);
-    code.ldz(t2, XOODOO_WORD(2, 3));
-    // x22 = leftRotate8(x20);
-    code.ldz(t3, XOODOO_WORD(2, 0));
-    code.stz(t3.shuffle(3, 0, 1, 2), XOODOO_WORD(2, 2));
-    // x23 = leftRotate8(x21);
-    code.ldz(t3, XOODOO_WORD(2, 1));
-    code.stz(t3.shuffle(3, 0, 1, 2), XOODOO_WORD(2, 3));
-    // x20 = t1;
-    code.stz(t1.shuffle(3, 0, 1, 2), XOODOO_WORD(2, 0));
-    // x21 = t2;
-    code.stz(t2.shuffle(3, 0, 1, 2), XOODOO_WORD(2, 1));
-
-    // Return from the subroutine and end the function.
-    code.ret();
+    code.stz(t1, XOODOO_SLOT(layout, 1, 3));
+    // t1 = x22; t2 = x23; x22 = x20; x23 = x21; x20 = t1; x21 = t2;
+    if (!rename) {
+        code.ldz(t1, XOODOO_WORD(2, 2));
+        code.ldz(t2, XOODOO_WORD(2, 3));
+        code.ldz(t3, XOODOO_WORD(2, 0));
+        code.stz(t3, XOODOO_WORD(2, 2));
+        code.ldz(t3, XOODOO_WORD(2, 1));
+        code.stz(t3, XOODOO_WORD(2, 3));
+        code.stz(t1, XOODOO_WORD(2, 0));
+        code.stz(t2, XOODOO_WORD(2, 1));
+    }
+
+    code.releaseReg(x0);
+    code.releaseReg(x1);
+    code.releaseReg(x2);
+    code.releaseReg(t1);
+    code.releaseReg(t2);
+    code.releaseReg(t3);
+}
+
+// Moves the words of the state from one layout to another.
+static void gen_xoodoo_relayout
+    (Code &code, const std::vector<int> &from, const std::vector<int> &to)
+{
+    Reg temp[4];
+    for (int col = 0; col < 4; ++col)
+        temp[col] = code.allocateReg(4);
+    for (int plane = 0; plane < 3; ++plane) {
+        bool same = true;
+        for (int col = 0; col < 4; ++col) {
+            if (from[plane * 4 + col] != to[plane * 4 + col])
+                same = false;
+        }
+        if (same)
+            continue;
+        for (int col = 0; col < 4; ++col)
+            code.ldz(temp[col], XOODOO_SLOT(from, plane, col));
+        for (int col = 0; col < 4; ++col)
+            code.stz(temp[col], XOODOO_SLOT(to, plane, col));
+    }
+    for (int col = 0; col < 4; ++col)
+        code.releaseReg(temp[col]);
+}
+
+static void gen_avr_xoodoo(Code &code, unsigned maxExtraWords)
+{
+    // Set up the function prologue with 0 bytes of local variable storage.
+    // Z points to the permutation state on input and output.
+    Reg count = code.prologue_permutation_with_count("xoodoo_permute", 0);
+    code.setFlag(Code::TempY);
+
+    // We need a 16-bit high register for the round constant.
+    Reg rc = code.allocateHighReg(2);
+
+    // The plane shifts move the words of planes 1 and 2 around in memory.
+    // Determine if it is worth unrolling the round body once for each
+    // step of the period with renamed slots instead.  The period is 4,
+    // which divides 12, so the state ends up in the normal layout.
+    std::vector<int> perm = xoodoo_identity();
+    xoodoo_plane_shift(perm, 1, 1);
+    xoodoo_plane_shift(perm, 2, 2);
+    RoundUnroller unroller(perm);
+    Code loop(code);
+    int loop_start = loop.size();
+    gen_xoodoo_round(loop, rc, unroller.layout(0), false);
+    Code body(code);
+    int body_start = body.size();
+    gen_xoodoo_round(body, rc, unroller.layout(0), true);
+    bool unroll = unroller.worthwhile
+        (loop.size() - loop_start, loop.straight_line_cycles(loop_start),
+         body.size() - body_start, body.straight_line_cycles(body_start),
+         maxExtraWords);
+    int phases = unroll ? unroller.period() : 1;
+
+    // Unroll the main loop with the bulk of the permutation in subroutines,
+    // one for each phase of the layout.  Round count values of 12 and 6
+    // are the most likely.  Other round counts that start part way through
+    // the period go via an entry stub that moves the state into the layout
+    // for that phase.
+    unsigned char round_labels[XOODOO_ROUNDS] = {0};
+    unsigned char entry_labels[XOODOO_ROUNDS] = {0};
+    std::vector<unsigned char> subroutines(phases, 0);
+    std::vector<unsigned char> fixups(phases, 0);
+    unsigned char end_label = 0;
+    code.compare(count, XOODOO_ROUNDS);
+    code.breq(round_labels[0]);
+    code.compare(count, 6);
+    code.breq(round_labels[6]);
+    for (int round = 1; round < XOODOO_ROUNDS; ++round) {
+        if (round == 6)
+            continue;
+        int first = XOODOO_ROUNDS - round;
+        code.compare(count, round);
+        if ((first % phases) != 0)
+            code.breq(entry_labels[first]);
+        else
+            code.breq(round_labels[first]);
+    }
+    code.jmp(end_label); // 0 rounds or > 12 rounds.
+    code.releaseReg(count);
+    for (int round = 1; round < XOODOO_ROUNDS; ++round) {
+        if (round != 6)
+            code.label(round_labels[round]);
+        code.move(rc, xoodoo_rc[round]);
+        code.call(subroutines[round % phases]);
+    }
+    code.jmp(end_label);
+
+    // Special-case for 12 rounds which allows us to optimise the
+    // loading of the round constants from one round to the next.
+    code.label(round_labels[0]);
+    for (int round = 0; round < XOODOO_ROUNDS; ++round) {
+        if (round > 0 &&
+              (xoodoo_rc[round] & 0xFF00) == (xoodoo_rc[round - 1] & 0xFF00)) {
+            // The high byte is the same as last time so no need to change it.
+            code.move(Reg(rc, 0, 1), xoodoo_rc[round]);
+        } else {
+            code.move(rc, xoodoo_rc[round]);
+        }
+        code.call(subroutines[round % phases]);
+    }
+    code.jmp(end_label);
+
+    // Special-case for 6 rounds which allows us to optimise the
+    // loading of the round constants from one round to the next.
+    code.label(round_labels[6]);
+    if ((6 % phases) != 0)
+        code.call(fixups[6 % phases]);
+    for (int round = 6; round < XOODOO_ROUNDS; ++round) {
+        if (round > 6 &&
+              (xoodoo_rc[round] & 0xFF00) == (xoodoo_rc[round - 1] & 0xFF00)) {
+            // The high byte is the same as last time so no need to change it.
+            code.move(Reg(rc, 0, 1), xoodoo_rc[round]);
+        } else {
+            code.move(rc, xoodoo_rc[round]);
+        }
+        code.call(subroutines[round % phases]);
+    }
+    code.jmp(end_label);
+
+    // Entry stubs for the other round counts when unrolled.
+    for (int round = 1; round < XOODOO_ROUNDS; ++round) {
+        if (round == 6 || (round % phases) == 0)
+            continue;
+        code.label(entry_labels[round]);
+        code.call(fixups[round % phases]);
+        code.jmp(round_labels[round]);
+    }
+
+    // Subroutines that move the state from the normal layout into the
+    // layout for each phase.
+    for (int phase = 1; phase < phases; ++phase) {
+        code.label(fixups[phase]);
+        gen_xoodoo_relayout(code, xoodoo_identity(), unroller.layout(phase));
+        code.ret();
+    }
+
+    // Subroutines for the round body.
+    for (int phase = 0; phase < phases; ++phase) {
+        code.label(subroutines[phase]);
+        gen_xoodoo_round(code, rc, unroller.layout(phase), unroll);
+        code.ret();
+    }
     code.label(end_label);
 }
 
+static void gen_avr_xoodoo_permutation(Code &code)
+{
+    gen_avr_xoodoo(code, 0);
+}
+
+static void gen_avr_xoodoo_permutation_unrolled(Code &code)
+{
+    gen_avr_xoodoo(code, XOODOO_UNROLL_WORDS);
+}
+
 static bool test_avr_xoodoo_permutation
     (Code &code, const gencrypto::TestVector &vec)
 {
@@ -303,3 +435,7 @@ static bool test_avr_xoodoo_permutation
 GENCRYPTO_REGISTER_AVR("xoodoo_permute", 0, "avr5",
                        gen_avr_xoodoo_permutation,
                        test_avr_xoodoo_permutation);
+
+GENCRYPTO_REGISTER_AVR("xoodoo_permute", "unrolled", "avr5",
+                       gen_avr_xoodoo_permutation_unrolled,
+                       test_avr_xoodoo_permutation);
@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2021 Southern Storm Software, Pty Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "avr/code.h"
+#include "common/registry.h"
+#include <cstring>
+
+using namespace AVR;
+
+// Number of rounds for the Xoodoo permutation.
+#define XOODOO_ROUNDS 12
+
+// Round constants for Xoodoo.
+static uint16_t const xoodoo_rc[XOODOO_ROUNDS] = {
+    0x0058, 0x0038, 0x03C0, 0x00D0, 0x0120, 0x0014,
+    0x0060, 0x002C, 0x0380, 0x00F0, 0x01A0, 0x0012
+};
+
+// Offset of a word in the Xoodoo state.
+#define XOODOO_WORD(row, col) ((row) * 16 + (col) * 4)
+
+
+/**
+ * \brief Computes leftRotate5(t) ^ leftRotate14(t) for Xoodoo's theta step.
+ *
+ * \param code The code block to generate into.
+ * \param t The column parity on input.
+ * \param temp Temporary register to use for the second rotation.
+ *
+ * \return A shuffled view of \a t that contains the result.
+ */
+static Reg gen_xoodoo_theta_mix(Code &code, const Reg &t, const Reg &temp)
+{
+    // Do the calculation in a way that avoids physical byte rotations.
+    code.move(temp, t);
+    code.ror(t, 3);
+    Reg result = t.shuffle(3, 0, 1, 2);
+    code.ror(temp, 2);
+    code.logxor(result, temp.shuffle(2, 3, 0, 1));
+    return result;
+}
+
+static void gen_avrrc_xoodoo_permutation(Code &code)
+{
+    // Set up the function prologue with 0 bytes of local variable storage.
+    // Z points to the permutation state on input and output.
+    Reg count = code.prologue_permutation_with_count("xoodoo_permute", 0);
+    code.setFlag(Code::TempY);
+
+    // We need a 16-bit register for the round constant.
+    Reg rc = code.allocateHighReg(2);
+
+    // Unroll the main loop with the bulk of the permutation in a subroutine.
+    // Round count values of 12 and 6 are the most likely.
+    unsigned char round_labels[XOODOO_ROUNDS] = {0};
+    unsigned char subroutine = 0;
+    unsigned char end_label = 0;
+    code.compare(count, XOODOO_ROUNDS);
+    code.breq(round_labels[0]);
+    code.compare(count, 6);
+    code.breq(round_labels[6]);
+    for (int round = 1; round < XOODOO_ROUNDS; ++round) {
+        if (round == 6)
+            continue;
+        code.compare(count, round);
+        code.breq(round_labels[XOODOO_ROUNDS - round]);
+    }
+    code.jmp(end_label); // 0 rounds or > 12 rounds.
+    code.releaseReg(count);
+    for (int round = 1; round < XOODOO_ROUNDS; ++round) {
+        if (round != 6)
+            code.label(round_labels[round]);
+        code.move(rc, xoodoo_rc[round]);
+        code.call(subroutine);
+    }
+    code.jmp(end_label);
+
+    // Special-case for 12 rounds which allows us to optimise the
+    // loading of the round constants from one round to the next.
+    code.label(round_labels[0]);
+    for (int round = 0; round < XOODOO_ROUNDS; ++round) {
+        if (round > 0 &&
+              (xoodoo_rc[round] & 0xFF00) == (xoodoo_rc[round - 1] & 0xFF00)) {
+            // The high byte is the same as last time so no need to change it.
+            code.move(Reg(rc, 0, 1), xoodoo_rc[round]);
+        } else {
+            code.move(rc, xoodoo_rc[round]);
+        }
+        code.call(subroutine);
+    }
+    code.jmp(end_label);
+
+    // Special-case for 6 rounds which allows us to optimise the
+    // loading of the round constants from one round to the next.
+    code.label(round_labels[6]);
+    for (int round = 6; round < XOODOO_ROUNDS; ++round) {
+        if (round > 6 &&
+              (xoodoo_rc[round] & 0xFF00) == (xoodoo_rc[round - 1] & 0xFF00)) {
+            // The high byte is the same as last time so no need to change it.
+            code.move(Reg(rc, 0, 1), xoodoo_rc[round]);
+        } else {
+            code.move(rc, xoodoo_rc[round]);
+        }
+        code.call(subroutine);
+    }
+    code.jmp(end_label);
+
+    // Start of the subroutine.  The reduced core only has enough
+    // registers left over for two words of the state at a time.
+    code.label(subroutine);
+    Reg t1 = code.allocateReg(4);
+    Reg t2 = code.allocateReg(4);
+
+    // Step theta: Mix column parity.
+    // t1 = x03 ^ x13 ^ x23;
+    code.ldz(t1, XOODOO_WORD(0, 3));
+    code.ldz_xor(t1, XOODOO_WORD(1, 3));
+    code.ldz_xor(t1, XOODOO_WORD(2, 3));
+    for (int col = 0; col < 4; ++col) {
+        // e = leftRotate5(t1) ^ leftRotate14(t1);
+        Reg e = gen_xoodoo_theta_mix(code, t1, t2);
+
+        // x0c ^= e; x1c ^= e; x2c ^= e;
+        code.ldz_xor_in(e, XOODOO_WORD(0, col));
+        code.ldz_xor_in(e, XOODOO_WORD(1, col));
+        code.ldz_xor_in(e, XOODOO_WORD(2, col));
+
+        // Recover the original parity of this column for the next one:
+        // t1 = e ^ x0c ^ x1c ^ x2c = (x0c ^ x1c ^ x2c) before the XOR.
+        if (col < 3) {
+            code.ldz_xor(e, XOODOO_WORD(0, col));
+            code.ldz_xor(e, XOODOO_WORD(1, col));
+            code.ldz_xor(e, XOODOO_WORD(2, col));
+            t1 = e;
+        }
+    }
+
+    // Step rho-west: Plane shift.
+    // t1 = x13; x13 = x12; x12 = x11; x11 = x10; x10 = t1;
+    code.ldz(t1, XOODOO_WORD(1, 3));
+    code.ldz(t2, XOODOO_WORD(1, 2));
+    code.stz(t2, XOODOO_WORD(1, 3));
+    code.ldz(t2, XOODOO_WORD(1, 1));
+    code.stz(t2, XOODOO_WORD(1, 2));
+    code.ldz(t2, XOODOO_WORD(1, 0));
+    code.stz(t2, XOODOO_WORD(1, 1));
+    code.stz(t1, XOODOO_WORD(1, 0));
+    // x2c = leftRotate11(x2c);
+    for (int col = 0; col < 4; ++col) {
+        code.ldz(t1, XOODOO_WORD(2, col));
+        code.rol(t1, 11);
+        code.stz(t1, XOODOO_WORD(2, col));
+    }
+
+    // Step iota: Add the round constant to the state.
+    code.ldz_xor_in(rc, XOODOO_WORD(0, 0));
+
+    // Step chi: Non-linear layer, two bytes at a time.
+    Reg x0 = Reg(t1, 0, 2);
+    Reg x1 = Reg(t1, 2, 2);
+    Reg x2 = Reg(t2, 0, 2);
+    Reg t = Reg(t2, 2, 2);
+    for (int offset = 0; offset < 16; offset += 2) {
+        // x0c ^= (~x1c) & x2c;
+        code.ldz(x0, XOODOO_WORD(0, 0) + offset);
+        code.ldz(x1, XOODOO_WORD(1, 0) + offset);
+        code.ldz(x2, XOODOO_WORD(2, 0) + offset);
+        code.move(t, x2);
+        code.logand_not(t, x1);
+        code.logxor(x0, t);
+        code.stz(x0, XOODOO_WORD(0, 0) + offset);
+
+        // x1c ^= (~x2c) & x0c;
+        code.move(t, x0);
+        code.logand_not(t, x2);
+        code.logxor(x1, t);
+        code.stz(x1, XOODOO_WORD(1, 0) + offset);
+
+        // x2c ^= (~x0c) & x1c;
+        code.logand_not(x1, x0);
+        code.logxor(x2, x1);
+        code.stz(x2, XOODOO_WORD(2, 0) + offset);
+    }
+
+    // Step rho-east: Plane shift.
+    // x1c = leftRotate1(x1c);
+    for (int col = 0; col < 4; ++col) {
+        code.ldz(t1, XOODOO_WORD(1, col));
+        code.rol(t1, 1);
+        code.stz(t1, XOODOO_WORD(1, col));
+    }
+    // x20 = leftRotate8(x22); x22 = leftRotate8(x20);
+    code.ldz(t1, XOODOO_WORD(2, 0));
+    code.ldz(t2, XOODOO_WORD(2, 2));
+    code.stz(t1.shuffle(3, 0, 1, 2), XOODOO_WORD(2, 2));
+    code.stz(t2.shuffle(3, 0, 1, 2), XOODOO_WORD(2, 0));
+    // x21 = leftRotate8(x23); x23 = leftRotate8(x21);
+    code.ldz(t1, XOODOO_WORD(2, 1));
+    code.ldz(t2, XOODOO_WORD(2, 3));
+    code.stz(t1.shuffle(3, 0, 1, 2), XOODOO_WORD(2, 3));
+    code.stz(t2.shuffle(3, 0, 1, 2), XOODOO_WORD(2, 1));
+
+    // Return from the subroutine and end the function.
+    code.ret();
+    code.label(end_label);
+}
+
+static bool test_avrrc_xoodoo_permutation
+    (Code &code, const gencrypto::TestVector &vec)
+{
+    int numRounds = vec.valueAsInt("Num_Rounds", 12);
+    unsigned char state[48];
+    if (numRounds < 0 || numRounds > 12)
+        return false;
+    if (!vec.populate(state, sizeof(state), "Input"))
+        return false;
+    code.exec_permutation(state, 48, numRounds);
+    return vec.check(state, sizeof(state), "Output");
+}
+
+GENCRYPTO_REGISTER_AVR("xoodoo_permute", 0, "avrrc",
+                       gen_avrrc_xoodoo_permutation,
+                       test_avrrc_xoodoo_permutation);